@@ -28,6 +28,10 @@
 // Fuse settings are 0xfb and 0x21:
 //   avrdude -c stk500 -p attiny13 -P /dev/ttyUSB0 -U hfuse:w:0xfb:m -U lfuse:w:0x21:m
 //
+// The firmware can also be built for the attiny45 and attiny85, which
+// have 256 and 512 bytes of EEPROM (see MCU in the Makefile). On those,
+// the bus is connected to PB2 (their INT0 pin) instead of PB1.
+//
 // Note that avr-libc 1.8.0 does not provide "tiny-stack" versions of
 // the crt*.o libraries but newer (suspectedly 4.7.1 and above) gcc
 // versions do expect those to exist (causing "ld: cannot find
@@ -111,8 +115,14 @@
 //  The timer overflow interrupt is always enabled after a falling edge,
 //  to detect the reset signal.
 
+#if defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__)
+// 8Mhz internal oscillator with CKDIV8 fuse set
+#define F_CPU (8000000/8)
+#define TINYX5
+#else
 // 4.8Mhz oscillator with CKDIV8 fuse set
 #define F_CPU (4800000/8)
+#endif
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
@@ -134,7 +144,21 @@
 #define EEMPE EEMWE
 #endif
 
-// Debug macro, generate a short pulse on the given pin (B0, B2 or B4)
+#if defined(TINYX5)
+// The bus is connected to the INT0 pin, which is PB2 on the tinyX5
+#define BUS_PIN PINB2
+#define DEBUG_PINS ((1 << PINB0) | (1 << PINB1) | (1 << PINB4))
+// The tinyX5 has more timers, but names the timer0 interrupt registers
+// without the 0
+#define TIMSK0 TIMSK
+#define TIFR0 TIFR
+#else
+#define BUS_PIN PINB1
+#define DEBUG_PINS ((1 << PINB0) | (1 << PINB2) | (1 << PINB4))
+#endif
+
+// Debug macro, generate a short pulse on the given pin (one of
+// DEBUG_PINS)
 #if defined(DEBUG)
 #define pulse(pin) do { \
     PORTB &= ~(1 << pin); \
@@ -152,6 +176,35 @@ uint8_t const UNIQUE_ID_OFFSET = 3;
 #define DATA_WRITE US_TO_CLOCKS(600)
 #define DATA_SAMPLE US_TO_CLOCKS(300)
 
+#if defined(WITH_FEC) && defined(WITH_TERNARY)
+// Both need their own registers, and there are not enough of those
+#error "WITH_FEC and WITH_TERNARY cannot be combined"
+#endif
+
+#if defined(WITH_FEC) || defined(WITH_TERNARY)
+// CMD_SET_MODE is only supported when there is a mode to set
+#define WITH_MODES
+#endif
+
+#if defined(WITH_TERNARY)
+// MODE_TERNARY timings. A short symbol is released by the master
+// before TERNARY_SAMPLE1, a medium symbol is released between
+// TERNARY_SAMPLE1 and TERNARY_SAMPLE2 and a long symbol is released
+// after TERNARY_SAMPLE2. When sending, we release a medium symbol at
+// TERNARY_WRITE1 and a long symbol at TERNARY_WRITE2.
+#define TERNARY_SAMPLE1 US_TO_CLOCKS(200)
+#define TERNARY_SAMPLE2 US_TO_CLOCKS(450)
+#define TERNARY_WRITE1 US_TO_CLOCKS(300)
+#define TERNARY_WRITE2 US_TO_CLOCKS(550)
+
+// In MODE_TERNARY, next_bit starts at TERNARY_FIRST_SYMBOL and is
+// shifted once after every symbol, so it becomes 0 after six symbols
+// (three pairs). TERNARY_PAIR_START has the next_bit values for the
+// first symbol of every pair.
+#define TERNARY_FIRST_SYMBOL 0x20
+#define TERNARY_PAIR_START 0x2a
+#endif
+
 // Values for the action variable - low level protocol state
 enum {
     // These are the actual action values, which define the action to
@@ -166,6 +219,13 @@ enum {
     AV_NACK2 = 0x6,
     AV_READY = 0x7,
     AV_STALL = 0x8,
+    AV_SEND_LONG = 0x9,
+    AV_RECEIVE_TERNARY = 0xa,
+    AV_RECEIVE_TERNARY_LATE = 0xb,
+    // Not participating in the rest of the transaction, only watching
+    // for the next reset. The INT0 ISR recognizes this value by bits 2
+    // and 3 both being set, which no other value has (see INT0_vect).
+    AV_WATCH = 0xc,
 
     // Mask for the action global to get one of the above values
     ACTION_MASK = 0xf,
@@ -179,11 +239,15 @@ enum {
     // When FLAG_MUTE is set, the AF_SAMPLE and AF_LINE_LOW bits should
     // be ignored for this bit
     AF_MUTE = 0x20,
+    // This bit is a MODE_TERNARY symbol, using different sample and
+    // release times
+    AF_TERNARY = 0x10,
 
     // These are the complete values (action value plus any relevant
     // action flags). The action global variable is always set to one of
     // these values.
     ACTION_IDLE = AV_IDLE,
+    ACTION_WATCH = AV_WATCH,
     ACTION_STALL = AV_STALL | AF_LINE_LOW,
     ACTION_SEND = AV_SEND,
     ACTION_SEND_HIGH = AV_SEND | AF_MUTE,
@@ -195,6 +259,11 @@ enum {
     ACTION_NACK1 = AV_NACK1 | AF_MUTE,
     ACTION_NACK2 = AV_NACK2 | AF_LINE_LOW | AF_MUTE,
     ACTION_READY = AV_READY | AF_SAMPLE,
+    ACTION_SEND_TERNARY_SHORT = AV_SEND | AF_MUTE | AF_TERNARY,
+    ACTION_SEND_TERNARY_MEDIUM = AV_SEND | AF_LINE_LOW | AF_MUTE | AF_TERNARY,
+    ACTION_SEND_TERNARY_LONG = AV_SEND_LONG | AF_LINE_LOW | AF_MUTE | AF_TERNARY,
+    ACTION_RECEIVE_TERNARY = AV_RECEIVE_TERNARY | AF_SAMPLE | AF_TERNARY,
+    ACTION_RECEIVE_TERNARY_LATE = AV_RECEIVE_TERNARY_LATE | AF_SAMPLE | AF_TERNARY,
 };
 
 // Values for the state variable - high level protocol state
@@ -218,8 +287,78 @@ enum {
     // CMD_WRITE_EEPROM or CMD_WRITE_EEPROM address overflowed the
     // EEPROM
     STATE_READ_EEPROM_OVERFLOW,
+    // CMD_READ_EEPROM_COUNTED, CMD_WRITE_EEPROM_COUNTED or one of the
+    // _WIDE versions received (and stored in next_byte), now receiving
+    // the byte count
+    STATE_RECEIVE_COUNT,
+    // CMD_READ_EEPROM_WIDE or CMD_WRITE_EEPROM_WIDE and the byte count
+    // received, now receiving the high byte of the address
+    STATE_RECEIVE_ADDR_HIGH,
+#if defined(WITH_BROADCAST)
+    // BC_CMD_WRITE_EEPROM failed for this slave, now sending our
+    // address to report the failure
+    STATE_REPORT_FAILURE,
+    // BC_CMD_READ_EEPROM received, waiting for the slaves with a lower
+    // address to send their part
+    STATE_BC_READ_EEPROM_WAIT,
+#endif
+#if defined(WITH_MODES)
+    // CMD_SET_MODE received, now receiving the mode
+    STATE_SET_MODE,
+#endif
+    // CMD_READ_STATS received, now sending the counters
+    STATE_READ_STATS,
+    // CMD_READ_CAPABILITIES received, now sending the minor version
+    // and features
+    STATE_READ_CAPABILITIES,
+    // CMD_SET_BITS, CMD_CLEAR_BITS or CMD_COMPARE_SWAP received (and
+    // stored in turns_left), now receiving the EEPROM address
+    STATE_ATOMIC_RECEIVE_ADDR,
+    // CMD_COMPARE_SWAP and EEPROM address received, now receiving the
+    // expected value
+    STATE_ATOMIC_RECEIVE_EXPECTED,
+    // Now receiving the mask or new value of an atomic command
+    STATE_ATOMIC_RECEIVE_VALUE,
+    // CMD_READ_EEPROM_SIZE received, now sending the size
+    STATE_READ_EEPROM_SIZE,
 };
 
+// The modes supported by CMD_SET_MODE
+#if defined(WITH_FEC)
+#define SUPPORTED_MODES MODE_FEC
+#elif defined(WITH_TERNARY)
+#define SUPPORTED_MODES MODE_TERNARY
+#else
+#define SUPPORTED_MODES 0
+#endif
+
+// The features sent by CMD_READ_CAPABILITIES
+#if defined(WITH_STATS)
+#define FEATURES_STATS FEATURE_STATS
+#else
+#define FEATURES_STATS 0
+#endif
+
+#if defined(WITH_ATOMIC)
+#define FEATURES_ATOMIC FEATURE_ATOMIC
+#else
+#define FEATURES_ATOMIC 0
+#endif
+
+#if defined(WITH_WIDE)
+#define FEATURES_WIDE FEATURE_WIDE
+#else
+#define FEATURES_WIDE 0
+#endif
+
+#if defined(WITH_BROADCAST)
+#define FEATURES_BROADCAST FEATURE_BROADCAST
+#else
+#define FEATURES_BROADCAST 0
+#endif
+
+#define FEATURES (SUPPORTED_MODES | FEATURES_STATS | FEATURES_ATOMIC | FEATURES_WIDE | FEATURES_BROADCAST)
+
 // Values for the flags variable - various flags
 enum {
     // When this flag is set, this slave will no longer participate on
@@ -236,6 +375,8 @@ enum {
     // If this flag is set, during any high bits sent the slave will
     // check the bus for collision (e.g., when another slave is sending
     // a low bit). If collision is detected, FLAG_MUTE is set.
+    // This flag is also set while receiving data for a broadcast
+    // command, to indicate that other slaves are participating as well.
     FLAG_CHECK_COLLISION = 8,
     // After the ACK bit:
     //  - if FLAG_IDLE is set, switch to idle and drop off the bus
@@ -246,6 +387,10 @@ enum {
     // After sending the ACK/NACK bit, clear FLAG_MUTE and
     // FLAG_CLEAR_MUTE
     FLAG_CLEAR_MUTE = 64,
+    // The current read or write command is a counted one, that
+    // transfers bytes_left more bytes and then returns to
+    // STATE_RECEIVE_COMMAND
+    FLAG_COUNTED = 128,
 };
 
 // Putting global variables in fixed registers saves a lot of
@@ -255,6 +400,9 @@ enum {
 // loop (saving another 16 bytes). Only call-used registers are
 // available, so that's effectively r2-r17. Using all of those will
 // probably kill the compiler, though.
+#if !defined(NOINIT)
+#define NOINIT __attribute__ ((section (".noinit")))
+#endif
 
 // This is the byte being sent or received. Should be initialized by the
 // mainloop when sending a byte, it is filled by the ISRs when receiving
@@ -269,6 +417,20 @@ register uint8_t next_bit asm("r3");
 // The address of the next EEPROM byte to send.
 register uint8_t next_byte asm("r4");
 
+#if defined(WITH_WIDE)
+// The high byte of the EEPROM address, set by CMD_READ_EEPROM_WIDE and
+// CMD_WRITE_EEPROM_WIDE (the low byte is in next_byte) and 0 for all
+// other commands. Only the mainloop uses it, so it does not need a
+// register. It is always set before it is used, so it can be in
+// .noinit.
+static uint8_t next_byte_high NOINIT;
+typedef uint16_t eeprom_addr_t;
+#define EEPROM_ADDR ((eeprom_addr_t)next_byte_high << 8 | next_byte)
+#else
+typedef uint8_t eeprom_addr_t;
+#define EEPROM_ADDR next_byte
+#endif
+
 // The bus address of this slave (only valid when FLAG_ENUMERATED is
 // set).
 register uint8_t bus_addr asm("r5");
@@ -279,7 +441,8 @@ register uint8_t flags asm("r6");
 // The action to take for the next or current bit
 register uint8_t action asm("r7");
 
-// The high level protocol state. Only valid when action != ACTION_IDLE.
+// The high level protocol state. Only valid when action is not
+// ACTION_IDLE or ACTION_WATCH.
 register uint8_t state asm("r8");
 
 // When this is set, the next ack/nack bit will be a nack, followed by
@@ -299,6 +462,41 @@ enum {
 };
 
 
+// The number of bytes still to be transferred by a counted command
+// (only valid when FLAG_COUNTED is set).
+register uint8_t bytes_left asm("r11");
+
+// The number of slaves that still have to send their part of a
+// BC_CMD_READ_EEPROM before it is our turn. Also used to remember the
+// command during CMD_SET_BITS, CMD_CLEAR_BITS and CMD_COMPARE_SWAP.
+register uint8_t turns_left asm("r12");
+
+// The transfer mode set by CMD_SET_MODE (MODE_* values), reset to 0 on
+// every bus reset.
+register uint8_t mode asm("r13");
+
+#if defined(WITH_FEC)
+// The Hamming check bits for the byte being sent or received. Prepared
+// by the mainloop when sending a byte, filled by the ISRs when
+// receiving a byte (cleared when the byte starts). Only touched once
+// per check bit, so it lives in memory to leave r15 free.
+static uint8_t check NOINIT;
+
+// The check bit currently being sent or received, after all data bits
+// (bitmask with exactly 1 bit enabled). When both next_bit and
+// check_bit are 0, the parity bit should be sent or received. Always
+// 0 when MODE_FEC is not set.
+register uint8_t check_bit asm("r14");
+#endif
+
+#if defined(WITH_TERNARY)
+// In MODE_TERNARY, the value of the current pair of symbols (0-8).
+// When receiving, this is accumulated by the ISRs while receiving the
+// pair. When sending, this is the value of the second symbol after
+// sending the first.
+register uint8_t symbol asm("r14");
+#endif
+
 // Register that is used by TIM0_COMPA_vect() and
 // TIM0_COMPA_vect_do_work() to pass on the sampled value. This needs to
 // happen in a global variable, since we can't clobber any other
@@ -311,6 +509,24 @@ register uint8_t sample_val asm("r16");
 // loading the constant into it.
 register uint8_t tcnt0_init asm("r17");
 
+#if defined(WITH_STATS)
+// Diagnostic counters (STAT_* values), sent by CMD_READ_STATS. These
+// are kept in .noinit, so they survive a watchdog reset (setup()
+// clears them after any other reset) and don't need the bss clear
+// loop.
+static uint8_t stats[STAT_COUNT] NOINIT;
+#endif
+
+// Increment one of the diagnostic counters, stopping at 0xff
+static inline void count_stat(uint8_t stat) {
+#if defined(WITH_STATS)
+    if (stats[stat] != 0xff)
+        stats[stat]++;
+#else
+    (void)stat;
+#endif
+}
+
 // Use a watchdog timeout of 32ms. The longest period the ISRs should be
 // busy without letting the mainloop work, should be 28 bits (4
 // handshaking bits, 8 databits with a parity error, another 4
@@ -356,6 +572,9 @@ static inline void wdt_off() {
     WDTCR = 0;
 }
 
+// Note that the naked ISRs below are emulated by the host simulation
+// in sim/slave.cpp, so keep that in sync when changing them.
+
 // This is the naked ISR that is called on INT0 interrupts. It
 // immediately clears the TCNT0 register so the time from the interrupt
 // to the timer restart (and thus timer compare match) becomes
@@ -367,10 +586,27 @@ ISR(INT0_vect, ISR_NAKED) {
     // Reset the TCNT0 register.
     asm("out %0, %1" : : "I"(_SFR_IO_ADDR(TCNT0)), "r"(tcnt0_init));
 
+#if defined(WITH_WATCH)
+    // Unless we're in ACTION_WATCH, jump to the function that will do
+    // the real work. Since that is declared as an ISR, it will also
+    // properly do all the register saving required. sbrs does not
+    // touch SREG, so this check needs no saving.
+    asm("sbrs %0, 3" : : "r"(action));
+    asm("rjmp __vector_bit_start");
+    asm("sbrs %0, 2" : : "r"(action));
+    asm("rjmp __vector_bit_start");
+
+    // In ACTION_WATCH, restarting the timer is all we need to do: if
+    // the line is still low when it overflows, TIM0_OVF sees a reset.
+    // The timer interrupts and sleep mode were already set up by the
+    // bit_start that switched to ACTION_WATCH.
+    asm("reti");
+#else
     // Jump to the function that will do the real work. Since that is
     // declared as an ISR, it will also properly do all the register
     // saving required.
     asm("rjmp __vector_bit_start");
+#endif
 }
 
 // Handle the start of a bit. Called by the INT0 ISR after resetting
@@ -395,7 +631,22 @@ ISR(__vector_bit_start)
     // case it was not released (note when a high-speed signal is on the
     // bus, the INT0 interrupt could trigger with the bus low somehow).
     TIMSK0 = (1 << TOIE0);
-    DDRB &= ~(1 << PINB1);
+    DDRB &= ~(1 << BUS_PIN);
+
+#if defined(WITH_TERNARY)
+    // Ternary symbols are sampled and released at different times
+    // than normal bits
+    if (action & AF_TERNARY) {
+        OCR0A = tcnt0_init + TERNARY_SAMPLE1;
+        if ((action & ACTION_MASK) == AV_SEND_LONG)
+            OCR0B = tcnt0_init + TERNARY_WRITE2;
+        else
+            OCR0B = tcnt0_init + TERNARY_WRITE1;
+    } else {
+        OCR0A = tcnt0_init + DATA_SAMPLE;
+        OCR0B = tcnt0_init + DATA_WRITE;
+    }
+#endif
 
     // Don't bother doing either of these when we're muted
     if ((flags & FLAG_MUTE) && (action & AF_MUTE))
@@ -403,7 +654,7 @@ ISR(__vector_bit_start)
 
     if ((action & AF_LINE_LOW)) {
         // Pull the line low and enable a timer to release it again
-        DDRB |= (1 << PINB1);
+        DDRB |= (1 << BUS_PIN);
         TIMSK0 |=  (1 << OCIE0B);
     }
 
@@ -468,7 +719,7 @@ ISR(__vector_bit_start)
 ISR(TIM0_COMPB_vect, ISR_NAKED)
 {
     // Release bus
-    asm("cbi %0, %1"   : : "I"(_SFR_IO_ADDR(DDRB)), "I"(PINB1));
+    asm("cbi %0, %1"   : : "I"(_SFR_IO_ADDR(DDRB)), "I"(BUS_PIN));
     asm("reti");
 }
 
@@ -487,6 +738,14 @@ ISR(TIM0_COMPA_vect, ISR_NAKED)
     asm("rjmp __vector_sample");
 }
 
+#if defined(WITH_TERNARY)
+// Returns true when the given three-bit value has an odd number of bits
+// set
+static inline bool odd_bits3(uint8_t value) {
+    return (0x96 >> value) & 1;
+}
+#endif
+
 // Declared as an ISR so it will properly save all registers, allowing
 // to call or jump to it from real ISRs. Name starts with __vector to
 // fool gcc into not giving the "appears to be a misspelled signal
@@ -494,12 +753,27 @@ ISR(TIM0_COMPA_vect, ISR_NAKED)
 ISR(__vector_sample)
 {
     switch (action & ACTION_MASK) {
+#if defined(WITH_WATCH)
+    case AV_IDLE:
+        // A falling edge while we're not participating. bit_start has
+        // just set up the timer overflow interrupt and edge-triggered
+        // INT0, so from now on until the transaction ends or the next
+        // reset, the INT0 ISR can skip bit_start altogether.
+        action = ACTION_WATCH;
+        break;
+#endif
     case AV_RECEIVE:
         // Read and store bit value
-        if (sample_val & (1 << PINB1)) {
+        if (sample_val & (1 << BUS_PIN)) {
             // When reading the parity bit, next_bit is 0 and this is a
             // no-op
             byte_buf |= next_bit;
+#if defined(WITH_FEC)
+            // When reading a check bit, next_bit is 0 and check_bit
+            // is set (and when reading the parity bit, both are 0)
+            if (!next_bit)
+                check |= check_bit;
+#endif
             // Toggle the parity flag on every 1 received, including the
             // parity bit
             flags ^= FLAG_PARITY;
@@ -507,29 +781,102 @@ ISR(__vector_sample)
 
         if (next_bit) {
             next_bit >>= 1;
+#if defined(WITH_FEC)
+        } else if (check_bit) {
+            check_bit >>= 1;
+#endif
         } else {
             // Full byte and parity bit received
             if (flags & FLAG_PARITY) {
                 // Parity is ok, let the mainloop decide what to do next
                 action = ACTION_STALL;
+#if defined(WITH_FEC)
+            } else if (mode & MODE_FEC) {
+                // Parity is not ok, but the mainloop might be able to
+                // correct the error using the check bits
+                action = ACTION_STALL;
+#endif
             } else {
                 // Parity is not ok, skip the STALL state and send a
                 // NACK and error code
                 action = ACTION_READY;
                 err_code = ERR_PARITY;
+                count_stat(STAT_PARITY);
             }
         }
         break;
+#if defined(WITH_TERNARY)
+    case AV_RECEIVE_TERNARY:
+    case AV_RECEIVE_TERNARY_LATE:
+        if (!(sample_val & (1 << BUS_PIN))) {
+            // The line is still low, so this is a medium or long
+            // symbol. The first symbol of a pair counts three times.
+            symbol += (next_bit & TERNARY_PAIR_START) ? 3 : 1;
+            if ((action & ACTION_MASK) == AV_RECEIVE_TERNARY) {
+                // Sample again to tell medium and long apart
+                OCR0A = tcnt0_init + TERNARY_SAMPLE2;
+                action = ACTION_RECEIVE_TERNARY_LATE;
+                break;
+            }
+        }
+        action = ACTION_RECEIVE_TERNARY;
+
+        if (next_bit & TERNARY_PAIR_START) {
+            // Wait for the second symbol of the pair
+            next_bit >>= 1;
+            break;
+        }
+
+        // A pair is complete and encodes three (inverted) bits, 8 is
+        // invalid. The last pair has the last two data bits and the
+        // parity bit.
+        if (symbol > 7)
+            err_code = ERR_PARITY;
+        symbol ^= 0x7;
+        if (odd_bits3(symbol))
+            flags ^= FLAG_PARITY;
+        if (next_bit == 0x01)
+            byte_buf = (byte_buf << 2) | (symbol >> 1);
+        else
+            byte_buf = (byte_buf << 3) | symbol;
+        symbol = 0;
+        next_bit >>= 1;
+
+        if (!next_bit) {
+            // Full byte and parity bit received
+            if ((flags & FLAG_PARITY) && err_code == ERR_OK) {
+                action = ACTION_STALL;
+            } else {
+                action = ACTION_READY;
+                err_code = ERR_PARITY;
+                count_stat(STAT_PARITY);
+            }
+        }
+        break;
+    case AV_SEND_LONG:
+#endif
     case AV_SEND:
-        if ((action & AF_SAMPLE) && !(sample_val & (1 << PINB1))) {
+        if ((action & AF_SAMPLE) && !(sample_val & (1 << BUS_PIN))) {
             // We're sending our address, but are not currently pulling the
             // line low. Check if the line is actually high. If not, someone
             // else is pulling the line low, so we drop out of the current
             // address sending round.
             flags |= FLAG_MUTE;
+            count_stat(STAT_COLLISION);
         }
 
+#if defined(WITH_TERNARY)
+        // In MODE_TERNARY, next_bit becomes 0 after the last symbol
+        // (there is no separate parity bit)
+        if ((action & AF_TERNARY) && (next_bit >>= 1))
+            goto prepare_next_bit;
+#endif
+
+#if defined(WITH_FEC)
+        if (!next_bit && !check_bit) {
+#else
         if (!next_bit) {
+#endif
             // Just sent the parity bit
             if (err_code != ERR_OK) {
                 // We just sent an error code, so skip the stall stage
@@ -546,14 +893,63 @@ ISR(__vector_sample)
             break;
         }
 
-        // Send next bit, or parity bit
+        // Send next bit, check bit or parity bit
+#if defined(WITH_FEC)
+        if (!next_bit)
+            check_bit >>= 1;
+#endif
         next_bit >>= 1;
 
         bool val;
 prepare_next_bit:
+#if defined(WITH_TERNARY)
+        if (mode & MODE_TERNARY) {
+            if (next_bit & TERNARY_PAIR_START) {
+                // Start a new pair, encoding the next three bits. The
+                // last pair has the last two data bits and the parity
+                // bit.
+                if (next_bit == TERNARY_FIRST_SYMBOL)
+                    symbol = byte_buf >> 5;
+                else if (next_bit == 0x08)
+                    symbol = (byte_buf >> 2) & 0x7;
+                else
+                    symbol = (byte_buf & 0x3) << 1;
+                if (odd_bits3(symbol))
+                    flags ^= FLAG_PARITY;
+                if (next_bit == 0x02 && !(flags & FLAG_PARITY))
+                    symbol |= 1;
+                // Bits are sent inverted, so an idle bus (only short
+                // symbols) reads as 0xff, just like with normal bits
+                symbol ^= 0x7;
+
+                // Send the first symbol, keep the second in symbol
+                if (symbol >= 6) {
+                    action = ACTION_SEND_TERNARY_LONG;
+                    symbol -= 6;
+                } else if (symbol >= 3) {
+                    action = ACTION_SEND_TERNARY_MEDIUM;
+                    symbol -= 3;
+                } else {
+                    action = ACTION_SEND_TERNARY_SHORT;
+                }
+            } else if (symbol == 2) {
+                action = ACTION_SEND_TERNARY_LONG;
+            } else if (symbol == 1) {
+                action = ACTION_SEND_TERNARY_MEDIUM;
+            } else {
+                action = ACTION_SEND_TERNARY_SHORT;
+            }
+            break;
+        }
+#endif
         if (next_bit) {
             // Send the next bit
             val = (byte_buf & next_bit);
+#if defined(WITH_FEC)
+        } else if (check_bit) {
+            // Send the next check bit
+            val = (check & check_bit);
+#endif
         } else {
             // next_bit == 0 means to send the parity bit
             val = !(flags & FLAG_PARITY);
@@ -572,6 +968,10 @@ prepare_next_bit:
             flags ^= FLAG_PARITY;
         }
         break;
+    case AV_STALL:
+        // The mainloop is still busy, the line was pulled low already
+        count_stat(STAT_STALL);
+        break;
     case AV_ACK1:
         action = ACTION_ACK2;
         break;
@@ -598,6 +998,14 @@ prepare_next_bit:
         } else {
             action = ACTION_RECEIVE;
             byte_buf = 0;
+#if defined(WITH_FEC)
+            check = 0;
+#endif
+#if defined(WITH_TERNARY)
+            symbol = 0;
+            if (mode & MODE_TERNARY)
+                action = ACTION_RECEIVE_TERNARY;
+#endif
         }
 
         break;
@@ -606,12 +1014,19 @@ prepare_next_bit:
         // Sample the line to see if anyone else is perhaps stalling the
         // bus. If so, keep trying to send our ready bit until everyone
         // is ready.
-        if (!(sample_val & (1 << PINB1)))
+        if (!(sample_val & (1 << BUS_PIN)))
             break;
 
         // Prepare for sending or receiving the next byte
         flags &= ~(FLAG_PARITY);
         next_bit = 0x80;
+#if defined(WITH_FEC)
+        check_bit = (mode & MODE_FEC) ? 0x08 : 0;
+#endif
+#if defined(WITH_TERNARY)
+        if (mode & MODE_TERNARY)
+            next_bit = TERNARY_FIRST_SYMBOL;
+#endif
 
         if (err_code != ERR_OK) {
             action = ACTION_NACK1;
@@ -627,17 +1042,19 @@ prepare_next_bit:
 
 ISR(TIM0_OVF_vect)
 {
-    uint8_t val = PINB & (1 << PINB1);
-
-    // Disable all timer interrupts
-    TIMSK0 = 0;
+    uint8_t val = PINB & (1 << BUS_PIN);
 
     /* If a falling edge interrupt was triggered between the timer
      * overflow and us sampling the line, then return and handle that
-     * instead and ignore the timer. */
+     * instead and ignore the timer. Leave the timer interrupts
+     * enabled, since in ACTION_WATCH, the INT0 ISR does not enable
+     * them again. */
     if (GIFR & (1 << INTF0))
         return;
 
+    // Disable all timer interrupts
+    TIMSK0 = 0;
+
     if (val) {
         // Bus has gone high. Since there hasn't been an INT0 in the
         // meantime, so more time has passed than is allowed between two
@@ -659,6 +1076,11 @@ ISR(TIM0_OVF_vect)
         // bit, but we're skipping that after a reset.
         byte_buf = 0;
         next_bit = 0x80;
+        // Every transaction starts in the standard mode
+        mode = 0;
+#if defined(WITH_FEC)
+        check_bit = 0;
+#endif
 
         // Clear all flags, except for the enumeration status
         flags &= FLAG_ENUMERATED;
@@ -668,7 +1090,7 @@ ISR(TIM0_OVF_vect)
 /* Don't use avr-libc's eeprom_read/update_byte functions, since those
  * produce significantly bigger code (partly because they use 16-bit
  * addresses, partly for lack of lto probably. */
-void EEPROM_write(uint8_t ucAddress, uint8_t ucData)
+void EEPROM_write(eeprom_addr_t ucAddress, uint8_t ucData)
 {
       /* Wait for completion of previous write */
     while(EECR & (1<<EEPE));
@@ -676,6 +1098,9 @@ void EEPROM_write(uint8_t ucAddress, uint8_t ucData)
     EECR = (0<<EEPM1)|(0>>EEPM0);
     /* Set up address and data registers */
     EEARL = ucAddress;
+#if defined(WITH_WIDE)
+    EEARH = ucAddress >> 8;
+#endif
     EEDR = ucData;
     /* Write logical one to EEMPE */
     EECR |= (1<<EEMPE);
@@ -683,18 +1108,155 @@ void EEPROM_write(uint8_t ucAddress, uint8_t ucData)
     EECR |= (1<<EEPE);
 }
 
-uint8_t EEPROM_read(uint8_t ucAddress)
+uint8_t EEPROM_read(eeprom_addr_t ucAddress)
 {
     /* Wait for completion of previous write */
     while(EECR & (1<<EEPE));
     /* Set up address register */
     EEARL = ucAddress;
+#if defined(WITH_WIDE)
+    EEARH = ucAddress >> 8;
+#endif
     /* Start eeprom read by writing EERE */
     EECR |= (1<<EERE);
     /* Return data from data register */
     return EEDR;
 }
 
+// Check the EEPROM address in next_byte (and next_byte_high) and, for
+// counted commands, the number of bytes in bytes_left against the
+// EEPROM size.
+static inline bool invalid_range() {
+    if (EEPROM_ADDR > E2END)
+        return true;
+    return (flags & FLAG_COUNTED) && bytes_left > E2END + 1 - EEPROM_ADDR;
+}
+
+// Advance next_byte to the next EEPROM address
+static inline void next_eeprom_byte() {
+    next_byte++;
+#if defined(WITH_WIDE)
+    if (!next_byte)
+        next_byte_high++;
+#endif
+}
+
+// When a counted command has transferred all of its bytes, go back to
+// receiving a command, so the master can send another command without
+// having to reset the bus and address us again. Returns true when this
+// happened.
+static inline bool counted_command_done() {
+    if (!(flags & FLAG_COUNTED) || bytes_left)
+        return false;
+
+    flags &= ~FLAG_COUNTED;
+#if defined(WITH_WIDE)
+    // The next command uses an 8-bit address again
+    next_byte_high = 0;
+#endif
+
+#if defined(WITH_BROADCAST)
+    if (!(flags & FLAG_CHECK_COLLISION)) {
+        flags &= ~FLAG_SEND;
+        state = STATE_RECEIVE_COMMAND;
+    } else if (!(flags & FLAG_SEND) && (flags & FLAG_MUTE)) {
+        // This was a broadcast write (which cannot be chained) and
+        // we failed and muted ourselves. Report our address.
+        state = STATE_REPORT_FAILURE;
+        flags |= FLAG_SEND | FLAG_CLEAR_MUTE;
+        byte_buf = bus_addr;
+    } else {
+        // This was a broadcast write that succeeded, or we sent our
+        // part of a broadcast read, so we're done.
+        flags |= FLAG_IDLE;
+    }
+#else
+    flags &= ~FLAG_SEND;
+    state = STATE_RECEIVE_COMMAND;
+#endif
+    return true;
+}
+
+// Write value to the EEPROM byte at next_byte, unless it is unchanged.
+// Sets err_code when the byte is read-only or the write fails.
+static void update_eeprom(uint8_t value) {
+    eeprom_addr_t addr = EEPROM_ADDR;
+    if (value == EEPROM_read(addr))
+        return;
+
+    // Byte was actually changed. Write it, unless it is a read-only
+    // byte
+    if (addr >= UNIQUE_ID_OFFSET && addr < UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH) {
+        err_code = ERR_WRITE_EEPROM_READ_ONLY;
+    } else {
+        EEPROM_write(addr, value);
+        // Check if the write completed succesfully
+        if (value != EEPROM_read(addr))
+            err_code = ERR_WRITE_EEPROM_FAILED;
+    }
+}
+
+#if defined(WITH_FEC)
+// Bytes sent in MODE_FEC are protected by a Hamming(12,8) code. Data
+// bit n (counting from the LSB) gets the n-th position that is not a
+// power of two (3, 5, 6, 7, 9, 10, 11, 12), the check bits get the
+// powers of two. The check bits are the xor of the positions of all
+// data bits that are set, so the xor of the received check bits and
+// the check bits calculated from the received data gives the position
+// of a single flipped bit. The parity bit is sent as normal (over the
+// data and check bits) and allows detecting two flipped bits.
+
+// Returns the position of the next data bit after pos
+static inline uint8_t hamming_next_pos(uint8_t pos) {
+    do {
+        pos++;
+    } while (!(pos & (pos - 1)));
+    return pos;
+}
+
+// Calculate the check bits for the given data byte. These start out
+// as 0x0c instead of 0, so 0xff gets all ones as check bits and an idle
+// bus reads as a valid 0xff byte, just like in the standard mode.
+static uint8_t hamming_check(uint8_t data) {
+    uint8_t result = 0x0c;
+    uint8_t pos = 2;
+    for (uint8_t bit = 1; bit; bit <<= 1) {
+        pos = hamming_next_pos(pos);
+        if (data & bit)
+            result ^= pos;
+    }
+    return result;
+}
+
+// Correct a single flipped bit in the byte just received, using the
+// received check bits and parity. Returns false when the error cannot
+// be corrected.
+static inline bool fec_correct() {
+    uint8_t syndrome = hamming_check(byte_buf) ^ check;
+
+    // Parity is ok, so either nothing or two bits were flipped
+    if (flags & FLAG_PARITY)
+        return syndrome == 0;
+
+    // A single flipped bit. If it is a data bit, flip it back.
+    // Otherwise, the parity bit (syndrome == 0) or a check bit
+    // (syndrome is a power of two) was flipped, which we can ignore.
+    if (syndrome & (syndrome - 1)) {
+        uint8_t pos = 2;
+        for (uint8_t bit = 1; bit; bit <<= 1) {
+            pos = hamming_next_pos(pos);
+            if (pos == syndrome) {
+                byte_buf ^= bit;
+                return true;
+            }
+        }
+        // Not a valid position, so more bits were flipped
+        return false;
+    }
+    return true;
+}
+#endif
+
 #if (__GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 8))
 // On GCC < 4.8, there is a bug that can cause writes to global register
 // variables be dropped in a function that never returns (e.g., main).
@@ -716,8 +1278,19 @@ void setup(void)
     if (!(MCUSR & (1 << WDRF)))
         flags &= ~FLAG_ENUMERATED;
 
+#if defined(WITH_STATS)
+    // The counters have undefined contents after power-on, so start
+    // counting from zero after anything but a watchdog reset
+    if (MCUSR & (1 << WDRF)) {
+        count_stat(STAT_WATCHDOG);
+    } else {
+        for (uint8_t i = 0; i < STAT_COUNT; ++i)
+            stats[i] = 0;
+    }
+#endif
+
     // Enable pullups on all ports except the bus pin (to save power)
-    PORTB = ~(1 << PINB1);
+    PORTB = ~(1 << BUS_PIN);
 
     // Shut off power to the ADC
     #if defined(PRR)
@@ -726,7 +1299,7 @@ void setup(void)
 
     // Set ports to output for debug
     #if defined(DEBUG)
-    DDRB = (1 << PINB0) | (1 << PINB2) | (1 << PINB4);
+    DDRB = DEBUG_PINS;
 
     // Bring PINB0 low after a watchdog reset
     if ((MCUSR & (1 << WDRF)))
@@ -779,10 +1352,22 @@ void loop(void)
         //    byte.
         //  - Set action to ACTION_READY (normally) or ACTION_IDLE (when
         //    no ready or ACK/NACK bits must be sent).
+#if defined(WITH_FEC)
+        if ((mode & MODE_FEC) && !(flags & FLAG_SEND) && !fec_correct()) {
+            // Too many bits flipped, handle like a parity error
+            err_code = ERR_PARITY;
+            count_stat(STAT_PARITY);
+            action = ACTION_READY;
+        } else
+#endif
         switch(state) {
         case STATE_RECEIVE_ADDRESS:
             // Read the first byte after a reset, which is either a
             // broadcast command or a bus address
+#if defined(WITH_WIDE)
+            // Every transaction starts out using 8-bit addresses
+            next_byte_high = 0;
+#endif
             if (byte_buf == BC_CMD_ENUMERATE) {
                 state = STATE_ENUMERATE;
                 flags |= FLAG_CHECK_COLLISION;
@@ -792,13 +1377,30 @@ void loop(void)
                 bus_addr = 0;
                 // Don't change out of STALL, let the next iteration
                 // prepare the first byte
+#if defined(WITH_BROADCAST)
+            } else if ((flags & FLAG_ENUMERATED) && byte_buf == BC_CMD_WRITE_EEPROM) {
+                // Broadcast write, which continues just like
+                // CMD_WRITE_EEPROM_COUNTED
+                flags |= FLAG_CHECK_COLLISION;
+                next_byte = CMD_WRITE_EEPROM_COUNTED;
+                state = STATE_RECEIVE_COUNT;
+                action = ACTION_READY;
+            } else if ((flags & FLAG_ENUMERATED) && byte_buf == BC_CMD_READ_EEPROM) {
+                // Broadcast read, which starts just like
+                // CMD_READ_EEPROM_COUNTED
+                flags |= FLAG_CHECK_COLLISION;
+                next_byte = CMD_READ_EEPROM_COUNTED;
+                state = STATE_RECEIVE_COUNT;
+                action = ACTION_READY;
+#endif
             } else if ((flags & FLAG_ENUMERATED) && byte_buf == bus_addr) {
                 // We're addressed, find out what the master wants
                 state = STATE_RECEIVE_COMMAND;
                 action = ACTION_READY;
             } else {
                 // We're not addressed, stop paying attention. Note that
-                // this does _not_ send the ready bit and ACK bit.
+                // this does _not_ send the ready bit and ACK bit. With
+                // WITH_WATCH, the next bit switches to ACTION_WATCH.
                 action = ACTION_IDLE;
             }
             break;
@@ -814,6 +1416,69 @@ void loop(void)
                     state = STATE_WRITE_EEPROM_RECEIVE_ADDR;
                     action = ACTION_READY;
                     break;
+#if defined(WITH_MODES)
+                case CMD_SET_MODE:
+                    state = STATE_SET_MODE;
+                    action = ACTION_READY;
+                    break;
+#endif
+#if defined(WITH_STATS)
+                case CMD_READ_STATS:
+                    // Send all counters, reusing the counted read
+                    // machinery to return to STATE_RECEIVE_COMMAND
+                    // afterwards
+                    next_byte = 0;
+                    bytes_left = STAT_COUNT;
+                    flags |= FLAG_SEND | FLAG_COUNTED;
+                    state = STATE_READ_STATS;
+                    // Don't change out of STALL, let the next
+                    // iteration prepare the first byte
+                    break;
+                case CMD_CLEAR_STATS:
+                    for (uint8_t i = 0; i < STAT_COUNT; ++i)
+                        stats[i] = 0;
+                    // Stay in STATE_RECEIVE_COMMAND, for chaining
+                    action = ACTION_READY;
+                    break;
+#endif
+                case CMD_READ_CAPABILITIES:
+                    // Send the minor version and features, like
+                    // CMD_READ_STATS
+                    next_byte = 0;
+                    bytes_left = 2;
+                    flags |= FLAG_SEND | FLAG_COUNTED;
+                    state = STATE_READ_CAPABILITIES;
+                    break;
+#if defined(WITH_ATOMIC)
+                case CMD_SET_BITS:
+                case CMD_CLEAR_BITS:
+                case CMD_COMPARE_SWAP:
+                    // Remember the command until the operands are
+                    // received
+                    turns_left = byte_buf;
+                    state = STATE_ATOMIC_RECEIVE_ADDR;
+                    action = ACTION_READY;
+                    break;
+#endif
+#if defined(WITH_WIDE)
+                case CMD_READ_EEPROM_SIZE:
+                    // Send the size, like CMD_READ_STATS
+                    next_byte = 0;
+                    bytes_left = 2;
+                    flags |= FLAG_SEND | FLAG_COUNTED;
+                    state = STATE_READ_EEPROM_SIZE;
+                    break;
+                case CMD_READ_EEPROM_WIDE:
+                case CMD_WRITE_EEPROM_WIDE:
+#endif
+                case CMD_READ_EEPROM_COUNTED:
+                case CMD_WRITE_EEPROM_COUNTED:
+                    // Remember the command until the count is
+                    // received
+                    next_byte = byte_buf;
+                    state = STATE_RECEIVE_COUNT;
+                    action = ACTION_READY;
+                    break;
                 default:
                     // Unknown command
                     err_code = ERR_UNKNOWN_COMMAND;
@@ -821,17 +1486,63 @@ void loop(void)
                     break;
             }
             break;
+        case STATE_RECEIVE_COUNT:
+            // We're running a counted command and just received the
+            // number of bytes to transfer. Continue with receiving the
+            // address, just like the uncounted version of the command.
+            bytes_left = byte_buf;
+            flags |= FLAG_COUNTED;
+#if defined(WITH_WIDE)
+            if (next_byte == CMD_READ_EEPROM_WIDE || next_byte == CMD_WRITE_EEPROM_WIDE) {
+                state = STATE_RECEIVE_ADDR_HIGH;
+                action = ACTION_READY;
+                break;
+            }
+#endif
+            if (next_byte == CMD_READ_EEPROM_COUNTED)
+                state = STATE_READ_EEPROM_RECEIVE_ADDR;
+            else
+                state = STATE_WRITE_EEPROM_RECEIVE_ADDR;
+            action = ACTION_READY;
+            break;
+#if defined(WITH_WIDE)
+        case STATE_RECEIVE_ADDR_HIGH:
+            // The low byte of the address follows, which is handled
+            // just like the address of the counted commands
+            next_byte_high = byte_buf;
+            if (next_byte == CMD_READ_EEPROM_WIDE)
+                state = STATE_READ_EEPROM_RECEIVE_ADDR;
+            else
+                state = STATE_WRITE_EEPROM_RECEIVE_ADDR;
+            action = ACTION_READY;
+            break;
+#endif
         case STATE_READ_EEPROM_RECEIVE_ADDR:
             // We're running CMD_READ_EEPROM and just received the
             // EEPROM addres to read from
             next_byte = byte_buf;
             flags |= FLAG_SEND;
             state = STATE_READ_EEPROM_SEND_DATA;
-            if (next_byte > E2END) {
+            if (invalid_range()) {
                 err_code = ERR_READ_EEPROM_INVALID_ADDRESS;
                 action = ACTION_READY;
                 break;
             }
+#if defined(WITH_BROADCAST)
+            if ((flags & FLAG_CHECK_COLLISION) && bus_addr && bytes_left) {
+                // This is a broadcast read, so let the slaves with a
+                // lower address send their part first. Meanwhile, we
+                // pretend to send bytes (while muted) to stay in sync.
+                // The count is kept in byte_buf, which is not
+                // otherwise used while muted.
+                state = STATE_BC_READ_EEPROM_WAIT;
+                flags |= FLAG_MUTE;
+                turns_left = bus_addr;
+                byte_buf = bytes_left;
+                action = ACTION_READY;
+                break;
+            }
+#endif
             // Don't change out of STALL, let the next iteration
             // prepare the first byte
             break;
@@ -841,25 +1552,31 @@ void loop(void)
             next_byte = byte_buf;
             state = STATE_WRITE_EEPROM_RECEIVE_DATA;
             action = ACTION_READY;
-            if (next_byte > E2END)
+            if (invalid_range())
                 err_code = ERR_READ_EEPROM_INVALID_ADDRESS;
+            else
+                counted_command_done();
             break;
         case STATE_WRITE_EEPROM_RECEIVE_DATA:
-            if (next_byte > E2END) {
+            if (EEPROM_ADDR > E2END) {
                 err_code = ERR_WRITE_EEPROM_INVALID_ADDRESS;
-            } else if (byte_buf != EEPROM_read(next_byte)) {
-                // Byte was actually changed. Write it, unless it is a
-                // read-only byte
-                if (next_byte >= UNIQUE_ID_OFFSET && next_byte < UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH) {
-                    err_code = ERR_WRITE_EEPROM_READ_ONLY;
-                } else {
-                    EEPROM_write(next_byte, byte_buf);
-                    // Check if the write completed succesfully
-                    if (byte_buf != EEPROM_read(next_byte))
-                        err_code = ERR_WRITE_EEPROM_FAILED;
-                }
+            } else {
+                update_eeprom(byte_buf);
             }
-            next_byte++;
+#if defined(WITH_BROADCAST)
+            if (err_code != ERR_OK && (flags & FLAG_CHECK_COLLISION)) {
+                // During a broadcast write, a nack and error code
+                // would collide with the data sent to the other
+                // slaves. Instead, just stop acking and report the
+                // failure after the last byte.
+                err_code = ERR_OK;
+                flags |= FLAG_MUTE;
+            }
+#endif
+            next_eeprom_byte();
+            // Note that this is harmless for uncounted commands
+            bytes_left--;
+            counted_command_done();
             action = ACTION_READY;
             break;
         case STATE_ENUMERATE:
@@ -892,28 +1609,152 @@ void loop(void)
             action = ACTION_READY;
             break;
         case STATE_READ_EEPROM_SEND_DATA:
-            if (next_byte > E2END) {
+            if (counted_command_done()) {
+                // All bytes sent, just ack the last one
+            } else if (EEPROM_ADDR > E2END) {
                 // Just send the last byte again, which will then be
                 // NACKed below (but we still have to ACK the previous
                 // byte first).
                 state = STATE_READ_EEPROM_OVERFLOW;
             } else {
                 // Read and send next EEPROM byte
-                byte_buf = EEPROM_read(next_byte);
+                byte_buf = EEPROM_read(EEPROM_ADDR);
+                next_eeprom_byte();
+                // Note that this is harmless for uncounted commands
+                bytes_left--;
+            }
+            action = ACTION_READY;
+            break;
+#if defined(WITH_BROADCAST)
+        case STATE_REPORT_FAILURE:
+            // We just sent our address to report a failed broadcast
+            // write, using the same arbitration as bus enumeration
+            if (flags & FLAG_MUTE) {
+                // Another slave with a lower address reported in this
+                // round, so try again in the next round (byte_buf
+                // still contains our address)
+                flags |= FLAG_CLEAR_MUTE;
+            } else {
+                // Our address was received by the master, we're done
+                flags |= FLAG_IDLE;
+            }
+            action = ACTION_READY;
+            break;
+        case STATE_BC_READ_EEPROM_WAIT:
+            // Another slave just sent a byte
+            if (!--bytes_left) {
+                bytes_left = byte_buf;
+                if (!--turns_left) {
+                    // It's our turn, start sending after the previous
+                    // slave acked its last byte. Don't change out of
+                    // STALL, let the next iteration prepare our first
+                    // byte.
+                    state = STATE_READ_EEPROM_SEND_DATA;
+                    flags |= FLAG_CLEAR_MUTE;
+                    break;
+                }
+            }
+            action = ACTION_READY;
+            break;
+#endif
+#if defined(WITH_MODES)
+        case STATE_SET_MODE:
+            // The new mode takes effect after the ack for this byte,
+            // after which we receive the next command
+            if (byte_buf & ~SUPPORTED_MODES) {
+                err_code = ERR_UNSUPPORTED_MODE;
+            } else {
+                mode = byte_buf;
+                state = STATE_RECEIVE_COMMAND;
+            }
+            action = ACTION_READY;
+            break;
+#endif
+#if defined(WITH_STATS)
+        case STATE_READ_STATS:
+            if (!counted_command_done()) {
+                byte_buf = stats[next_byte];
+                next_byte++;
+                bytes_left--;
+            }
+            action = ACTION_READY;
+            break;
+#endif
+        case STATE_READ_CAPABILITIES:
+            if (!counted_command_done()) {
+                byte_buf = next_byte ? FEATURES : PROTOCOL_MINOR_VERSION;
+                next_byte++;
+                bytes_left--;
+            }
+            action = ACTION_READY;
+            break;
+#if defined(WITH_ATOMIC)
+        case STATE_ATOMIC_RECEIVE_ADDR:
+            next_byte = byte_buf;
+            if (next_byte > E2END)
+                err_code = ERR_WRITE_EEPROM_INVALID_ADDRESS;
+            else if (turns_left == CMD_COMPARE_SWAP)
+                state = STATE_ATOMIC_RECEIVE_EXPECTED;
+            else
+                state = STATE_ATOMIC_RECEIVE_VALUE;
+            action = ACTION_READY;
+            break;
+        case STATE_ATOMIC_RECEIVE_EXPECTED:
+            // This is not a counted command, so bytes_left is free to
+            // keep the expected value
+            bytes_left = byte_buf;
+            state = STATE_ATOMIC_RECEIVE_VALUE;
+            action = ACTION_READY;
+            break;
+        case STATE_ATOMIC_RECEIVE_VALUE:
+        {
+            // Modify the EEPROM byte and send its old value, reusing
+            // the counted read machinery to return to
+            // STATE_RECEIVE_COMMAND afterwards. Since the mainloop
+            // does this while stalling the bus, no other master
+            // transaction can come in between.
+            uint8_t old = EEPROM_read(next_byte);
+            if (turns_left == CMD_SET_BITS)
+                update_eeprom(old | byte_buf);
+            else if (turns_left == CMD_CLEAR_BITS)
+                update_eeprom(old & ~byte_buf);
+            else if (old == bytes_left)
+                update_eeprom(byte_buf);
+            byte_buf = old;
+            bytes_left = 0;
+            flags |= FLAG_SEND | FLAG_COUNTED;
+            state = STATE_READ_EEPROM_SEND_DATA;
+            action = ACTION_READY;
+            break;
+        }
+#endif
+#if defined(WITH_WIDE)
+        case STATE_READ_EEPROM_SIZE:
+            // Sent as a 16-bit number, high byte first
+            if (!counted_command_done()) {
+                byte_buf = next_byte ? (uint8_t)(E2END + 1) : (E2END + 1) >> 8;
                 next_byte++;
+                bytes_left--;
             }
             action = ACTION_READY;
             break;
+#endif
         case STATE_READ_EEPROM_OVERFLOW:
             // We just send a dummy value for an overflowed read. NACK
             // this byte and send an error code
             err_code = ERR_READ_EEPROM_INVALID_ADDRESS;
             action = ACTION_READY;
         }
+#if defined(WITH_FEC)
+        // Prepare the check bits for the next byte to send (if any),
+        // which is the error code when sending a nack
+        if (mode & MODE_FEC)
+            check = hamming_check(err_code != ERR_OK ? err_code : byte_buf);
+#endif
         // We made some progress
         wdt_flags |= WDT_PROGRESS;
     }
-    if (PINB & (1 << PINB1))
+    if (PINB & (1 << BUS_PIN))
         wdt_flags |= WDT_LINE_HIGH;
 
     // Reset the watchdog timer when:
@@ -924,8 +1765,17 @@ void loop(void)
     //   - The line stays low for too long (regardless of who causes that)
     //   - We're not idle, but also not making any progress for too long
     //
+    //  In ACTION_WATCH, the INT0 ISR no longer sets WDT_LINE_HIGH, but
+    //  the mainloop only runs after a falling edge, so the line must
+    //  have been high. A line stuck low ends ACTION_WATCH at the next
+    //  timer overflow, so that case is still caught.
+#if defined(WITH_WATCH)
+    if (action == ACTION_WATCH || (wdt_flags & (WDT_LINE_HIGH) &&
+        (wdt_flags & WDT_PROGRESS || action == ACTION_IDLE))) {
+#else
     if (wdt_flags & (WDT_LINE_HIGH) &&
         (wdt_flags & WDT_PROGRESS || action == ACTION_IDLE)) {
+#endif
         wdt_reset();
         wdt_flags = 0;
     }
@@ -941,7 +1791,7 @@ void loop(void)
     // an interrupt does not set the action to ACTION_STALL after we
     // checked for it but before entering sleep mode
     if (action != ACTION_STALL) {
-        if (action == ACTION_IDLE && !TIMSK0 && (PINB & (1 << PINB1))) {
+        if (action == ACTION_IDLE && !TIMSK0 && (PINB & (1 << BUS_PIN))) {
             // No timers are running, so we can go to power down mode
             // (where timers stop running) instead of sleep mode.  Since
             // we can only wake up from powerdown on a low-level
@@ -4,8 +4,12 @@
 enum {
     // Start bus enumeration
     BC_CMD_ENUMERATE = 0xfe,
+    // Write EEPROM on all enumerated slaves
+    BC_CMD_WRITE_EEPROM = 0xfd,
+    // Read EEPROM from all enumerated slaves, in address order
+    BC_CMD_READ_EEPROM = 0xfc,
 
-    BC_FIRST = BC_CMD_ENUMERATE,
+    BC_FIRST = BC_CMD_READ_EEPROM,
     ADDRESS_RESERVED = 0xff,
 };
 
@@ -14,9 +18,65 @@ enum {
     CMD_RESERVED = 0x00,
     CMD_READ_EEPROM = 0x01,
     CMD_WRITE_EEPROM = 0x02,
+    CMD_READ_EEPROM_COUNTED = 0x03,
+    CMD_WRITE_EEPROM_COUNTED = 0x04,
+    CMD_SET_MODE = 0x05,
+    CMD_READ_STATS = 0x06,
+    CMD_CLEAR_STATS = 0x07,
+    CMD_READ_CAPABILITIES = 0x08,
+    CMD_SET_BITS = 0x09,
+    CMD_CLEAR_BITS = 0x0a,
+    CMD_COMPARE_SWAP = 0x0b,
+    CMD_READ_EEPROM_WIDE = 0x0c,
+    CMD_WRITE_EEPROM_WIDE = 0x0d,
+    CMD_READ_EEPROM_SIZE = 0x0e,
 
     CMD_FIRST = CMD_READ_EEPROM,
-    CMD_LAST = CMD_WRITE_EEPROM,
+    CMD_LAST = CMD_READ_EEPROM_SIZE,
+};
+
+// Values for the CMD_SET_MODE argument (can be combined)
+enum {
+    // Send four Hamming check bits after the data bits of every byte
+    MODE_FEC = 0x01,
+    // Send three bits in every pair of three-level symbols
+    MODE_TERNARY = 0x02,
+};
+
+// Sent by CMD_READ_CAPABILITIES. Slaves that nack that command with
+// ERR_UNKNOWN_COMMAND implement minor version 0, without any of the
+// optional features below.
+uint8_t const PROTOCOL_MINOR_VERSION = 1;
+
+// Optional features, sent as a bitmap by CMD_READ_CAPABILITIES
+enum {
+    // CMD_SET_MODE modes, using the same bits as the MODE_* values
+    FEATURE_FEC = MODE_FEC,
+    FEATURE_TERNARY = MODE_TERNARY,
+    FEATURE_MODES = 0x0f,
+    // CMD_READ_STATS and CMD_CLEAR_STATS
+    FEATURE_STATS = 0x10,
+    // CMD_SET_BITS, CMD_CLEAR_BITS and CMD_COMPARE_SWAP
+    FEATURE_ATOMIC = 0x20,
+    // CMD_READ_EEPROM_WIDE, CMD_WRITE_EEPROM_WIDE and
+    // CMD_READ_EEPROM_SIZE
+    FEATURE_WIDE = 0x40,
+    // BC_CMD_WRITE_EEPROM and BC_CMD_READ_EEPROM
+    FEATURE_BROADCAST = 0x80,
+};
+
+// Diagnostic counters, in the order CMD_READ_STATS sends them
+enum {
+    // Bytes received with a parity error (that could not be corrected)
+    STAT_PARITY,
+    // Arbitration rounds lost to another slave
+    STAT_COLLISION,
+    // Watchdog resets
+    STAT_WATCHDOG,
+    // Stall bits sent
+    STAT_STALL,
+
+    STAT_COUNT,
 };
 
 uint8_t const UNIQUE_ID_LENGTH = 8;
@@ -28,6 +88,7 @@ enum {
     ERR_PROTOCOL = 2,
     ERR_PARITY = 3,
     ERR_UNKNOWN_COMMAND = 4,
+    ERR_UNSUPPORTED_MODE = 5,
 
     ERR_WRITE_EEPROM_INVALID_ADDRESS = 0xff,
     ERR_WRITE_EEPROM_READ_ONLY = 0xfe,
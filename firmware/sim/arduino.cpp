@@ -0,0 +1,205 @@
+// Host-side stand-in for the parts of the Arduino API used by the
+// master test code
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Every Arduino call takes some simulated time, roughly what it would
+// take on the 16Mhz scout. This is what makes time pass for the
+// simulated slaves: busy-waiting on micros() or digitalRead() advances
+// the simulation just like on real hardware.
+
+#include <string.h>
+#include <vector>
+#include <Arduino.h>
+#include "bus.h"
+
+// Simulated duration of the various calls
+static const sim_time PIN_CALL_TIME = us(3);
+static const sim_time MICROS_CALL_TIME = us(2);
+
+// A pin connected to a bus line
+struct BusPin {
+    SimBus *bus;
+    uint8_t pin;
+    unsigned driver;
+    uint8_t mode;
+    uint8_t value;
+};
+
+// The bus that keeps the time (shared by all connected buses)
+static SimBus *bus;
+static std::vector<BusPin> bus_pins;
+
+SimSerial Serial;
+
+void sim_arduino_attach(SimBus *b, uint8_t pin) {
+    bus = b;
+    bus_pins.clear();
+    sim_arduino_add_bus(b, pin);
+}
+
+void sim_arduino_add_bus(SimBus *b, uint8_t pin) {
+    BusPin p = {b, pin, b->add_driver(), INPUT, LOW};
+    bus_pins.push_back(p);
+}
+
+static BusPin *find_pin(uint8_t pin) {
+    for (size_t i = 0; i < bus_pins.size(); ++i) {
+        if (bus_pins[i].pin == pin)
+            return &bus_pins[i];
+    }
+    return NULL;
+}
+
+static void update_bus(const BusPin *p) {
+    p->bus->drive(p->driver, p->mode == OUTPUT && p->value == LOW);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    bus->advance(PIN_CALL_TIME);
+    BusPin *p = find_pin(pin);
+    if (p) {
+        p->mode = mode;
+        update_bus(p);
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    bus->advance(PIN_CALL_TIME);
+    BusPin *p = find_pin(pin);
+    if (p) {
+        p->value = value;
+        update_bus(p);
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    bus->advance(PIN_CALL_TIME);
+    BusPin *p = find_pin(pin);
+    if (p)
+        return p->bus->line() ? HIGH : LOW;
+    return LOW;
+}
+
+int analogRead(uint8_t pin) {
+    (void)pin;
+    return 0;
+}
+
+unsigned long micros() {
+    bus->advance(MICROS_CALL_TIME);
+    return bus->now() / 1000;
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+    bus->advance(::ms(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+    bus->advance(::us(us));
+}
+
+long random(long max) {
+    if (max <= 0)
+        return 0;
+    return random() % max;
+}
+
+long random(long min, long max) {
+    if (max <= min)
+        return min;
+    return min + random() % (max - min);
+}
+
+void randomSeed(unsigned long seed) {
+    srandom(seed);
+}
+
+SimSerial::SimSerial()
+    : out(stdout), failures(0), at_line_start(true), key_pressed(true) {
+}
+
+void SimSerial::write(const char *s) {
+    if (at_line_start && strncmp(s, "--->", 4) == 0)
+        failures++;
+    if (*s)
+        at_line_start = (s[strlen(s) - 1] == '\n');
+    if (out)
+        fputs(s, out);
+}
+
+void SimSerial::print(const char *s) {
+    write(s);
+}
+
+void SimSerial::print(char c) {
+    char s[2] = {c, 0};
+    write(s);
+}
+
+void SimSerial::print(unsigned char n, int base) {
+    print((unsigned long)n, base);
+}
+
+void SimSerial::print(int n, int base) {
+    print((long)n, base);
+}
+
+void SimSerial::print(unsigned int n, int base) {
+    print((unsigned long)n, base);
+}
+
+void SimSerial::print(long n, int base) {
+    // Like Arduino, only print a sign for decimal numbers
+    if (base == DEC && n < 0) {
+        write("-");
+        print((unsigned long)-n, base);
+    } else {
+        print((unsigned long)n, base);
+    }
+}
+
+void SimSerial::print(unsigned long n, int base) {
+    char s[sizeof(n) * 8 + 1];
+    snprintf(s, sizeof(s), base == HEX ? "%lX" : "%lu", n);
+    write(s);
+}
+
+void SimSerial::println() {
+    write("\r\n");
+}
+
+size_t SimSerial::write(const uint8_t *buf, size_t len) {
+    if (out)
+        fwrite(buf, 1, len, out);
+    return len;
+}
+
+int SimSerial::read() {
+    key_pressed = !key_pressed;
+    return key_pressed ? '\n' : -1;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,202 @@
+// Host-side stand-in for the parts of avr-libc used by the slave firmware
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// firmware.c is compiled for the host by including it inside the body of
+// a class deriving from AvrCore (see slave.cpp). This header (pulled in
+// through the <avr/*.h> headers in include/) provides everything the
+// firmware expects from avr-libc: I/O registers become members of
+// AvrCore, so every simulated slave gets its own set, and the few
+// macros that touch the CPU itself (sei, sleep_cpu, ...) become calls
+// into the simulator.
+
+#ifndef _SIM_AVR_H
+#define _SIM_AVR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Identifies a single I/O register
+enum {
+    IO_PINB,
+    IO_DDRB,
+    IO_PORTB,
+    IO_TCNT0,
+    IO_TCCR0B,
+    IO_OCR0A,
+    IO_OCR0B,
+    IO_TIMSK0,
+    IO_TIFR0,
+    IO_GIMSK,
+    IO_GIFR,
+    IO_MCUCR,
+    IO_MCUSR,
+    IO_WDTCR,
+    IO_EECR,
+    IO_EEARL,
+    IO_EEARH,
+    IO_EEDR,
+
+    IO_COUNT,
+};
+
+// Implemented by the simulator, to give I/O registers and CPU
+// instructions their side effects.
+class AvrHooks {
+public:
+    virtual uint8_t io_read(uint8_t reg) = 0;
+    virtual void io_write(uint8_t reg, uint8_t value) = 0;
+    virtual void cpu_sei() = 0;
+    virtual void cpu_cli() = 0;
+    virtual void cpu_sleep() = 0;
+    virtual void cpu_wdr() = 0;
+    // Size of the simulated EEPROM, in bytes
+    virtual unsigned eeprom_size() = 0;
+protected:
+    ~AvrHooks() {}
+};
+
+class AvrCore;
+
+// A single I/O register. Behaves like the volatile uint8_t that avr-libc
+// provides, but passes every access to the AvrHooks.
+class IoReg {
+public:
+    IoReg(AvrCore *core, uint8_t reg) : core(core), reg(reg) {}
+
+    operator uint8_t() const;
+    IoReg &operator=(uint8_t value);
+    IoReg &operator=(const IoReg &other) { return *this = (uint8_t)other; }
+    IoReg &operator|=(uint8_t value) { return *this = *this | value; }
+    IoReg &operator&=(uint8_t value) { return *this = *this & value; }
+    IoReg &operator^=(uint8_t value) { return *this = *this ^ value; }
+
+private:
+    AvrCore *core;
+    uint8_t reg;
+};
+
+class AvrCore {
+public:
+    AvrCore(AvrHooks *hooks) :
+        PINB(this, IO_PINB), DDRB(this, IO_DDRB), PORTB(this, IO_PORTB),
+        TCNT0(this, IO_TCNT0), TCCR0B(this, IO_TCCR0B),
+        OCR0A(this, IO_OCR0A), OCR0B(this, IO_OCR0B),
+        TIMSK0(this, IO_TIMSK0), TIFR0(this, IO_TIFR0),
+        GIMSK(this, IO_GIMSK), GIFR(this, IO_GIFR),
+        MCUCR(this, IO_MCUCR), MCUSR(this, IO_MCUSR), WDTCR(this, IO_WDTCR),
+        EECR(this, IO_EECR), EEARL(this, IO_EEARL), EEARH(this, IO_EEARH),
+        EEDR(this, IO_EEDR),
+        hooks(hooks)
+    {}
+
+    IoReg PINB, DDRB, PORTB;
+    IoReg TCNT0, TCCR0B, OCR0A, OCR0B, TIMSK0, TIFR0;
+    IoReg GIMSK, GIFR, MCUCR, MCUSR, WDTCR;
+    IoReg EECR, EEARL, EEARH, EEDR;
+
+    void sim_sei() { hooks->cpu_sei(); }
+    void sim_cli() { hooks->cpu_cli(); }
+    void sim_sleep_cpu() { hooks->cpu_sleep(); }
+    void sim_wdt_reset() { hooks->cpu_wdr(); }
+    int sim_e2end() { return hooks->eeprom_size() - 1; }
+
+private:
+    AvrHooks *hooks;
+    friend class IoReg;
+};
+
+inline IoReg::operator uint8_t() const {
+    return core->hooks->io_read(reg);
+}
+
+inline IoReg &IoReg::operator=(uint8_t value) {
+    core->hooks->io_write(reg, value);
+    return *this;
+}
+
+// Register bits, as used on the attiny13
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB4   4
+
+#define TOIE0   1
+#define OCIE0A  2
+#define OCIE0B  3
+#define TOV0    1
+#define OCF0A   2
+#define OCF0B   3
+#define CS00    0
+#define CS01    1
+#define CS02    2
+
+#define INT0    6
+#define INTF0   6
+
+#define ISC00   0
+#define ISC01   1
+#define SM0     3
+#define SM1     4
+#define SE      5
+
+#define PORF    0
+#define EXTRF   1
+#define BORF    2
+#define WDRF    3
+
+#define WDP0    0
+#define WDP1    1
+#define WDP2    2
+#define WDE     3
+#define WDCE    4
+#define WDP3    5
+
+#define EERE    0
+#define EEPE    1
+#define EEMPE   2
+#define EEPM0   4
+#define EEPM1   5
+
+// Last EEPROM address. Every simulated slave gets the size of its
+// EEPROM image, so slaves with a bigger EEPROM (e.g. an attiny85) can
+// be simulated without building the firmware again.
+#define E2END   sim_e2end()
+
+#define _SFR_IO_ADDR(reg) 0
+#define _NOP() do { } while (0)
+
+#define ISR_NAKED
+#define ISR(vector, ...) void vector(void)
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+#define wdt_reset() sim_wdt_reset()
+
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_PWR_DOWN (1 << SM1)
+#define set_sleep_mode(mode) \
+    (MCUCR = (MCUCR & ~((1 << SM0) | (1 << SM1))) | (mode))
+#define sleep_cpu() sim_sleep_cpu()
+
+#endif // _SIM_AVR_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,152 @@
+// Simulated backpack bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <math.h>
+#include "bus.h"
+
+// The defaults are an ideal line, but with values that are realistic
+// when a pull-up is set: a pin and some wiring for the master, an AVR
+// output pin pulling low and the ATtiny13 input thresholds.
+BusConfig::BusConfig()
+    : pullup(0), capacitance(30e-12), driver_resistance(25),
+      input_low(0.3), input_high(0.6) {
+}
+
+SimBus::SimBus(const BusConfig &config)
+    : trace(NULL), clock(new Clock), config(config),
+      total_capacitance(config.capacitance), drivers_low(0), level(true),
+      v0(1), target(1), tau(0), t0(0), level_epoch(0) {
+}
+
+SimBus::SimBus(SimBus &clock_from, const BusConfig &config)
+    : trace(NULL), clock(clock_from.clock), config(config),
+      total_capacitance(config.capacitance), drivers_low(0), level(true),
+      v0(1), target(1), tau(0), t0(clock->time), level_epoch(0) {
+}
+
+void SimBus::run_until(sim_time t) {
+    Clock &c = *clock;
+    while (!c.events.empty() && c.events.top().time <= t) {
+        // Copy the event, since running it might schedule new events
+        Event e = c.events.top();
+        c.events.pop();
+        if (e.time > c.time)
+            c.time = e.time;
+        e.fn();
+    }
+    if (t > c.time)
+        c.time = t;
+}
+
+void SimBus::schedule(sim_time t, std::function<void()> fn) {
+    Event e = {t, clock->next_seq++, fn};
+    clock->events.push(e);
+}
+
+unsigned SimBus::add_driver(double capacitance) {
+    low.push_back(false);
+    total_capacitance += capacitance;
+    return low.size() - 1;
+}
+
+void SimBus::add_listener(LineListener *listener) {
+    listeners.push_back(listener);
+}
+
+double SimBus::voltage_at(sim_time t) const {
+    if (tau <= 0 || t < t0)
+        return tau <= 0 ? target : v0;
+    return target + (v0 - target) * exp(-(double)(t - t0) / tau);
+}
+
+double SimBus::voltage() const {
+    return voltage_at(now());
+}
+
+void SimBus::drive(unsigned driver, bool l) {
+    if (low[driver] == l)
+        return;
+
+    // Start a new curve from the current voltage
+    v0 = voltage_at(now());
+    t0 = now();
+    low[driver] = l;
+    drivers_low += l ? 1 : -1;
+
+    if (config.pullup <= 0) {
+        target = drivers_low ? 0 : 1;
+        tau = 0;
+    } else if (drivers_low) {
+        // The drivers in parallel form a voltage divider with the
+        // pull-up, the capacitance discharges through both
+        double r = config.driver_resistance / drivers_low;
+        target = r / (r + config.pullup);
+        tau = r * config.pullup / (r + config.pullup) * total_capacitance * 1e9;
+    } else {
+        target = 1;
+        tau = config.pullup * total_capacitance * 1e9;
+    }
+    update_level();
+}
+
+// Schedule the next change of the logic level, if the voltage is going
+// to cross the relevant threshold
+void SimBus::update_level() {
+    unsigned epoch = ++level_epoch;
+    double threshold = level ? config.input_low : config.input_high;
+    if (level ? target >= threshold : target <= threshold)
+        return;
+
+    double v = voltage_at(now());
+    if (tau <= 0 || (level ? v < threshold : v > threshold)) {
+        level_changed(epoch);
+        return;
+    }
+
+    double dt = tau * log((v - target) / (threshold - target));
+    schedule(now() + (sim_time)ceil(dt), [this, epoch]() { level_changed(epoch); });
+}
+
+void SimBus::level_changed(unsigned epoch) {
+    if (epoch != level_epoch)
+        return;
+    level = !level;
+
+    if (trace) {
+        Edge e = {now(), level};
+        trace->push_back(e);
+    }
+
+    for (size_t i = 0; i < listeners.size(); ++i)
+        listeners[i]->line_changed(level);
+}
+
+uint64_t SimBus::low_mask() const {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < low.size() && i < 64; ++i) {
+        if (low[i])
+            mask |= (uint64_t)1 << i;
+    }
+    return mask;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
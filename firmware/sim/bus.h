@@ -0,0 +1,174 @@
+// Simulated backpack bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _SIM_BUS_H
+#define _SIM_BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+
+// Simulated time, in nanoseconds since the start of the simulation
+typedef uint64_t sim_time;
+
+static inline sim_time us(double x) { return (sim_time)(x * 1000); }
+static inline sim_time ms(double x) { return (sim_time)(x * 1000000); }
+
+// Electrical parameters of a bus line
+struct BusConfig {
+    BusConfig();
+
+    // Pull-up resistance, in Ω. When 0, the line is ideal: it changes
+    // level as soon as the last driver releases it or the first driver
+    // pulls it low.
+    double pullup;
+
+    // Capacitance of the wiring and the master, in F. Every driver
+    // adds its own capacitance to this.
+    double capacitance;
+
+    // Resistance of a pin driving the line low, in Ω
+    double driver_resistance;
+
+    // Input thresholds, as a fraction of VCC. The line reads low once
+    // it drops below input_low and high once it rises above
+    // input_high, in between it keeps its previous level.
+    double input_low, input_high;
+};
+
+// Something that wants to know about changes of the bus line
+class LineListener {
+public:
+    virtual void line_changed(bool high) = 0;
+protected:
+    ~LineListener() {}
+};
+
+// A discrete event simulation of a single open-collector bus line.
+//
+// Unless the line is ideal, its voltage is modeled as an RC circuit:
+// the total capacitance charges through the pull-up, or discharges
+// through the drivers pulling it low. Everything connected to the bus
+// (including the slave ISRs sampling the line) sees the logic level
+// that results from the input thresholds, so slow edges delay or even
+// hide changes.
+//
+// Time only moves forward when somebody (normally the master, through
+// the Arduino API in arduino.cpp) calls run_until() or advance(). Any
+// events scheduled by the slaves up to that time are processed in
+// order.
+//
+// Multiple buses (e.g. for a master driving several bus pins) can share
+// a single clock: a bus constructed from another bus is a separate line
+// that runs in the same simulated time, with the events of both
+// processed in a single queue.
+class SimBus {
+public:
+    SimBus(const BusConfig &config = BusConfig());
+    SimBus(SimBus &clock_from, const BusConfig &config = BusConfig());
+
+    sim_time now() const { return clock->time; }
+
+    // Process all events scheduled up to and including t, then
+    // advance the current time to t.
+    void run_until(sim_time t);
+    void advance(sim_time dt) { run_until(now() + dt); }
+
+    // Call fn at time t (or right away, the next time events are
+    // processed, if t is in the past)
+    void schedule(sim_time t, std::function<void()> fn);
+
+    // Register a new device that can pull the line low, adding the
+    // given capacitance (in F) to the line. Returns the id to pass to
+    // drive().
+    unsigned add_driver(double capacitance = 0);
+    void add_listener(LineListener *listener);
+
+    // Let the given driver pull the line low or release it
+    void drive(unsigned driver, bool low);
+
+    // True when the line reads high
+    bool line() const { return level; }
+
+    // The current line voltage, as a fraction of VCC
+    double voltage() const;
+
+    // Bitmask of drivers currently pulling the line low (bit n is
+    // driver n, only the first 64 drivers are represented).
+    uint64_t low_mask() const;
+
+    // Every change of the line level, recorded when trace is not NULL
+    struct Edge {
+        sim_time time;
+        bool high;
+    };
+    std::vector<Edge> *trace;
+
+private:
+    struct Event {
+        sim_time time;
+        uint64_t seq;
+        std::function<void()> fn;
+        bool operator<(const Event &other) const {
+            // priority_queue puts the biggest first
+            if (time != other.time)
+                return time > other.time;
+            return seq > other.seq;
+        }
+    };
+
+    // Shared between all buses that share the clock
+    struct Clock {
+        Clock() : time(0), next_seq(0) {}
+        sim_time time;
+        uint64_t next_seq;
+        std::priority_queue<Event> events;
+    };
+    std::shared_ptr<Clock> clock;
+
+    double voltage_at(sim_time t) const;
+    void update_level();
+    void level_changed(unsigned epoch);
+
+    BusConfig config;
+    double total_capacitance;
+
+    std::vector<bool> low;
+    unsigned drivers_low;
+    std::vector<LineListener*> listeners;
+
+    // The logic level as read from the line
+    bool level;
+    // The voltage was v0 at t0 and since moves towards target, with
+    // time constant tau (in ns)
+    double v0, target, tau;
+    sim_time t0;
+    // Incremented whenever a scheduled level change becomes invalid
+    unsigned level_epoch;
+};
+
+#endif // _SIM_BUS_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,129 @@
+// Fault injection for the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <string.h>
+#include "fault.h"
+
+FaultConfig::FaultConfig()
+    : seed(1), bit_flip(0), flip_start(us(200)), flip_end(us(600)),
+      glitch_rate(0), glitch_length(us(5)), stall(0), stall_time(ms(20)),
+      brownout(0), brownout_time(ms(5)), stuck_rate(0), stuck_time(ms(100)) {
+}
+
+SimFaults::SimFaults(SimBus &bus, const std::vector<SimSlave*> &slaves,
+                     const FaultConfig &config)
+    : bus(bus), slaves(slaves), config(config), rng(config.seed),
+      holds(0), enabled(false), epoch(0) {
+    memset(&statistics, 0, sizeof(statistics));
+    driver = bus.add_driver();
+    bus.add_listener(this);
+}
+
+void SimFaults::enable(bool on) {
+    if (on == enabled)
+        return;
+    enabled = on;
+    ++epoch;
+    if (on) {
+        schedule_glitch();
+        schedule_stuck();
+    }
+}
+
+bool SimFaults::chance(double p) {
+    return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+}
+
+// Time until the next event of a Poisson process with the given rate
+// (per second)
+sim_time SimFaults::interval(double rate) {
+    return (sim_time)(std::exponential_distribution<double>(rate)(rng) * 1e9);
+}
+
+void SimFaults::hold_low(sim_time start, sim_time duration) {
+    bus.schedule(start, [this]() {
+        if (holds++ == 0)
+            bus.drive(driver, true);
+    });
+    bus.schedule(start + duration, [this]() {
+        if (--holds == 0)
+            bus.drive(driver, false);
+    });
+}
+
+void SimFaults::schedule_glitch() {
+    if (config.glitch_rate <= 0)
+        return;
+    unsigned e = epoch;
+    bus.schedule(bus.now() + interval(config.glitch_rate), [this, e]() {
+        if (e != epoch)
+            return;
+        statistics.glitches++;
+        hold_low(bus.now(), config.glitch_length);
+        schedule_glitch();
+    });
+}
+
+void SimFaults::schedule_stuck() {
+    if (config.stuck_rate <= 0)
+        return;
+    unsigned e = epoch;
+    bus.schedule(bus.now() + interval(config.stuck_rate), [this, e]() {
+        if (e != epoch)
+            return;
+        statistics.stuck++;
+        hold_low(bus.now(), config.stuck_time);
+        // The next one can only start after this one ended
+        bus.schedule(bus.now() + config.stuck_time, [this, e]() {
+            if (e == epoch)
+                schedule_stuck();
+        });
+    });
+}
+
+void SimFaults::line_changed(bool high) {
+    // Only falling edges made by the master or the slaves count
+    if (high || !enabled || holds)
+        return;
+
+    if (chance(config.bit_flip)) {
+        statistics.bit_flips++;
+        hold_low(bus.now() + config.flip_start, config.flip_end - config.flip_start);
+    }
+
+    if (slaves.empty())
+        return;
+    SimSlave *slave = slaves[rng() % slaves.size()];
+    if (chance(config.stall)) {
+        statistics.stalls++;
+        slave->stall(config.stall_time);
+    }
+    if (chance(config.brownout) && slave->powered()) {
+        statistics.brownouts++;
+        // Not right away, since this runs from within the bus
+        bus.schedule(bus.now(), [slave]() { slave->power_off(); });
+        bus.schedule(bus.now() + config.brownout_time, [slave]() { slave->power_on(); });
+    }
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,112 @@
+// Fault injection for the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef _SIM_FAULT_H
+#define _SIM_FAULT_H
+
+#include <random>
+#include <vector>
+#include "bus.h"
+#include "slave.h"
+
+// Rates of the faults injected by SimFaults. Everything is off by
+// default.
+struct FaultConfig {
+    FaultConfig();
+
+    // Seed for the fault generator, which is separate from random() so
+    // the faults do not change what the master does
+    unsigned long seed;
+
+    // Probability that a bit is flipped, for every falling edge. Noise
+    // on an open collector line shows up as the line pulled low, so a
+    // flipped bit is held low from flip_start to flip_end after its
+    // falling edge, which turns a 1 into a 0 (and leaves a 0 alone).
+    double bit_flip;
+    sim_time flip_start, flip_end;
+
+    // Average number of glitches per second: low pulses of
+    // glitch_length at random times, shorter than the time between a
+    // falling edge and the sampling of the bit
+    double glitch_rate;
+    sim_time glitch_length;
+
+    // Probability that a slave stalls, for every falling edge. The
+    // next byte it processes takes stall_time longer (see
+    // SimSlave::stall()).
+    double stall;
+    sim_time stall_time;
+
+    // Probability that a slave browns out, for every falling edge. It
+    // loses power for brownout_time, which makes it forget its address.
+    double brownout;
+    sim_time brownout_time;
+
+    // Average number of times per second the line gets stuck low, for
+    // stuck_time. Longer than the slave watchdog timeout, this resets
+    // all slaves.
+    double stuck_rate;
+    sim_time stuck_time;
+};
+
+// Injects random faults into a bus and its slaves, as configured.
+// Faults are only injected while enabled, so the bus can be set up
+// (e.g. enumerated) without them.
+class SimFaults : private LineListener {
+public:
+    SimFaults(SimBus &bus, const std::vector<SimSlave*> &slaves,
+              const FaultConfig &config);
+
+    void enable(bool on);
+
+    // Number of faults injected
+    struct Stats {
+        unsigned long bit_flips, glitches, stalls, brownouts, stuck;
+    };
+    const Stats &stats() const { return statistics; }
+
+private:
+    virtual void line_changed(bool high);
+
+    bool chance(double p);
+    sim_time interval(double rate);
+    void hold_low(sim_time start, sim_time duration);
+    void schedule_glitch();
+    void schedule_stuck();
+
+    SimBus &bus;
+    std::vector<SimSlave*> slaves;
+    FaultConfig config;
+    Stats statistics;
+    std::mt19937 rng;
+    unsigned driver;
+    // Number of faults currently holding the line low
+    unsigned holds;
+    bool enabled;
+    // Incremented to cancel the scheduled glitch and stuck line
+    unsigned epoch;
+};
+
+#endif // _SIM_FAULT_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
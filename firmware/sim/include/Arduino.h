@@ -0,0 +1,110 @@
+// Host-side stand-in for the parts of the Arduino API used by the
+// master test code, see arduino.cpp
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _SIM_ARDUINO_H
+#define _SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+class SimBus;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+#define DEC 10
+#define HEX 16
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class SimSerial {
+public:
+    SimSerial();
+
+    void begin(unsigned long baud) { (void)baud; }
+
+    void print(const char *s);
+    void print(char c);
+    void print(unsigned char n, int base = DEC);
+    void print(int n, int base = DEC);
+    void print(unsigned int n, int base = DEC);
+    void print(long n, int base = DEC);
+    void print(unsigned long n, int base = DEC);
+
+    template <typename T>
+    void println(T value) { print(value); println(); }
+    template <typename T>
+    void println(T value, int base) { print(value, base); println(); }
+    void println();
+
+    // Raw bytes, these do not count as the start of a line
+    size_t write(const uint8_t *buf, size_t len);
+
+    // There is nobody to type anything, so this returns -1 (no data)
+    // and a newline alternately. This makes sure that any "press a key
+    // to continue" prompts continue right away.
+    int read();
+
+    // Where output is written, or NULL to discard it
+    FILE *out;
+
+    // Number of lines written that start with "--->", which is how the
+    // test code marks failures
+    unsigned long failures;
+
+private:
+    void write(const char *s);
+
+    bool at_line_start;
+    bool key_pressed;
+};
+
+extern SimSerial Serial;
+
+// Connect the Arduino pins to a simulated bus. The given pin becomes
+// the bus line, all other pins are not connected.
+void sim_arduino_attach(SimBus *bus, uint8_t bus_pin);
+
+// Connect another pin to a second bus line, which must share the clock
+// of the bus passed to sim_arduino_attach (see SimBus).
+void sim_arduino_add_bus(SimBus *bus, uint8_t bus_pin);
+
+#endif // _SIM_ARDUINO_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,2 @@
+// Stand-in for the avr-libc header of the same name, see avr.h
+#include "../../avr.h"
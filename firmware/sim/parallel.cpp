@@ -0,0 +1,119 @@
+// Running independent simulations in parallel
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "parallel.h"
+
+// Sent through the pipe by the workers. This is smaller than PIPE_BUF,
+// so writes from different workers are never interleaved.
+struct SimJobMessage {
+    uint32_t job;
+    SimJobResult result;
+};
+
+unsigned sim_default_workers() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Runs a single job in a child forked from the worker, so the globals
+// left behind by one job never leak into the next one run by the same
+// worker. Returns false when the child could not be started or did not
+// exit cleanly.
+static bool sim_run_job(unsigned i, const SimJob &job, int fd) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        SimJobMessage msg = {};
+        msg.job = i;
+        msg.result.done = true;
+        if (job(i, &msg.result) && write(fd, &msg, sizeof(msg)) != sizeof(msg))
+            _exit(1);
+        // _exit() skips flushing stdio buffers
+        fflush(stdout);
+        _exit(0);
+    }
+    int wstatus;
+    return waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus) && !WEXITSTATUS(wstatus);
+}
+
+static void sim_worker(unsigned worker, unsigned workers, unsigned count,
+                       const SimJob &job, int fd) {
+    bool ok = true;
+    for (unsigned i = worker; i < count; i += workers) {
+        if (!sim_run_job(i, job, fd))
+            ok = false;
+    }
+    _exit(ok ? 0 : 1);
+}
+
+bool sim_run_parallel(unsigned workers, unsigned count, const SimJob &job,
+                      std::vector<SimJobResult> &results) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return false;
+    }
+
+    // Flush before forking, so buffered output is not duplicated
+    fflush(stdout);
+    fflush(stderr);
+    std::vector<pid_t> pids;
+    for (unsigned w = 0; w < workers; ++w) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            sim_worker(w, workers, count, job, fds[1]);
+        }
+        pids.push_back(pid);
+    }
+    close(fds[1]);
+
+    results.assign(count, SimJobResult());
+    SimJobMessage msg;
+    while (read(fds[0], &msg, sizeof(msg)) == sizeof(msg)) {
+        if (msg.job < count)
+            results[msg.job] = msg.result;
+    }
+    close(fds[0]);
+
+    bool ok = pids.size() == workers;
+    for (unsigned i = 0; i < pids.size(); ++i) {
+        int wstatus;
+        if (waitpid(pids[i], &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+            ok = false;
+    }
+    return ok;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,68 @@
+// Running independent simulations in parallel
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _SIM_PARALLEL_H
+#define _SIM_PARALLEL_H
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "bus.h"
+
+// Number of SimJobResult.values
+#define SIM_JOB_VALUES 8
+
+// Outcome of a single job
+struct SimJobResult {
+    // False when the job was skipped, or its worker died before
+    // finishing it
+    bool done;
+    // Number of failed tests
+    uint32_t failures;
+    // Simulated time the job took
+    sim_time time;
+    // Anything else the job wants to report, e.g. for a benchmark
+    uint64_t values[SIM_JOB_VALUES];
+};
+
+// A job fills in result (done is already set) and returns true, or
+// returns false to skip the job.
+typedef std::function<bool(unsigned job, SimJobResult *result)> SimJob;
+
+// The number of CPUs, the default number of workers
+unsigned sim_default_workers();
+
+// Run jobs 0 up to count, spread over the given number of worker
+// processes. Since the simulator and the master test code keep their
+// state in globals, every job runs in its own forked copy of the
+// current process, so jobs cannot influence each other (nor the
+// caller), no matter how many workers there are. Every job should set
+// up its own SimBus and slaves.
+//
+// results gets an entry for every job. Returns false when a worker
+// could not be started or did not exit cleanly.
+bool sim_run_parallel(unsigned workers, unsigned count, const SimJob &job,
+                      std::vector<SimJobResult> &results);
+
+#endif // _SIM_PARALLEL_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,287 @@
+// Benchmark of the transfer modes, using the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Reads the complete EEPROM of a single slave in one session, once in
+// every transfer mode the slave supports, and prints how long that takes
+// in simulated time. This is repeated for a slave running at its nominal
+// clock speed and at 10% below and above it, the worst case the bus
+// timings should allow for.
+//
+// Finally, the same read is done with a second slave on the bus, to
+// show how many of the falling edges that second slave had to fully
+// process. Once it knows it is not addressed, it should only watch for
+// the next reset (ACTION_WATCH).
+//
+// Then, a slave with 512 bytes of EEPROM (like an attiny85) is written
+// across the 256 byte boundary and read back completely using the
+// 16-bit addressed commands.
+//
+// Finally, a fixture with up to four buses (one slave each, all with
+// a different clock skew) is programmed with bp_parallel_write_eeprom,
+// to show how the throughput scales with the number of buses.
+
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+
+static const double skews[] = {0.9, 1.0, 1.1};
+static const uint8_t modes[] = {0, MODE_FEC, MODE_TERNARY};
+static const char *mode_names[] = {"standard", "MODE_FEC", "MODE_TERNARY"};
+
+// Returns the simulated time in ns to read the full EEPROM in the given
+// mode, or 0 when the mode is not supported or the read failed.
+static sim_time bench_read(SimBus &bus, SimSlave &slave, uint8_t mode) {
+    uint8_t buf[EEPROM_SIZE];
+    status s = {OK, 0};
+    uint8_t used = mode;
+
+    // Let the bus go idle
+    delay(5);
+
+    sim_time start = bus.now();
+    bool ok = bp_session_begin_mode(0, &used, &s);
+    ok = ok && bp_session_read_eeprom(0, buf, sizeof(buf), &s);
+    sim_time duration = bus.now() - start;
+
+    if (!ok || used != mode)
+        return 0;
+    if (memcmp(buf, &slave.eeprom()[0], sizeof(buf))) {
+        printf("EEPROM contents did not match\n");
+        return 0;
+    }
+    return duration;
+}
+
+// A bystander should only fully process the bits up to and including
+// the address byte, which takes a few more than this
+static const unsigned long MAX_BYSTANDER_BITS = 32;
+
+// Read the EEPROM of one slave, with a second slave on the bus, and
+// print how many INT0 interrupts the second slave handled. Returns
+// false when the second slave did too much work.
+static bool bench_bystander() {
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    SimSlave target(bus, sim_eeprom_image(0x1234, 1, 1000));
+    SimSlave bystander(bus, sim_eeprom_image(0x1234, 1, 1001));
+    target.power_on();
+    bystander.power_on();
+
+    uint8_t count = 2;
+    if (!bp_scan(ids, &count) || count != 2) {
+        printf("Bystander: enumeration failed\n");
+        return false;
+    }
+
+    uint8_t addr = target.bus_addr();
+    uint8_t buf[EEPROM_SIZE];
+    status s = {OK, 0};
+    delay(5);
+
+    SimSlave::Stats before = bystander.stats();
+    bool ok = bp_session_begin(addr, &s);
+    ok = ok && bp_session_read_eeprom(0, buf, sizeof(buf), &s);
+    const SimSlave::Stats &after = bystander.stats();
+    if (!ok) {
+        printf("Bystander: read failed\n");
+        return false;
+    }
+
+    unsigned long int0 = after.int0 - before.int0;
+    unsigned long watched = after.int0_watch - before.int0_watch;
+    printf("\nBystander: %lu INT0 interrupts, %lu fully processed, %lu watched\n",
+           int0, int0 - watched, watched);
+    return int0 - watched <= MAX_BYSTANDER_BITS;
+}
+
+// EEPROM size of the slave for bench_wide
+static const unsigned WIDE_EEPROM_SIZE = 512;
+
+// Write a few bytes around offset 0x100 of a slave with a big EEPROM,
+// read back all of it in the fastest mode and print how long that took. Returns false when
+// anything failed.
+static bool bench_wide() {
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    SimSlave slave(bus, sim_eeprom_image(0x1234, 1, 1000, WIDE_EEPROM_SIZE));
+    slave.power_on();
+
+    uint8_t count = 1;
+    status s = {OK, 0};
+    if (!bp_scan(ids, &count) || count != 1 || !bp_discover(0, &s)) {
+        printf("Wide: enumeration failed\n");
+        return false;
+    }
+    if (bp_current->caps[0].eeprom_size != WIDE_EEPROM_SIZE) {
+        printf("Wide: unexpected EEPROM size %u\n", bp_current->caps[0].eeprom_size);
+        return false;
+    }
+
+    uint8_t data[16];
+    for (unsigned i = 0; i < sizeof(data); ++i)
+        data[i] = random(0, 256);
+    bool ok = bp_session_begin(0, &s);
+    ok = ok && bp_session_write_eeprom_wide(0x100 - sizeof(data) / 2, data, sizeof(data), &s);
+
+    uint8_t buf[WIDE_EEPROM_SIZE];
+    delay(5);
+    sim_time start = bus.now();
+    ok = ok && bp_session_begin_fastest(0, &s);
+    ok = ok && bp_session_read_eeprom_wide(0, buf, sizeof(buf), &s);
+    sim_time t = bus.now() - start;
+    if (!ok) {
+        printf("Wide: transfer failed\n");
+        return false;
+    }
+    if (memcmp(buf, &slave.eeprom()[0], sizeof(buf)) ||
+        memcmp(&buf[0x100 - sizeof(data) / 2], data, sizeof(data))) {
+        printf("Wide: EEPROM contents did not match\n");
+        return false;
+    }
+    printf("\nWide: read %u bytes in %.1fms, %.0f bytes/s\n",
+           WIDE_EEPROM_SIZE, t / 1e6, WIDE_EEPROM_SIZE / (t / 1e9));
+    return true;
+}
+
+// Clock skew of the slave on each bus for bench_parallel
+static const double parallel_skews[] = {1.0, 0.9, 1.1, 1.05};
+
+// Program the writable part of the EEPROM of one slave on each of the
+// given number of buses at once, verify it and print the throughput.
+// Returns false when anything failed.
+static bool bench_parallel(unsigned count) {
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    std::vector<SimBus*> buses;
+    std::vector<SimSlave*> slaves;
+    bp_bus fixture[lengthof(parallel_skews)];
+    bp_bus *list[lengthof(parallel_skews)];
+    for (unsigned i = 0; i < count; ++i) {
+        SimBus *b = i ? new SimBus(bus) : &bus;
+        if (i)
+            sim_arduino_add_bus(b, BP_BUS_PIN + i);
+        SlaveConfig config;
+        config.clock_skew = parallel_skews[i];
+        slaves.push_back(new SimSlave(*b, sim_eeprom_image(0x1234, 1, 1000 + i), config));
+        slaves.back()->power_on();
+        buses.push_back(b);
+        bp_bus_init(&fixture[i], BP_BUS_PIN + i, bp_default_bus.timing);
+        list[i] = &fixture[i];
+    }
+
+    bool ok = true;
+    for (unsigned i = 0; i < count && ok; ++i) {
+        uint8_t n = 1;
+        bp_select(list[i]);
+        ok = bp_scan(ids, &n) && n == 1;
+    }
+    bp_select(&bp_default_bus);
+
+    const uint8_t offset = UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH;
+    const uint8_t len = EEPROM_SIZE - offset;
+    uint8_t data[len];
+    for (unsigned i = 0; i < len; ++i)
+        data[i] = random(0, 256);
+    status s[lengthof(parallel_skews)];
+
+    delay(5);
+    sim_time start = bus.now();
+    ok = ok && bp_parallel_write_eeprom(list, count, 0, offset, data, len, s);
+    sim_time t = bus.now() - start;
+    for (unsigned i = 0; i < count && ok; ++i)
+        ok = !memcmp(&slaves[i]->eeprom()[offset], data, len);
+    if (ok) {
+        printf("%-6u %10.1f %10.0f\n", count, t / 1e6, count * len / (t / 1e9));
+    } else {
+        printf("%-6u failed\n", count);
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        delete slaves[i];
+        if (i)
+            delete buses[i];
+    }
+    return ok;
+}
+
+int main() {
+    int failed = 0;
+    Serial.out = NULL;
+    bp_default_bus.timing = &timings_to_test[TIMING_TYP];
+
+    printf("Reading %u bytes of EEPROM in a single session\n\n", EEPROM_SIZE);
+    printf("%-6s %-14s %10s %10s %8s\n", "skew", "mode", "time (ms)", "bytes/s", "speedup");
+
+    for (unsigned i = 0; i < lengthof(skews); ++i) {
+        SimBus bus;
+        sim_arduino_attach(&bus, BP_BUS_PIN);
+
+        SlaveConfig config;
+        config.clock_skew = skews[i];
+        SimSlave slave(bus, sim_eeprom_image(0x1234, 1, 1000), config);
+        slave.power_on();
+
+        uint8_t count = 1;
+        if (!bp_scan(ids, &count) || count != 1) {
+            printf("%-6.2f enumeration failed\n", skews[i]);
+            failed = 1;
+            continue;
+        }
+
+        sim_time standard = 0;
+        for (unsigned m = 0; m < lengthof(modes); ++m) {
+            sim_time t = bench_read(bus, slave, modes[m]);
+            if (!t) {
+                // Standard mode must always work
+                if (!modes[m]) {
+                    printf("%-6.2f %-14s failed\n", skews[i], mode_names[m]);
+                    failed = 1;
+                }
+                continue;
+            }
+            if (!modes[m])
+                standard = t;
+            printf("%-6.2f %-14s %10.1f %10.0f %7.2fx\n", skews[i], mode_names[m],
+                   t / 1e6, EEPROM_SIZE / (t / 1e9),
+                   standard ? (double)standard / t : 0.0);
+        }
+    }
+
+    if (!bench_bystander())
+        failed = 1;
+    if (!bench_wide())
+        failed = 1;
+
+    printf("\nProgramming %u bytes per bus, all buses at once\n\n",
+           EEPROM_SIZE - UNIQUE_ID_OFFSET - UNIQUE_ID_LENGTH);
+    printf("%-6s %10s %10s\n", "buses", "time (ms)", "bytes/s");
+    for (unsigned count = 1; count <= lengthof(parallel_skews); ++count) {
+        if (!bench_parallel(count))
+            failed = 1;
+    }
+    return failed;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
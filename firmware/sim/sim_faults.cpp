@@ -0,0 +1,270 @@
+// Throughput of the backpack bus under injected faults
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// Reads small blocks of EEPROM from random slaves for a fixed amount of
+// simulated time, with faults injected into the bus (see fault.h), once
+// for every combination of fault model and master retry policy (see
+// bp_retry()). For each, it prints:
+//  - The goodput: bytes read with the right contents, per second.
+//  - The number of reads that succeeded, that still failed after all
+//    retries and that returned wrong data without an error.
+//  - The number of faults injected.
+//  - For the reads that only succeeded after a retry, the recovery
+//    latency: the time from the end of the first failed attempt until
+//    the read succeeded.
+//
+// Every combination runs on a fresh simulated bus, spread over worker
+// processes (one per CPU by default) by sim_run_parallel(). The exit
+// status is 1 when anything failed without faults.
+//
+// Usage: sim_faults [-j jobs] [-n slaves] [-s seed] [-t seconds]
+
+#include <unistd.h>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "fault.h"
+#include "parallel.h"
+
+struct faults_model {
+    const char *name;
+    void (*apply)(FaultConfig *config);
+};
+
+static const faults_model models[] = {
+    {"none", [](FaultConfig *) {}},
+    {"bit flips", [](FaultConfig *c) { c->bit_flip = 0.005; }},
+    {"glitches", [](FaultConfig *c) { c->glitch_rate = 20; }},
+    {"slave stalls", [](FaultConfig *c) { c->stall = 0.002; }},
+    {"brownouts", [](FaultConfig *c) { c->brownout = 0.0005; }},
+    {"stuck low", [](FaultConfig *c) { c->stuck_rate = 2; }},
+};
+
+struct faults_policy {
+    const char *name;
+    bp_retry_policy policy;
+    // Rescan using the ids found at the start of the run
+    bool rescan;
+};
+
+static const faults_policy policies[] = {
+    {"none", {1, 0, NULL, 0}, false},
+    {"immediate", {4, 0, NULL, 0}, false},
+    {"backoff", {8, 1, NULL, 0}, false},
+    {"backoff+rescan", {8, 1, NULL, 0}, true},
+};
+
+// SimJobResult.values
+enum {
+    VALUE_BYTES,
+    VALUE_OK,
+    VALUE_FAILED,
+    VALUE_WRONG,
+    VALUE_FAULTS,
+    VALUE_RECOVERED,
+    // In ns
+    VALUE_RECOVERY_TOTAL,
+    VALUE_RECOVERY_MAX,
+};
+
+// Bytes read by every transaction
+#define FAULTS_READ_SIZE 8
+
+static unsigned slave_count = 2;
+static unsigned long seed = 1;
+static double seconds = 20;
+
+struct faults_read {
+    SimBus *bus;
+    uint8_t addr;
+    uint8_t offset;
+    uint8_t buf[FAULTS_READ_SIZE];
+    // When the first attempt failed, if any
+    bool failed;
+    sim_time failed_at;
+};
+
+static bool faults_attempt(void *arg, status *s) {
+    faults_read *r = (faults_read *)arg;
+    bool ok = bp_session_begin(r->addr, s);
+    ok = ok && bp_session_read_eeprom(r->offset, r->buf, sizeof(r->buf), s);
+    if (!ok && !r->failed) {
+        r->failed = true;
+        r->failed_at = r->bus->now();
+    }
+    return ok;
+}
+
+static bool faults_job(unsigned job, SimJobResult *result) {
+    const faults_model *model = &models[job / lengthof(policies)];
+    const faults_policy *policy = &policies[job % lengthof(policies)];
+
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+    std::vector<SimSlave*> slaves;
+    for (unsigned i = 0; i < slave_count; ++i) {
+        SimSlave *slave = new SimSlave(bus, sim_eeprom_image(0x1234, 1, 1000 + i));
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    FaultConfig config;
+    config.seed = seed + job / lengthof(policies);
+    model->apply(&config);
+    SimFaults faults(bus, slaves, config);
+
+    bp_default_bus.timing = &timings_to_test[TIMING_TYP];
+    randomSeed(seed);
+
+    // The contents every address should return, as found before the
+    // faults start
+    std::vector<const std::vector<uint8_t>*> expected;
+    uint8_t count = lengthof(ids);
+    if (!bp_scan(ids, &count) || count != slave_count) {
+        result->failures = 1;
+    } else {
+        for (uint8_t a = 0; a < count; ++a) {
+            for (unsigned i = 0; i < slave_count; ++i) {
+                if (slaves[i]->bus_addr() == a)
+                    expected.push_back(&slaves[i]->eeprom());
+            }
+        }
+    }
+
+    bp_retry_policy retry = policy->policy;
+    if (policy->rescan) {
+        retry.ids = ids;
+        retry.id_count = count;
+    }
+
+    faults.enable(true);
+    sim_time start = bus.now();
+    uint64_t *v = result->values;
+    while (!result->failures && bus.now() - start < ms(seconds * 1000)) {
+        faults_read r;
+        r.bus = &bus;
+        r.addr = random(0, count);
+        r.offset = random(0, EEPROM_SIZE - FAULTS_READ_SIZE + 1);
+        r.failed = false;
+        status s = {OK, 0};
+        if (!bp_retry(&retry, faults_attempt, &r, &s)) {
+            v[VALUE_FAILED]++;
+        } else if (memcmp(r.buf, &(*expected[r.addr])[r.offset], sizeof(r.buf))) {
+            v[VALUE_WRONG]++;
+        } else {
+            v[VALUE_OK]++;
+            v[VALUE_BYTES] += sizeof(r.buf);
+            if (r.failed) {
+                sim_time latency = bus.now() - r.failed_at;
+                v[VALUE_RECOVERED]++;
+                v[VALUE_RECOVERY_TOTAL] += latency;
+                if (latency > v[VALUE_RECOVERY_MAX])
+                    v[VALUE_RECOVERY_MAX] = latency;
+            }
+        }
+        // Let the bus go idle between reads
+        delay(1);
+    }
+    faults.enable(false);
+    result->time = bus.now() - start;
+
+    const SimFaults::Stats &st = faults.stats();
+    v[VALUE_FAULTS] = st.bit_flips + st.glitches + st.stalls + st.brownouts + st.stuck;
+
+    for (unsigned i = 0; i < slave_count; ++i)
+        delete slaves[i];
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int jobs = sim_default_workers();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:n:s:t:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'n':
+            slave_count = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j jobs] [-n slaves] [-s seed] [-t seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+    if (slave_count < 1 || slave_count > lengthof(eeproms) || seconds <= 0) {
+        fprintf(stderr, "Invalid number of slaves or seconds\n");
+        return 2;
+    }
+
+    Serial.out = NULL;
+    printf("Reading %u bytes at a time from %u slaves for %.1fs per combination, %d jobs\n\n",
+           FAULTS_READ_SIZE, slave_count, seconds, jobs);
+
+    std::vector<SimJobResult> results;
+    if (!sim_run_parallel(jobs, lengthof(models) * lengthof(policies), faults_job, results)) {
+        fprintf(stderr, "A worker failed\n");
+        return 2;
+    }
+
+    printf("%-13s %-15s %8s %6s %6s %6s %6s %9s %9s\n", "faults", "retry policy",
+           "bytes/s", "ok", "failed", "wrong", "faults", "recovered", "avg/max ms");
+    int failed = 0;
+    for (unsigned m = 0; m < lengthof(models); ++m) {
+        for (unsigned p = 0; p < lengthof(policies); ++p) {
+            const SimJobResult &r = results[m * lengthof(policies) + p];
+            const uint64_t *v = r.values;
+            printf("%-13s %-15s ", p ? "" : models[m].name, policies[p].name);
+            if (!r.done || r.failures) {
+                printf("failed\n");
+                if (!m)
+                    failed = 1;
+                continue;
+            }
+            // Without faults, everything should work
+            if (!m && (v[VALUE_FAILED] || v[VALUE_WRONG]))
+                failed = 1;
+            printf("%8.1f %6lu %6lu %6lu %6lu %9lu", v[VALUE_BYTES] / (r.time / 1e9),
+                   (unsigned long)v[VALUE_OK], (unsigned long)v[VALUE_FAILED],
+                   (unsigned long)v[VALUE_WRONG], (unsigned long)v[VALUE_FAULTS],
+                   (unsigned long)v[VALUE_RECOVERED]);
+            if (v[VALUE_RECOVERED])
+                printf(" %.1f/%.1f", v[VALUE_RECOVERY_TOTAL] / 1e6 / v[VALUE_RECOVERED],
+                       v[VALUE_RECOVERY_MAX] / 1e6);
+            printf("\n");
+        }
+    }
+    return failed;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
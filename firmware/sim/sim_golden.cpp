@@ -0,0 +1,377 @@
+// Golden bus trace regression check, using the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// A change to the firmware can shift edge timings or add stall bits
+// without making any functional test fail. This runs a fixed set of
+// scenarios with fixed seeds and typical timings, decodes the bus line
+// with tools/busdecode and compares every byte against a baseline
+// checked in under golden/:
+//  - The byte values, their meaning and the ack/nack must match.
+//  - The number of bits and stall bits must match, unless -S allows
+//    some stall bits more or less.
+//  - Every low pulse must be within -t μs (default 5) of the baseline.
+//
+// Every byte is a line like:
+//
+//   command 0x02 ack stall=1 low=131,613,...
+//
+// with the low time of every bit (data, stall, ready and handshake) in
+// μs. Run with -u after an intended change to rewrite the baseline.
+//
+// Usage: sim_golden [-v] [-u] [-t tolerance_us] [-S stall_bits] baseline
+
+#include <unistd.h>
+#include <string>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "../../tools/busdecode/decoder.h"
+
+#define GOLDEN_SLAVES 2
+#define GOLDEN_SEED 1
+
+struct golden_scenario {
+    const char *name;
+    // Parity error position, see parity_error_byte
+    uint8_t parity;
+    // Run after enumerating the slaves and reading their EEPROMs, or
+    // instead of that when NULL
+    void (*run)();
+};
+
+static const golden_scenario scenarios[] = {
+    {"enumerate", 0xff, NULL},
+    {"read", 0xff, []() {
+        test_read_eeprom(0, 0, 8);
+        test_read_eeprom(1, UNIQUE_ID_OFFSET, UNIQUE_ID_LENGTH);
+    }},
+    {"write", 0xff, []() {
+        test_write_eeprom(0, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, 4);
+        test_chained(1, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, 4);
+    }},
+    {"broadcast", 0xff, []() {
+        test_broadcast_read(GOLDEN_SLAVES);
+        test_broadcast_write(GOLDEN_SLAVES);
+    }},
+    {"read_overflow", 0xff, []() { test_read_overflow(0); }},
+    {"write_overflow", 0xff, []() { test_write_overflow(0); }},
+    {"write_readonly", 0xff, []() { test_write_readonly(0, UNIQUE_ID_OFFSET); }},
+    {"unknown_command", 0xff, []() { test_unknown_command(0, CMD_RESERVED); }},
+    {"parity_error_address", 0, []() { test_read_eeprom(0, 0, 2); }},
+    {"parity_error_command", 1, []() { test_read_eeprom(0, 0, 2); }},
+    {"parity_error_data", 3, []() { test_write_eeprom(0, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, 2); }},
+    {"transfer_modes", 0xff, []() {
+        test_fec(0, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH);
+        test_ternary(1, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH);
+    }},
+};
+
+struct golden_byte {
+    decode_byte b;
+    std::vector<unsigned> low;
+};
+
+// Collects the decoded bytes, with the pulses that make them up
+class Collector : public DecodeListener {
+public:
+    Collector(const std::vector<SimBus::Edge> &edges) : edges(edges), pos(0) { }
+
+    virtual void byte(const decode_byte &b) {
+        golden_byte g;
+        g.b = b;
+        // Every pulse starts with a falling edge and ends with a rising
+        // edge, which the decoder has seen already
+        for (; pos + 1 < edges.size() && edges[pos].time <= b.end; ++pos) {
+            if (edges[pos].high || edges[pos].time < b.start)
+                continue;
+            g.low.push_back((edges[pos + 1].time - edges[pos].time + 500) / 1000);
+        }
+        bytes.push_back(g);
+    }
+
+    std::vector<golden_byte> bytes;
+
+private:
+    const std::vector<SimBus::Edge> &edges;
+    size_t pos;
+};
+
+static std::string golden_format(const golden_byte &g) {
+    // Roles can contain spaces
+    std::string line = decode_role_str[g.b.role];
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (line[i] == ' ')
+            line[i] = '_';
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), " 0x%02x %s stall=%u low=", g.b.value,
+             decode_handshake_str[g.b.handshake], g.b.stall_bits);
+    line += buf;
+    for (size_t i = 0; i < g.low.size(); ++i) {
+        snprintf(buf, sizeof(buf), i ? ",%u" : "%u", g.low[i]);
+        line += buf;
+    }
+    return line;
+}
+
+// Run a scenario and return its bytes, formatted as baseline lines
+static std::vector<std::string> golden_run(const golden_scenario *sc) {
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    std::vector<SimSlave*> slaves;
+    for (unsigned i = 0; i < GOLDEN_SLAVES; ++i) {
+        SimSlave *slave = new SimSlave(bus, sim_eeprom_image(0x1234, 1, 1000 + i));
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    setup();
+    bp_default_bus.timing = &timings_to_test[TIMING_TYP];
+    parity_error_byte = 0xff;
+    Serial.failures = 0;
+    randomSeed(GOLDEN_SEED);
+
+    std::vector<SimBus::Edge> edges;
+    if (!sc->run)
+        bus.trace = &edges;
+
+    uint8_t count = lengthof(ids);
+    if (test_scan(ids, &count) && count == GOLDEN_SLAVES) {
+        for (uint8_t i = 0; i < count; ++i)
+            bp_read_eeprom(i, 0, eeproms[i], EEPROM_SIZE);
+    }
+    if (sc->run) {
+        bus.trace = &edges;
+        parity_error_byte = sc->parity;
+        sc->run();
+    }
+    // Let the last transaction time out
+    bus.advance(ms(5));
+    bus.trace = NULL;
+
+    std::vector<std::string> lines;
+    if (Serial.failures) {
+        lines.push_back("test failed");
+    } else {
+        Collector collector(edges);
+        BusDecoder decoder(&collector);
+        // Tracing started with the bus idle
+        decoder.edge(0, true);
+        for (size_t i = 0; i < edges.size(); ++i)
+            decoder.edge(edges[i].time, edges[i].high);
+        decoder.finish(bus.now());
+        for (size_t i = 0; i < collector.bytes.size(); ++i)
+            lines.push_back(golden_format(collector.bytes[i]));
+    }
+
+    for (unsigned i = 0; i < GOLDEN_SLAVES; ++i)
+        delete slaves[i];
+    return lines;
+}
+
+// Split a baseline line into the part before "low=" and the low times
+static std::string golden_split(const std::string &line, std::vector<unsigned> *low) {
+    size_t pos = line.find(" low=");
+    if (pos == std::string::npos)
+        return line;
+    const char *p = line.c_str() + pos + 5;
+    while (*p) {
+        char *end;
+        low->push_back(strtoul(p, &end, 10));
+        p = *end ? end + 1 : end;
+    }
+    return line.substr(0, pos);
+}
+
+static unsigned golden_stall(const std::string &head) {
+    size_t pos = head.find(" stall=");
+    return pos == std::string::npos ? 0 : atoi(head.c_str() + pos + 7);
+}
+
+// Compare a single byte, returns an empty string when it matches
+static std::string golden_compare(const std::string &expect, const std::string &got,
+                                  unsigned tolerance, unsigned stall_tolerance) {
+    std::vector<unsigned> expect_low, got_low;
+    std::string expect_head = golden_split(expect, &expect_low);
+    std::string got_head = golden_split(got, &got_low);
+
+    size_t stall = expect_head.find(" stall=");
+    if (expect_head.substr(0, stall) != got_head.substr(0, got_head.find(" stall=")))
+        return "byte differs";
+
+    unsigned se = golden_stall(expect_head), sg = golden_stall(got_head);
+    if ((se > sg ? se - sg : sg - se) > stall_tolerance)
+        return "stall bits differ";
+    if (expect_low.size() - se != got_low.size() - sg)
+        return "number of bits differs";
+
+    // With a different number of stall bits, only the data bits at the
+    // start and the ready and handshake bits at the end can be compared
+    size_t n = expect_low.size() < got_low.size() ? expect_low.size() : got_low.size();
+    for (size_t i = 0; i < n; ++i) {
+        size_t e = i, g = i;
+        if (i >= n - 3) {
+            e = expect_low.size() - (n - i);
+            g = got_low.size() - (n - i);
+        }
+        unsigned a = expect_low[e], b = got_low[g];
+        if ((a > b ? a - b : b - a) > tolerance) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "bit %u low for %uus instead of %uus",
+                     (unsigned)g, b, a);
+            return buf;
+        }
+    }
+    return "";
+}
+
+// Read the baseline: for every scenario, the lines that follow its
+// "scenario <name>" line
+static bool golden_read(const char *filename, std::vector<std::vector<std::string> > &baseline) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    baseline.assign(lengthof(scenarios), std::vector<std::string>());
+    std::vector<std::string> *current = NULL;
+    char buf[512];
+    while (fgets(buf, sizeof(buf), f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (!buf[0] || buf[0] == '#')
+            continue;
+        if (!strncmp(buf, "scenario ", 9)) {
+            current = NULL;
+            for (unsigned i = 0; i < lengthof(scenarios); ++i) {
+                if (!strcmp(buf + 9, scenarios[i].name))
+                    current = &baseline[i];
+            }
+            if (!current)
+                fprintf(stderr, "%s: Unknown scenario %s, ignored\n", filename, buf + 9);
+        } else if (current) {
+            current->push_back(buf);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static bool golden_write(const char *filename, const std::vector<std::vector<std::string> > &traces) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    fprintf(f, "# Golden bus traces, written by sim_golden -u. Every line is a byte:\n"
+               "# role, value, handshake, stall bits and the low time of every bit in us.\n");
+    for (unsigned i = 0; i < lengthof(scenarios); ++i) {
+        fprintf(f, "\nscenario %s\n", scenarios[i].name);
+        for (size_t j = 0; j < traces[i].size(); ++j)
+            fprintf(f, "%s\n", traces[i][j].c_str());
+    }
+    return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+    bool update = false, verbose = false;
+    unsigned tolerance = 5, stall_tolerance = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vut:S:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = true;
+            break;
+        case 'u':
+            update = true;
+            break;
+        case 't':
+            tolerance = atoi(optarg);
+            break;
+        case 'S':
+            stall_tolerance = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v] [-u] [-t tolerance_us] [-S stall_bits] baseline\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-v] [-u] [-t tolerance_us] [-S stall_bits] baseline\n", argv[0]);
+        return 2;
+    }
+    const char *filename = argv[optind];
+
+    if (!verbose)
+        Serial.out = NULL;
+
+    std::vector<std::vector<std::string> > traces;
+    for (unsigned i = 0; i < lengthof(scenarios); ++i)
+        traces.push_back(golden_run(&scenarios[i]));
+
+    if (update) {
+        if (!golden_write(filename, traces))
+            return 2;
+        printf("Wrote %u scenarios to %s\n", (unsigned)lengthof(scenarios), filename);
+        return 0;
+    }
+
+    std::vector<std::vector<std::string> > baseline;
+    if (!golden_read(filename, baseline))
+        return 2;
+
+    unsigned failed = 0;
+    for (unsigned i = 0; i < lengthof(scenarios); ++i) {
+        const std::vector<std::string> &expect = baseline[i];
+        const std::vector<std::string> &got = traces[i];
+        std::string diff;
+        size_t j;
+        for (j = 0; j < expect.size() && j < got.size() && diff.empty(); ++j)
+            diff = golden_compare(expect[j], got[j], tolerance, stall_tolerance);
+        if (diff.empty() && expect.size() != got.size()) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%u bytes instead of %u",
+                     (unsigned)got.size(), (unsigned)expect.size());
+            diff = buf;
+            j = (expect.size() < got.size() ? expect.size() : got.size()) + 1;
+        }
+
+        if (diff.empty()) {
+            printf("ok    %s\n", scenarios[i].name);
+            continue;
+        }
+        failed++;
+        printf("FAIL  %s: byte %u: %s\n", scenarios[i].name, (unsigned)j - 1, diff.c_str());
+        if (j - 1 < expect.size())
+            printf("\texpected: %s\n", expect[j - 1].c_str());
+        if (j - 1 < got.size())
+            printf("\tgot:      %s\n", got[j - 1].c_str());
+    }
+
+    printf("%u of %u scenarios differ from %s\n", failed, (unsigned)lengthof(scenarios), filename);
+    return failed ? 1 : 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
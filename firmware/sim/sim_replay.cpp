@@ -0,0 +1,382 @@
+// Replay of captured bus sessions against simulated slaves
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// Plays back bus sessions captured by the master (see capture.h)
+// against simulated slaves, to reproduce a problem seen in the field.
+// The input is the serial output of the master, with the capture
+// records (as sent by bp_capture_dump) mixed with normal text, like
+// tools/logdecode reads it.
+//
+// The slaves are enumerated first, so they get the same addresses as
+// in the field when they have the same EEPROM contents (pass a raw
+// EEPROM image for every slave with -i). Then the master edges of every
+// capture are repeated with their original timing, and every level the
+// master sampled is compared against the simulated line. The resulting
+// bus trace is decoded with tools/busdecode and every transaction is
+// printed. With -v, every byte is printed as well. With -q, only
+// mismatches and the summary are printed.
+//
+// With -r, a few sessions are captured against the simulated slaves
+// instead and written to the given file, in the format the master
+// sends them in.
+//
+// The exit status is 1 when a sampled level did not match, or when
+// there was nothing to replay.
+//
+// Usage: sim_replay [-v|-q] [-n slaves] [-i image]... [-r] log|-
+
+#include <unistd.h>
+#include <string>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "../../tools/busdecode/decoder.h"
+
+// Idle time before every capture, so the slaves see a new session
+#define REPLAY_GAP ms(10)
+
+static int verbosity = 1;
+
+static const char *edge_str[] = {
+    [EDGE_RESET] = "reset",
+    [EDGE_WRITE_0] = "write 0",
+    [EDGE_WRITE_1] = "write 1",
+    [EDGE_READ] = "read",
+    [EDGE_RELEASE] = "release",
+    [EDGE_SAMPLE_LOW] = "sample low",
+    [EDGE_SAMPLE_HIGH] = "sample high",
+    [EDGE_HIGH] = "high",
+};
+
+struct replay_session {
+    std::vector<capture_edge> edges;
+    // Number of edges announced by the header
+    uint16_t count;
+    bool overflow;
+};
+
+static void print_time(decode_time t) {
+    printf("%12.6f", t / 1e9);
+}
+
+class Printer : public DecodeListener {
+public:
+    virtual void byte(const decode_byte &b) {
+        if (verbosity < 2)
+            return;
+        print_time(b.start);
+        printf("     0x%02x %-14s %-8s", b.value, decode_role_str[b.role],
+               decode_handshake_str[b.handshake]);
+        if (b.stall_bits)
+            printf(" stall=%u", b.stall_bits);
+        if (b.parity_error)
+            printf(" parity error");
+        printf("\n");
+    }
+
+    virtual void transaction(const decode_transaction &t) {
+        if (verbosity < 1)
+            return;
+        print_time(t.start);
+        printf(" %8.3fms %s: %s", (t.end - t.start) / 1e6, t.description,
+               decode_result_str[t.result]);
+        if (t.stall_bits)
+            printf(", %u stall bits", t.stall_bits);
+        printf("\n");
+    }
+
+    virtual void violation(decode_time t, decode_violation v, decode_time duration) {
+        print_time(t);
+        printf(" ---> %s", decode_violation_str[v]);
+        if (duration)
+            printf(" (%.1fus)", duration / 1e3);
+        printf("\n");
+    }
+};
+
+// Read all captures from f. Everything that is not a capture record is
+// skipped, as are edges that do not belong to a capture.
+static void replay_read(FILE *f, std::vector<replay_session> *sessions, unsigned long *stray) {
+    // Bytes that might be the start of a record
+    uint8_t buf[CAPTURE_RECORD_SIZE];
+    size_t len = 0;
+    int c;
+    while ((c = getc(f)) != EOF) {
+        buf[len++] = c;
+        while (len) {
+            if (buf[0] == CAPTURE_SYNC && len < CAPTURE_RECORD_SIZE)
+                break;
+
+            capture_edge e;
+            if (buf[0] == CAPTURE_SYNC && capture_decode(buf, &e)) {
+                if (e.type == CAPTURE_HEADER || e.type == CAPTURE_HEADER_OVERFLOW) {
+                    replay_session s;
+                    s.count = e.time;
+                    s.overflow = e.type == CAPTURE_HEADER_OVERFLOW;
+                    sessions->push_back(s);
+                } else if (!sessions->empty() && sessions->back().edges.size() < sessions->back().count) {
+                    sessions->back().edges.push_back(e);
+                } else {
+                    (*stray)++;
+                }
+                len = 0;
+                break;
+            }
+            memmove(buf, buf + 1, --len);
+        }
+    }
+}
+
+// Replay the edges of a single session, starting REPLAY_GAP from now.
+// Returns the number of mismatches.
+static unsigned long replay_run(SimBus &bus, unsigned driver, const replay_session &s, unsigned index) {
+    unsigned long mismatches = 0;
+    sim_time t = bus.now() + REPLAY_GAP;
+    for (size_t i = 0; i < s.edges.size(); ++i) {
+        const capture_edge &e = s.edges[i];
+        // Times wrap around, but the differences do not
+        if (i)
+            t += us((uint16_t)(e.time - s.edges[i - 1].time));
+        bus.run_until(t);
+
+        bool expect_high;
+        switch (e.type) {
+            case EDGE_RESET:
+            case EDGE_WRITE_0:
+            case EDGE_WRITE_1:
+            case EDGE_READ:
+                bus.drive(driver, true);
+                continue;
+            case EDGE_RELEASE:
+                bus.drive(driver, false);
+                continue;
+            case EDGE_SAMPLE_LOW:
+                expect_high = false;
+                break;
+            case EDGE_SAMPLE_HIGH:
+            case EDGE_HIGH:
+                expect_high = true;
+                break;
+            default:
+                fprintf(stderr, "Capture %u, edge %u: unknown type 0x%02x\n",
+                        index, (unsigned)i, e.type);
+                mismatches++;
+                continue;
+        }
+
+        if (bus.line() != expect_high) {
+            print_time(t);
+            printf(" ---> Capture %u, edge %u (%s): line is %s\n", index,
+                   (unsigned)i, edge_str[e.type], bus.line() ? "high" : "low");
+            mismatches++;
+        }
+    }
+    bus.drive(driver, false);
+    return mismatches;
+}
+
+// Capture a few sessions against the slaves and send them to the
+// serial port
+static bool replay_record() {
+    static capture c;
+    uint8_t buf[2];
+    uint8_t data[] = {0x5a, 0xa5};
+    status s = {OK};
+    bool ok = true;
+
+    Serial.println("Capturing read from slave 0");
+    capture_init(&c);
+    bp_capture = &c;
+    ok = ok && bp_session_begin(0, &s);
+    ok = ok && bp_session_read_eeprom(0, buf, sizeof(buf), &s);
+    bp_capture = NULL;
+    bp_capture_dump(&c);
+    ok = ok && !c.overflow;
+
+    Serial.println("Capturing write to slave 1");
+    capture_init(&c);
+    bp_capture = &c;
+    ok = ok && bp_write_eeprom(1, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, data, sizeof(data));
+    bp_capture = NULL;
+    bp_capture_dump(&c);
+    ok = ok && !c.overflow;
+
+    Serial.println("Capturing read back from slave 1");
+    capture_init(&c);
+    bp_capture = &c;
+    ok = ok && bp_session_begin(1, &s);
+    ok = ok && bp_session_read_eeprom(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, buf, sizeof(buf), &s);
+    bp_capture = NULL;
+    bp_capture_dump(&c);
+    ok = ok && !c.overflow && !memcmp(buf, data, sizeof(data));
+
+    return ok;
+}
+
+static bool read_image(const char *filename, std::vector<uint8_t> *image) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+    int c;
+    while ((c = getc(f)) != EOF)
+        image->push_back(c);
+    fclose(f);
+    return true;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-v|-q] [-n slaves] [-i image]... [-r] log|-\n", name);
+}
+
+int main(int argc, char **argv) {
+    unsigned count = 2;
+    std::vector<std::vector<uint8_t> > images;
+    bool record = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vqn:i:r")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbosity = 2;
+            break;
+        case 'q':
+            verbosity = 0;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'i':
+            images.push_back(std::vector<uint8_t>());
+            if (!read_image(optarg, &images.back()))
+                return 2;
+            break;
+        case 'r':
+            record = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!images.empty())
+        count = images.size();
+    if (!count || count > lengthof(ids)) {
+        fprintf(stderr, "Between 1 and %u slaves supported\n", (unsigned)lengthof(ids));
+        return 2;
+    }
+    if (record && count < 2) {
+        fprintf(stderr, "Recording needs at least 2 slaves\n");
+        return 2;
+    }
+
+    const char *filename = argv[optind];
+    FILE *f;
+    if (record)
+        f = strcmp(filename, "-") ? fopen(filename, "wb") : stdout;
+    else
+        f = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+    if (!f) {
+        perror(filename);
+        return 2;
+    }
+
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    std::vector<SimSlave*> slaves;
+    for (unsigned i = 0; i < count; ++i) {
+        SimSlave *slave = new SimSlave(bus, images.empty() ? sim_eeprom_image(0x1234, 1, 1000 + i) : images[i]);
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    // Enumerate the slaves, like the master did before capturing
+    bp_default_bus.timing = &timings_to_test[TIMING_TYP];
+    status s = {OK};
+    uint8_t found = lengthof(ids);
+    if (!bp_scan(ids, &found, &s) || found != count) {
+        fprintf(stderr, "Enumeration found %u of %u slaves\n", found, count);
+        return 2;
+    }
+
+    int result = 0;
+    if (record) {
+        Serial.out = f;
+        if (!replay_record()) {
+            fprintf(stderr, "Capturing failed\n");
+            result = 1;
+        }
+    } else {
+        std::vector<replay_session> sessions;
+        unsigned long stray = 0;
+        replay_read(f, &sessions, &stray);
+
+        std::vector<SimBus::Edge> edges;
+        bus.trace = &edges;
+        sim_time start = bus.now();
+        unsigned driver = bus.add_driver();
+        unsigned long replayed = 0, mismatches = 0;
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            const replay_session &session = sessions[i];
+            if (session.overflow || session.edges.size() < session.count) {
+                fprintf(stderr, "Capture %u is incomplete, replaying the first %u edges\n",
+                        (unsigned)i, (unsigned)session.edges.size());
+            }
+            mismatches += replay_run(bus, driver, session, i);
+            replayed += session.edges.size();
+        }
+        // Let the last transaction time out
+        bus.advance(ms(5));
+        bus.trace = NULL;
+
+        Printer printer;
+        BusDecoder decoder(&printer);
+        decoder.edge(start, true);
+        for (size_t i = 0; i < edges.size(); ++i)
+            decoder.edge(edges[i].time, edges[i].high);
+        decoder.finish(bus.now());
+
+        printf("%u captures, %lu edges replayed, %lu mismatches\n",
+               (unsigned)sessions.size(), replayed, mismatches);
+        if (stray)
+            printf("%lu edges outside of a capture skipped\n", stray);
+        if (mismatches || !replayed)
+            result = 1;
+    }
+
+    if (f != stdin && f != stdout)
+        fclose(f);
+    for (unsigned i = 0; i < count; ++i)
+        delete slaves[i];
+    return result;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
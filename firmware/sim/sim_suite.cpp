@@ -0,0 +1,332 @@
+// Conformance test suite, using the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Runs the individual tests from the test sketch as separate cases.
+// Every case runs in its own process with its own simulated bus and
+// freshly enumerated slaves, so cases are independent and run in
+// parallel (one worker per CPU by default). On the simulated serial port, the "press a key" prompt after
+// a failure never blocks.
+//
+// Prints a line per case and optionally writes a JSON report with the
+// result and simulated bus time of every case. Exits with a non-zero
+// status if any case failed.
+//
+// Usage: sim_suite [-q] [-v] [-j jobs] [-n slaves] [-s seed]
+//                  [-p parity_error_byte] [-c case] [-o report.json]
+
+#include <unistd.h>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "parallel.h"
+
+static void suite_parallel(uint8_t count);
+static void suite_large(uint8_t addr);
+
+struct suite_case {
+    const char *name;
+    // Called once for every slave, or once for the whole bus
+    void (*slave)(uint8_t addr);
+    void (*bus)(uint8_t count);
+    // EEPROM size of the slaves, 0 for the default (SIM_EEPROM_SIZE)
+    unsigned eeprom_size;
+};
+
+static const suite_case cases[] = {
+    {"read_eeprom", [](uint8_t addr) {
+        uint8_t start = random(0, EEPROM_SIZE);
+        test_read_eeprom(addr, start, random(1, EEPROM_SIZE - start));
+    }, NULL},
+    {"write_eeprom", [](uint8_t addr) {
+        test_write_eeprom(addr, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE - UNIQUE_ID_OFFSET - UNIQUE_ID_LENGTH);
+        test_read_eeprom(addr, 0, EEPROM_SIZE);
+    }, NULL},
+    {"chained", [](uint8_t addr) {
+        uint8_t start = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE);
+        test_chained(addr, start, random(1, EEPROM_SIZE - start + 1));
+    }, NULL},
+    {"fec", [](uint8_t addr) {
+        test_fec(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE - 4));
+    }, NULL},
+    {"ternary", [](uint8_t addr) {
+        test_ternary(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE - 8));
+    }, NULL},
+    {"stats", test_stats, NULL},
+    {"capabilities", test_capabilities, NULL},
+    {"atomic", [](uint8_t addr) {
+        test_atomic(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE));
+    }, NULL},
+    {"wide", test_wide, NULL},
+    {"telemetry", test_telemetry, NULL},
+    {"capture", test_capture, NULL},
+    {"retry", test_retry, NULL},
+    {"layout", test_layout, NULL},
+    {"planned_write", test_planned_write, NULL},
+    {"kv", test_kv, NULL},
+    {"unknown_command", [](uint8_t addr) {
+        test_unknown_command(addr, CMD_RESERVED);
+        test_unknown_command(addr, random(CMD_LAST + 1, 256));
+    }, NULL},
+    {"invalid_read_address", [](uint8_t addr) {
+        test_invalid_read_address(addr, random(EEPROM_SIZE, 256));
+    }, NULL},
+    {"read_overflow", test_read_overflow, NULL},
+    {"write_overflow", test_write_overflow, NULL},
+    {"write_readonly", [](uint8_t addr) {
+        test_write_readonly(addr, UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH));
+    }, NULL},
+    {"write_unchanged_readonly", [](uint8_t addr) {
+        test_write_unchanged_readonly(addr, UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH));
+    }, NULL},
+    {"broadcast_write", NULL, test_broadcast_write},
+    {"broadcast_read", NULL, test_broadcast_read},
+    {"unassigned_address", NULL, [](uint8_t count) {
+        test_unassigned_address(ADDRESS_RESERVED);
+        test_unassigned_address(random(count + 1, BC_FIRST));
+    }},
+    {"eventlog", NULL, [](uint8_t) { test_eventlog(); }},
+    {"parallel", NULL, suite_parallel},
+    {"large_eeprom_256", suite_large, NULL, 256},
+    {"large_eeprom_512", suite_large, NULL, 512},
+};
+
+static unsigned slave_count = 3;
+static unsigned long seed = 1;
+static const char *only_case = NULL;
+
+// The bus of the current case
+static SimBus *suite_bus;
+
+// Pins for the extra buses of the parallel case, next to BP_BUS_PIN
+static const uint8_t PARALLEL_PINS[] = {BP_BUS_PIN + 1, BP_BUS_PIN + 2, BP_BUS_PIN + 3};
+
+// Add a few more buses with a single slave each (sharing the clock of
+// the case's bus) and test writing all buses at once
+static void suite_parallel(uint8_t) {
+    const unsigned count = lengthof(PARALLEL_PINS) + 1;
+    std::vector<SimBus*> buses;
+    std::vector<SimSlave*> slaves;
+    bp_bus extra[lengthof(PARALLEL_PINS)];
+    bp_bus *list[count] = {&bp_default_bus};
+
+    for (unsigned i = 0; i < lengthof(PARALLEL_PINS); ++i) {
+        SimBus *bus = new SimBus(*suite_bus);
+        sim_arduino_add_bus(bus, PARALLEL_PINS[i]);
+        SimSlave *slave = new SimSlave(*bus, sim_eeprom_image(0x1234, 1, 2000 + i));
+        slave->power_on();
+        buses.push_back(bus);
+        slaves.push_back(slave);
+        bp_bus_init(&extra[i], PARALLEL_PINS[i], bp_default_bus.timing);
+        list[i + 1] = &extra[i];
+    }
+    // Let the new slaves start up
+    delay(100);
+
+    test_parallel(list, count);
+
+    for (unsigned i = 0; i < slaves.size(); ++i) {
+        delete slaves[i];
+        delete buses[i];
+    }
+}
+
+// The tests that depend on the EEPROM size, for slaves with a bigger
+// EEPROM (like the attiny45 and attiny85)
+static void suite_large(uint8_t addr) {
+    uint16_t size = bp_eeprom_size(addr);
+    if (size > 0x100)
+        size = 0x100;
+    test_capabilities(addr);
+    test_wide(addr);
+    test_write_eeprom(addr, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size - UNIQUE_ID_OFFSET - UNIQUE_ID_LENGTH);
+    test_read_eeprom(addr, 0, size);
+    if (size < 0x100)
+        test_invalid_read_address(addr, random(size, 256));
+    uint8_t start = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size);
+    test_chained(addr, start, random(1, size - start + 1));
+    test_atomic(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size));
+    test_read_overflow(addr);
+    test_write_overflow(addr);
+    test_layout(addr);
+}
+
+// Run a single case on a new bus. The time spent enumerating the
+// slaves and reading their EEPROMs is not included in result->time.
+static bool suite_job(unsigned i, SimJobResult *result) {
+    const suite_case *c = &cases[i];
+    if (only_case && strcmp(only_case, c->name))
+        return false;
+
+    SimBus bus;
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+    suite_bus = &bus;
+
+    std::vector<SimSlave*> slaves;
+    for (unsigned s = 0; s < slave_count; ++s) {
+        unsigned size = c->eeprom_size ? c->eeprom_size : SIM_EEPROM_SIZE;
+        SimSlave *slave = new SimSlave(bus, sim_eeprom_image(0x1234, 1, 1000 + s, size));
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    setup();
+    bp_default_bus.timing = &timings_to_test[TIMING_TYP];
+    Serial.failures = 0;
+    randomSeed(seed + i);
+
+    test_start(c->name);
+    uint8_t count = lengthof(ids);
+    bool ok = test_scan(ids, &count);
+    if (ok && count != slave_count) {
+        test_print_failed("Unexpected number of slaves");
+        ok = false;
+    }
+    for (uint8_t a = 0; a < count && ok; ++a) {
+        if (!bp_discover(a) || !bp_read_eeprom_all(a, eeproms[a])) {
+            test_print_failed("EEPROM read failed");
+            ok = false;
+        }
+    }
+
+    sim_time start = bus.now();
+    if (ok && c->slave) {
+        for (uint8_t a = 0; a < count; ++a)
+            c->slave(a);
+    } else if (ok) {
+        c->bus(count);
+    }
+    result->time = bus.now() - start;
+    result->failures = Serial.failures;
+
+    for (unsigned s = 0; s < slave_count; ++s)
+        delete slaves[s];
+    return true;
+}
+
+static bool suite_report(const char *filename, const std::vector<SimJobResult> &results) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    fprintf(f, "{\n  \"slaves\": %u,\n  \"seed\": %lu,\n  \"cases\": [", slave_count, seed);
+    bool first = true;
+    for (unsigned i = 0; i < lengthof(cases); ++i) {
+        const SimJobResult &r = results[i];
+        if (only_case && strcmp(only_case, cases[i].name))
+            continue;
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"result\": \"%s\", "
+                   "\"failures\": %u, \"bus_time_us\": %llu}",
+                first ? "" : ",", cases[i].name,
+                !r.done ? "error" : r.failures ? "fail" : "pass",
+                r.failures, (unsigned long long)(r.time / 1000));
+        first = false;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+    int jobs = sim_default_workers();
+    bool quiet = false, verbose = false;
+    const char *report = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qvj:n:s:p:c:o:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'n':
+            slave_count = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            parity_error_byte = atoi(optarg);
+            break;
+        case 'c':
+            only_case = optarg;
+            break;
+        case 'o':
+            report = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-v] [-j jobs] [-n slaves] [-s seed]\n"
+                            "       [-p parity_error_byte] [-c case] [-o report.json]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (slave_count < 1 || slave_count > lengthof(eeproms)) {
+        fprintf(stderr, "Between 1 and %u slaves supported\n", (unsigned)lengthof(eeproms));
+        return 2;
+    }
+    // The test output of concurrent cases would be interleaved
+    if (verbose)
+        jobs = 1;
+    else
+        Serial.out = NULL;
+    if (jobs < 1)
+        jobs = 1;
+
+    std::vector<SimJobResult> results;
+    if (!sim_run_parallel(jobs, lengthof(cases), suite_job, results)) {
+        fprintf(stderr, "A worker failed\n");
+        return 2;
+    }
+
+    unsigned run = 0, failed = 0;
+    sim_time total = 0;
+    for (unsigned i = 0; i < lengthof(cases); ++i) {
+        const SimJobResult &r = results[i];
+        if (only_case && strcmp(only_case, cases[i].name))
+            continue;
+        run++;
+        if (!r.done || r.failures)
+            failed++;
+        total += r.time;
+        if (!quiet || !r.done || r.failures)
+            printf("%-5s %-26s %10.1f ms\n", !r.done ? "ERROR" : r.failures ? "FAIL" : "ok",
+                   cases[i].name, r.time / 1e6);
+    }
+
+    if (!run) {
+        fprintf(stderr, "Unknown case: %s\n", only_case);
+        return 2;
+    }
+    printf("%u of %u cases failed, %.3fs of simulated bus time\n", failed, run, total / 1e9);
+
+    if (report && !suite_report(report, results))
+        return 2;
+    return failed ? 1 : 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
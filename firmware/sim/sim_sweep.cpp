@@ -0,0 +1,306 @@
+// Timing margin sweep, using the simulated bus
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Where the test sketch's loop() tries a single random timing set per
+// pass, this runs a short set of tests for every combination of master
+// timings (on a grid covering and extending past TIMING_MIN/TIMING_MAX),
+// slave clock skew and parity error position. It prints a pass/fail map
+// and the fastest timing set with some margin left.
+//
+// With -R, the bus line is modeled with a pull-up of the given
+// resistance and every slave adds -C pF of capacitance, which shows how
+// fast the bus can run with a given number of backpacks (-n).
+//
+// Every combination runs on a fresh simulated bus, spread over worker
+// processes (one per CPU by default) by sim_run_parallel().
+//
+// Usage: sim_sweep [-q] [-j jobs] [-k steps] [-n slaves] [-s seed]
+//                  [-R pullup_ohm] [-C slave_pf]
+
+#include <unistd.h>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "parallel.h"
+
+// The range swept for every master timing, in μs. idle is not swept,
+// since TIMING_MIN and TIMING_MAX agree on it.
+struct sweep_axis {
+    const char *name;
+    unsigned timings::*field;
+    unsigned min, max;
+};
+
+static const sweep_axis axes[] = {
+    {"reset", &timings::reset, 1500, 3500},
+    {"start", &timings::start, 25, 150},
+    {"value", &timings::value, 300, 600},
+    {"sample", &timings::sample, 100, 300},
+    {"next_bit", &timings::next_bit, 500, 1500},
+};
+
+#define AXES lengthof(axes)
+
+static const double skews[] = {0.9, 1.0, 1.1};
+
+// Parity error positions, the first means no parity error
+static const uint8_t parities[] = {0xff, 0, 1, 2, 5};
+
+#define CELLS (lengthof(skews) * lengthof(parities))
+
+static unsigned steps = 3;
+static unsigned slave_count = 2;
+static unsigned long seed = 1;
+static BusConfig bus_config;
+static SlaveConfig slave_config;
+
+// Fill in the timings for the given timing set (an index into the grid
+// of steps^AXES sets). Returns false when the combination makes no
+// sense (e.g., sampling after the bit value is released).
+static bool sweep_timings(unsigned set, timings *t) {
+    *t = timings_to_test[TIMING_TYP];
+    for (unsigned a = 0; a < AXES; ++a) {
+        unsigned step = set % steps;
+        set /= steps;
+        unsigned v = axes[a].min;
+        if (steps > 1)
+            v += (axes[a].max - axes[a].min) * step / (steps - 1);
+        t->*axes[a].field = v;
+    }
+    return t->start < t->sample && t->sample < t->value &&
+           t->value + t->idle <= t->next_bit;
+}
+
+// Run the tests for a single point (timing set, skew and parity
+// position). Returns the number of failures.
+static unsigned long sweep_point(const timings *t, double skew, uint8_t parity, unsigned long point_seed) {
+    SimBus bus(bus_config);
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    SlaveConfig config = slave_config;
+    config.clock_skew = skew;
+    std::vector<SimSlave*> slaves;
+    for (unsigned i = 0; i < slave_count; ++i) {
+        SimSlave *slave = new SimSlave(bus, sim_eeprom_image(0x1234, 1, 1000 + i), config);
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    timings used = *t;
+    bp_default_bus.timing = &used;
+    parity_error_byte = parity;
+    Serial.failures = 0;
+    randomSeed(point_seed);
+
+    uint8_t count = lengthof(ids);
+    if (!test_scan(ids, &count) || count != slave_count) {
+        Serial.failures++;
+    } else {
+        for (uint8_t i = 0; i < count; ++i) {
+            if (!bp_read_eeprom(i, 0, eeproms[i], EEPROM_SIZE))
+                Serial.failures++;
+        }
+        for (uint8_t i = 0; i < count && !Serial.failures; ++i) {
+            test_read_eeprom(i, 0, EEPROM_SIZE);
+            uint8_t start = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE);
+            test_chained(i, start, random(1, EEPROM_SIZE - start + 1));
+            test_unknown_command(i, random(CMD_LAST + 1, 256));
+            test_write_readonly(i, UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH));
+        }
+        if (!Serial.failures)
+            test_broadcast_read(count);
+    }
+
+    for (unsigned i = 0; i < slave_count; ++i)
+        delete slaves[i];
+    return Serial.failures;
+}
+
+static bool sweep_job(unsigned point, SimJobResult *result) {
+    unsigned set = point / CELLS;
+    unsigned cell = point % CELLS;
+    timings t;
+    if (!sweep_timings(set, &t))
+        return false;
+
+    result->failures = sweep_point(&t, skews[cell / lengthof(parities)],
+                                   parities[cell % lengthof(parities)], seed + point);
+    return true;
+}
+
+// A timing set passes when it has no failures at any skew and parity
+// position
+static bool sweep_passed(const std::vector<SimJobResult> &results, unsigned set) {
+    for (unsigned c = 0; c < CELLS; ++c) {
+        const SimJobResult &r = results[set * CELLS + c];
+        if (!r.done || r.failures)
+            return false;
+    }
+    return true;
+}
+
+// A timing set is safe when it passes, and so do all its valid
+// neighbours on the grid (one step up or down on any axis), so it does
+// not sit right on the edge of a failing region.
+static bool sweep_safe(const std::vector<SimJobResult> &results, unsigned set) {
+    if (!sweep_passed(results, set))
+        return false;
+
+    unsigned weight = 1;
+    for (unsigned a = 0; a < AXES; ++a, weight *= steps) {
+        unsigned step = set / weight % steps;
+        timings t;
+        if (step > 0 && sweep_timings(set - weight, &t) && !sweep_passed(results, set - weight))
+            return false;
+        if (step + 1 < steps && sweep_timings(set + weight, &t) && !sweep_passed(results, set + weight))
+            return false;
+    }
+    return true;
+}
+
+// Is timing set a faster than b? This compares the bit time first,
+// since that dominates the transfer time, and then the reset time.
+static bool sweep_faster(const timings *a, const timings *b) {
+    if (a->next_bit != b->next_bit)
+        return a->next_bit < b->next_bit;
+    return a->reset < b->reset;
+}
+
+int main(int argc, char **argv) {
+    int jobs = sim_default_workers();
+    bool quiet = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qj:k:n:s:R:C:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'k':
+            steps = atoi(optarg);
+            break;
+        case 'n':
+            slave_count = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            bus_config.pullup = atof(optarg);
+            break;
+        case 'C':
+            slave_config.capacitance = atof(optarg) * 1e-12;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-j jobs] [-k steps] [-n slaves] [-s seed]\n"
+                            "       [-R pullup_ohm] [-C slave_pf]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+    if (steps < 1 || slave_count < 1 || slave_count > lengthof(eeproms)) {
+        fprintf(stderr, "Invalid number of steps or slaves\n");
+        return 2;
+    }
+
+    Serial.out = NULL;
+    unsigned sets = 1;
+    for (unsigned a = 0; a < AXES; ++a)
+        sets *= steps;
+
+    printf("Sweeping %u timing sets x %u skews x %u parity positions, %d jobs\n",
+           sets, (unsigned)lengthof(skews), (unsigned)lengthof(parities), jobs);
+    if (bus_config.pullup > 0) {
+        double c = bus_config.capacitance + slave_count * slave_config.capacitance;
+        printf("%u slaves, %.0f ohm pull-up, %.0f pF bus capacitance, RC = %.1f us\n",
+               slave_count, bus_config.pullup, c * 1e12, bus_config.pullup * c * 1e6);
+    } else {
+        printf("%u slaves, ideal bus line\n", slave_count);
+    }
+    printf("\n");
+
+    std::vector<SimJobResult> results;
+    if (!sim_run_parallel(jobs, sets * CELLS, sweep_job, results)) {
+        fprintf(stderr, "A worker failed\n");
+        return 2;
+    }
+
+    if (!quiet) {
+        // One column per skew, with a character per parity position:
+        // '.' passed, 'X' failed
+        for (unsigned a = 0; a < AXES; ++a)
+            printf("%8s ", axes[a].name);
+        for (unsigned k = 0; k < lengthof(skews); ++k)
+            printf(" %*.2f", (int)lengthof(parities), skews[k]);
+        printf("\n");
+    }
+
+    unsigned valid = 0, passed = 0, safe = 0;
+    bool have_best = false;
+    timings best;
+    for (unsigned set = 0; set < sets; ++set) {
+        timings t;
+        if (!sweep_timings(set, &t))
+            continue;
+        valid++;
+        if (sweep_passed(results, set))
+            passed++;
+        if (sweep_safe(results, set)) {
+            safe++;
+            if (!have_best || sweep_faster(&t, &best)) {
+                best = t;
+                have_best = true;
+            }
+        }
+
+        if (quiet)
+            continue;
+        for (unsigned a = 0; a < AXES; ++a)
+            printf("%8u ", t.*axes[a].field);
+        for (unsigned c = 0; c < CELLS; ++c) {
+            if (c % lengthof(parities) == 0)
+                printf(" ");
+            const SimJobResult &r = results[set * CELLS + c];
+            printf("%c", r.done && !r.failures ? '.' : 'X');
+        }
+        printf("\n");
+    }
+
+    printf("\n%u valid timing sets, %u passed, %u safe\n", valid, passed, safe);
+    if (!have_best) {
+        printf("No safe operating point found\n");
+        return 1;
+    }
+    printf("Fastest safe operating point:\n");
+    for (unsigned a = 0; a < AXES; ++a)
+        printf("\t%s: %u\n", axes[a].name, best.*axes[a].field);
+    printf("\tidle: %u\n", best.idle);
+    printf("Maximum bit rate: %.0f bits/s\n", 1e6 / best.next_bit);
+    return 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
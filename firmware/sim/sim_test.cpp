@@ -0,0 +1,141 @@
+// Run the master test code from ../test against simulated slaves
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// This runs a single iteration of the test sketch's loop() (which tests
+// all timing sets against all slaves) and exits with a non-zero status
+// if any test failed.
+//
+// With -R, the bus line is modeled with a pull-up of the given
+// resistance and every slave adds -C pF of capacitance.
+//
+// With -w, every change of the bus line is written to a VCD file, which
+// can be decoded with tools/busdecode or viewed with e.g. GTKWave.
+//
+// Usage: sim_test [-q] [-n slaves] [-s seed] [-p parity_error_byte]
+//                 [-R pullup_ohm] [-C slave_pf] [-w trace.vcd]
+
+#include <unistd.h>
+#include "../test/code.cpp"
+#include "bus.h"
+#include "slave.h"
+#include "../../tools/busdecode/vcd.h"
+
+// Writes the bus line to a VCD file, if f is not NULL
+class VcdWriter : public LineListener {
+public:
+    VcdWriter(SimBus &bus, FILE *f) : bus(bus), f(f) {
+        if (!f)
+            return;
+        vcd_write_header(f, "bus", bus.line());
+        bus.add_listener(this);
+    }
+
+    virtual void line_changed(bool high) {
+        vcd_write_change(f, bus.now(), high);
+    }
+
+private:
+    SimBus &bus;
+    FILE *f;
+};
+
+int main(int argc, char **argv) {
+    unsigned count = 3;
+    unsigned long seed = 1;
+    BusConfig bus_config;
+    SlaveConfig slave_config;
+    const char *trace = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qn:s:p:R:C:w:")) != -1) {
+        switch (opt) {
+        case 'q':
+            Serial.out = NULL;
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            parity_error_byte = atoi(optarg);
+            break;
+        case 'R':
+            bus_config.pullup = atof(optarg);
+            break;
+        case 'C':
+            slave_config.capacitance = atof(optarg) * 1e-12;
+            break;
+        case 'w':
+            trace = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-n slaves] [-s seed] [-p parity_error_byte]\n"
+                            "       [-R pullup_ohm] [-C slave_pf] [-w trace.vcd]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (count > lengthof(eeproms)) {
+        fprintf(stderr, "At most %u slaves supported\n", (unsigned)lengthof(eeproms));
+        return 2;
+    }
+
+    SimBus bus(bus_config);
+    sim_arduino_attach(&bus, BP_BUS_PIN);
+
+    FILE *trace_file = NULL;
+    if (trace) {
+        trace_file = fopen(trace, "w");
+        if (!trace_file) {
+            perror(trace);
+            return 2;
+        }
+    }
+    VcdWriter writer(bus, trace_file);
+
+    std::vector<SimSlave*> slaves;
+    for (unsigned i = 0; i < count; ++i) {
+        SimSlave *slave = new SimSlave(bus, sim_eeprom_image(0x1234, 1, 1000 + i), slave_config);
+        slave->power_on();
+        slaves.push_back(slave);
+    }
+
+    setup();
+    randomSeed(seed);
+    loop();
+
+    printf("%lu failures in %.3fs of simulated time\n",
+           Serial.failures, bus.now() / 1e9);
+
+    for (unsigned i = 0; i < count; ++i)
+        delete slaves[i];
+    if (trace_file) {
+        vcd_write_change(trace_file, bus.now(), bus.line());
+        fclose(trace_file);
+    }
+
+    return Serial.failures ? 1 : 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
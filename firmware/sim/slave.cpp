@@ -0,0 +1,663 @@
+// Simulated backpack bus slave, running the real slave firmware
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "slave.h"
+#include "../protocol.h"
+#include "../test/crc.h"
+#include "../test/layout.h"
+
+// The firmware, compiled as a C++ class so every simulated slave gets
+// its own copy of the global (register) variables. The macros below
+// turn the register variables into plain members, drop the inline
+// assembly (the naked ISRs that consist of only inline assembly are
+// emulated by SimSlave instead) and turn the file-scope statics into
+// members as well.
+class Firmware : public AvrCore {
+public:
+    Firmware(AvrHooks *hooks) : AvrCore(hooks) {}
+
+    // The register file has undefined contents at power-on, so fill
+    // the global register variables with garbage instead of zeroes, to
+    // make sure the firmware does not depend on them.
+    void *operator new(size_t size) {
+        void *p = ::operator new(size);
+        memset(p, 0xff, size);
+        return p;
+    }
+
+#define register
+#define asm(...)
+#define static
+#define main firmware_main
+// Diagnostic counters keep their (member) value across a simulated
+// watchdog reset anyway
+#define NOINIT
+#include "../firmware.c"
+#undef register
+#undef asm
+#undef static
+#undef main
+#undef NOINIT
+};
+
+// Interrupt latencies, in CPU cycles. This is the time from the
+// interrupt condition until the naked ISR samples or drives the bus,
+// which is 4 cycles interrupt response time, 2 cycles for the rjmp in
+// the vector table and 1 or 2 cycles for the first instruction.
+static const unsigned INT0_LATENCY = 7;
+static const unsigned COMPA_LATENCY = 7;
+static const unsigned COMPB_LATENCY = 8;
+// TIM0_OVF_vect is a regular ISR, which samples the bus only after its
+// prologue
+static const unsigned OVF_LATENCY = 20;
+// Waking up from sleep halts the CPU for another 4 cycles. Power-down
+// additionally needs the oscillator start-up time (6 cycles with the
+// SUT fuses used)
+static const unsigned SLEEP_WAKEUP = 4;
+static const unsigned POWER_DOWN_WAKEUP = 4 + 6;
+
+// Interrupt enable bits in TIMSK0, flag bits in TIFR0 and interrupt
+// latencies for each of the timer interrupt sources
+static const uint8_t timer_enable_bits[] = {
+    (1 << TOIE0), (1 << OCIE0A), (1 << OCIE0B),
+};
+static const uint8_t timer_flag_bits[] = {
+    (1 << TOV0), (1 << OCF0A), (1 << OCF0B),
+};
+static const unsigned timer_latencies[] = {
+    OVF_LATENCY, COMPA_LATENCY, COMPB_LATENCY,
+};
+
+// Safety net against firmware that never goes to sleep
+static const unsigned MAX_LOOP_ITERATIONS = 100;
+
+SlaveConfig::SlaveConfig()
+    : clock_skew(1.0), loop_cycles(150), eeprom_write_time(us(3400)),
+      capacitance(20e-12) {
+}
+
+SimSlave::SimSlave(SimBus &bus, const std::vector<uint8_t> &eeprom,
+                   const SlaveConfig &config)
+    : bus(bus), config(config), fw(new Firmware(this)),
+      eeprom_data(eeprom), is_powered(false), i_flag(false),
+      sleeping(false), sleep_start(0), sleep_mode(0), cpu_time(0),
+      holding(false), pending_action(0), hold_epoch(0), extra_hold(0),
+      timer_start(0), timer_init(0), timer_flags(0), timer_epoch(0),
+      intf0(false), int0_scheduled(false), int0_epoch(0),
+      eeprom_busy_until(0), wdt_last_reset(0), wdt_deadline(0),
+      wdt_epoch(0) {
+    memset(&statistics, 0, sizeof(statistics));
+    memset(regs, 0, sizeof(regs));
+    for (unsigned i = 0; i < TIMER_SOURCES; ++i)
+        flag_since[i] = 0;
+    driver = bus.add_driver(config.capacitance);
+    bus.add_listener(this);
+}
+
+SimSlave::~SimSlave() {
+    delete fw;
+}
+
+uint8_t SimSlave::action() const { return fw->action; }
+uint8_t SimSlave::state() const { return fw->state; }
+uint8_t SimSlave::flags() const { return fw->flags; }
+uint8_t SimSlave::bus_addr() const { return fw->bus_addr; }
+
+void SimSlave::power_on() {
+    if (is_powered)
+        return;
+
+    delete fw;
+    fw = new Firmware(this);
+    is_powered = true;
+    memset(regs, 0, sizeof(regs));
+    reset(1 << PORF);
+}
+
+void SimSlave::power_off() {
+    if (!is_powered)
+        return;
+
+    wake();
+    is_powered = false;
+    holding = false;
+    // Invalidate all pending events
+    ++hold_epoch;
+    ++timer_epoch;
+    ++int0_epoch;
+    ++wdt_epoch;
+    int0_scheduled = false;
+    update_drive();
+}
+
+void SimSlave::reset(uint8_t reason) {
+    sim_time now = bus.now();
+
+    wake();
+    holding = false;
+    ++hold_epoch;
+    ++timer_epoch;
+    ++int0_epoch;
+    ++wdt_epoch;
+    int0_scheduled = false;
+    i_flag = false;
+    cpu_time = 0;
+
+    // All I/O registers are cleared on reset, except for the reset
+    // flags and (because WDRF forces it on) the watchdog enable bit
+    uint8_t mcusr = regs[IO_MCUSR] | reason;
+    memset(regs, 0, sizeof(regs));
+    regs[IO_MCUSR] = mcusr;
+    if (mcusr & (1 << WDRF))
+        regs[IO_WDTCR] = (1 << WDE);
+    update_drive();
+
+    timer_start = now;
+    timer_init = 0;
+    timer_flags = 0;
+    for (unsigned i = 0; i < TIMER_SOURCES; ++i)
+        flag_since[i] = now;
+    intf0 = false;
+    wdt_last_reset = now;
+    wdt_deadline = 0;
+
+    fw->setup();
+    run_main();
+}
+
+sim_time SimSlave::cycles(double n) const {
+    return (sim_time)llround(n * 1e9 / (F_CPU * config.clock_skew));
+}
+
+/* I/O registers */
+
+void SimSlave::update_drive() {
+    // The bus pin is only pulled low when it is an output, with the
+    // pullup (i.e. output value) disabled
+    bool low = is_powered && (regs[IO_DDRB] & (1 << PINB1))
+               && !(regs[IO_PORTB] & (1 << PINB1));
+    bus.drive(driver, low);
+}
+
+uint8_t SimSlave::io_read(uint8_t reg) {
+    switch (reg) {
+    case IO_PINB:
+        return (regs[IO_PORTB] & ~(1 << PINB1))
+               | (bus.line() ? (1 << PINB1) : 0);
+    case IO_TCNT0:
+        return timer_value(local_now());
+    case IO_TIFR0: {
+        uint8_t value = 0;
+        for (unsigned i = 0; i < TIMER_SOURCES; ++i) {
+            if (timer_flag(i))
+                value |= timer_flag_bits[i];
+        }
+        return value;
+    }
+    case IO_GIFR:
+        return (intf0 && !int0_level_mode()) ? (1 << INTF0) : 0;
+    case IO_EECR:
+        // The firmware only reads EECR to busy-wait for a previous
+        // write to complete, so just let the CPU time pass until the
+        // write is done.
+        if (eeprom_busy_until > local_now())
+            cpu_time = eeprom_busy_until - bus.now();
+        return regs[IO_EECR] & ~(1 << EEPE);
+    default:
+        return regs[reg];
+    }
+}
+
+void SimSlave::io_write(uint8_t reg, uint8_t value) {
+    switch (reg) {
+    case IO_PINB:
+        // Writing PINB toggles PORTB bits
+        regs[IO_PORTB] ^= value;
+        update_drive();
+        break;
+    case IO_DDRB:
+    case IO_PORTB:
+        regs[reg] = value;
+        update_drive();
+        break;
+    case IO_TCNT0:
+        timer_materialize();
+        timer_start = local_now();
+        timer_init = value;
+        break;
+    case IO_TCCR0B:
+        timer_materialize();
+        timer_init = timer_value(local_now());
+        timer_start = local_now();
+        regs[reg] = value;
+        break;
+    case IO_OCR0A:
+    case IO_OCR0B:
+        timer_materialize();
+        regs[reg] = value;
+        break;
+    case IO_TIFR0:
+        // Interrupt flags are cleared by writing a one
+        timer_materialize();
+        timer_flags &= ~value;
+        break;
+    case IO_GIFR:
+        if (value & (1 << INTF0))
+            intf0 = false;
+        break;
+    case IO_MCUSR:
+        // Reset flags can only be cleared, not set
+        regs[reg] &= value;
+        break;
+    case IO_WDTCR:
+        regs[reg] = value;
+        // WDRF forces the watchdog on
+        if (regs[IO_MCUSR] & (1 << WDRF))
+            regs[reg] |= (1 << WDE);
+        break;
+    case IO_EECR: {
+        uint8_t old = regs[IO_EECR];
+        unsigned addr = (regs[IO_EEARL] | (regs[IO_EEARH] << 8))
+                        % eeprom_data.size();
+        if (value & (1 << EERE)) {
+            regs[IO_EEDR] = eeprom_data[addr];
+            value &= ~(1 << EERE);
+        }
+        if ((value & (1 << EEPE)) && (old & (1 << EEMPE))) {
+            // Only erase + write mode is supported (which is all the
+            // firmware uses)
+            eeprom_data[addr] = regs[IO_EEDR];
+            eeprom_busy_until = local_now() + config.eeprom_write_time;
+            statistics.eeprom_writes++;
+            value &= ~(1 << EEMPE);
+        }
+        regs[reg] = value & ~(1 << EEPE);
+        break;
+    }
+    default:
+        regs[reg] = value;
+        break;
+    }
+}
+
+void SimSlave::cpu_sei() {
+    i_flag = true;
+}
+
+void SimSlave::cpu_cli() {
+    i_flag = false;
+}
+
+void SimSlave::cpu_sleep() {
+    if (!(regs[IO_MCUCR] & (1 << SE)))
+        return;
+    sleeping = true;
+    sleep_start = local_now();
+    sleep_mode = regs[IO_MCUCR] & ((1 << SM0) | (1 << SM1));
+}
+
+void SimSlave::cpu_wdr() {
+    wdt_last_reset = local_now();
+}
+
+unsigned SimSlave::eeprom_size() {
+    return eeprom_data.size();
+}
+
+/* Timer0 */
+
+double SimSlave::timer_tick() const {
+    static const unsigned prescalers[] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    unsigned prescaler = prescalers[regs[IO_TCCR0B] & 0x7];
+    return prescaler * 1e9 / (F_CPU * config.clock_skew);
+}
+
+uint8_t SimSlave::timer_value(sim_time t) const {
+    double tick = timer_tick();
+    if (!tick || t < timer_start)
+        return timer_init;
+    return timer_init + (uint64_t)((t - timer_start) / tick);
+}
+
+uint8_t SimSlave::timer_compare(unsigned src) const {
+    switch (src) {
+    case TIMER_COMPA:
+        return regs[IO_OCR0A];
+    case TIMER_COMPB:
+        return regs[IO_OCR0B];
+    default:
+        // Overflow happens when the counter wraps to 0
+        return 0;
+    }
+}
+
+// Find the first time after the given time when the counter reaches the
+// compare value for the given source.
+bool SimSlave::timer_match_after(unsigned src, sim_time after, sim_time *when) const {
+    double tick = timer_tick();
+    if (!tick)
+        return false;
+
+    uint64_t k = 1;
+    if (after >= timer_start)
+        k = (uint64_t)((after - timer_start) / tick) + 1;
+    k += (uint8_t)(timer_compare(src) - timer_init - k);
+    *when = timer_start + (sim_time)llround(k * tick);
+    return true;
+}
+
+bool SimSlave::timer_flag(unsigned src) const {
+    if (timer_flags & timer_flag_bits[src])
+        return true;
+    sim_time when;
+    return timer_match_after(src, flag_since[src], &when)
+           && when <= local_now();
+}
+
+// Collect all flags set by matches up to now in timer_flags, so the
+// timer settings can be changed without losing them.
+void SimSlave::timer_materialize() {
+    for (unsigned i = 0; i < TIMER_SOURCES; ++i) {
+        if (timer_flag(i))
+            timer_flags |= timer_flag_bits[i];
+        flag_since[i] = local_now();
+    }
+}
+
+void SimSlave::timer_reschedule() {
+    unsigned epoch = ++timer_epoch;
+    if (!is_powered)
+        return;
+
+    for (unsigned i = 0; i < TIMER_SOURCES; ++i) {
+        if (!(regs[IO_TIMSK0] & timer_enable_bits[i]))
+            continue;
+
+        sim_time when = bus.now();
+        if (!timer_flag(i) && !timer_match_after(i, flag_since[i], &when))
+            continue;
+        if (when < bus.now())
+            when = bus.now();
+        unsigned latency = timer_latencies[i];
+        if (sleeping)
+            latency += SLEEP_WAKEUP;
+        bus.schedule(when + cycles(latency),
+                     [this, i, epoch]() { timer_dispatch(i, epoch); });
+    }
+}
+
+void SimSlave::timer_dispatch(unsigned src, unsigned epoch) {
+    if (epoch != timer_epoch || !is_powered || !i_flag)
+        return;
+
+    if (!timer_flag(src)) {
+        timer_reschedule();
+        return;
+    }
+
+    // The hardware clears the flag when running the ISR
+    timer_materialize();
+    timer_flags &= ~timer_flag_bits[src];
+    wake();
+
+    switch (src) {
+    case TIMER_COMPA:
+        // Emulate the naked TIM0_COMPA_vect
+        statistics.tim0_compa++;
+        fw->sample_val = io_read(IO_PINB);
+        fw->__vector_sample();
+        break;
+    case TIMER_COMPB:
+        // Emulate the naked TIM0_COMPB_vect
+        statistics.tim0_compb++;
+        io_write(IO_DDRB, regs[IO_DDRB] & ~(1 << PINB1));
+        break;
+    case TIMER_OVF:
+        statistics.tim0_ovf++;
+        fw->TIM0_OVF_vect();
+        break;
+    }
+    after_isr();
+}
+
+/* INT0 */
+
+bool SimSlave::int0_level_mode() const {
+    return !(regs[IO_MCUCR] & ((1 << ISC00) | (1 << ISC01)));
+}
+
+void SimSlave::line_changed(bool high) {
+    if (!is_powered)
+        return;
+
+    // The edge detector only runs in edge-triggered mode (and needs
+    // the I/O clock, which is stopped during power-down anyway).
+    if (!high && !int0_level_mode())
+        intf0 = true;
+    int0_check();
+}
+
+void SimSlave::int0_check() {
+    if (int0_scheduled || !is_powered || !(regs[IO_GIMSK] & (1 << INT0)))
+        return;
+
+    bool pending = int0_level_mode() ? !bus.line() : intf0;
+    if (!pending)
+        return;
+
+    unsigned latency = INT0_LATENCY;
+    if (sleeping && sleep_mode == SLEEP_MODE_PWR_DOWN)
+        latency += POWER_DOWN_WAKEUP;
+    else if (sleeping)
+        latency += SLEEP_WAKEUP;
+
+    unsigned epoch = int0_epoch;
+    int0_scheduled = true;
+    bus.schedule(bus.now() + cycles(latency),
+                 [this, epoch]() { int0_dispatch(epoch); });
+}
+
+void SimSlave::int0_dispatch(unsigned epoch) {
+    if (epoch != int0_epoch)
+        return;
+    int0_scheduled = false;
+
+    if (!is_powered || !i_flag || !(regs[IO_GIMSK] & (1 << INT0)))
+        return;
+
+    if (int0_level_mode()) {
+        // A level interrupt only fires when the line is still low
+        if (bus.line())
+            return;
+    } else {
+        if (!intf0)
+            return;
+        // The hardware clears the flag when running the ISR
+        intf0 = false;
+    }
+
+    wake();
+    statistics.int0++;
+
+    // Emulate the naked INT0_vect
+    io_write(IO_TCNT0, fw->tcnt0_init);
+    if ((fw->action & Firmware::AV_WATCH) == Firmware::AV_WATCH) {
+        statistics.int0_watch++;
+        after_isr();
+        return;
+    }
+    fw->__vector_bit_start();
+    // __vector_bit_start calls __vector_sample directly when no sample
+    // is needed
+    if (!(regs[IO_TIMSK0] & (1 << OCIE0A)))
+        fw->__vector_sample();
+    after_isr();
+}
+
+/* Watchdog */
+
+sim_time SimSlave::wdt_timeout() const {
+    // The watchdog runs from its own 128kHz oscillator, so it is not
+    // affected by the clock skew. The shortest timeout is 2K cycles.
+    uint8_t wdtcr = regs[IO_WDTCR];
+    unsigned wdp = (wdtcr & 0x7) | ((wdtcr & (1 << WDP3)) ? 0x8 : 0);
+    return ms(16) << wdp;
+}
+
+void SimSlave::wdt_reschedule() {
+    if (!is_powered || !(regs[IO_WDTCR] & (1 << WDE))) {
+        wdt_deadline = 0;
+        ++wdt_epoch;
+        return;
+    }
+
+    sim_time deadline = wdt_last_reset + wdt_timeout();
+    if (deadline == wdt_deadline)
+        return;
+
+    wdt_deadline = deadline;
+    unsigned epoch = ++wdt_epoch;
+    bus.schedule(deadline, [this, epoch]() { wdt_expired(epoch); });
+}
+
+void SimSlave::wdt_expired(unsigned epoch) {
+    if (epoch != wdt_epoch || !is_powered)
+        return;
+
+    statistics.wdt_resets++;
+    reset(1 << WDRF);
+}
+
+/* CPU */
+
+void SimSlave::wake() {
+    if (!sleeping)
+        return;
+
+    sim_time slept = bus.now() - sleep_start;
+    if (sleep_mode == SLEEP_MODE_PWR_DOWN)
+        statistics.power_down_time += slept;
+    else
+        statistics.idle_time += slept;
+    statistics.wakeups++;
+    sleeping = false;
+}
+
+void SimSlave::after_isr() {
+    // The ISR returns into the mainloop, right after the sleep
+    // instruction (or wherever it was when not sleeping).
+    run_main();
+}
+
+void SimSlave::run_main() {
+    for (unsigned i = 0; is_powered && !sleeping && !holding; ++i) {
+        if (i > MAX_LOOP_ITERATIONS) {
+            fprintf(stderr, "Slave mainloop does not go to sleep\n");
+            abort();
+        }
+
+        bool processing = (fw->action == Firmware::ACTION_STALL);
+        cpu_time = 0;
+        fw->loop();
+
+        if (processing) {
+            // The mainloop just processed a byte, instantaneously.
+            // Pretend it is still busy by keeping the ISRs sending
+            // stall bits until the processing would have been done
+            // and only then apply the action it decided upon.
+            sim_time duration = cycles(config.loop_cycles) + cpu_time + extra_hold;
+            extra_hold = 0;
+            pending_action = fw->action;
+            fw->action = Firmware::ACTION_STALL;
+            holding = true;
+            // The loop went to sleep right away, but the real CPU
+            // would still be busy
+            sleeping = false;
+
+            unsigned epoch = ++hold_epoch;
+            bus.schedule(bus.now() + duration,
+                         [this, epoch]() { release_hold(epoch); });
+        }
+        cpu_time = 0;
+    }
+
+    timer_reschedule();
+    int0_check();
+    wdt_reschedule();
+}
+
+void SimSlave::release_hold(unsigned epoch) {
+    if (epoch != hold_epoch || !is_powered || !holding)
+        return;
+
+    holding = false;
+    // If an ISR changed the action in the meantime (e.g., a reset was
+    // detected), assume the mainloop was done before that.
+    if (fw->action == Firmware::ACTION_STALL)
+        fw->action = pending_action;
+    run_main();
+}
+
+/* EEPROM images */
+
+std::vector<uint8_t> sim_eeprom_image(uint16_t model, uint8_t revision,
+                                      uint32_t serial, unsigned size) {
+    static const char name[] = "sim";
+    std::vector<uint8_t> image(size, 0xff);
+
+    unsigned pos = 0;
+    image[pos++] = 1; // Layout version
+    // The header cannot describe more than 255 bytes, bigger slaves
+    // report their real size with CMD_READ_EEPROM_SIZE
+    image[pos++] = size > 0xff ? 0xff : size;
+    image[pos++] = 0; // Used size, filled below
+    // Unique ID
+    image[pos++] = 1; // Protocol version
+    image[pos++] = model >> 8;
+    image[pos++] = model;
+    image[pos++] = revision;
+    image[pos++] = serial >> 16;
+    image[pos++] = serial >> 8;
+    image[pos++] = serial;
+    uint8_t crc = 0;
+    for (unsigned i = 3; i < pos; ++i)
+        crc = crc_update(UNIQUE_ID_CRC_POLY, crc, image[i]);
+    image[pos++] = crc;
+    image[pos++] = 1; // Firmware version
+    // The name has the high bit set on its last character
+    for (unsigned i = 0; i < sizeof(name) - 1; ++i)
+        image[pos++] = name[i] | (i == sizeof(name) - 2 ? 0x80 : 0);
+
+    image[2] = pos + 2;
+    uint16_t checksum = 0;
+    for (unsigned i = 0; i < pos; ++i)
+        checksum = crc16_update(LAYOUT_CRC_POLY, checksum, image[i]);
+    image[pos++] = checksum >> 8;
+    image[pos++] = checksum;
+    return image;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
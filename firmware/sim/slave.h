@@ -0,0 +1,221 @@
+// Simulated backpack bus slave, running the real slave firmware
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef _SIM_SLAVE_H
+#define _SIM_SLAVE_H
+
+#include <stdint.h>
+#include <vector>
+#include "bus.h"
+#include "avr.h"
+
+class Firmware;
+
+// Default EEPROM size of a simulated slave, that of the attiny13
+#define SIM_EEPROM_SIZE 64
+
+// Timing parameters of a simulated slave
+struct SlaveConfig {
+    SlaveConfig();
+
+    // Actual clock speed relative to the nominal clock speed (e.g.,
+    // 1.1 for an oscillator running 10% fast)
+    double clock_skew;
+
+    // Number of CPU cycles the mainloop needs to process a single
+    // byte (i.e., the time the slave spends in ACTION_STALL, excluding
+    // any EEPROM write time)
+    unsigned loop_cycles;
+
+    // Time an EEPROM erase + write takes
+    sim_time eeprom_write_time;
+
+    // Capacitance the backpack adds to the bus (pin, connector and
+    // traces), in F. Only matters when the bus has a pull-up set.
+    double capacitance;
+};
+
+// A single slave on a SimBus. This runs the actual code from
+// firmware.c, with its I/O registers and interrupts emulated by this
+// class.
+//
+// Note that the ISRs and mainloop run instantaneously in simulated
+// time: an ISR runs completely at the moment its inline assembly would
+// have sampled or driven the bus. The mainloop time spent processing a
+// byte is modeled by keeping the action at ACTION_STALL for the
+// duration of the processing.
+class SimSlave : public LineListener, private AvrHooks {
+public:
+    SimSlave(SimBus &bus, const std::vector<uint8_t> &eeprom,
+             const SlaveConfig &config = SlaveConfig());
+    virtual ~SimSlave();
+
+    // Apply power, running the firmware's setup(). Before this, the
+    // slave does not respond to the bus at all.
+    void power_on();
+
+    // Remove power, releasing the bus. EEPROM contents and
+    // statistics are preserved, everything else is lost.
+    void power_off();
+
+    bool powered() const { return is_powered; }
+
+    // Make the mainloop take the given time longer for the next byte it
+    // processes, as if it got stuck on something. The ISRs keep
+    // sending stall bits in the meantime.
+    void stall(sim_time duration) { extra_hold = duration; }
+
+    // The firmware instance, to inspect its state (e.g. action or
+    // bus_addr).
+    Firmware &firmware() { return *fw; }
+
+    std::vector<uint8_t> &eeprom() { return eeprom_data; }
+
+    // Statistics
+    struct Stats {
+        // Number of ISRs run, per vector
+        unsigned long int0, tim0_compa, tim0_compb, tim0_ovf;
+        // Number of INT0 ISRs that returned right away in ACTION_WATCH
+        // (these are included in int0)
+        unsigned long int0_watch;
+        // Number of times the CPU woke up from sleep
+        unsigned long wakeups;
+        // Number of watchdog resets
+        unsigned long wdt_resets;
+        // Number of EEPROM writes
+        unsigned long eeprom_writes;
+        // Time spent sleeping, in idle and power-down mode
+        sim_time idle_time, power_down_time;
+    };
+    const Stats &stats() const { return statistics; }
+
+    // Convenience accessors for the firmware state
+    uint8_t action() const;
+    uint8_t state() const;
+    uint8_t flags() const;
+    uint8_t bus_addr() const;
+
+    virtual void line_changed(bool high);
+
+private:
+    // AvrHooks
+    virtual uint8_t io_read(uint8_t reg);
+    virtual void io_write(uint8_t reg, uint8_t value);
+    virtual void cpu_sei();
+    virtual void cpu_cli();
+    virtual void cpu_sleep();
+    virtual void cpu_wdr();
+    virtual unsigned eeprom_size();
+
+    enum {
+        TIMER_OVF,
+        TIMER_COMPA,
+        TIMER_COMPB,
+        TIMER_SOURCES,
+    };
+
+    sim_time local_now() const { return bus.now() + cpu_time; }
+    sim_time cycles(double n) const;
+    double timer_tick() const;
+    uint8_t timer_value(sim_time t) const;
+    uint8_t timer_compare(unsigned src) const;
+    bool timer_match_after(unsigned src, sim_time after, sim_time *when) const;
+    bool timer_flag(unsigned src) const;
+    void timer_materialize();
+    void timer_reschedule();
+    void timer_dispatch(unsigned src, unsigned epoch);
+
+    bool int0_level_mode() const;
+    void int0_check();
+    void int0_dispatch(unsigned epoch);
+
+    sim_time wdt_timeout() const;
+    void wdt_reschedule();
+    void wdt_expired(unsigned epoch);
+
+    void update_drive();
+    void wake();
+    void after_isr();
+    void run_main();
+    void release_hold(unsigned epoch);
+    void reset(uint8_t reason);
+
+    SimBus &bus;
+    unsigned driver;
+    SlaveConfig config;
+    Firmware *fw;
+    Stats statistics;
+
+    std::vector<uint8_t> eeprom_data;
+    uint8_t regs[IO_COUNT];
+    bool is_powered;
+    bool i_flag;
+
+    // Set when the CPU is in sleep mode
+    bool sleeping;
+    sim_time sleep_start;
+    uint8_t sleep_mode;
+
+    // CPU time used by the mainloop since it started running
+    // (instantaneously) at bus.now()
+    sim_time cpu_time;
+
+    // When set, the mainloop is (in simulated time) still processing
+    // and pending_action is the action it will set when done
+    bool holding;
+    uint8_t pending_action;
+    unsigned hold_epoch;
+    // Added to the next processing time, see stall()
+    sim_time extra_hold;
+
+    // Timer state. The counter had value timer_init at timer_start
+    // and has been counting since. Matches after flag_since[src] set
+    // the corresponding interrupt flag, in addition to those already
+    // collected in timer_flags.
+    sim_time timer_start;
+    uint8_t timer_init;
+    uint8_t timer_flags;
+    sim_time flag_since[TIMER_SOURCES];
+    unsigned timer_epoch;
+
+    bool intf0;
+    bool int0_scheduled;
+    unsigned int0_epoch;
+
+    sim_time eeprom_busy_until;
+
+    sim_time wdt_last_reset;
+    sim_time wdt_deadline;
+    unsigned wdt_epoch;
+};
+
+// Build an EEPROM image containing a valid header (as specified in
+// EEPROMLayout.rst) for the given model, hardware revision and serial
+// number, followed by a checksum. The rest of the EEPROM is filled with
+// 0xff.
+std::vector<uint8_t> sim_eeprom_image(uint16_t model, uint8_t revision,
+                                      uint32_t serial,
+                                      unsigned size = SIM_EEPROM_SIZE);
+
+#endif // _SIM_SLAVE_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,168 @@
+// Edge capture and timing histograms for the bus master
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <string.h>
+#include "capture.h"
+#include "crc.h"
+
+const capture_spec capture_specs[] = {
+    [DURATION_RESET] = {"Master reset", 2200, 3000},
+    [DURATION_SEND_1] = {"Master send 1", 100, 150},
+    [DURATION_SEND_0] = {"Master send 0", 600, 700},
+    [DURATION_RECEIVE] = {"Master receive", 100, 150},
+    [DURATION_SAMPLE] = {"Master sample data", 300, 400},
+    [DURATION_NEXT_BIT] = {"Next bit start", 700, 1500},
+    [DURATION_IDLE] = {"Bus idle time", 50, 0},
+};
+
+void capture_init(capture *c) {
+    c->count = 0;
+    c->overflow = false;
+}
+
+uint16_t capture_bin_width(capture_duration d) {
+    const capture_spec *spec = &capture_specs[d];
+    if (!spec->max)
+        return CAPTURE_OPEN_BIN;
+    return (spec->max - spec->min + CAPTURE_BINS - 1) / CAPTURE_BINS;
+}
+
+void capture_summary_init(capture_summary *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static void add_duration(capture_summary *s, capture_duration d, uint16_t value) {
+    const capture_spec *spec = &capture_specs[d];
+    capture_stats *st = &s->durations[d];
+
+    if (!st->count || value < st->min)
+        st->min = value;
+    if (!st->count || value > st->max)
+        st->max = value;
+    st->count++;
+
+    if (value < spec->min) {
+        st->below++;
+    } else if (spec->max && value > spec->max) {
+        st->above++;
+    } else {
+        uint16_t bin = (value - spec->min) / capture_bin_width(d);
+        if (bin >= CAPTURE_BINS)
+            bin = CAPTURE_BINS - 1;
+        st->bins[bin]++;
+    }
+}
+
+void capture_summarize(const capture *c, capture_summary *s) {
+    // Edge that started the current bit or reset, if any
+    const capture_edge *start = NULL;
+    // Start of the previous bit, to measure the next bit start
+    const capture_edge *prev = NULL;
+    // When the line was last released (or seen high), to measure the
+    // idle time
+    const capture_edge *high = NULL;
+    bool released = false;
+
+    for (uint16_t i = 0; i < c->count; ++i) {
+        const capture_edge *e = &c->edges[i];
+        switch (e->type) {
+            case EDGE_RESET:
+                start = e;
+                prev = high = NULL;
+                released = false;
+                break;
+            case EDGE_WRITE_0:
+            case EDGE_WRITE_1:
+            case EDGE_READ:
+                if (prev)
+                    add_duration(s, DURATION_NEXT_BIT, e->time - prev->time);
+                if (high && prev)
+                    add_duration(s, DURATION_IDLE, e->time - high->time);
+                start = prev = e;
+                high = NULL;
+                released = false;
+                break;
+            case EDGE_RELEASE:
+                // Only the first release after the line was pulled low
+                // ends the low period
+                if (!start || released)
+                    break;
+                released = true;
+                high = e;
+                if (start->type == EDGE_RESET)
+                    add_duration(s, DURATION_RESET, e->time - start->time);
+                else if (start->type == EDGE_WRITE_0)
+                    add_duration(s, DURATION_SEND_0, e->time - start->time);
+                else if (start->type == EDGE_WRITE_1)
+                    add_duration(s, DURATION_SEND_1, e->time - start->time);
+                else
+                    add_duration(s, DURATION_RECEIVE, e->time - start->time);
+                break;
+            case EDGE_SAMPLE_LOW:
+            case EDGE_SAMPLE_HIGH:
+                if (start && start->type == EDGE_READ)
+                    add_duration(s, DURATION_SAMPLE, e->time - start->time);
+                break;
+            case EDGE_HIGH:
+                high = e;
+                break;
+        }
+    }
+}
+
+static void encode(uint8_t type, uint16_t data, uint8_t *buf) {
+    buf[0] = CAPTURE_SYNC;
+    buf[1] = type;
+    buf[2] = data;
+    buf[3] = data >> 8;
+
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CAPTURE_RECORD_SIZE - 1; ++i)
+        crc = crc_update(CAPTURE_CRC_POLY, crc, buf[i]);
+    buf[CAPTURE_RECORD_SIZE - 1] = crc;
+}
+
+void capture_encode_header(const capture *c, uint8_t *buf) {
+    encode(c->overflow ? CAPTURE_HEADER_OVERFLOW : CAPTURE_HEADER, c->count, buf);
+}
+
+void capture_encode_edge(const capture_edge *e, uint8_t *buf) {
+    encode(e->type, e->time, buf);
+}
+
+bool capture_decode(const uint8_t *buf, capture_edge *e) {
+    if (buf[0] != CAPTURE_SYNC)
+        return false;
+
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < CAPTURE_RECORD_SIZE - 1; ++i)
+        crc = crc_update(CAPTURE_CRC_POLY, crc, buf[i]);
+    if (crc != buf[CAPTURE_RECORD_SIZE - 1])
+        return false;
+
+    e->type = buf[1];
+    e->time = buf[2] | (uint16_t)buf[3] << 8;
+    return true;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
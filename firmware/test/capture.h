@@ -0,0 +1,184 @@
+// Edge capture and timing histograms for the bus master
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// When capturing is enabled, the bus code records the time of every
+// edge it makes and every sample it takes in a preallocated buffer.
+// Afterwards, these are turned into histograms of the durations from
+// the "Bus timings" table in BackpackbusProtocol.rst, as far as the
+// master can measure them. This shows how much slack there is between
+// the actual master timings and the limits of the protocol.
+//
+// Times are stored as the lower 16 bits of micros(), which is plenty
+// for the durations within a transaction. Only standard bits are
+// captured, MODE_TERNARY symbols are not.
+//
+// A capture can also be sent out as records (like the event log, see
+// eventlog.h), which makes it a compact log of a bus session: every
+// edge the master made, plus the level it sampled for every bit read.
+// firmware/sim/sim_replay reads these from the serial output and plays
+// the master side back against simulated slaves, to reproduce a session
+// from the field. Since only 16 bits of time are kept, the gap between
+// two edges in a capture cannot be longer than 65ms.
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stdint.h>
+
+// Number of edges that fit in the buffer. A byte written takes about
+// 30 edges, a byte read about 50, so this fits the enumeration of a
+// single slave (about 470 edges). With more slaves, an enumeration
+// takes a lot more, since every slave takes part in reading every id
+// until it loses arbitration: about 1300 edges for two slaves and 4200
+// for four. Define a bigger CAPTURE_SIZE to capture those.
+#ifndef CAPTURE_SIZE
+#define CAPTURE_SIZE 512
+#endif
+
+// Number of histogram bins between the minimum and maximum duration
+#define CAPTURE_BINS 8
+// Bin width for durations without a maximum, in μs
+#define CAPTURE_OPEN_BIN 100
+
+typedef enum {
+    // The master pulls the line low for a reset
+    EDGE_RESET,
+    // The master pulls the line low to write a 0 or 1 bit
+    EDGE_WRITE_0,
+    EDGE_WRITE_1,
+    // The master pulls the line low to read a bit
+    EDGE_READ,
+    // The master releases the line
+    EDGE_RELEASE,
+    // The master samples the line, and reads it low or high
+    EDGE_SAMPLE_LOW,
+    EDGE_SAMPLE_HIGH,
+    // The line was seen high again after a bit was read
+    EDGE_HIGH,
+} capture_edge_type;
+
+// Records are sent as the sync byte, the type, the data (16 bits,
+// little endian) and a CRC over everything before it. A capture is
+// sent as a header record, whose data is the number of edges, followed
+// by one record per edge, whose data is its time.
+#define CAPTURE_SYNC 0xa6
+#define CAPTURE_RECORD_SIZE 5
+#define CAPTURE_CRC_POLY 0x2f
+
+// Record types for the header, for a complete capture or one that
+// overflowed. Edges use their capture_edge_type.
+#define CAPTURE_HEADER 0x80
+#define CAPTURE_HEADER_OVERFLOW 0x81
+
+// Durations from the protocol specification that can be measured from
+// the captured edges
+typedef enum {
+    DURATION_RESET,
+    DURATION_SEND_1,
+    DURATION_SEND_0,
+    DURATION_RECEIVE,
+    DURATION_SAMPLE,
+    DURATION_NEXT_BIT,
+    DURATION_IDLE,
+
+    DURATION_COUNT,
+} capture_duration;
+
+struct capture_spec {
+    // Name as used in BackpackbusProtocol.rst
+    const char *name;
+    // Limits, in μs. A maximum of 0 means there is none.
+    uint16_t min;
+    uint16_t max;
+};
+
+extern const capture_spec capture_specs[];
+
+struct capture_edge {
+    uint8_t type;
+    uint16_t time;
+};
+
+struct capture {
+    capture_edge edges[CAPTURE_SIZE];
+    uint16_t count;
+    // Set when edges did not fit
+    bool overflow;
+};
+
+struct capture_stats {
+    uint16_t count;
+    // Measured extremes, in μs
+    uint16_t min;
+    uint16_t max;
+    // Durations outside the limits
+    uint16_t below;
+    uint16_t above;
+    // Durations within the limits, bin n starts at min + n *
+    // capture_bin_width(). Without a maximum, the last bin counts all
+    // longer durations as well.
+    uint16_t bins[CAPTURE_BINS];
+};
+
+struct capture_summary {
+    capture_stats durations[DURATION_COUNT];
+};
+
+// Clear the buffer
+void capture_init(capture *c);
+
+// Record an edge. When the buffer is full, the edge is dropped and
+// c->overflow is set.
+static inline void capture_edge_at(capture *c, capture_edge_type type, uint16_t time) {
+    if (c->count == CAPTURE_SIZE) {
+        c->overflow = true;
+        return;
+    }
+    c->edges[c->count].type = type;
+    c->edges[c->count].time = time;
+    c->count++;
+}
+
+// Width of the histogram bins for the given duration, in μs
+uint16_t capture_bin_width(capture_duration d);
+
+// Clear a summary
+void capture_summary_init(capture_summary *s);
+
+// Add the durations of all captured edges to the summary. This can be
+// called for multiple captures, to combine them.
+void capture_summarize(const capture *c, capture_summary *s);
+
+// Encode the header of a capture into CAPTURE_RECORD_SIZE bytes
+void capture_encode_header(const capture *c, uint8_t *buf);
+
+// Encode an edge into CAPTURE_RECORD_SIZE bytes
+void capture_encode_edge(const capture_edge *e, uint8_t *buf);
+
+// Decode a record of CAPTURE_RECORD_SIZE bytes. For a header, e->type
+// is CAPTURE_HEADER or CAPTURE_HEADER_OVERFLOW and e->time is the
+// number of edges. Returns false when it does not start with the sync
+// byte or the CRC does not match.
+bool capture_decode(const uint8_t *buf, capture_edge *e);
+
+#endif // _CAPTURE_H
@@ -28,6 +28,11 @@
 #define BP_BUS_PIN 2
 #endif
 
+// Define to a list of pins with more buses (with at least one slave
+// each) to also test parallel transfers on, e.g.
+// -DBP_EXTRA_BUS_PINS=4,5
+//#define BP_EXTRA_BUS_PINS 4, 5
+
 struct timings {
     unsigned reset;
     unsigned start;
@@ -80,17 +85,31 @@ timings timings_to_test[] = {
 // The maximum time after which the slave should go back to idle
 #define NEXT_BIT_TIMEOUT 2200
 
-timings *current_timings;
-
-// Should perhaps be read from EEPROM, but for now hardcoding is fine
+// EEPROM size of slaves that cannot report it (without FEATURE_WIDE,
+// i.e. the attiny13a). Every slave has at least this much, so tests
+// that address several slaves at once stay below it. See
+// bp_eeprom_size() for the size of a particular slave.
 #define EEPROM_SIZE 64
+// The biggest EEPROM the master handles (the attiny85)
+#define MAX_EEPROM_SIZE 512
 // Ofset of the unique ID within the EEPROM
 #define UNIQUE_ID_OFFSET 3
 
+// Bit slots used by a byte, excluding stall bits: 8 data bits, parity,
+// ready and ack/nack
+#define BYTE_BITS 12
+// Time the slave needs to write a byte to its EEPROM, during which it
+// stalls the bus (typical value for the ATtiny13)
+#define EEPROM_WRITE_TIME 3400
+
 #define lengthof(x) (sizeof(x)/sizeof(*x))
 
 #include "protocol.h"
 #include "crc.h"
+#include "layout.h"
+#include "telemetry.h"
+#include "eventlog.h"
+#include "capture.h"
 
 typedef enum {
     OK,
@@ -120,30 +139,138 @@ struct status {
     uint8_t slave_code;
 };
 
+// How every error code is counted in the telemetry
+const telemetry_result bp_telemetry_result[] = {
+    [OK] = TELEMETRY_OK,
+    [TIMEOUT] = TELEMETRY_TIMEOUT,
+    [NACK] = TELEMETRY_NACK,
+    [NACK_NO_SLAVE_CODE] = TELEMETRY_NACK,
+    [NO_ACK_OR_NACK] = TELEMETRY_NO_REPLY,
+    [ACK_AND_NACK] = TELEMETRY_COLLISION,
+    [PARITY_ERROR] = TELEMETRY_PARITY,
+};
+
 uint8_t ids[127][8];
-uint8_t eeproms[4][EEPROM_SIZE];
+uint8_t eeproms[4][MAX_EEPROM_SIZE];
 
 // Where to introduce a parity error? This indicates the number of
 // bytes to be sent normally before a parity error is introduced
 uint8_t parity_error_byte = -1;
 
-// How many bytes without parity error are left in the current
-// transaction? Automatically reset to parity_error_byte by test_reset.
-uint8_t parity_error_left;
+// What a slave supports, as reported by CMD_READ_CAPABILITIES
+struct bp_capabilities {
+    // Set when the fields below are valid
+    bool known;
+    uint8_t minor;
+    // FEATURE_* values
+    uint8_t features;
+    // EEPROM size in bytes, as reported by CMD_READ_EEPROM_SIZE. 0 for
+    // slaves without FEATURE_WIDE (see the layout header instead).
+    uint16_t eeprom_size;
+};
+
+// The state of a single bus. The master can drive multiple buses, each
+// on its own pin: all bp_* functions work on the bus bp_current points
+// to, bp_select() switches to another one. bp_run_jobs() transfers on
+// several buses at once.
+struct bp_bus {
+    // The pin the bus line is connected to
+    uint8_t pin;
+
+    // When was the start of the most recent bit?
+    unsigned long bit_start;
+
+    // The mode (MODE_* values) set using CMD_SET_MODE in the current
+    // transaction. Automatically reset to 0 by bp_reset.
+    uint8_t mode;
+
+    // The bit timings to use on this bus
+    const timings *timing;
+
+    // How many bytes without parity error are left in the current
+    // transaction? Automatically reset to parity_error_byte by
+    // test_reset.
+    uint8_t parity_error_left;
+
+    // Capabilities of every slave on this bus, cached by bp_discover()
+    // and used to pick the fastest mode for a session
+    bp_capabilities caps[lengthof(ids)];
+};
+
+// The bus on BP_BUS_PIN, which is the one used unless another one is
+// selected. Its timing must be set before use.
+bp_bus bp_default_bus = {BP_BUS_PIN, 0, 0};
+
+// Set up another bus on the given pin with the given timings, without
+// any cached capabilities
+void bp_bus_init(bp_bus *bus, uint8_t pin, const timings *timing) {
+    memset(bus, 0, sizeof(*bus));
+    bus->pin = pin;
+    bus->timing = timing;
+}
+
+bp_bus *bp_current = &bp_default_bus;
+
+#if defined(BP_EXTRA_BUS_PINS)
+const uint8_t bp_extra_bus_pins[] = {BP_EXTRA_BUS_PINS};
+bp_bus bp_extra_buses[lengthof(bp_extra_bus_pins)];
+#endif
+
+// Counters for all bus traffic, see telemetry.h
+telemetry bp_telemetry;
+
+// Events from the bus code, which cannot print while a transaction is
+// running. Drained by bp_log_drain() between transactions.
+eventlog bp_log;
+
+// Set to a buffer to record the timing of every edge, see capture.h.
+// Capturing takes a few μs per edge, which is included in the measured
+// durations.
+capture *bp_capture = NULL;
+
+void bp_capture_edge(capture_edge_type type) {
+    if (bp_capture)
+        capture_edge_at(bp_capture, type, micros());
+}
+
+// Send all logged events to the serial port, see eventlog.h
+void bp_log_drain() {
+    eventlog_event e;
+    uint8_t buf[EVENTLOG_RECORD_SIZE];
+    while (eventlog_get(&bp_log, &e)) {
+        eventlog_encode(&e, buf);
+        Serial.write(buf, sizeof(buf));
+    }
+}
+
+// Send a capture to the serial port, see capture.h
+void bp_capture_dump(const capture *c) {
+    uint8_t buf[CAPTURE_RECORD_SIZE];
+    capture_encode_header(c, buf);
+    Serial.write(buf, sizeof(buf));
+    for (uint16_t i = 0; i < c->count; ++i) {
+        capture_encode_edge(&c->edges[i], buf);
+        Serial.write(buf, sizeof(buf));
+    }
+}
 
-// When was the start of the most recent bit?
-unsigned long bit_start = 0;
+// Make all bp_* functions use the given bus. Note that bp_telemetry,
+// bp_log and bp_capture are shared by all buses, so they are only
+// meaningful for one of them.
+void bp_select(bp_bus *bus) {
+    bp_current = bus;
+}
 
 bool bp_wait_for_free_bus(status *status) {
     uint8_t timeout = 255;
     while(timeout--) {
-        if (digitalRead(BP_BUS_PIN) == HIGH)
+        if (digitalRead(bp_current->pin) == HIGH)
             return true;
     }
 
     if (status)
         status->code = TIMEOUT;
-    Serial.println("Bus stays low too long!");
+    eventlog_put(&bp_log, EVENT_BUS_LOW, 0, micros());
     return false;
 }
 
@@ -151,53 +278,167 @@ bool bp_wait_for_free_bus(status *status) {
 bool bp_reset(status *status = NULL) {
     if (!bp_wait_for_free_bus(status))
         return false;
-    pinMode(BP_BUS_PIN, OUTPUT);
-    digitalWrite(BP_BUS_PIN, LOW);
-    delayMicroseconds(current_timings->reset);
-    pinMode(BP_BUS_PIN, INPUT);
-    delayMicroseconds(current_timings->idle);
+    telemetry_begin(&bp_telemetry, micros());
+    pinMode(bp_current->pin, OUTPUT);
+    digitalWrite(bp_current->pin, LOW);
+    bp_capture_edge(EDGE_RESET);
+    delayMicroseconds(bp_current->timing->reset);
+    pinMode(bp_current->pin, INPUT);
+    bp_capture_edge(EDGE_RELEASE);
+    delayMicroseconds(bp_current->timing->idle);
+    bp_current->mode = 0;
     return true;
 }
 
+// Calculate the Hamming(12,8) check bits for the given byte, as sent in
+// MODE_FEC. Data bit n (counting from the LSB) gets the n-th position
+// that is not a power of two (3, 5, 6, 7, 9, 10, 11, 12), the check bits
+// are the xor of the positions of all data bits that are set (and 0x0c,
+// so an idle bus reads as a valid 0xff byte).
+uint8_t bp_hamming_check(uint8_t b) {
+    uint8_t result = 0x0c;
+    uint8_t pos = 2;
+    for (uint8_t bit = 1; bit; bit <<= 1) {
+        do {
+            pos++;
+        } while (!(pos & (pos - 1)));
+        if (b & bit)
+            result ^= pos;
+    }
+    return result;
+}
+
+// Correct a single flipped bit in a byte received in MODE_FEC.
+// syndrome is the xor of the received and calculated check bits,
+// parity_ok tells if the parity bit matched. Returns false when the
+// error cannot be corrected.
+bool bp_fec_correct(uint8_t *b, uint8_t syndrome, bool parity_ok) {
+    // Parity is ok, so either nothing or two bits were flipped
+    if (parity_ok)
+        return syndrome == 0;
+
+    // A flipped parity bit (syndrome 0) or check bit (power of two)
+    // does not matter
+    if (!(syndrome & (syndrome - 1)))
+        return true;
+
+    uint8_t pos = 2;
+    for (uint8_t bit = 1; bit; bit <<= 1) {
+        do {
+            pos++;
+        } while (!(pos & (pos - 1)));
+        if (pos == syndrome) {
+            *b ^= bit;
+            return true;
+        }
+    }
+    return false;
+}
+
 bool bp_write_bit(uint8_t bit, status *status = NULL) {
-    while(micros() - bit_start < current_timings->next_bit) /* wait */;
+    while(micros() - bp_current->bit_start < bp_current->timing->next_bit) /* wait */;
     if (!bp_wait_for_free_bus(status))
         return false;
-    bit_start = micros();
-    pinMode(BP_BUS_PIN, OUTPUT);
-    digitalWrite(BP_BUS_PIN, LOW);
-    delayMicroseconds(current_timings->start);
-    if (bit)
-        pinMode(BP_BUS_PIN, INPUT);
-    delayMicroseconds(current_timings->value);
-    pinMode(BP_BUS_PIN, INPUT);
-    delayMicroseconds(current_timings->idle);
+    bp_current->bit_start = micros();
+    pinMode(bp_current->pin, OUTPUT);
+    digitalWrite(bp_current->pin, LOW);
+    bp_capture_edge(bit ? EDGE_WRITE_1 : EDGE_WRITE_0);
+    delayMicroseconds(bp_current->timing->start);
+    if (bit) {
+        pinMode(bp_current->pin, INPUT);
+        bp_capture_edge(EDGE_RELEASE);
+    }
+    delayMicroseconds(bp_current->timing->value);
+    if (!bit) {
+        pinMode(bp_current->pin, INPUT);
+        bp_capture_edge(EDGE_RELEASE);
+    }
+    delayMicroseconds(bp_current->timing->idle);
     return true;
 }
 
 bool bp_read_bit(uint8_t *value, status *status = NULL) {
-    while(micros() - bit_start < current_timings->next_bit) /* wait */;
+    while(micros() - bp_current->bit_start < bp_current->timing->next_bit) /* wait */;
     if (!bp_wait_for_free_bus(status))
         return false;
-    bit_start = micros();
-    pinMode(BP_BUS_PIN, OUTPUT);
-    digitalWrite(BP_BUS_PIN, LOW);
-    delayMicroseconds(current_timings->start);
-    pinMode(BP_BUS_PIN, INPUT);
-    delayMicroseconds(current_timings->sample);
-    *value = digitalRead(BP_BUS_PIN);
-    delayMicroseconds(current_timings->value - current_timings->sample);
+    bp_current->bit_start = micros();
+    pinMode(bp_current->pin, OUTPUT);
+    digitalWrite(bp_current->pin, LOW);
+    bp_capture_edge(EDGE_READ);
+    delayMicroseconds(bp_current->timing->start);
+    pinMode(bp_current->pin, INPUT);
+    bp_capture_edge(EDGE_RELEASE);
+    delayMicroseconds(bp_current->timing->sample);
+    *value = digitalRead(bp_current->pin);
+    bp_capture_edge(*value ? EDGE_SAMPLE_HIGH : EDGE_SAMPLE_LOW);
+    delayMicroseconds(bp_current->timing->value - bp_current->timing->sample);
     // If a slave pulls the line low, wait for him to finish (to
     // prevent the idle time from disappearing because of a slow
     // slave), but don't wait forever.
     if (!bp_wait_for_free_bus(status))
         return false;
-    delayMicroseconds(current_timings->idle);
+    bp_capture_edge(EDGE_HIGH);
+    delayMicroseconds(bp_current->timing->idle);
+    return true;
+}
+
+// MODE_TERNARY timings, in μs since the start of the symbol. A short
+// symbol is released after timings->start, a medium symbol at
+// TERNARY_RELEASE1 and a long symbol at TERNARY_RELEASE2. These leave
+// room for a 10% clock error in the slave.
+#define TERNARY_SAMPLE1 200
+#define TERNARY_SAMPLE2 450
+#define TERNARY_RELEASE1 340
+#define TERNARY_RELEASE2 600
+#define TERNARY_NEXT_BIT 750
+
+// Write a single MODE_TERNARY symbol (0 = short, 1 = medium, 2 = long)
+bool bp_write_symbol(uint8_t symbol, status *status = NULL) {
+    while(micros() - bp_current->bit_start < TERNARY_NEXT_BIT) /* wait */;
+    if (!bp_wait_for_free_bus(status))
+        return false;
+    bp_current->bit_start = micros();
+    pinMode(bp_current->pin, OUTPUT);
+    digitalWrite(bp_current->pin, LOW);
+    delayMicroseconds(bp_current->timing->start);
+    if (symbol == 1)
+        while(micros() - bp_current->bit_start < TERNARY_RELEASE1) /* wait */;
+    else if (symbol == 2)
+        while(micros() - bp_current->bit_start < TERNARY_RELEASE2) /* wait */;
+    pinMode(bp_current->pin, INPUT);
+    delayMicroseconds(bp_current->timing->idle);
+    return true;
+}
+
+// Read a single MODE_TERNARY symbol (0 = short, 1 = medium, 2 = long)
+bool bp_read_symbol(uint8_t *symbol, status *status = NULL) {
+    while(micros() - bp_current->bit_start < TERNARY_NEXT_BIT) /* wait */;
+    if (!bp_wait_for_free_bus(status))
+        return false;
+    bp_current->bit_start = micros();
+    pinMode(bp_current->pin, OUTPUT);
+    digitalWrite(bp_current->pin, LOW);
+    delayMicroseconds(bp_current->timing->start);
+    pinMode(bp_current->pin, INPUT);
+    *symbol = 0;
+    while(micros() - bp_current->bit_start < TERNARY_SAMPLE1) /* wait */;
+    if (digitalRead(bp_current->pin) == LOW) {
+        *symbol = 1;
+        while(micros() - bp_current->bit_start < TERNARY_SAMPLE2) /* wait */;
+        if (digitalRead(bp_current->pin) == LOW)
+            *symbol = 2;
+    }
+    if (!bp_wait_for_free_bus(status))
+        return false;
+    delayMicroseconds(bp_current->timing->idle);
     return true;
 }
 
+// Maximum number of stall bits before a ready bit
+#define MAX_STALL_BITS 20
+
 bool bp_read_ready(status *status = NULL) {
-    int timeout = 20;
+    int timeout = MAX_STALL_BITS;
     while (timeout--) {
         uint8_t value;
         if (!bp_read_bit(&value, status))
@@ -206,14 +447,15 @@ bool bp_read_ready(status *status = NULL) {
         // Ready bit?
         if (value == HIGH)
             return true;
+        telemetry_stall(&bp_telemetry);
     }
-    Serial.println("Stall timeout");
+    eventlog_put(&bp_log, EVENT_STALL_TIMEOUT, MAX_STALL_BITS, micros());
     if (status)
         status->code = TIMEOUT;
     return false;
 }
 
-bool bp_read_byte(uint8_t *b, status *status = NULL);
+bool bp_read_byte_bits(uint8_t *b, status *status);
 
 bool bp_read_ack_nack(status *status = NULL) {
     uint8_t first, second;
@@ -233,8 +475,10 @@ bool bp_read_ack_nack(status *status = NULL) {
         ok = false;
     } else if (second == LOW) {
         if (status) {
-            // Read error code from the slave
-            if (bp_read_byte(&status->slave_code))
+            // Read error code from the slave. This passes no status,
+            // so a nack of the error code itself does not read another
+            // error code (bp_read_byte would always pass one).
+            if (bp_read_byte_bits(&status->slave_code, NULL))
                 status->code = NACK;
             else
                 status->code = NACK_NO_SLAVE_CODE;
@@ -249,7 +493,48 @@ bool bp_read_ack_nack(status *status = NULL) {
     return ok;
 }
 
-bool bp_read_byte(uint8_t *b, status *status) {
+// Read the data and parity bits of a byte in MODE_TERNARY, sent as
+// three pairs of symbols that encode three bits each
+bool bp_read_ternary(uint8_t *b, status *status) {
+    bool ok = true;
+    bool valid = true;
+    uint16_t bits = 0;
+    for (uint8_t i = 0; i < 3 && ok; ++i) {
+        uint8_t first, second;
+        ok = ok && bp_read_symbol(&first, status);
+        ok = ok && bp_read_symbol(&second, status);
+        uint8_t pair = first * 3 + second;
+        // A pair can encode 9 values, only 8 are valid. Bits are sent
+        // inverted, so an idle bus reads as 0xff.
+        if (pair > 7)
+            valid = false;
+        bits = (bits << 3) | (~pair & 0x7);
+    }
+    if (!ok)
+        return false;
+
+    bool parity_val = 0;
+    for (uint16_t bit = 1; bit < 0x200; bit <<= 1) {
+        if (bits & bit)
+            parity_val ^= 1;
+    }
+
+    *b = bits >> 1;
+    if (!valid || !parity_val) {
+        if (status)
+            status->code = PARITY_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool bp_read_byte_bits(uint8_t *b, status *status) {
+    if (bp_current->mode & MODE_TERNARY) {
+        bool ok = bp_read_ternary(b, status);
+        ok = ok && bp_read_ready(status);
+        return ok && bp_read_ack_nack(status);
+    }
+
     bool parity_val = 0;
     bool ok = true;
     *b = 0;
@@ -264,9 +549,30 @@ bool bp_read_byte(uint8_t *b, status *status) {
         }
         next_bit >>= 1;
     }
+
+    uint8_t check = 0;
+    if (bp_current->mode & MODE_FEC) {
+        next_bit = 0x08;
+        while (next_bit && ok) {
+            ok = ok && bp_read_bit(&value, status);
+
+            if (value) {
+                check |= next_bit;
+                parity_val ^= 1;
+            }
+            next_bit >>= 1;
+        }
+    }
     ok = ok && bp_read_bit(&value, status);
 
-    if (ok && value == parity_val) {
+    if (ok && (bp_current->mode & MODE_FEC)) {
+        uint8_t syndrome = check ^ bp_hamming_check(*b);
+        if (!bp_fec_correct(b, syndrome, value != parity_val)) {
+            if (status)
+                status->code = PARITY_ERROR;
+            return false;
+        }
+    } else if (ok && value == parity_val) {
         if (status)
             status->code = PARITY_ERROR;
         return false;
@@ -277,17 +583,59 @@ bool bp_read_byte(uint8_t *b, status *status) {
     return ok && bp_read_ack_nack(status);
 }
 
-bool bp_write_byte(uint8_t b, status *status = NULL, bool invert_parity = false) {
+// Write the data and parity bits of a byte in MODE_TERNARY, as three
+// pairs of symbols that encode three bits each
+bool bp_write_ternary(uint8_t b, status *status, bool invert_parity, uint8_t flip) {
+    bool parity_val = 0;
+    for (uint8_t bit = 0x80; bit; bit >>= 1) {
+        if (b & bit)
+            parity_val ^= 1;
+    }
+
+    if (invert_parity) // for testing
+        parity_val = !parity_val;
+
+    uint16_t bits = ((b ^ flip) << 1) | !parity_val;
+    bool ok = true;
+    for (int8_t shift = 6; shift >= 0 && ok; shift -= 3) {
+        // Bits are sent inverted, so an idle bus reads as 0xff
+        uint8_t pair = ~(bits >> shift) & 0x7;
+        ok = ok && bp_write_symbol(pair / 3, status);
+        ok = ok && bp_write_symbol(pair % 3, status);
+    }
+    return ok;
+}
+
+// flip can be used to flip data bits after calculating the check bits
+// and parity, for testing error correction in MODE_FEC
+bool bp_write_byte_bits(uint8_t b, status *status, bool invert_parity, uint8_t flip) {
+    if (bp_current->mode & MODE_TERNARY) {
+        bool ok = bp_write_ternary(b, status, invert_parity, flip);
+        ok = ok && bp_read_ready(status);
+        return ok && bp_read_ack_nack(status);
+    }
+
     bool parity_val = 0;
     bool ok = true;
+    uint8_t check = bp_hamming_check(b);
     uint8_t next_bit = 0x80;
     while (next_bit && ok) {
         if (b & next_bit)
             parity_val ^= 1;
-        ok = ok && bp_write_bit(b & next_bit, status);
+        ok = ok && bp_write_bit((b ^ flip) & next_bit, status);
         next_bit >>= 1;
     }
 
+    if (bp_current->mode & MODE_FEC) {
+        next_bit = 0x08;
+        while (next_bit && ok) {
+            if (check & next_bit)
+                parity_val ^= 1;
+            ok = ok && bp_write_bit(check & next_bit, status);
+            next_bit >>= 1;
+        }
+    }
+
     if (invert_parity) // for testing
         parity_val = !parity_val;
 
@@ -298,6 +646,286 @@ bool bp_write_byte(uint8_t b, status *status = NULL, bool invert_parity = false)
     return ok && bp_read_ack_nack(status);
 }
 
+// Pass the result of a byte to the telemetry
+void bp_telemetry_byte(bool write, uint8_t b, bool ok, const status *s) {
+    telemetry_result result = ok ? TELEMETRY_OK : bp_telemetry_result[s->code];
+    telemetry_byte(&bp_telemetry, write, b, result, s->slave_code, micros());
+}
+
+// The status is always collected (even when the caller is not
+// interested) so the telemetry knows how the byte ended. This means the
+// slave error code is read after every nack.
+bool bp_read_byte(uint8_t *b, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+    bool ok = bp_read_byte_bits(b, s);
+    bp_telemetry_byte(false, *b, ok, s);
+    return ok;
+}
+
+bool bp_write_byte(uint8_t b, status *s = NULL, bool invert_parity = false, uint8_t flip = 0) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+    bool ok = bp_write_byte_bits(b, s, invert_parity, flip);
+    bp_telemetry_byte(true, b, ok, s);
+    return ok;
+}
+
+// A transaction on a single bus, for bp_run_jobs(). After the reset,
+// the tx bytes are written (normally starting with a slave address and
+// a command) and then the rx bytes are read, all in the standard mode.
+struct bp_job {
+    bp_bus *bus;
+    const uint8_t *tx;
+    uint8_t tx_len;
+    uint8_t *rx;
+    uint8_t rx_len;
+
+    // The result, set by bp_run_jobs()
+    status result;
+
+    // Progress, private to bp_run_jobs()
+    uint8_t phase;
+    // Index of the current byte, tx bytes first. tx_len + rx_len can
+    // be more than 255.
+    uint16_t pos;
+    // Data and parity bits left in JOB_DATA, ack/nack bits left in
+    // JOB_ACK
+    uint8_t bits;
+    uint8_t stall_bits;
+    // The bits received so far
+    uint8_t value;
+    uint8_t first_ack_bit;
+    // Set when reading the error code after a nack
+    bool nacked;
+};
+
+// bp_job.phase values
+enum {
+    JOB_DATA,
+    JOB_READY,
+    JOB_ACK,
+    JOB_DONE,
+};
+
+// Start the next byte of a job, or finish it after the last one
+void bp_job_next_byte(bp_job *j) {
+    if (!j->nacked && j->pos == j->tx_len + j->rx_len) {
+        j->phase = JOB_DONE;
+        return;
+    }
+    j->phase = JOB_DATA;
+    j->bits = 9;
+    j->value = 0;
+}
+
+void bp_job_fail(bp_job *j, error_code code) {
+    j->result.code = code;
+    j->phase = JOB_DONE;
+}
+
+// Should the master release the line early in the next bit of the
+// job? This is the case for reads and for writing a 1.
+bool bp_job_release(const bp_job *j) {
+    if (j->phase != JOB_DATA || j->nacked || j->pos >= j->tx_len)
+        return true;
+
+    uint8_t b = j->tx[j->pos];
+    if (j->bits > 1)
+        return b & (1 << (j->bits - 2));
+
+    // The parity bit makes the number of ones odd
+    bool parity_val = 0;
+    for (uint8_t bit = 0x80; bit; bit >>= 1) {
+        if (b & bit)
+            parity_val ^= 1;
+    }
+    return !parity_val;
+}
+
+// Process the value of the line sampled in the most recent bit of the
+// job
+void bp_job_bit(bp_job *j, uint8_t value) {
+    switch (j->phase) {
+    case JOB_DATA:
+        j->bits--;
+        if (j->bits) {
+            j->value = (j->value << 1) | value;
+        } else {
+            // For bytes that were read, check the parity
+            bool parity_val = value;
+            for (uint8_t bit = 0x80; bit; bit >>= 1) {
+                if (j->value & bit)
+                    parity_val ^= 1;
+            }
+            bool reading = j->nacked || j->pos >= j->tx_len;
+            if (reading && !parity_val)
+                bp_job_fail(j, j->nacked ? NACK_NO_SLAVE_CODE : PARITY_ERROR);
+            else
+                j->phase = JOB_READY;
+            j->stall_bits = 0;
+        }
+        break;
+    case JOB_READY:
+        if (value == HIGH) {
+            j->phase = JOB_ACK;
+            j->bits = 2;
+        } else if (++j->stall_bits == MAX_STALL_BITS) {
+            bp_job_fail(j, TIMEOUT);
+        }
+        break;
+    case JOB_ACK:
+        if (--j->bits) {
+            j->first_ack_bit = value;
+            break;
+        }
+        // Acks are sent as 01, nacks as 10, see bp_read_ack_nack()
+        if (j->first_ack_bit == LOW && value == LOW) {
+            bp_job_fail(j, j->nacked ? NACK_NO_SLAVE_CODE : ACK_AND_NACK);
+        } else if (value == LOW) {
+            if (j->nacked) {
+                bp_job_fail(j, NACK_NO_SLAVE_CODE);
+            } else {
+                // Read the error code next
+                j->nacked = true;
+                bp_job_next_byte(j);
+            }
+        } else if (j->first_ack_bit != LOW) {
+            bp_job_fail(j, j->nacked ? NACK_NO_SLAVE_CODE : NO_ACK_OR_NACK);
+        } else if (j->nacked) {
+            j->result.slave_code = j->value;
+            bp_job_fail(j, NACK);
+        } else {
+            if (j->pos >= j->tx_len)
+                j->rx[j->pos - j->tx_len] = j->value;
+            j->pos++;
+            bp_job_next_byte(j);
+        }
+        break;
+    }
+}
+
+// The most jobs bp_run_jobs() runs at once
+#define BP_MAX_JOBS 8
+
+// Run a transaction on each of the given buses at the same time (every
+// job should use a different bus). The buses are reset together and
+// every bit starts on all of them at once (using the timings of the
+// current bus), with each bus getting its
+// own bit value, so the jobs take about as long as the longest of them
+// would on its own. A bus that stalls longer than the others simply
+// falls a few bits behind them.
+//
+// Every job gets its own status, a failed job does not influence the
+// others. Returns true when all jobs succeeded, or false without
+// running any job when there are more than BP_MAX_JOBS. The standard
+// mode is always used and the transfers are not included in
+// bp_telemetry.
+bool bp_run_jobs(bp_job *jobs, uint8_t count) {
+    bp_bus *selected = bp_current;
+    const timings *timing = selected->timing;
+    bool ok = true;
+
+    if (count > BP_MAX_JOBS)
+        return false;
+
+    for (uint8_t i = 0; i < count; ++i) {
+        bp_job *j = &jobs[i];
+        j->result.code = OK;
+        j->result.slave_code = 0;
+        j->pos = 0;
+        j->nacked = false;
+        bp_job_next_byte(j);
+        bp_select(j->bus);
+        if (!bp_wait_for_free_bus(&j->result))
+            j->phase = JOB_DONE;
+    }
+
+    // Reset all buses at once
+    for (uint8_t i = 0; i < count; ++i) {
+        if (jobs[i].phase == JOB_DONE)
+            continue;
+        pinMode(jobs[i].bus->pin, OUTPUT);
+        digitalWrite(jobs[i].bus->pin, LOW);
+    }
+    delayMicroseconds(timing->reset);
+    for (uint8_t i = 0; i < count; ++i) {
+        if (jobs[i].phase == JOB_DONE)
+            continue;
+        pinMode(jobs[i].bus->pin, INPUT);
+        jobs[i].bus->mode = 0;
+    }
+    delayMicroseconds(timing->idle);
+
+    unsigned long bit_start = micros() - timing->next_bit;
+    while (true) {
+        uint8_t active = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase != JOB_DONE)
+                active++;
+        }
+        if (!active)
+            break;
+
+        while(micros() - bit_start < timing->next_bit) /* wait */;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase == JOB_DONE)
+                continue;
+            bp_select(jobs[i].bus);
+            if (!bp_wait_for_free_bus(&jobs[i].result))
+                jobs[i].phase = JOB_DONE;
+        }
+
+        // All times are relative to the start of the bit, so they do
+        // not depend on the number of buses
+        bit_start = micros();
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase == JOB_DONE)
+                continue;
+            jobs[i].bus->bit_start = bit_start;
+            pinMode(jobs[i].bus->pin, OUTPUT);
+            digitalWrite(jobs[i].bus->pin, LOW);
+        }
+        while(micros() - bit_start < timing->start) /* wait */;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase != JOB_DONE && bp_job_release(&jobs[i]))
+                pinMode(jobs[i].bus->pin, INPUT);
+        }
+        while(micros() - bit_start < timing->start + timing->sample) /* wait */;
+        uint8_t values[BP_MAX_JOBS];
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase != JOB_DONE)
+                values[i] = digitalRead(jobs[i].bus->pin);
+        }
+        while(micros() - bit_start < timing->start + timing->value) /* wait */;
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase != JOB_DONE && !bp_job_release(&jobs[i]))
+                pinMode(jobs[i].bus->pin, INPUT);
+        }
+
+        // Wait for slaves pulling the line low, like bp_read_bit()
+        for (uint8_t i = 0; i < count; ++i) {
+            if (jobs[i].phase == JOB_DONE)
+                continue;
+            bp_select(jobs[i].bus);
+            if (bp_wait_for_free_bus(&jobs[i].result))
+                bp_job_bit(&jobs[i], values[i]);
+            else
+                jobs[i].phase = JOB_DONE;
+        }
+        delayMicroseconds(timing->idle);
+    }
+
+    for (uint8_t i = 0; i < count; ++i) {
+        if (jobs[i].result.code != OK)
+            ok = false;
+    }
+    bp_select(selected);
+    return ok;
+}
+
 bool bp_scan(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t *count, status *s = NULL) {
     bool ok = true;
     // Make sure we can always read the status ourselves, even if our
@@ -332,12 +960,9 @@ bool bp_scan(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t *count, status *s = NUL
             break;
 
         if (crc != 0) {
-            Serial.print("Unique ID checksum error: ");
-            for (uint8_t i = 0; i < UNIQUE_ID_LENGTH; ++i) {
-                if (id[i] < 0x10) Serial.print("0");
-                Serial.print(id[i], HEX);
-            }
-            Serial.println();
+            eventlog_put(&bp_log, EVENT_ID_CHECKSUM, next_addr, micros());
+            for (uint8_t i = 0; i < UNIQUE_ID_LENGTH; ++i)
+                eventlog_put(&bp_log, EVENT_ID_BYTE, id[i], micros());
             return false;
         }
 
@@ -347,6 +972,99 @@ bool bp_scan(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t *count, status *s = NUL
     return ok;
 }
 
+// Maximum bp_retry_policy.id_count for which bp_retry() can rescan
+#define BP_RETRY_MAX_SLAVES 8
+
+// What bp_retry() does when a transaction fails
+struct bp_retry_policy {
+    // Number of attempts, including the first one
+    uint8_t attempts;
+    // Time to wait before the first retry, in ms, doubled for every
+    // next retry. This gives the bus time to recover from a line that
+    // was stuck low, or slaves that were reset by their watchdog.
+    uint16_t backoff;
+    // When not NULL, enumerate the bus again when a slave seems to have
+    // lost its address (e.g. in a brownout): two attempts in a row got
+    // no reply, and one of the known addresses does not ack either. A
+    // glitch usually only costs a single reply, and rescanning a
+    // glitchy bus can hand out wrong addresses, so this is only done
+    // when a slave is really missing. ids is the caller's id table, as
+    // filled by the last bp_scan(), which found id_count slaves (at
+    // most BP_RETRY_MAX_SLAVES). The rescan must find exactly the same
+    // ids in the same order, so every slave gets its old address back,
+    // otherwise bp_retry gives up. The table itself is never changed.
+    const uint8_t (*ids)[UNIQUE_ID_LENGTH];
+    uint8_t id_count;
+};
+
+// Can a transaction that failed with the given status succeed when it
+// is tried again? Nacks are only retried when the slave saw a
+// corrupted byte, any other error code would just be sent again.
+bool bp_retryable(const status *s) {
+    if (s->code == NACK)
+        return s->slave_code == ERR_PARITY || s->slave_code == ERR_PROTOCOL;
+    return s->code != OK;
+}
+
+// Returns true when one of the first count addresses does not ack
+bool bp_address_missing(uint8_t count) {
+    for (uint8_t addr = 0; addr < count; ++addr) {
+        status s = {OK, 0};
+        bp_reset(&s);
+        if (!bp_write_byte(addr, &s) && s.code == NO_ACK_OR_NACK)
+            return true;
+    }
+    return false;
+}
+
+// Enumerate the bus again, and check that it finds the slaves from the
+// policy at their old addresses. Returns false (with the scan status
+// in *s if the scan itself failed) otherwise.
+bool bp_rescan(const bp_retry_policy *policy, status *s) {
+    uint8_t found[BP_RETRY_MAX_SLAVES + 1][UNIQUE_ID_LENGTH];
+    uint8_t count = policy->id_count;
+    if (count > BP_RETRY_MAX_SLAVES)
+        return false;
+
+    status scan = {OK, 0};
+    if (!bp_scan(found, &count, &scan)) {
+        *s = scan;
+        return false;
+    }
+    return count == policy->id_count &&
+           !memcmp(found, policy->ids, count * UNIQUE_ID_LENGTH);
+}
+
+// Run a transaction until it succeeds, or the policy gives up. attempt
+// should do the complete transaction, starting with a bus reset, and
+// return true when it succeeded. Returns the result of the last
+// attempt, with its status in *s.
+bool bp_retry(const bp_retry_policy *policy, bool (*attempt)(void *arg, status *s), void *arg, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+
+    unsigned long backoff = policy->backoff;
+    uint8_t no_reply = 0;
+    for (uint8_t i = 1; ; ++i) {
+        s->code = OK;
+        s->slave_code = 0;
+        if (attempt(arg, s))
+            return true;
+        if (i >= policy->attempts || !bp_retryable(s))
+            return false;
+
+        delay(backoff);
+        backoff *= 2;
+        no_reply = s->code == NO_ACK_OR_NACK ? no_reply + 1 : 0;
+        if (policy->ids && no_reply >= 2 && bp_address_missing(policy->id_count)) {
+            if (!bp_rescan(policy, s))
+                return false;
+            no_reply = 0;
+        }
+    }
+}
+
 bool bp_read_eeprom(uint8_t addr, uint8_t offset, uint8_t *buf, uint8_t len) {
     bool ok = true;
     bp_reset();
@@ -370,46 +1088,816 @@ bool bp_write_eeprom(uint8_t addr, uint8_t offset, uint8_t *buf, uint8_t len) {
     return ok;
 }
 
+// Start a session with the given slave, by resetting the bus and
+// addressing the slave. After this, any number of (counted) commands
+// can be sent to the slave using the bp_session_* functions below,
+// without resetting the bus in between. The session ends when the
+// master stops sending bits (or resets the bus).
+bool bp_session_begin(uint8_t addr, status *status = NULL) {
+    bool ok = bp_reset(status);
+    return ok && bp_write_byte(addr, status);
+}
 
-void setup() {
-    Serial.begin(115200);
-    pinMode(3, OUTPUT);
-    digitalWrite(3, LOW);
+// Send a command in the current session. This lets the telemetry count
+// every command in a chained session separately.
+bool bp_session_command(uint8_t cmd, status *status = NULL) {
+    telemetry_command(&bp_telemetry, micros());
+    return bp_write_byte(cmd, status);
+}
 
-    #ifdef VCC_ENABLE
-    pinMode(VCC_ENABLE, OUTPUT);
-    digitalWrite(VCC_ENABLE, HIGH);
-    #endif
+// Switch the current session to the given mode (MODE_* values), which
+// takes effect from the next byte on. Slaves that do not support the
+// mode nack with ERR_UNSUPPORTED_MODE, which ends the session. Slaves
+// built without any modes nack with ERR_UNKNOWN_COMMAND.
+bool bp_session_set_mode(uint8_t mode, status *status = NULL) {
+    bool ok = true;
+    ok = ok && bp_session_command(CMD_SET_MODE, status);
+    ok = ok && bp_write_byte(mode, status);
+    if (ok)
+        bp_current->mode = mode;
+    return ok;
+}
 
-    randomSeed(analogRead(0));
+// Start a session like bp_session_begin and try to switch to the given
+// mode. If the slave does not support it, start a new session in the
+// standard mode instead. *mode is set to the mode actually used.
+bool bp_session_begin_mode(uint8_t addr, uint8_t *mode, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+
+    // Don't try a mode the slave is known not to support
+    const bp_capabilities *caps = bp_current->caps;
+    if (addr < lengthof(bp_current->caps) && caps[addr].known &&
+        (*mode & FEATURE_MODES & ~caps[addr].features)) {
+        *mode = 0;
+        return bp_session_begin(addr, s);
+    }
+
+    if (bp_session_begin(addr, s) && bp_session_set_mode(*mode, s))
+        return true;
+
+    // Slaves without any modes do not know CMD_SET_MODE at all
+    if (s->code != NACK || (s->slave_code != ERR_UNSUPPORTED_MODE &&
+                            s->slave_code != ERR_UNKNOWN_COMMAND))
+        return false;
+
+    s->code = OK;
+    *mode = 0;
+    return bp_session_begin(addr, s);
 }
 
-uint8_t eeprom_written = false;
+bool bp_session_read_eeprom(uint8_t offset, uint8_t *buf, uint8_t len, status *status = NULL) {
+    bool ok = true;
+    ok = ok && bp_session_command(CMD_READ_EEPROM_COUNTED, status);
+    ok = ok && bp_write_byte(len, status);
+    ok = ok && bp_write_byte(offset, status);
+    while (ok && len--)
+        ok = bp_read_byte(buf++, status);
+    return ok;
+}
 
-void print_scan_result(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t count) {
-    for (uint8_t i = 0; i < count; ++ i) {
-        Serial.print("Device "); Serial.print(i, HEX); Serial.print(" found with id: ");
-        for (uint8_t j = 0; j < UNIQUE_ID_LENGTH; ++j) {
-            if (result[i][j] < 0x10) Serial.print("0");
-                Serial.print(result[i][j], HEX);
-        }
-        Serial.println();
-    }
+bool bp_session_write_eeprom(uint8_t offset, const uint8_t *buf, uint8_t len, status *status = NULL) {
+    bool ok = true;
+    ok = ok && bp_session_command(CMD_WRITE_EEPROM_COUNTED, status);
+    ok = ok && bp_write_byte(len, status);
+    ok = ok && bp_write_byte(offset, status);
+    while (ok && len--)
+        ok = bp_write_byte(*buf++, status);
+    return ok;
 }
 
-void print_eeprom(uint8_t addr, uint8_t *buf, uint8_t len) {
-    Serial.print("Device "); Serial.print(addr, HEX); Serial.println(" EEPROM:");
-    Serial.print("  ");
-    while (len--) {
-        if (*buf < 0x10) Serial.print("0");
-        Serial.print(*buf++, HEX);
-    }
-    Serial.println();
+// Set the bits in mask in the EEPROM byte at offset, in the current
+// session. *old is set to the value of the byte before the change.
+// Slaves built without WITH_ATOMIC nack with ERR_UNKNOWN_COMMAND.
+bool bp_session_set_bits(uint8_t offset, uint8_t mask, uint8_t *old, status *status = NULL) {
+    bool ok = bp_session_command(CMD_SET_BITS, status);
+    ok = ok && bp_write_byte(offset, status);
+    ok = ok && bp_write_byte(mask, status);
+    return ok && bp_read_byte(old, status);
 }
 
-void test_println_status(const char *msg, const status *s) {
-    Serial.print(msg);
-    if (s->code < lengthof(error_code_str))
+// Clear the bits in mask in the EEPROM byte at offset, like
+// bp_session_set_bits
+bool bp_session_clear_bits(uint8_t offset, uint8_t mask, uint8_t *old, status *status = NULL) {
+    bool ok = bp_session_command(CMD_CLEAR_BITS, status);
+    ok = ok && bp_write_byte(offset, status);
+    ok = ok && bp_write_byte(mask, status);
+    return ok && bp_read_byte(old, status);
+}
+
+// Write value to the EEPROM byte at offset, but only when it contains
+// expected. *old is set to the value of the byte before, so the value
+// was written when *old == expected.
+bool bp_session_compare_swap(uint8_t offset, uint8_t expected, uint8_t value, uint8_t *old, status *status = NULL) {
+    bool ok = bp_session_command(CMD_COMPARE_SWAP, status);
+    ok = ok && bp_write_byte(offset, status);
+    ok = ok && bp_write_byte(expected, status);
+    ok = ok && bp_write_byte(value, status);
+    return ok && bp_read_byte(old, status);
+}
+
+// Read the EEPROM size of the slave in the current session. Slaves
+// built without WITH_WIDE nack with ERR_UNKNOWN_COMMAND.
+bool bp_session_read_eeprom_size(uint16_t *size, status *status = NULL) {
+    uint8_t high, low;
+    bool ok = bp_session_command(CMD_READ_EEPROM_SIZE, status);
+    ok = ok && bp_read_byte(&high, status);
+    ok = ok && bp_read_byte(&low, status);
+    if (ok)
+        *size = high << 8 | low;
+    return ok;
+}
+
+// Read len bytes from the EEPROM at a 16-bit offset, in the current
+// session. A single command transfers at most 255 bytes, so bigger
+// reads are split into several commands, chained in the same session.
+// Needs a slave with FEATURE_WIDE.
+bool bp_session_read_eeprom_wide(uint16_t offset, uint8_t *buf, uint16_t len, status *status = NULL) {
+    bool ok = true;
+    while (ok && len) {
+        uint8_t n = len > 0xff ? 0xff : len;
+        ok = bp_session_command(CMD_READ_EEPROM_WIDE, status);
+        ok = ok && bp_write_byte(n, status);
+        ok = ok && bp_write_byte(offset >> 8, status);
+        ok = ok && bp_write_byte(offset, status);
+        for (uint8_t i = 0; ok && i < n; ++i)
+            ok = bp_read_byte(buf++, status);
+        offset += n;
+        len -= n;
+    }
+    return ok;
+}
+
+// Write len bytes to the EEPROM at a 16-bit offset, like
+// bp_session_read_eeprom_wide
+bool bp_session_write_eeprom_wide(uint16_t offset, const uint8_t *buf, uint16_t len, status *status = NULL) {
+    bool ok = true;
+    while (ok && len) {
+        uint8_t n = len > 0xff ? 0xff : len;
+        ok = bp_session_command(CMD_WRITE_EEPROM_WIDE, status);
+        ok = ok && bp_write_byte(n, status);
+        ok = ok && bp_write_byte(offset >> 8, status);
+        ok = ok && bp_write_byte(offset, status);
+        for (uint8_t i = 0; ok && i < n; ++i)
+            ok = bp_write_byte(*buf++, status);
+        offset += n;
+        len -= n;
+    }
+    return ok;
+}
+
+// Read the diagnostic counters (STAT_COUNT bytes, STAT_* order) of the
+// slave in the current session. Slaves built without WITH_STATS nack
+// with ERR_UNKNOWN_COMMAND.
+bool bp_session_read_stats(uint8_t *stats, status *status = NULL) {
+    bool ok = bp_session_command(CMD_READ_STATS, status);
+    for (uint8_t i = 0; i < STAT_COUNT && ok; ++i)
+        ok = bp_read_byte(&stats[i], status);
+    return ok;
+}
+
+// Reset the diagnostic counters of the slave in the current session
+bool bp_session_clear_stats(status *status = NULL) {
+    return bp_session_command(CMD_CLEAR_STATS, status);
+}
+
+// Read the protocol minor version and the optional features (FEATURE_*
+// values) of the slave in the current session
+bool bp_session_read_capabilities(uint8_t *minor, uint8_t *features, status *status = NULL) {
+    bool ok = bp_session_command(CMD_READ_CAPABILITIES, status);
+    ok = ok && bp_read_byte(minor, status);
+    return ok && bp_read_byte(features, status);
+}
+
+// Read the capabilities of the given slave and cache them in the caps
+// of the current bus.
+// Slaves that nack with ERR_UNKNOWN_COMMAND run older firmware, they
+// are cached as minor version 0 without any features. For slaves with
+// FEATURE_WIDE, the EEPROM size is read as well.
+bool bp_discover(uint8_t addr, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+    if (addr >= lengthof(bp_current->caps))
+        return false;
+
+    bp_capabilities *caps = &bp_current->caps[addr];
+    bool ok = bp_session_begin(addr, s);
+    ok = ok && bp_session_read_capabilities(&caps->minor, &caps->features, s);
+    if (!ok && s->code == NACK && s->slave_code == ERR_UNKNOWN_COMMAND) {
+        s->code = OK;
+        caps->minor = 0;
+        caps->features = 0;
+        ok = true;
+    }
+    caps->eeprom_size = 0;
+    if (ok && (caps->features & FEATURE_WIDE))
+        ok = bp_session_read_eeprom_size(&caps->eeprom_size, s);
+    caps->known = ok;
+    return ok;
+}
+
+// Do the slaves with addresses below count all support the given
+// features, according to their cached capabilities?
+bool bp_all_support(uint8_t count, uint8_t features) {
+    const bp_capabilities *caps = bp_current->caps;
+    for (uint8_t addr = 0; addr < count; ++addr) {
+        if (addr >= lengthof(bp_current->caps) || !caps[addr].known ||
+            (caps[addr].features & features) != features)
+            return false;
+    }
+    return true;
+}
+
+// Return the fastest mode the given slave supports, according to its
+// cached capabilities. MODE_FEC is slower than the standard mode (it
+// only makes transfers more robust), so it is never returned.
+uint8_t bp_fastest_mode(uint8_t addr) {
+    const bp_capabilities *caps = bp_current->caps;
+    if (addr < lengthof(bp_current->caps) && caps[addr].known &&
+        (caps[addr].features & FEATURE_TERNARY))
+        return MODE_TERNARY;
+    return 0;
+}
+
+// Start a session like bp_session_begin, in the fastest mode the slave
+// supports
+bool bp_session_begin_fastest(uint8_t addr, status *status = NULL) {
+    uint8_t mode = bp_fastest_mode(addr);
+    if (!mode)
+        return bp_session_begin(addr, status);
+    return bp_session_begin_mode(addr, &mode, status);
+}
+
+// Return the EEPROM size of the given slave, as reported by a slave
+// with FEATURE_WIDE (and cached by bp_discover), or EEPROM_SIZE for
+// other slaves.
+uint16_t bp_eeprom_size(uint8_t addr) {
+    const bp_capabilities *caps = bp_current->caps;
+    if (addr < lengthof(bp_current->caps) && caps[addr].known &&
+        caps[addr].eeprom_size)
+        return caps[addr].eeprom_size;
+    return EEPROM_SIZE;
+}
+
+// Read the complete EEPROM of the given slave (bp_eeprom_size bytes)
+// into buf. EEPROMs that do not fit in a single read command are read
+// using 16-bit addresses.
+bool bp_read_eeprom_all(uint8_t addr, uint8_t *buf) {
+    uint16_t size = bp_eeprom_size(addr);
+    if (size > 0xff)
+        return bp_session_begin(addr) && bp_session_read_eeprom_wide(0, buf, size);
+    return bp_read_eeprom(addr, 0, buf, size);
+}
+
+// Write the same data to the EEPROM of all enumerated slaves at once.
+// Only slaves with FEATURE_BROADCAST take part, the others ignore the
+// command. Slaves that fail to write any of the bytes still write the
+// remaining bytes, but report their address at the end. These addresses are
+// stored in failed, the number of addresses in *count. *count should
+// contain the size of failed when calling this function.
+//
+// Returns true when the broadcast completed, even when some slaves
+// failed. When false is returned, the data might have been written to
+// some or all slaves.
+bool bp_broadcast_write_eeprom(uint8_t offset, const uint8_t *buf, uint8_t len, uint8_t *failed, uint8_t *count, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+
+    uint8_t max = *count;
+    *count = 0;
+
+    if (!bp_reset(s))
+        return false;
+    if (!bp_write_byte(BC_CMD_WRITE_EEPROM, s)) {
+        // No enumerated slaves on the bus
+        if (s->code == NO_ACK_OR_NACK) {
+            s->code = OK;
+            return true;
+        }
+        return false;
+    }
+
+    // Note that a nack for the offset (e.g., because the range is
+    // invalid for some slaves) is not expected to be unanimous, so
+    // this will typically show as ACK_AND_NACK
+    bool ok = true;
+    ok = ok && bp_write_byte(len, s);
+    ok = ok && bp_write_byte(offset, s);
+    if (!ok)
+        return false;
+
+    while (len--) {
+        // When no slave acks, all of them failed to write this byte,
+        // so just continue
+        if (!bp_write_byte(*buf++, s) && s->code != NO_ACK_OR_NACK)
+            return false;
+    }
+
+    // Read the addresses of the slaves that failed, until nobody
+    // responds anymore.
+    while (true) {
+        uint8_t addr;
+        if (!bp_read_byte(&addr, s)) {
+            if (s->code != NO_ACK_OR_NACK)
+                return false;
+            s->code = OK;
+            return true;
+        }
+        if (*count < max)
+            failed[(*count)++] = addr;
+    }
+}
+
+// Read the same EEPROM range from all enumerated slaves at once. Slaves
+// send their part in order of their address, so the part of the slave
+// with address n is stored at buf + n * len. buf should have room for
+// count * len bytes, where count is the number of enumerated slaves.
+//
+// When a slave does not respond (e.g., because it was removed since
+// enumeration, or lacks FEATURE_BROADCAST), its part is read as 0xff
+// and the other slaves still send theirs. Pass present to find out which slaves responded.
+bool bp_broadcast_read_eeprom(uint8_t offset, uint8_t *buf, uint8_t len, uint8_t count, bool *present = NULL, status *s = NULL) {
+    status s2 = {OK, 0};
+    if (!s)
+        s = &s2;
+
+    bool ok = true;
+    ok = ok && bp_reset(s);
+    ok = ok && bp_write_byte(BC_CMD_READ_EEPROM, s);
+    ok = ok && bp_write_byte(len, s);
+    if (!ok)
+        return false;
+
+    // Only the first slave acks the offset, the others are already
+    // waiting for their turn. If the first slave is missing, nobody
+    // acks.
+    if (!bp_write_byte(offset, s) && s->code != NO_ACK_OR_NACK)
+        return false;
+    s->code = OK;
+
+    for (uint8_t addr = 0; addr < count; ++addr) {
+        bool responded = false;
+        for (uint8_t i = 0; i < len; ++i) {
+            if (bp_read_byte(buf++, s))
+                responded = true;
+            else if (s->code != NO_ACK_OR_NACK)
+                return false;
+        }
+        s->code = OK;
+        if (present)
+            present[addr] = responded;
+    }
+    return true;
+}
+
+// Write the same data to the EEPROM of the slave with the given address
+// on each of the given buses, all at the same time (see bp_run_jobs).
+// This is meant for test fixtures that program many backpacks at once.
+// statuses gets the result for every bus. Returns true when all writes
+// succeeded. len can be at most BP_PARALLEL_WRITE_MAX, since the
+// command and data must fit in a single job, and count at most
+// BP_MAX_JOBS; otherwise, false is returned without touching statuses.
+#define BP_PARALLEL_WRITE_MAX (UINT8_MAX - 4)
+bool bp_parallel_write_eeprom(bp_bus *const *buses, uint8_t count, uint8_t addr, uint8_t offset, const uint8_t *buf, uint8_t len, status *statuses) {
+    if (len > BP_PARALLEL_WRITE_MAX || count > BP_MAX_JOBS)
+        return false;
+
+    uint8_t tx[4 + BP_PARALLEL_WRITE_MAX];
+    tx[0] = addr;
+    tx[1] = CMD_WRITE_EEPROM_COUNTED;
+    tx[2] = len;
+    tx[3] = offset;
+    memcpy(&tx[4], buf, len);
+
+    bp_job jobs[BP_MAX_JOBS];
+    for (uint8_t i = 0; i < count; ++i) {
+        jobs[i].bus = buses[i];
+        jobs[i].tx = tx;
+        jobs[i].tx_len = 4 + len;
+        jobs[i].rx = NULL;
+        jobs[i].rx_len = 0;
+    }
+    bool ok = bp_run_jobs(jobs, count);
+    for (uint8_t i = 0; i < count; ++i)
+        statuses[i] = jobs[i].result;
+    return ok;
+}
+
+// Read len bytes from the EEPROM of the slave with the given address
+// on each of the given buses, at the same time. buf gets len bytes for
+// every bus. Like bp_parallel_write_eeprom otherwise, but any len is
+// fine.
+bool bp_parallel_read_eeprom(bp_bus *const *buses, uint8_t count, uint8_t addr, uint8_t offset, uint8_t *buf, uint8_t len, status *statuses) {
+    const uint8_t tx[] = {addr, CMD_READ_EEPROM_COUNTED, len, offset};
+    if (count > BP_MAX_JOBS)
+        return false;
+
+    bp_job jobs[BP_MAX_JOBS];
+    for (uint8_t i = 0; i < count; ++i) {
+        jobs[i].bus = buses[i];
+        jobs[i].tx = tx;
+        jobs[i].tx_len = sizeof(tx);
+        jobs[i].rx = &buf[i * len];
+        jobs[i].rx_len = len;
+    }
+    bool ok = bp_run_jobs(jobs, count);
+    for (uint8_t i = 0; i < count; ++i)
+        statuses[i] = jobs[i].result;
+    return ok;
+}
+
+// Read the EEPROM layout of the given slave. Every byte is passed to
+// the parser as soon as it is received, so parsing overlaps the
+// transfer, and handler (if not NULL) is called for the header and
+// every descriptor as soon as they are complete.
+//
+// The bytes are read using a single read command, which is ended when
+// the parser has seen the checksum. Since the used EEPROM size is in
+// the header, only the used part of the EEPROM is transferred.
+//
+// Returns true when the complete layout was read and is valid. When
+// false is returned with an OK status, parser->error says what is
+// wrong with the EEPROM contents.
+bool bp_read_layout(uint8_t addr, layout_parser *parser, void (*handler)(const layout_parser *, layout_result), status *status = NULL) {
+    layout_result res = LAYOUT_MORE;
+    uint8_t b;
+
+    layout_init(parser);
+    bool ok = bp_session_begin_fastest(addr, status);
+    ok = ok && bp_write_byte(CMD_READ_EEPROM, status);
+    ok = ok && bp_write_byte(0, status);
+    while (ok && res != LAYOUT_DONE && res != LAYOUT_ERROR) {
+        ok = bp_read_byte(&b, status);
+        if (ok)
+            res = layout_feed(parser, b);
+        if (handler && (res == LAYOUT_HEADER || res == LAYOUT_DESCRIPTOR))
+            handler(parser, res);
+    }
+    return ok && res == LAYOUT_DONE;
+}
+
+// A series of bytes to write in a single (counted) write command
+struct bp_write_run {
+    uint8_t offset;
+    uint8_t len;
+};
+
+// Every run adds at least one unchanged byte between runs, so this is
+// enough to write anything that can be addressed with an 8-bit offset
+#define MAX_WRITE_RUNS (0x100 / 2 + 1)
+
+struct bp_write_plan {
+    bp_write_run runs[MAX_WRITE_RUNS];
+    uint8_t count;
+    // Bytes to send, including unchanged bytes between changes
+    uint8_t bytes;
+    // Bytes that are actually changed
+    uint8_t changed;
+    // Estimated time to execute the plan, in μs
+    unsigned long duration;
+};
+
+// Every run costs a command, count and offset byte. Between two
+// changed bytes, carrying up to this many unchanged bytes is cheaper
+// than starting a new run.
+#define WRITE_RUN_OVERHEAD 3
+
+// Plan writing target to the EEPROM of a slave, whose current contents
+// (e.g., a cached copy) are in current. Both are indexed by EEPROM
+// offset, only the len bytes starting at offset are considered. Only
+// changed bytes are written, except when carrying a few unchanged bytes
+// saves starting a new command. The unique id is read-only, so changes
+// to it are ignored.
+//
+// All runs are written in a single session using counted write
+// commands, so no bus resets are needed between runs. The estimated
+// duration is based on the timings of the current bus and assumes the slave does not
+// stall except for EEPROM writes.
+void bp_plan_write(const uint8_t *target, const uint8_t *current, uint8_t offset, uint8_t len, bp_write_plan *plan) {
+    bp_write_run *run = NULL;
+    uint8_t last_changed = 0;
+
+    plan->count = plan->bytes = plan->changed = 0;
+    for (uint8_t i = offset; i < offset + len; ++i) {
+        if (target[i] == current[i])
+            continue;
+        if (i >= UNIQUE_ID_OFFSET && i < UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH)
+            continue;
+
+        if (run && i - last_changed - 1 <= WRITE_RUN_OVERHEAD) {
+            // Carry the unchanged bytes in between
+            run->len = i - run->offset + 1;
+        } else {
+            run = &plan->runs[plan->count++];
+            run->offset = i;
+            run->len = 1;
+        }
+        last_changed = i;
+        plan->changed++;
+    }
+
+    for (uint8_t i = 0; i < plan->count; ++i)
+        plan->bytes += plan->runs[i].len;
+
+    plan->duration = 0;
+    if (plan->count) {
+        // Reset and address byte, then a counted command per run
+        unsigned long bytes = 1 + plan->count * WRITE_RUN_OVERHEAD + plan->bytes;
+        plan->duration = bp_current->timing->reset + bp_current->timing->next_bit;
+        plan->duration += bytes * BYTE_BITS * bp_current->timing->next_bit;
+        plan->duration += (unsigned long)plan->changed * EEPROM_WRITE_TIME;
+    }
+}
+
+// Execute a plan made by bp_plan_write, writing the bytes from target.
+bool bp_write_planned(uint8_t addr, const uint8_t *target, const bp_write_plan *plan, status *status = NULL) {
+    if (!plan->count)
+        return true;
+
+    bool ok = bp_session_begin(addr, status);
+    for (uint8_t i = 0; i < plan->count && ok; ++i) {
+        const bp_write_run *run = &plan->runs[i];
+        ok = bp_session_write_eeprom(run->offset, &target[run->offset], run->len, status);
+    }
+    return ok;
+}
+
+// A key/value store in the EEPROM space after the layout checksum,
+// which the layout leaves free for use by the scout.
+//
+// The store is an append-only log of records. Changing a value appends
+// a new record, so a frequent update is a single short write that
+// touches new cells every time, spreading wear over the free area. A
+// record consists of:
+//
+//   key (1 byte, 0xff is not a valid key)
+//   value length (1 byte, 0 means the key was deleted)
+//   sequence number (1 byte, increments with every record)
+//   value (0 or more bytes)
+//   CRC-8 over all of the above
+//
+// The log ends at the first 0xff byte where a key is expected, or at the
+// first record with an invalid CRC. When it is full, the log is
+// compacted: only the newest record for every key is kept, renumbered
+// to follow the newest sequence number, and the rest of the area is
+// erased to 0xff. Old records might remain after the compacted ones,
+// but those have older sequence numbers and are ignored. A delete
+// record is kept while older records for its key are still in the log,
+// so such leftovers cannot bring the value back.
+//
+// Compaction rewrites the area in place, there is no room for a second
+// copy. When it is interrupted (e.g. by a reset or bus error), the
+// record it was writing is left with an invalid CRC, which ends the
+// log. The keys whose records were not rewritten yet are then lost and
+// read back as not present.
+#define KV_KEY_FREE 0xff
+// Key, length, sequence number and CRC
+#define KV_RECORD_OVERHEAD 4
+// The end of the store comes from the layout header, which cannot
+// describe more than 255 bytes
+#define KV_MAX_END 0xff
+
+struct bp_kv_store {
+    uint8_t addr;
+    // The free area, [start, end)
+    uint8_t start;
+    uint8_t end;
+    // Offset of the first free byte
+    uint8_t head;
+    // Sequence number for the next record
+    uint8_t seq;
+    // How many times the log was compacted since opening
+    uint8_t compactions;
+    // The EEPROM contents, only the free area is used
+    uint8_t cache[KV_MAX_END];
+};
+
+uint8_t bp_kv_crc(const uint8_t *record, uint8_t len) {
+    uint8_t crc = 0;
+    while (len--)
+        crc = crc_update(UNIQUE_ID_CRC_POLY, crc, *record++);
+    return crc;
+}
+
+// Is sequence number a newer than b? Sequence numbers wrap around, but
+// since compaction renumbers the records it keeps, all records in the
+// area (including leftovers from an interrupted compaction) are at most
+// two logs worth of records apart, which is less than 128.
+bool bp_kv_newer(uint8_t a, uint8_t b) {
+    return (int8_t)(a - b) > 0;
+}
+
+// Find the offset of the newest valid record for the given key in the
+// cached log, or 0 when there is none. Also sets kv->head and kv->seq.
+uint8_t bp_kv_scan(bp_kv_store *kv, uint8_t key) {
+    uint8_t pos = kv->start;
+    uint8_t found = 0;
+    bool any = false;
+
+    while (kv->end - pos >= KV_RECORD_OVERHEAD) {
+        const uint8_t *r = &kv->cache[pos];
+        if (r[0] == KV_KEY_FREE || r[1] > kv->end - pos - KV_RECORD_OVERHEAD)
+            break;
+        uint8_t size = r[1] + KV_RECORD_OVERHEAD;
+        if (bp_kv_crc(r, size - 1) != r[size - 1])
+            break;
+
+        if (!any || bp_kv_newer(r[2] + 1, kv->seq))
+            kv->seq = r[2] + 1;
+        any = true;
+        if (r[0] == key && (!found || bp_kv_newer(r[2], kv->cache[found + 2])))
+            found = pos;
+        pos += size;
+    }
+    kv->head = pos;
+    return found;
+}
+
+// Open the store on the given slave. This reads the EEPROM layout to
+// find the free area and then reads the free area.
+bool bp_kv_open(bp_kv_store *kv, uint8_t addr, status *status = NULL) {
+    layout_parser parser;
+    if (!bp_read_layout(addr, &parser, NULL, status))
+        return false;
+
+    kv->addr = addr;
+    kv->start = parser.header.used_size;
+    kv->end = parser.header.eeprom_size;
+    if (kv->end > bp_eeprom_size(addr))
+        kv->end = bp_eeprom_size(addr);
+    kv->seq = 0;
+    kv->compactions = 0;
+
+    bool ok = bp_session_begin_fastest(addr, status);
+    ok = ok && bp_session_read_eeprom(kv->start, &kv->cache[kv->start], kv->end - kv->start, status);
+    if (ok)
+        bp_kv_scan(kv, KV_KEY_FREE);
+    return ok;
+}
+
+// Write new contents for the free area, which have been prepared in
+// image (at the same offsets as in the EEPROM). Only changed bytes are
+// written.
+bool bp_kv_write(bp_kv_store *kv, const uint8_t *image, status *status) {
+    bp_write_plan plan;
+    bp_plan_write(image, kv->cache, kv->start, kv->end - kv->start, &plan);
+    if (!bp_write_planned(kv->addr, image, &plan, status))
+        return false;
+    memcpy(&kv->cache[kv->start], &image[kv->start], kv->end - kv->start);
+    return true;
+}
+
+// Erase the free area, removing all keys
+bool bp_kv_format(bp_kv_store *kv, status *status = NULL) {
+    uint8_t image[KV_MAX_END];
+    memset(image, KV_KEY_FREE, sizeof(image));
+    if (!bp_kv_write(kv, image, status))
+        return false;
+    kv->head = kv->start;
+    return true;
+}
+
+// Is there a record for the given key in the log, other than the one at
+// offset skip?
+bool bp_kv_has_other(const bp_kv_store *kv, uint8_t key, uint8_t skip) {
+    for (uint8_t r = kv->start; r < kv->head; r += kv->cache[r + 1] + KV_RECORD_OVERHEAD) {
+        if (r != skip && kv->cache[r] == key)
+            return true;
+    }
+    return false;
+}
+
+// Prepare the compacted log in image (at the same offsets as in the
+// EEPROM), with only the newest record for every key, dropping deleted
+// keys once nothing older is left for them to hide. Returns the offset
+// of the first free byte in image.
+uint8_t bp_kv_compact_image(bp_kv_store *kv, uint8_t *image) {
+    uint8_t pos = kv->start;
+    uint8_t seq = kv->seq;
+    memset(image, KV_KEY_FREE, KV_MAX_END);
+
+    // Copy records in log order and renumber them after the newest
+    // record, so the kept records are never older than leftovers
+    for (uint8_t r = kv->start; r < kv->head; r += kv->cache[r + 1] + KV_RECORD_OVERHEAD) {
+        uint8_t size = kv->cache[r + 1] + KV_RECORD_OVERHEAD;
+        if (bp_kv_scan(kv, kv->cache[r]) != r)
+            continue;
+        if (!kv->cache[r + 1] && !bp_kv_has_other(kv, kv->cache[r], r))
+            continue;
+        memcpy(&image[pos], &kv->cache[r], size);
+        image[pos + 2] = seq++;
+        image[pos + size - 1] = bp_kv_crc(&image[pos], size - 1);
+        pos += size;
+    }
+    return pos;
+}
+
+// Write a log prepared by bp_kv_compact_image()
+bool bp_kv_compact(bp_kv_store *kv, const uint8_t *image, status *status) {
+    if (!bp_kv_write(kv, image, status))
+        return false;
+    kv->compactions++;
+    bp_kv_scan(kv, KV_KEY_FREE);
+    return true;
+}
+
+// Get the value for the given key. *len should contain the size of buf
+// and is set to the length of the value. Returns false when the key is
+// not present or buf is too small.
+bool bp_kv_get(bp_kv_store *kv, uint8_t key, uint8_t *buf, uint8_t *len) {
+    uint8_t r = bp_kv_scan(kv, key);
+    if (!r || !kv->cache[r + 1] || kv->cache[r + 1] > *len)
+        return false;
+    *len = kv->cache[r + 1];
+    memcpy(buf, &kv->cache[r + 3], *len);
+    return true;
+}
+
+// Set the value for the given key, by appending a record. A length of 0
+// deletes the key. Returns false when the value does not fit (even after
+// compaction), without writing anything or changing the status, or on a
+// bus error.
+bool bp_kv_set(bp_kv_store *kv, uint8_t key, const uint8_t *value, uint8_t len, status *status = NULL) {
+    if (key == KV_KEY_FREE || len > kv->end - kv->start - KV_RECORD_OVERHEAD)
+        return false;
+    uint8_t size = len + KV_RECORD_OVERHEAD;
+
+    // Only compact when that makes enough room, since every compaction
+    // wears the EEPROM and risks losing keys
+    if (size > kv->end - kv->head) {
+        uint8_t image[KV_MAX_END];
+        if (size > kv->end - bp_kv_compact_image(kv, image))
+            return false;
+        if (!bp_kv_compact(kv, image, status))
+            return false;
+    }
+
+    uint8_t *r = &kv->cache[kv->head];
+    uint8_t record[KV_MAX_END];
+    record[0] = key;
+    record[1] = len;
+    record[2] = kv->seq;
+    if (len)
+        memcpy(&record[3], value, len);
+    record[size - 1] = bp_kv_crc(record, size - 1);
+
+    bool ok = bp_session_begin(kv->addr, status);
+    ok = ok && bp_session_write_eeprom(kv->head, record, size, status);
+    if (!ok)
+        return false;
+    memcpy(r, record, size);
+    kv->head += size;
+    kv->seq++;
+    return true;
+}
+
+// Delete the given key
+bool bp_kv_delete(bp_kv_store *kv, uint8_t key, status *status = NULL) {
+    return bp_kv_set(kv, key, NULL, 0, status);
+}
+
+void setup() {
+    Serial.begin(115200);
+    pinMode(3, OUTPUT);
+    digitalWrite(3, LOW);
+
+    #ifdef VCC_ENABLE
+    pinMode(VCC_ENABLE, OUTPUT);
+    digitalWrite(VCC_ENABLE, HIGH);
+    #endif
+
+    randomSeed(analogRead(0));
+}
+
+uint8_t eeprom_written = false;
+
+void print_scan_result(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t count) {
+    for (uint8_t i = 0; i < count; ++ i) {
+        Serial.print("Device "); Serial.print(i, HEX); Serial.print(" found with id: ");
+        for (uint8_t j = 0; j < UNIQUE_ID_LENGTH; ++j) {
+            if (result[i][j] < 0x10) Serial.print("0");
+                Serial.print(result[i][j], HEX);
+        }
+        Serial.println();
+    }
+}
+
+void print_eeprom(uint8_t addr, uint8_t *buf, uint16_t len) {
+    Serial.print("Device "); Serial.print(addr, HEX); Serial.println(" EEPROM:");
+    Serial.print("  ");
+    while (len--) {
+        if (*buf < 0x10) Serial.print("0");
+        Serial.print(*buf++, HEX);
+    }
+    Serial.println();
+}
+
+void test_println_status(const char *msg, const status *s) {
+    Serial.print(msg);
+    if (s->code < lengthof(error_code_str))
         Serial.print(error_code_str[s->code]);
     else
         Serial.print(s->code);
@@ -417,160 +1905,1387 @@ void test_println_status(const char *msg, const status *s) {
         Serial.print(", slave error code: 0x");
         Serial.print(s->slave_code, HEX);
     }
-    Serial.println();
-}
+    Serial.println();
+}
+
+void print_layout_item(const layout_parser *p, layout_result res) {
+    if (res == LAYOUT_HEADER) {
+        const layout_header *h = &p->header;
+        Serial.print("  Backpack: "); Serial.print(h->name);
+        Serial.print(", model: 0x"); Serial.print(h->model, HEX);
+        Serial.print(", revision: "); Serial.print(h->hardware_revision);
+        Serial.print(", serial: "); Serial.print(h->serial);
+        Serial.print(", used: "); Serial.print(h->used_size);
+        Serial.print("/"); Serial.println(h->eeprom_size);
+    } else {
+        const layout_descriptor *d = &p->desc;
+        Serial.print("  Descriptor 0x"); Serial.print(d->type, HEX);
+        Serial.print(" at 0x"); Serial.print(d->offset, HEX);
+        Serial.print(", "); Serial.print(d->length); Serial.print(" bytes");
+        if (d->name[0]) {
+            Serial.print(": ");
+            Serial.print(d->name);
+        }
+        Serial.println();
+    }
+}
+
+void print_layout(uint8_t addr) {
+    layout_parser parser;
+    status s = {OK};
+    if (!bp_read_layout(addr, &parser, print_layout_item, &s)) {
+        // Not a failure, the tests below overwrite the EEPROM with
+        // random data
+        if (s.code != OK)
+            test_println_status("  Layout read failed: ", &s);
+        else {
+            Serial.print("  Invalid layout: ");
+            Serial.println(layout_error_str[parser.error]);
+        }
+    }
+}
+
+void print_telemetry_entry(const telemetry_entry *e) {
+    Serial.print("  0x");
+    if (e->addr < 0x10) Serial.print("0");
+    Serial.print(e->addr, HEX);
+    if (e->cmd == TELEMETRY_NO_COMMAND) {
+        Serial.print("     ");
+    } else {
+        Serial.print(" 0x");
+        if (e->cmd < 0x10) Serial.print("0");
+        Serial.print(e->cmd, HEX);
+    }
+    Serial.print(": ");
+    Serial.print(e->transactions);
+    Serial.print(" transactions, ");
+    Serial.print(e->retries);
+    Serial.print(" retries, ");
+    Serial.print(e->bytes);
+    Serial.print(" bytes, ");
+    Serial.print(e->stall_bits);
+    Serial.print(" stall bits, latency avg/max ");
+    Serial.print(e->transactions ? e->latency_total / e->transactions : 0);
+    Serial.print("/");
+    Serial.print(e->latency_max);
+    Serial.println("us");
+
+    Serial.print("   ");
+    for (uint8_t r = 0; r < TELEMETRY_RESULTS; ++r) {
+        if (!e->results[r])
+            continue;
+        Serial.print(" ");
+        Serial.print(telemetry_result_str[r]);
+        Serial.print(": ");
+        Serial.print(e->results[r]);
+        if (r == TELEMETRY_NACK) {
+            Serial.print(" (last 0x");
+            Serial.print(e->last_nack, HEX);
+            Serial.print(")");
+        }
+    }
+    Serial.print(", histogram:");
+    for (uint8_t b = 0; b < TELEMETRY_BUCKETS; ++b) {
+        Serial.print(" ");
+        Serial.print(e->latency[b]);
+    }
+    Serial.println();
+}
+
+void print_telemetry() {
+    Serial.println("Bus telemetry:");
+    telemetry_end(&bp_telemetry);
+    for (uint8_t i = 0; i < bp_telemetry.used; ++i)
+        print_telemetry_entry(&bp_telemetry.entries[i]);
+    if (bp_telemetry.dropped) {
+        Serial.print("  ");
+        Serial.print(bp_telemetry.dropped);
+        Serial.println(" transactions not tracked");
+    }
+}
+
+void test_progress(const char *msg, const uint8_t *b, const status *s) {
+    Serial.print('\t');
+    Serial.print(msg);
+    if (b) {
+        Serial.print("0x");
+        Serial.print(*b, HEX);
+    }
+    if (s)
+        test_println_status(" - Status: ", s);
+    else
+        Serial.println();
+}
+
+void test_progress(const char *msg, const status *s = NULL) {
+    test_progress(msg, NULL, s);
+}
+
+void test_progress(const char *msg, uint8_t b, const status *s = NULL) {
+    test_progress(msg, &b, s);
+}
+
+// Like test_progress, but for a (decimal) number that might not fit in
+// a byte
+void test_progress_number(const char *msg, unsigned long n, const status *s = NULL) {
+    Serial.print('\t');
+    Serial.print(msg);
+    Serial.print(n);
+    if (s)
+        test_println_status(" - Status: ", s);
+    else
+        Serial.println();
+}
+
+void test_start(const char *msg) {
+    bp_log_drain();
+    Serial.println();
+    Serial.println(msg);
+}
+
+void test_print_failed(const char *msg, const status *s = NULL, const status *expected = NULL) {
+    bp_log_drain();
+    Serial.print("---> ");
+    Serial.println(msg);
+    if (s)
+        test_println_status("---> Status was: ", s);
+    if (expected)
+        test_println_status("---> Expected: ", expected);
+
+    while(Serial.read() != -1) /* Do nothing */;
+    Serial.println("---> Press a key to continue testing");
+    while(Serial.read() == -1) /* Do nothing */;
+}
+
+bool test_check_status(const status *s, const status *expected) {
+    if (s->code != expected->code) {
+        test_print_failed("Unexpected status", s, expected);
+        return false;
+    } else if (expected->code == NACK && s->slave_code != expected->slave_code) {
+        test_print_failed("Unexpected slave error code", s, expected);
+        return false;
+    }
+    return true;
+}
+
+bool test_check_value(const char *msg, uint8_t value, uint8_t expected) {
+    if (value == expected)
+        return true;
+    Serial.print("---> ");
+    Serial.print(msg);
+    Serial.print(": 0x");
+    Serial.print(value, HEX);
+    Serial.print(", expected 0x");
+    Serial.println(expected, HEX);
+    test_print_failed("Unexpected value");
+    return false;
+}
+
+bool test_scan(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t *count) {
+    status s = {OK};
+    status expect_ok = {OK};
+    bp_scan(result, count, &s);
+    return test_check_status(&s, &expect_ok);
+}
+
+bool test_reset() {
+    status s = {OK};
+    bp_current->parity_error_left = parity_error_byte;
+    if (!bp_reset(&s)) {
+        test_print_failed("Reset failed", &s);
+        return false;
+    }
+    test_progress("Reset", &s);
+    return true;
+}
+
+bool test_read_byte(uint8_t *b, status *expected) {
+    status s = {OK};
+    bool ok = bp_read_byte(b, &s);
+    if (ok)
+        test_progress("Read byte: ", *b, &s);
+    else
+        test_progress("Failed to read byte", &s);
+
+    return test_check_status(&s, expected);
+}
+
+bool test_empty_bus();
+
+bool test_write_byte(uint8_t b, status *expected, const char *msg = NULL) {
+    status s = {OK};
+    if (bp_current->parity_error_left-- == 0 && expected->code != NO_ACK_OR_NACK) {
+        status expect_parity = {NACK, ERR_PARITY};
+        bp_write_byte(b, &s, true);
+        test_progress("Introducing parity error in next byte");
+        test_progress(msg ? : "Written byte: ", b, &s);
+        bool ok = test_check_status(&s, &expect_parity);
+        ok = ok && test_empty_bus();
+        // Even if the parity error was handled as expected, don't
+        // continue with the rest of the testcase
+        return false;
+    } else {
+        bp_write_byte(b, &s);
+        test_progress(msg ? : "Written byte: ", b, &s);
+        return test_check_status(&s, expected);
+    }
+}
+
+bool test_address(uint8_t addr, status *expected) {
+    return test_write_byte(addr, expected, "Sending address: ");
+}
+
+bool test_cmd(uint8_t addr, uint8_t cmd, status *expected) {
+    status expect_ok = {OK};
+    bool ok = test_address(addr, &expect_ok);
+    return ok && test_write_byte(cmd, expected, "Sending command: ");
+}
+
+bool test_empty_bus() {
+    status expect_no_reply = {NO_ACK_OR_NACK};
+    uint8_t b;
+    return test_read_byte(&b, &expect_no_reply);
+}
+
+bool test_timeout() {
+    while(micros() - bp_current->bit_start < NEXT_BIT_TIMEOUT) /* wait */;
+    return test_empty_bus();
+}
+
+void test_write_eeprom(uint8_t addr, uint8_t eeprom_addr, uint8_t len) {
+    test_start("Write the EEPROM");
+    status expect_ok = {OK, 0};
+
+    bool ok = test_reset();
+    ok = ok && test_cmd(addr, CMD_WRITE_EEPROM, &expect_ok);
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint8_t i = 0; i < len && ok; ++i) {
+        uint8_t b = random(0, 256);
+        ok = ok && test_write_byte(b, &expect_ok);
+        if (ok)
+            eeproms[addr][eeprom_addr + i] = b;
+    }
+}
+
+void test_read_eeprom(uint8_t addr, uint8_t eeprom_addr, uint16_t len) {
+    test_start("Read a piece of EEPROM");
+    status expect_ok = {OK, 0};
+
+    bool ok = test_reset();
+    ok = ok && test_cmd(addr, CMD_READ_EEPROM, &expect_ok);
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint16_t i = 0; i < len && ok; ++i) {
+        uint8_t b;
+        ok = ok && test_read_byte(&b, &expect_ok);
+        if (ok && b != eeproms[addr][eeprom_addr + i]) {
+            test_print_failed("EEPROM contents did not match");
+            ok = false;
+        }
+    }
+}
+
+void test_chained(uint8_t addr, uint8_t eeprom_addr, uint8_t len) {
+    test_start("Chain counted commands in a single transaction");
+    status expect_ok = {OK, 0};
+    status expect_invalid_read = {NACK, ERR_READ_EEPROM_INVALID_ADDRESS};
+    uint8_t b;
+
+    bool ok = test_reset();
+    ok = ok && test_address(addr, &expect_ok);
+    for (uint8_t round = 0; round < 2 && ok; ++round) {
+        // Read some bytes
+        ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+        ok = ok && test_write_byte(len, &expect_ok, "Sending count: ");
+        ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+        for (uint8_t i = 0; i < len && ok; ++i) {
+            ok = ok && test_read_byte(&b, &expect_ok);
+            if (ok && b != eeproms[addr][eeprom_addr + i]) {
+                test_print_failed("EEPROM contents did not match");
+                ok = false;
+            }
+        }
+
+        // Write the last byte read with a new value (the next round
+        // reads it back)
+        b = random(0, 256);
+        ok = ok && test_write_byte(CMD_WRITE_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+        ok = ok && test_write_byte(1, &expect_ok, "Sending count: ");
+        ok = ok && test_write_byte(eeprom_addr + len - 1, &expect_ok);
+        ok = ok && test_write_byte(b, &expect_ok);
+        if (ok)
+            eeproms[addr][eeprom_addr + len - 1] = b;
+
+        // An empty read should be accepted as well
+        ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+        ok = ok && test_write_byte(0, &expect_ok, "Sending count: ");
+        ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    }
+
+    // Reading past the end should be refused up front. When the count
+    // to get there does not fit in a byte, just end the transaction.
+    uint16_t past_end = bp_eeprom_size(addr) - eeprom_addr + 1;
+    if (past_end <= 0xff) {
+        ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+        ok = ok && test_write_byte(past_end, &expect_ok, "Sending count: ");
+        ok = ok && test_write_byte(eeprom_addr, &expect_invalid_read);
+    } else {
+        ok = ok && test_reset();
+    }
+    ok = ok && test_empty_bus();
+}
+
+void test_fec(uint8_t addr, uint8_t eeprom_addr) {
+    test_start("Correct bit errors in MODE_FEC");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_parity = {NACK, ERR_PARITY};
+    uint8_t mode = MODE_FEC;
+    uint8_t data[4];
+
+    // Don't introduce parity errors, a single flipped parity bit would
+    // just be corrected
+    bp_current->parity_error_left = -1;
+
+    bool ok = bp_session_begin_mode(addr, &mode, &s);
+    test_progress("Start session in MODE_FEC", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && !mode) {
+        test_progress("MODE_FEC not supported, skipping");
+        return;
+    }
+
+    // Write bytes with a single flipped bit each, which should be
+    // corrected by the slave
+    ok = ok && test_write_byte(CMD_WRITE_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    ok = ok && test_write_byte(sizeof(data), &expect_ok, "Sending count: ");
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint8_t i = 0; i < sizeof(data) && ok; ++i) {
+        data[i] = random(0, 256);
+        uint8_t flip = 1 << random(0, 8);
+        bp_write_byte(data[i], &s, false, flip);
+        test_progress("Written byte with flipped bit: ", data[i], &s);
+        ok = test_check_status(&s, &expect_ok);
+        if (ok)
+            eeproms[addr][eeprom_addr + i] = data[i];
+    }
+
+    // Read them back
+    ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    ok = ok && test_write_byte(sizeof(data), &expect_ok, "Sending count: ");
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint8_t i = 0; i < sizeof(data) && ok; ++i) {
+        uint8_t b;
+        ok = ok && test_read_byte(&b, &expect_ok);
+        if (ok && b != data[i]) {
+            test_print_failed("EEPROM contents did not match");
+            ok = false;
+        }
+    }
+
+    // Two flipped bits cannot be corrected and should be nacked
+    ok = ok && test_write_byte(CMD_WRITE_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    ok = ok && test_write_byte(1, &expect_ok, "Sending count: ");
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    if (ok) {
+        uint8_t b = ~data[0];
+        bp_write_byte(b, &s, false, 0x81);
+        test_progress("Written byte with two flipped bits: ", b, &s);
+        ok = test_check_status(&s, &expect_parity);
+    }
+    ok = ok && test_empty_bus();
+}
+
+void test_progress_stats(const char *msg, const uint8_t *stats, const status *s) {
+    Serial.print('\t');
+    Serial.print(msg);
+    for (uint8_t i = 0; i < STAT_COUNT; ++i) {
+        Serial.print(' ');
+        Serial.print(stats[i]);
+    }
+    test_println_status(" - Status: ", s);
+}
+
+void test_stats(uint8_t addr) {
+    test_start("Diagnostic counters");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_parity = {NACK, ERR_PARITY};
+    uint8_t stats[STAT_COUNT] = {0};
+
+    // Only the parity error introduced below should be counted
+    bp_current->parity_error_left = -1;
+
+    bool ok = bp_session_begin(addr, &s) && bp_session_read_stats(stats, &s);
+    if (s.code == NACK && s.slave_code == ERR_UNKNOWN_COMMAND) {
+        test_progress("Counters not supported, skipping", &s);
+        return;
+    }
+    test_progress_stats("Read counters:", stats, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+
+    // Clear and read them again, in the same session
+    ok = ok && bp_session_clear_stats(&s);
+    ok = ok && bp_session_read_stats(stats, &s);
+    test_progress_stats("Cleared counters:", stats, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && (stats[STAT_PARITY] || stats[STAT_COLLISION] || stats[STAT_WATCHDOG])) {
+        test_print_failed("Counters not cleared");
+        ok = false;
+    }
+
+    // Send a command with a parity error, which should be counted
+    ok = ok && test_reset();
+    ok = ok && test_address(addr, &expect_ok);
+    if (ok) {
+        bp_write_byte(CMD_READ_STATS, &s, true);
+        test_progress("Written command with parity error", &s);
+        ok = test_check_status(&s, &expect_parity);
+    }
+
+    s.code = OK;
+    ok = ok && bp_session_begin(addr, &s) && bp_session_read_stats(stats, &s);
+    test_progress_stats("Read counters:", stats, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && stats[STAT_PARITY] != 1) {
+        test_print_failed("Parity error not counted");
+        ok = false;
+    }
+    // The slave waits for another command, until it times out
+    ok = ok && test_timeout();
+}
+
+bool test_telemetry_check(const char *msg, uint32_t value, uint32_t expected) {
+    if (value == expected)
+        return true;
+    Serial.print("---> ");
+    Serial.print(msg);
+    Serial.print(": ");
+    Serial.print(value);
+    Serial.print(", expected ");
+    Serial.println(expected);
+    test_print_failed("Unexpected telemetry");
+    return false;
+}
+
+void test_capabilities(uint8_t addr) {
+    test_start("Capability discovery");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_unsupported = {NACK, ERR_UNSUPPORTED_MODE};
+    status expect_unknown = {NACK, ERR_UNKNOWN_COMMAND};
+    uint8_t b;
+
+    bp_current->parity_error_left = -1;
+    bool ok = bp_discover(addr, &s);
+    const bp_capabilities *caps = &bp_current->caps[addr];
+    test_progress("Minor version: ", caps->minor, &s);
+    test_progress("Features: ", caps->features);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (!caps->known || caps->minor != PROTOCOL_MINOR_VERSION) {
+        test_print_failed("Unexpected minor version");
+        return;
+    }
+
+    // Every mode should be accepted exactly when it is advertised.
+    // Slaves without any modes do not know CMD_SET_MODE.
+    const status *unsupported = (caps->features & FEATURE_MODES) ? &expect_unsupported : &expect_unknown;
+    for (uint8_t mode = MODE_FEC; mode <= MODE_TERNARY && ok; mode <<= 1) {
+        s.code = OK;
+        bp_session_begin(addr, &s) && bp_session_set_mode(mode, &s);
+        test_progress("Set mode: ", mode, &s);
+        ok = test_check_status(&s, (caps->features & mode) ? &expect_ok : unsupported);
+    }
+
+    s.code = OK;
+    uint8_t stats[STAT_COUNT];
+    bp_session_begin(addr, &s) && bp_session_read_stats(stats, &s);
+    test_progress("Read counters", &s);
+    ok = ok && test_check_status(&s, (caps->features & FEATURE_STATS) ? &expect_ok : &expect_unknown);
+
+    // Setting no bits at all does not change anything
+    s.code = OK;
+    bp_session_begin(addr, &s) && bp_session_set_bits(0, 0, &b, &s);
+    test_progress("Set no bits", &s);
+    ok = ok && test_check_status(&s, (caps->features & FEATURE_ATOMIC) ? &expect_ok : &expect_unknown);
+
+    s.code = OK;
+    uint16_t size = 0;
+    bp_session_begin(addr, &s) && bp_session_read_eeprom_size(&size, &s);
+    test_progress("Read EEPROM size", &s);
+    ok = ok && test_check_status(&s, (caps->features & FEATURE_WIDE) ? &expect_ok : &expect_unknown);
+    if (ok && (caps->features & FEATURE_WIDE) &&
+        (size != caps->eeprom_size || size < EEPROM_SIZE || size > MAX_EEPROM_SIZE)) {
+        test_print_failed("Unexpected EEPROM size");
+        ok = false;
+    }
+
+    // The slave should accept another command afterwards
+    s.code = OK;
+    uint8_t minor, features;
+    ok = ok && bp_session_begin(addr, &s);
+    ok = ok && bp_session_read_capabilities(&minor, &features, &s);
+    ok = ok && bp_session_read_eeprom(0, &b, 1, &s);
+    test_progress("Chained read after capabilities: ", b, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && (minor != caps->minor || features != caps->features)) {
+        test_print_failed("Capabilities changed");
+        ok = false;
+    }
+    ok = ok && test_timeout();
+}
+
+void test_atomic(uint8_t addr, uint8_t eeprom_addr) {
+    test_start("Atomic EEPROM updates");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_invalid_write = {NACK, ERR_WRITE_EEPROM_INVALID_ADDRESS};
+    status expect_read_only = {NACK, ERR_WRITE_EEPROM_READ_ONLY};
+    uint8_t start = random(0, 256);
+    uint8_t mask = random(1, 256);
+    // Only printed when the command succeeded
+    uint8_t old, b;
+
+    bp_current->parity_error_left = -1;
+    bool ok = bp_session_begin(addr, &s) && bp_session_write_eeprom(eeprom_addr, &start, 1, &s);
+    // Track this write right away, slaves without the atomic commands
+    // skip the rest of the test
+    if (ok)
+        eeproms[addr][eeprom_addr] = start;
+    ok = ok && bp_session_set_bits(eeprom_addr, mask, &old, &s);
+    if (s.code == NACK && s.slave_code == ERR_UNKNOWN_COMMAND) {
+        test_progress("Atomic commands not supported, skipping", &s);
+        return;
+    }
+    test_progress("Set bits, old value: ", ok ? &old : NULL, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("Old value", old, start);
+    uint8_t expected = start | mask;
+
+    // Chained in the same session
+    ok = ok && bp_session_clear_bits(eeprom_addr, mask, &old, &s);
+    test_progress("Clear bits, old value: ", ok ? &old : NULL, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("Old value", old, expected);
+    expected &= ~mask;
+
+    // A compare-and-swap with the wrong expected value changes nothing
+    ok = ok && bp_session_compare_swap(eeprom_addr, ~expected, start, &old, &s);
+    test_progress("Failed compare-and-swap, old value: ", ok ? &old : NULL, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("Old value", old, expected);
+
+    ok = ok && bp_session_compare_swap(eeprom_addr, expected, start, &old, &s);
+    test_progress("Compare-and-swap, old value: ", ok ? &old : NULL, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("Old value", old, expected);
+
+    ok = ok && bp_session_read_eeprom(eeprom_addr, &b, 1, &s);
+    test_progress("Read back: ", ok ? &b : NULL, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("EEPROM contents", b, start);
+
+    // Read-only bytes can only be "changed" to their current value
+    uint8_t id_addr = UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH);
+    ok = ok && bp_session_set_bits(id_addr, 0, &old, &s);
+    test_progress("Set no bits in read-only byte", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok) {
+        bp_session_compare_swap(id_addr, old, ~old, &b, &s);
+        test_progress("Compare-and-swap read-only byte", &s);
+        ok = test_check_status(&s, &expect_read_only);
+    }
+
+    // With 8-bit addresses, there is only an invalid address to try
+    // on slaves with less than 256 bytes of EEPROM
+    uint16_t size = bp_eeprom_size(addr);
+    s.code = OK;
+    if (ok && size < 0x100) {
+        bp_session_begin(addr, &s) && bp_session_clear_bits(random(size, 0x100), mask, &old, &s);
+        test_progress("Clear bits at invalid address", &s);
+        ok = test_check_status(&s, &expect_invalid_write);
+    }
+    ok = ok && test_empty_bus();
+}
+
+void test_wide(uint8_t addr) {
+    test_start("16-bit EEPROM addresses");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_invalid_read = {NACK, ERR_READ_EEPROM_INVALID_ADDRESS};
+    uint8_t buf[MAX_EEPROM_SIZE], b;
+    uint16_t size = 0;
+
+    bp_current->parity_error_left = -1;
+    bool ok = bp_session_begin(addr, &s) && bp_session_read_eeprom_size(&size, &s);
+    if (s.code == NACK && s.slave_code == ERR_UNKNOWN_COMMAND) {
+        test_progress("16-bit addresses not supported, skipping", &s);
+        return;
+    }
+    test_progress_number("EEPROM size: ", size, &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && (size < EEPROM_SIZE || size > MAX_EEPROM_SIZE)) {
+        test_print_failed("Unexpected EEPROM size");
+        return;
+    }
+
+    uint16_t offset = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size);
+    uint16_t len = random(1, size - offset + 1);
+    for (uint16_t i = 0; i < len; ++i)
+        buf[i] = random(0, 256);
+
+    // Chained in the same session
+    ok = ok && bp_session_write_eeprom_wide(offset, buf, len, &s);
+    test_progress("Write", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok)
+        memcpy(&eeproms[addr][offset], buf, len);
+
+    ok = ok && bp_session_read_eeprom_wide(0, buf, size, &s);
+    test_progress("Read", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && memcmp(buf, eeproms[addr], size)) {
+        test_print_failed("EEPROM contents differ");
+        ok = false;
+    }
+
+    // Commands with an 8-bit address should not be affected by the
+    // previous high byte
+    if (ok) {
+        ok = bp_session_read_eeprom(offset & 0xff, &b, 1, &s);
+        test_progress("Chained 8-bit read: ", b, &s);
+    }
+    ok = ok && test_check_status(&s, &expect_ok);
+    ok = ok && test_check_value("EEPROM contents", b, eeproms[addr][offset & 0xff]);
+
+    // The high byte should not be ignored: this has the same low byte,
+    // but is past the end
+    s.code = OK;
+    if (ok) {
+        uint16_t past = ((size + 0xff) & ~0xff) | (offset & 0xff);
+        bp_session_begin(addr, &s) && bp_session_read_eeprom_wide(past, buf, 1, &s);
+        test_progress("Read past the end", &s);
+        ok = test_check_status(&s, &expect_invalid_read);
+    }
+
+    // Neither should the count (this is a single command, so nothing is
+    // written)
+    s.code = OK;
+    if (ok) {
+        bp_session_begin(addr, &s) && bp_session_write_eeprom_wide(size - 1, buf, 2, &s);
+        test_progress("Write past the end", &s);
+        ok = test_check_status(&s, &expect_invalid_read);
+    }
+    ok = ok && test_empty_bus();
+}
+
+void test_telemetry(uint8_t addr) {
+    test_start("Master telemetry");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    status expect_unknown = {NACK, ERR_UNKNOWN_COMMAND};
+    uint8_t buf[4];
+
+    bp_current->parity_error_left = -1;
+    telemetry_init(&bp_telemetry);
+
+    // Two commands in a single session, counted separately
+    bool ok = bp_session_begin(addr, &s);
+    ok = ok && bp_session_read_eeprom(0, buf, 4, &s);
+    ok = ok && bp_session_read_eeprom(4, buf, 2, &s);
+    test_progress("Read EEPROM twice in one session", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+
+    // The same failing command twice, the second counts as a retry
+    for (uint8_t i = 0; i < 2 && ok; ++i) {
+        ok = test_reset();
+        ok = ok && test_cmd(addr, CMD_RESERVED, &expect_unknown);
+    }
+    telemetry_end(&bp_telemetry);
+    if (!ok)
+        return;
 
-void test_progress(const char *msg, const uint8_t *b, const status *s) {
-    Serial.print('\t');
-    Serial.print(msg);
-    if (b) {
-        Serial.print("0x");
-        Serial.print(*b, HEX);
+    const telemetry_entry *e = telemetry_find(&bp_telemetry, addr, CMD_READ_EEPROM_COUNTED);
+    if (!e) {
+        test_print_failed("No telemetry for read command");
+        return;
     }
-    if (s)
-        test_println_status(" - Status: ", s);
-    else
-        Serial.println();
+    // Address, command, length, offset and four data bytes, then
+    // command, length, offset and two data bytes
+    ok = ok && test_telemetry_check("Read transactions", e->transactions, 2);
+    ok = ok && test_telemetry_check("Read ok", e->results[TELEMETRY_OK], 2);
+    ok = ok && test_telemetry_check("Read bytes", e->bytes, 13);
+    ok = ok && test_telemetry_check("Read retries", e->retries, 0);
+
+    uint16_t binned = 0;
+    for (uint8_t b = 0; b < TELEMETRY_BUCKETS; ++b)
+        binned += e->latency[b];
+    ok = ok && test_telemetry_check("Read latencies", binned, 2);
+    // Every byte takes at least BYTE_BITS bit slots
+    if (ok && e->latency_max < 8ul * BYTE_BITS * bp_current->timing->next_bit) {
+        test_print_failed("Read latency too short");
+        ok = false;
+    }
+
+    e = telemetry_find(&bp_telemetry, addr, CMD_RESERVED);
+    if (ok && !e) {
+        test_print_failed("No telemetry for unknown command");
+        return;
+    }
+    ok = ok && test_telemetry_check("Unknown transactions", e->transactions, 2);
+    ok = ok && test_telemetry_check("Unknown nacks", e->results[TELEMETRY_NACK], 2);
+    ok = ok && test_telemetry_check("Unknown nack code", e->last_nack, ERR_UNKNOWN_COMMAND);
+    ok = ok && test_telemetry_check("Unknown retries", e->retries, 1);
+
+    telemetry_entry sum;
+    ok = ok && telemetry_slave(&bp_telemetry, addr, &sum);
+    ok = ok && test_telemetry_check("Slave transactions", sum.transactions, 4);
+
+    if (ok)
+        print_telemetry();
 }
 
-void test_progress(const char *msg, const status *s = NULL) {
-    test_progress(msg, NULL, s);
+void print_capture_summary(const capture_summary *summary) {
+    for (uint8_t d = 0; d < DURATION_COUNT; ++d) {
+        const capture_spec *spec = &capture_specs[d];
+        const capture_stats *st = &summary->durations[d];
+        if (!st->count)
+            continue;
+        Serial.print("  ");
+        Serial.print(spec->name);
+        Serial.print(": ");
+        Serial.print(st->count);
+        Serial.print(" measured, min/max ");
+        Serial.print(st->min);
+        Serial.print("/");
+        Serial.print(st->max);
+        Serial.print("us, slack ");
+        Serial.print((long)st->min - spec->min);
+        Serial.print("/");
+        if (spec->max)
+            Serial.print((long)spec->max - st->max);
+        else
+            Serial.print("-");
+        Serial.println("us");
+
+        Serial.print("    ");
+        Serial.print(st->below);
+        Serial.print(" below ");
+        Serial.print(spec->min);
+        Serial.print("us |");
+        for (uint8_t b = 0; b < CAPTURE_BINS; ++b) {
+            Serial.print(" ");
+            Serial.print(st->bins[b]);
+        }
+        Serial.print(" | ");
+        if (spec->max) {
+            Serial.print(st->above);
+            Serial.print(" above ");
+            Serial.print(spec->max);
+            Serial.print("us, ");
+        }
+        Serial.print("bins of ");
+        Serial.print(capture_bin_width((capture_duration)d));
+        Serial.println("us");
+    }
 }
 
-void test_progress(const char *msg, uint8_t b, const status *s = NULL) {
-    test_progress(msg, &b, s);
+// Allowed deviation from the timing limits in test_capture, for the
+// resolution of micros() and the overhead of capturing
+#define CAPTURE_TOLERANCE 10
+
+bool test_capture_check(const char *msg, uint16_t value, uint16_t expected) {
+    if (value == expected)
+        return true;
+    Serial.print("---> ");
+    Serial.print(msg);
+    Serial.print(": ");
+    Serial.print(value);
+    Serial.print(", expected ");
+    Serial.println(expected);
+    test_print_failed("Unexpected capture");
+    return false;
 }
 
-void test_start(const char *msg) {
-    Serial.println();
-    Serial.println(msg);
+// Allocated statically, since it is too big for the stack
+capture test_capture_buf;
+
+void test_capture(uint8_t addr) {
+    test_start("Capture master timings");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    uint8_t buf[2];
+
+    bp_current->parity_error_left = -1;
+    capture_init(&test_capture_buf);
+    bp_capture = &test_capture_buf;
+    bool ok = bp_session_begin(addr, &s);
+    ok = ok && bp_session_read_eeprom(0, buf, sizeof(buf), &s);
+    bp_capture = NULL;
+    test_progress("Read EEPROM while capturing", &s);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (test_capture_buf.overflow) {
+        test_print_failed("Capture buffer too small");
+        return;
+    }
+
+    capture_summary summary;
+    capture_summary_init(&summary);
+    capture_summarize(&test_capture_buf, &summary);
+    print_capture_summary(&summary);
+
+    const capture_stats *d = summary.durations;
+    // Address, command, length and offset, 9 bits each
+    ok = ok && test_capture_check("Resets", d[DURATION_RESET].count, 1);
+    ok = ok && test_capture_check("Bits written", d[DURATION_SEND_0].count + d[DURATION_SEND_1].count, 4 * 9);
+    ok = ok && test_capture_check("Bits sampled", d[DURATION_SAMPLE].count, d[DURATION_RECEIVE].count);
+    ok = ok && test_capture_check("Bit starts", d[DURATION_NEXT_BIT].count,
+                                  d[DURATION_SEND_0].count + d[DURATION_SEND_1].count + d[DURATION_RECEIVE].count - 1);
+
+    for (uint8_t i = 0; i < DURATION_COUNT && ok; ++i) {
+        const capture_spec *spec = &capture_specs[i];
+        if (d[i].count && (d[i].min + CAPTURE_TOLERANCE < spec->min ||
+            (spec->max && d[i].max > spec->max + CAPTURE_TOLERANCE))) {
+            Serial.print("---> ");
+            Serial.println(spec->name);
+            test_print_failed("Master timing outside the specification");
+            ok = false;
+        }
+    }
+
+    // Every edge should survive encoding, as sent by bp_capture_dump
+    uint8_t record[CAPTURE_RECORD_SIZE];
+    capture_edge e;
+    capture_encode_header(&test_capture_buf, record);
+    if (ok && (!capture_decode(record, &e) || e.type != CAPTURE_HEADER ||
+        e.time != test_capture_buf.count)) {
+        test_print_failed("Capture header changed by encoding");
+        ok = false;
+    }
+    for (uint16_t i = 0; i < test_capture_buf.count && ok; ++i) {
+        const capture_edge *orig = &test_capture_buf.edges[i];
+        capture_encode_edge(orig, record);
+        if (!capture_decode(record, &e) || e.type != orig->type || e.time != orig->time) {
+            test_print_failed("Captured edge changed by encoding");
+            ok = false;
+        }
+    }
 }
 
-void test_print_failed(const char *msg, const status *s = NULL, const status *expected = NULL) {
-    Serial.print("---> ");
-    Serial.println(msg);
-    if (s)
-        test_println_status("---> Status was: ", s);
-    if (expected)
-        test_println_status("---> Expected: ", expected);
+// A read for test_retry, with the parity of the command byte inverted
+// in the first corrupt attempts
+struct test_retry_read {
+    uint8_t addr;
+    uint8_t cmd;
+    uint8_t corrupt;
+    uint8_t attempts;
+};
 
-    while(Serial.read() != -1) /* Do nothing */;
-    Serial.println("---> Press a key to continue testing");
-    while(Serial.read() == -1) /* Do nothing */;
+bool test_retry_attempt(void *arg, status *s) {
+    test_retry_read *r = (test_retry_read *)arg;
+    uint8_t buf[2];
+    bool corrupt = r->attempts++ < r->corrupt;
+    bool ok = bp_session_begin(r->addr, s);
+    ok = ok && bp_write_byte(r->cmd, s, corrupt);
+    ok = ok && bp_write_byte(0, s);
+    ok = ok && bp_read_byte(&buf[0], s);
+    ok = ok && bp_read_byte(&buf[1], s);
+    return ok;
 }
 
-bool test_check_status(const status *s, const status *expected) {
-    if (s->code != expected->code) {
-        test_print_failed("Unexpected status", s, expected);
+bool test_retry_check(const test_retry_read *r, bool ok, const status *s, bool expect_ok,
+                      const status *expected, uint8_t attempts) {
+    if (ok != expect_ok || !test_check_status(s, expected))
         return false;
-    } else if (expected->code == NACK && s->slave_code != expected->slave_code) {
-        test_print_failed("Unexpected slave error code", s, expected);
+    if (r->attempts != attempts) {
+        Serial.print("---> ");
+        Serial.print(r->attempts);
+        Serial.print(" attempts, expected ");
+        Serial.println(attempts);
+        test_print_failed("Unexpected number of attempts");
         return false;
     }
     return true;
 }
 
-bool test_scan(uint8_t result[][UNIQUE_ID_LENGTH], uint8_t *count) {
+void test_retry(uint8_t addr) {
+    test_start("Retry failed transactions");
     status s = {OK};
-    status expect_ok = {OK};
-    bp_scan(result, count, &s);
-    return test_check_status(&s, &expect_ok);
+    status expect_ok = {OK, 0};
+    status expect_parity = {NACK, ERR_PARITY};
+    status expect_unknown = {NACK, ERR_UNKNOWN_COMMAND};
+    status expect_no_reply = {NO_ACK_OR_NACK, 0};
+    bp_retry_policy policy = {3, 1, NULL, 0};
+
+    bp_current->parity_error_left = -1;
+    // Corrupted bytes are retried until the policy gives up
+    test_retry_read r = {addr, CMD_READ_EEPROM, 2, 0};
+    bool ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("Read, corrupted twice", &s);
+    if (!test_retry_check(&r, ok, &s, true, &expect_ok, 3))
+        return;
+
+    r.corrupt = 3;
+    r.attempts = 0;
+    ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("Read, corrupted three times", &s);
+    if (!test_retry_check(&r, ok, &s, false, &expect_parity, 3))
+        return;
+
+    // Other nacks are not retried
+    r.cmd = CMD_RESERVED;
+    r.corrupt = 0;
+    r.attempts = 0;
+    ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("Unknown command", &s);
+    if (!test_retry_check(&r, ok, &s, false, &expect_unknown, 1))
+        return;
+
+    // An unassigned address never replies, but all known slaves still
+    // ack their address, so the bus is not scanned again
+    uint8_t found[lengthof(eeproms) + 1][UNIQUE_ID_LENGTH];
+    uint8_t n = lengthof(found) - 1;
+    if (!test_scan(found, &n))
+        return;
+    policy.ids = found;
+    policy.id_count = n;
+    r.addr = BC_FIRST - 1;
+    r.cmd = CMD_READ_EEPROM;
+    r.attempts = 0;
+    ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("No reply", &s);
+    if (!test_retry_check(&r, ok, &s, false, &expect_no_reply, 3))
+        return;
+
+    // An aborted enumeration makes all slaves forget their address,
+    // like a brownout would. After two attempts without a reply, the
+    // rescan gives them their old addresses back.
+    bp_reset();
+    bp_write_byte(BC_CMD_ENUMERATE);
+    r.addr = addr;
+    r.attempts = 0;
+    ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("Lost addresses, rescan", &s);
+    if (!test_retry_check(&r, ok, &s, true, &expect_ok, 3))
+        return;
+
+    // When the rescan finds a different number of slaves, the
+    // addresses cannot be trusted, so it gives up right away. This
+    // claims one slave more than found, which needs a spare row.
+    if (n >= lengthof(found) || n + 1 > BP_RETRY_MAX_SLAVES)
+        return;
+    policy.id_count = n + 1;
+    r.addr = BC_FIRST - 1;
+    r.attempts = 0;
+    ok = bp_retry(&policy, test_retry_attempt, &r, &s);
+    test_progress("No reply, rescan finds fewer slaves", &s);
+    test_retry_check(&r, ok, &s, false, &expect_no_reply, 2);
 }
 
-bool test_reset() {
-    status s = {OK};
-    parity_error_left = parity_error_byte;
-    if (!bp_reset(&s)) {
-        test_print_failed("Reset failed", &s);
-        return false;
+void test_eventlog() {
+    test_start("Deferred event log");
+    eventlog log;
+    eventlog_event e;
+    uint8_t buf[EVENTLOG_RECORD_SIZE];
+    bool ok = true;
+
+    // Overfill the log, the last three events should be dropped
+    eventlog_init(&log);
+    for (uint8_t i = 0; i < EVENTLOG_SIZE + 3; ++i)
+        eventlog_put(&log, EVENT_ID_BYTE, i, 1000ul * i);
+
+    uint8_t count = 0;
+    while (ok && eventlog_get(&log, &e)) {
+        // Every event should survive encoding
+        eventlog_encode(&e, buf);
+        eventlog_event decoded;
+        if (!eventlog_decode(buf, &decoded) || decoded.type != e.type ||
+            decoded.arg != e.arg || decoded.time != e.time) {
+            test_print_failed("Event changed by encoding");
+            ok = false;
+        } else if (count < EVENTLOG_SIZE && (e.type != EVENT_ID_BYTE || e.arg != count)) {
+            test_print_failed("Events out of order");
+            ok = false;
+        } else if (count == EVENTLOG_SIZE && (e.type != EVENT_LOST || e.arg != 3)) {
+            test_print_failed("Dropped events not reported");
+            ok = false;
+        }
+        count++;
     }
-    test_progress("Reset", &s);
-    return true;
+    if (ok && count != EVENTLOG_SIZE + 1) {
+        test_print_failed("Wrong number of events");
+        ok = false;
+    }
+
+    // A corrupted record should be rejected
+    buf[3] ^= 0x10;
+    if (ok && eventlog_decode(buf, &e)) {
+        test_print_failed("Corrupted record accepted");
+        ok = false;
+    }
+    if (ok)
+        test_progress("Events logged, dropped and encoded correctly");
 }
 
-bool test_read_byte(uint8_t *b, status *expected) {
+void test_ternary(uint8_t addr, uint8_t eeprom_addr) {
+    test_start("Transfer bytes in MODE_TERNARY");
     status s = {OK};
-    bool ok = bp_read_byte(b, &s);
-    if (ok)
-        test_progress("Read byte: ", *b, &s);
-    else
-        test_progress("Failed to read byte", &s);
+    status expect_ok = {OK, 0};
+    status expect_parity = {NACK, ERR_PARITY};
+    uint8_t mode = MODE_TERNARY;
+    uint8_t data[8];
+
+    // Parity errors are tested separately below
+    bp_current->parity_error_left = -1;
+
+    bool ok = bp_session_begin_mode(addr, &mode, &s);
+    test_progress("Start session in MODE_TERNARY", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && !mode) {
+        test_progress("MODE_TERNARY not supported, skipping");
+        return;
+    }
 
-    return test_check_status(&s, expected);
-}
+    ok = ok && test_write_byte(CMD_WRITE_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    ok = ok && test_write_byte(sizeof(data), &expect_ok, "Sending count: ");
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint8_t i = 0; i < sizeof(data) && ok; ++i) {
+        data[i] = random(0, 256);
+        ok = ok && test_write_byte(data[i], &expect_ok);
+        if (ok)
+            eeproms[addr][eeprom_addr + i] = data[i];
+    }
 
-bool test_empty_bus();
+    ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    ok = ok && test_write_byte(sizeof(data), &expect_ok, "Sending count: ");
+    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    for (uint8_t i = 0; i < sizeof(data) && ok; ++i) {
+        uint8_t b;
+        ok = ok && test_read_byte(&b, &expect_ok);
+        if (ok && b != data[i]) {
+            test_print_failed("EEPROM contents did not match");
+            ok = false;
+        }
+    }
 
-bool test_write_byte(uint8_t b, status *expected, const char *msg = NULL) {
-    status s = {OK};
-    if (parity_error_left-- == 0 && expected->code != NO_ACK_OR_NACK) {
-        status expect_parity = {NACK, ERR_PARITY};
-        bp_write_byte(b, &s, true);
+    // Parity errors are still detected
+    ok = ok && test_write_byte(CMD_READ_EEPROM_COUNTED, &expect_ok, "Sending command: ");
+    if (ok) {
+        bp_write_byte(1, &s, true);
         test_progress("Introducing parity error in next byte");
-        test_progress(msg ? : "Written byte: ", b, &s);
-        bool ok = test_check_status(&s, &expect_parity);
-        ok = ok && test_empty_bus();
-        // Even if the parity error was handled as expected, don't
-        // continue with the rest of the testcase
-        return false;
-    } else {
-        bp_write_byte(b, &s);
-        test_progress(msg ? : "Written byte: ", b, &s);
-        return test_check_status(&s, expected);
+        test_progress("Sending count: ", 1, &s);
+        ok = test_check_status(&s, &expect_parity);
     }
+    ok = ok && test_empty_bus();
 }
 
-bool test_address(uint8_t addr, status *expected) {
-    return test_write_byte(addr, expected, "Sending address: ");
-}
-
-bool test_cmd(uint8_t addr, uint8_t cmd, status *expected) {
-    status expect_ok = {OK};
-    bool ok = test_address(addr, &expect_ok);
-    return ok && test_write_byte(cmd, expected, "Sending command: ");
+// Build a valid EEPROM layout with the given name and descriptors for
+// the given slave, keeping its unique id. Returns the used size.
+uint8_t test_layout_image(uint8_t addr, uint8_t *image, const char *name, const uint8_t *descriptors, uint8_t len) {
+    uint8_t pos = LAYOUT_NAME_OFFSET;
+
+    // Keep the (read-only) unique id and firmware version
+    memcpy(image, eeproms[addr], LAYOUT_NAME_OFFSET);
+    image[0] = LAYOUT_VERSION;
+    // The header cannot describe more than 255 bytes
+    uint16_t size = bp_eeprom_size(addr);
+    image[LAYOUT_EEPROM_SIZE_OFFSET] = size > 0xff ? 0xff : size;
+    while (*name) {
+        image[pos++] = *name | (name[1] ? 0 : 0x80);
+        name++;
+    }
+    if (len)
+        memcpy(&image[pos], descriptors, len);
+    pos += len;
+    image[LAYOUT_USED_SIZE_OFFSET] = pos + LAYOUT_CHECKSUM_SIZE;
+    uint16_t crc = 0;
+    for (uint8_t i = 0; i < pos; ++i)
+        crc = crc16_update(LAYOUT_CRC_POLY, crc, image[i]);
+    image[pos++] = crc >> 8;
+    image[pos++] = crc;
+    return pos;
 }
 
-bool test_empty_bus() {
-    status expect_no_reply = {NO_ACK_OR_NACK};
-    uint8_t b;
-    return test_read_byte(&b, &expect_no_reply);
-}
+// Descriptors collected by test_layout_collect
+layout_descriptor test_layout_descs[10];
+uint8_t test_layout_count;
 
-bool test_timeout() {
-    while(micros() - bit_start < NEXT_BIT_TIMEOUT) /* wait */;
-    return test_empty_bus();
+void test_layout_collect(const layout_parser *p, layout_result res) {
+    if (res == LAYOUT_DESCRIPTOR && test_layout_count < lengthof(test_layout_descs))
+        test_layout_descs[test_layout_count++] = p->desc;
 }
 
-void test_write_eeprom(uint8_t addr, uint8_t eeprom_addr, uint8_t len) {
-    test_start("Write the EEPROM");
+void test_layout(uint8_t addr) {
+    test_start("Parse the EEPROM layout while reading it");
+    status s = {OK};
     status expect_ok = {OK, 0};
+    static const char name[] = "test";
+    static const uint8_t descriptors[] = {
+        DESC_GROUP, 'g', 'r' | 0x80,
+        DESC_POWER_USAGE, 7, 0x0a, 0x60, 0x7f,
+        DESC_IO_PIN, 3, 'l', 'e', 'd' | 0x80,
+        DESC_UART, 1, 2, 6,
+        DESC_EMPTY, DESC_EMPTY,
+        DESC_I2C_SLAVE, 0x80 | 0x48, 1, 't' | 0x80,
+        DESC_SPI_SLAVE, 0x80 | 5, 0x90, 'f', 'l', 'a', 's', 'h' | 0x80,
+        DESC_DATA, 2, 0x12, 0x34,
+        // An empty descriptor right before the checksum
+        DESC_EMPTY,
+    };
+    static const struct {
+        uint8_t type;
+        uint8_t length;
+        const char *name;
+    } expected[] = {
+        {DESC_GROUP, 3, "gr"},
+        {DESC_POWER_USAGE, 5, ""},
+        {DESC_IO_PIN, 5, "led"},
+        {DESC_UART, 4, "uart"},
+        {DESC_EMPTY, 2, ""},
+        {DESC_I2C_SLAVE, 4, "t"},
+        {DESC_SPI_SLAVE, 8, "flash"},
+        {DESC_DATA, 4, "data"},
+        {DESC_EMPTY, 1, ""},
+    };
+    uint8_t image[EEPROM_SIZE];
+    uint8_t len = test_layout_image(addr, image, name, descriptors, sizeof(descriptors));
 
     bool ok = test_reset();
     ok = ok && test_cmd(addr, CMD_WRITE_EEPROM, &expect_ok);
-    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
+    ok = ok && test_write_byte(0, &expect_ok);
     for (uint8_t i = 0; i < len && ok; ++i) {
-        uint8_t b = random(0, 256);
-        ok = ok && test_write_byte(b, &expect_ok);
+        ok = ok && test_write_byte(image[i], &expect_ok);
         if (ok)
-            eeproms[addr][eeprom_addr + i] = b;
+            eeproms[addr][i] = image[i];
+    }
+    if (!ok)
+        return;
+
+    layout_parser parser;
+    test_layout_count = 0;
+    ok = bp_read_layout(addr, &parser, test_layout_collect, &s);
+    test_progress("Read layout", &s);
+    ok = test_check_status(&s, &expect_ok) && ok;
+    if (s.code == OK && parser.error != LAYOUT_OK) {
+        test_print_failed(layout_error_str[parser.error]);
+        return;
+    }
+    if (!ok)
+        return;
+
+    test_progress("Bytes read: ", parser.offset);
+    if (parser.offset != len) {
+        test_print_failed("Not exactly the used EEPROM size was read");
+        return;
+    }
+
+    const layout_header *h = &parser.header;
+    if (strcmp(h->name, name) || h->used_size != len ||
+        h->model != (eeproms[addr][4] << 8 | eeproms[addr][5])) {
+        test_print_failed("Header did not match");
+        return;
+    }
+
+    if (test_layout_count != lengthof(expected)) {
+        test_print_failed("Unexpected number of descriptors");
+        return;
+    }
+    uint8_t offset = LAYOUT_NAME_OFFSET + sizeof(name) - 1;
+    for (uint8_t i = 0; i < test_layout_count; ++i) {
+        const layout_descriptor *d = &test_layout_descs[i];
+        test_progress("Descriptor: ", d->type);
+        if (d->type != expected[i].type || d->offset != offset ||
+            d->length != expected[i].length || strcmp(d->name, expected[i].name)) {
+            test_print_failed("Descriptor did not match");
+            return;
+        }
+        offset += d->length;
+    }
+
+    const layout_descriptor *d = test_layout_descs;
+    if (d[1].power.pin != 7 || layout_power_usage(d[1].power.minimum) != 20 ||
+        layout_power_usage(d[1].power.typical) != 1024 ||
+        d[2].io_pin.pin != 3 || d[3].uart.rx_pin != 2 || d[3].uart.speed != 6 ||
+        d[5].i2c.address != 0x48 || d[5].i2c.speed != 1 ||
+        d[6].spi.ss_pin != 5 || layout_spi_speed(d[6].spi.speed) != 8000000 ||
+        d[7].data.offset != d[7].offset + 2 || d[7].data.length != 2) {
+        test_print_failed("Descriptor fields did not match");
+        return;
+    }
+
+    // Break the checksum, which should be detected after reading the
+    // same bytes again
+    uint8_t b = image[len - 1] ^ 0x01;
+    ok = test_reset();
+    ok = ok && test_cmd(addr, CMD_WRITE_EEPROM, &expect_ok);
+    ok = ok && test_write_byte(len - 1, &expect_ok);
+    ok = ok && test_write_byte(b, &expect_ok);
+    if (!ok)
+        return;
+    eeproms[addr][len - 1] = b;
+
+    ok = bp_read_layout(addr, &parser, NULL, &s);
+    test_progress("Read layout with invalid checksum", &s);
+    if (ok || s.code != OK || parser.error != LAYOUT_ERR_CHECKSUM) {
+        test_print_failed("Invalid checksum not detected");
+        return;
     }
 }
 
-void test_read_eeprom(uint8_t addr, uint8_t eeprom_addr, uint8_t len) {
-    test_start("Read a piece of EEPROM");
+void test_planned_write(uint8_t addr) {
+    test_start("Write only the changed parts of the EEPROM");
+    status s = {OK};
     status expect_ok = {OK, 0};
+    uint8_t target[EEPROM_SIZE];
+    bp_write_plan plan;
+
+    // Change a few random bytes, some of which are close enough
+    // together to be merged into a single run
+    memcpy(target, eeproms[addr], sizeof(target));
+    for (uint8_t i = 0; i < 6; ++i)
+        target[random(0, EEPROM_SIZE)] ^= random(1, 256);
+
+    bp_plan_write(target, eeproms[addr], 0, sizeof(target), &plan);
+    test_progress("Runs: ", plan.count);
+    test_progress("Bytes to send: ", plan.bytes);
+    test_progress("Changed bytes: ", plan.changed);
+    Serial.print("\tEstimated duration: "); Serial.print(plan.duration); Serial.println("us");
+
+    // Check that all changes (except to the unique id) are covered
+    uint8_t covered[EEPROM_SIZE] = {0};
+    for (uint8_t i = 0; i < plan.count; ++i)
+        memset(&covered[plan.runs[i].offset], 1, plan.runs[i].len);
+    for (uint8_t i = 0; i < EEPROM_SIZE; ++i) {
+        bool unique_id = i >= UNIQUE_ID_OFFSET && i < UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH;
+        if (covered[i] && unique_id) {
+            test_print_failed("Plan writes to the unique id");
+            return;
+        }
+        if (!covered[i] && !unique_id && target[i] != eeproms[addr][i]) {
+            test_print_failed("Plan misses a changed byte");
+            return;
+        }
+        if (unique_id)
+            target[i] = eeproms[addr][i];
+    }
 
-    bool ok = test_reset();
-    ok = ok && test_cmd(addr, CMD_READ_EEPROM, &expect_ok);
-    ok = ok && test_write_byte(eeprom_addr, &expect_ok);
-    for (uint8_t i = 0; i < len && ok; ++i) {
-        uint8_t b;
-        ok = ok && test_read_byte(&b, &expect_ok);
-        if (ok && b != eeproms[addr][eeprom_addr + i]) {
-            test_print_failed("EEPROM contents did not match");
-            ok = false;
+    unsigned long start = micros();
+    bool ok = bp_write_planned(addr, target, &plan, &s);
+    Serial.print("\tActual duration: "); Serial.print(micros() - start); Serial.println("us");
+    test_progress("Planned write", &s);
+    if (!test_check_status(&s, &expect_ok) || !ok)
+        return;
+    memcpy(eeproms[addr], target, sizeof(target));
+
+    // Planning again should find nothing to do
+    bp_plan_write(target, eeproms[addr], 0, sizeof(target), &plan);
+    if (plan.count) {
+        test_print_failed("Unexpected runs after writing");
+        return;
+    }
+    test_read_eeprom(addr, 0, EEPROM_SIZE);
+}
+
+void test_kv(uint8_t addr) {
+    test_start("Key/value store in the free EEPROM space");
+    status s = {OK};
+    status expect_ok = {OK, 0};
+    uint8_t image[EEPROM_SIZE];
+    bp_kv_store kv;
+    // Expected values, a length of 0 means not present
+    uint8_t values[3][4];
+    uint8_t lens[3] = {0};
+
+    // Use a minimal layout, leaving most of the EEPROM free
+    uint8_t used = test_layout_image(addr, image, "kv", NULL, 0);
+    bool ok = bp_session_begin(addr, &s);
+    ok = ok && bp_session_write_eeprom(0, image, used, &s);
+    test_progress("Write minimal layout", &s);
+    if (!test_check_status(&s, &expect_ok) || !ok)
+        return;
+    memcpy(eeproms[addr], image, used);
+
+    ok = bp_kv_open(&kv, addr, &s);
+    ok = ok && bp_kv_format(&kv, &s);
+    test_progress("Open and format store", &s);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (!ok) {
+        test_print_failed("Failed to open store");
+        return;
+    }
+
+    // Set the first key only once, so it keeps surviving compactions
+    // while the sequence number wraps around
+    lens[0] = sizeof(*values);
+    for (uint8_t j = 0; j < lens[0]; ++j)
+        values[0][j] = random(0, 256);
+    ok = bp_kv_set(&kv, 0, values[0], lens[0], &s);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (!ok) {
+        test_print_failed("Failed to set value");
+        return;
+    }
+
+    // Enough updates to fill the store many times and wrap the
+    // sequence number
+    for (uint8_t i = 0; i < 150; ++i) {
+        uint8_t key = random(1, lengthof(lens));
+        uint8_t len = random(0, sizeof(*values) + 1);
+        for (uint8_t j = 0; j < len; ++j)
+            values[key][j] = random(0, 256);
+        ok = bp_kv_set(&kv, key, values[key], len, &s);
+        if (!test_check_status(&s, &expect_ok))
+            return;
+        if (!ok) {
+            test_print_failed("Failed to set value");
+            return;
+        }
+        lens[key] = len;
+    }
+    test_progress("Compactions: ", kv.compactions);
+    if (!kv.compactions) {
+        test_print_failed("Store was never compacted");
+        return;
+    }
+
+    // A value that fits in an empty store, but not next to the other
+    // keys, is refused without compacting
+    uint8_t big[KV_MAX_END] = {0};
+    uint8_t head = kv.head, compactions = kv.compactions;
+    ok = bp_kv_set(&kv, lengthof(lens), big, kv.end - kv.start - KV_RECORD_OVERHEAD, &s);
+    test_progress("Set value that does not fit", &s);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (ok || kv.head != head || kv.compactions != compactions) {
+        test_print_failed("Value that does not fit was written");
+        return;
+    }
+
+    // Open again, to check the values as read from the EEPROM
+    ok = bp_kv_open(&kv, addr, &s);
+    test_progress("Open store again", &s);
+    if (!test_check_status(&s, &expect_ok))
+        return;
+    if (!ok) {
+        test_print_failed("Failed to open store");
+        return;
+    }
+    for (uint8_t key = 0; key < lengthof(lens); ++key) {
+        uint8_t buf[sizeof(*values)];
+        uint8_t len = sizeof(buf);
+        bool found = bp_kv_get(&kv, key, buf, &len);
+        test_progress("Value length: ", found ? len : 0);
+        if (found != (lens[key] != 0) || (found && (len != lens[key] || memcmp(buf, values[key], len)))) {
+            test_print_failed("Value did not match");
+            return;
         }
     }
+
+    memcpy(&eeproms[addr][kv.start], &kv.cache[kv.start], kv.end - kv.start);
+    test_read_eeprom(addr, kv.start, kv.end - kv.start);
 }
 
 void test_unknown_command(uint8_t addr, uint8_t cmd) {
@@ -595,10 +3310,16 @@ void test_read_overflow(uint8_t addr) {
     test_start("Read overflow into an invalid address");
     status expect_ok = {OK, 0};
     status expect_invalid_read = {NACK, ERR_READ_EEPROM_INVALID_ADDRESS};
+    uint16_t size = bp_eeprom_size(addr);
     uint8_t b;
+    if (size > 0x100) {
+        // The end is only reachable with 16-bit addresses, see test_wide
+        test_progress("End not reachable with 8-bit addresses, skipping");
+        return;
+    }
     bool ok = test_reset();
     ok = ok && test_cmd(addr, CMD_READ_EEPROM, &expect_ok);
-    ok = ok && test_write_byte(EEPROM_SIZE - 1, &expect_ok);
+    ok = ok && test_write_byte(size - 1, &expect_ok);
     ok = ok && test_read_byte(&b, &expect_ok);
     ok = ok && test_read_byte(&b, &expect_invalid_read);
     ok = ok && test_empty_bus();
@@ -609,10 +3330,15 @@ void test_write_overflow(uint8_t addr) {
     test_start("Write overflow into an invalid address");
     status expect_ok = {OK, 0};
     status expect_invalid_write = {NACK, ERR_WRITE_EEPROM_INVALID_ADDRESS};
+    uint16_t size = bp_eeprom_size(addr);
+    if (size > 0x100) {
+        test_progress("End not reachable with 8-bit addresses, skipping");
+        return;
+    }
     bool ok = test_reset();
     ok = ok && test_cmd(addr, CMD_WRITE_EEPROM, &expect_ok);
-    ok = ok && test_write_byte(EEPROM_SIZE - 1, &expect_ok);
-    ok = ok && test_write_byte(eeproms[addr][EEPROM_SIZE - 1], &expect_ok);
+    ok = ok && test_write_byte(size - 1, &expect_ok);
+    ok = ok && test_write_byte(eeproms[addr][size - 1], &expect_ok);
     ok = ok && test_write_byte(0, &expect_invalid_write);
     ok = ok && test_empty_bus();
 }
@@ -638,6 +3364,165 @@ void test_write_unchanged_readonly(uint8_t addr, uint8_t eeprom_addr) {
     ok = ok && test_timeout();
 }
 
+void test_broadcast_write(uint8_t count) {
+    test_start("Broadcast write to all slaves");
+    status s = {OK};
+    status expect_ok = {OK};
+    uint8_t data[4];
+    uint8_t failed[lengthof(eeproms)];
+    uint8_t failed_count = lengthof(failed);
+    uint8_t offset = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE - sizeof(data));
+
+    for (uint8_t i = 0; i < sizeof(data); ++i)
+        data[i] = random(0, 256);
+
+    bool ok = bp_broadcast_write_eeprom(offset, data, sizeof(data), failed, &failed_count, &s);
+    test_progress("Broadcast write", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && failed_count != 0) {
+        test_print_failed("Unexpected failures reported");
+        ok = false;
+    }
+    for (uint8_t addr = 0; addr < count && ok; ++addr)
+        memcpy(&eeproms[addr][offset], data, sizeof(data));
+
+    // Write the (read-only) unique id checksum byte with the value of
+    // the first slave followed by a normal byte. All other slaves
+    // should fail and report themselves.
+    offset = UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH - 1;
+    data[0] = eeproms[0][offset];
+    data[1] = random(0, 256);
+    failed_count = lengthof(failed);
+    ok = ok && bp_broadcast_write_eeprom(offset, data, 2, failed, &failed_count, &s);
+    test_progress("Broadcast write to read-only byte", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    if (ok && failed_count != count - 1) {
+        test_print_failed("Unexpected number of failures reported");
+        ok = false;
+    }
+    for (uint8_t i = 0; i < failed_count && ok; ++i) {
+        test_progress("Failure reported by slave: ", failed[i]);
+        if (failed[i] != i + 1) {
+            test_print_failed("Unexpected failure reported");
+            ok = false;
+        }
+    }
+    // Failing slaves still write the remaining bytes
+    for (uint8_t addr = 0; addr < count && ok; ++addr)
+        eeproms[addr][offset + 1] = data[1];
+
+    for (uint8_t addr = 0; addr < count && ok; ++addr)
+        test_read_eeprom(addr, offset - 4, 6);
+}
+
+void test_broadcast_read(uint8_t count) {
+    test_start("Broadcast read from all slaves");
+    status s = {OK};
+    status expect_ok = {OK};
+    // Read the header up to and including the unique id, the typical
+    // use of a broadcast read
+    const uint8_t len = UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH;
+    uint8_t buf[lengthof(eeproms) * len];
+    bool present[lengthof(eeproms)];
+
+    bool ok = bp_broadcast_read_eeprom(0, buf, len, count, present, &s);
+    test_progress("Broadcast read", &s);
+    ok = ok && test_check_status(&s, &expect_ok);
+    for (uint8_t addr = 0; addr < count && ok; ++addr) {
+        test_progress("Read from slave: ", addr);
+        if (!present[addr]) {
+            test_print_failed("Slave did not respond");
+            ok = false;
+        } else if (memcmp(&buf[addr * len], eeproms[addr], len)) {
+            test_print_failed("Read data does not match EEPROM contents");
+            ok = false;
+        }
+    }
+}
+
+// Write and read back the slave with address 0 on all given buses at
+// once. Every bus is enumerated again and should have at least one
+// slave, whose capabilities are discovered. Writing all buses should
+// not take much longer than writing only the first one.
+void test_parallel(bp_bus *const *buses, uint8_t count) {
+    test_start("Parallel transfers on multiple buses");
+    status expect_ok = {OK};
+    status s[BP_MAX_JOBS];
+    uint8_t found[lengthof(eeproms) + 1][UNIQUE_ID_LENGTH];
+    bool ok = true;
+
+    if (count > BP_MAX_JOBS) {
+        test_print_failed("Too many buses");
+        return;
+    }
+
+    for (uint8_t i = 0; i < count; ++i)
+        s[i] = expect_ok;
+    for (uint8_t i = 0; i < count && ok; ++i) {
+        // bp_scan needs a spare row
+        uint8_t n = lengthof(found) - 1;
+        bp_select(buses[i]);
+        ok = test_scan(found, &n);
+        test_progress("Slaves on bus: ", n);
+        if (ok && !n) {
+            test_print_failed("No slaves found");
+            ok = false;
+        }
+        // Capabilities are cached per bus
+        ok = ok && bp_discover(0, &s[i]);
+        ok = ok && test_check_status(&s[i], &expect_ok);
+        if (ok && !buses[i]->caps[0].known) {
+            test_print_failed("Capabilities not cached for this bus");
+            ok = false;
+        }
+    }
+    bp_select(&bp_default_bus);
+
+    // Use new data every time, since unchanged bytes are not written
+    const uint8_t offset = UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH;
+    const uint8_t len = EEPROM_SIZE - offset;
+    uint8_t data[len];
+    for (uint8_t i = 0; i < len; ++i)
+        data[i] = random(0, 256);
+
+    unsigned long start = micros();
+    ok = ok && bp_parallel_write_eeprom(buses, 1, 0, offset, data, len, s);
+    unsigned long single = micros() - start;
+    test_progress("Write first bus", &s[0]);
+    ok = ok && test_check_status(&s[0], &expect_ok);
+
+    for (uint8_t i = 0; i < len; ++i)
+        data[i] = random(0, 256);
+    start = micros();
+    ok = ok && bp_parallel_write_eeprom(buses, count, 0, offset, data, len, s);
+    unsigned long parallel = micros() - start;
+    for (uint8_t i = 0; i < count && ok; ++i) {
+        test_progress("Write bus: ", i, &s[i]);
+        ok = test_check_status(&s[i], &expect_ok);
+    }
+    if (ok) {
+        Serial.print("\tOne bus: "); Serial.print(single); Serial.print("us, ");
+        Serial.print(count); Serial.print(" buses: "); Serial.print(parallel); Serial.println("us");
+        if (parallel > single * 3 / 2) {
+            test_print_failed("Parallel write too slow");
+            ok = false;
+        }
+    }
+
+    uint8_t buf[BP_MAX_JOBS * len];
+    ok = ok && bp_parallel_read_eeprom(buses, count, 0, offset, buf, len, s);
+    for (uint8_t i = 0; i < count && ok; ++i) {
+        test_progress("Read bus: ", i, &s[i]);
+        ok = test_check_status(&s[i], &expect_ok);
+        if (ok && memcmp(&buf[i * len], data, len)) {
+            test_print_failed("Read data does not match written data");
+            ok = false;
+        }
+        if (ok && buses[i] == &bp_default_bus)
+            memcpy(&eeproms[0][offset], data, len);
+    }
+}
+
 void test_unassigned_address(uint8_t addr) {
     test_start("Address an unknown slave");
     status expect_no_reply = {NO_ACK_OR_NACK};
@@ -677,14 +3562,14 @@ void loop() {
         delay(1000);
         uint8_t count = lengthof(ids);
 
-        current_timings = &timings_to_test[t];
+        bp_default_bus.timing = &timings_to_test[t];
 
         if (t == TIMING_RND)
-            select_random_timings(current_timings, &timings_to_test[TIMING_MIN], &timings_to_test[TIMING_MAX]);
+            select_random_timings(&timings_to_test[t], &timings_to_test[TIMING_MIN], &timings_to_test[TIMING_MAX]);
 
         Serial.print("Using timing set: ");
         Serial.println(t);
-        print_timings(current_timings);
+        print_timings(bp_default_bus.timing);
 
         long seed = random();
         randomSeed(seed);
@@ -698,17 +3583,27 @@ void loop() {
         digitalWrite(3, HIGH);
         digitalWrite(3, LOW);
         if (!test_scan(ids, &count)) {
+            bp_log_drain();
             Serial.println("---> Enumeration failed");
             return;
         }
         print_scan_result(ids, count);
+        for (uint8_t i = 0; i < count; ++i) {
+            status s = {OK};
+            if (!bp_discover(i, &s)) {
+                bp_log_drain();
+                Serial.print("---> Capability discovery failed for device "); Serial.println(i);
+            }
+        }
         delay(100);
         Serial.println("Reading EEPROM...");
         for (uint8_t i = 0; i < count; ++i) {
-            if (!bp_read_eeprom(i, 0, eeproms[i], sizeof(*eeproms))) {
+            if (!bp_read_eeprom_all(i, eeproms[i])) {
+                bp_log_drain();
                 Serial.print("---> EEPROM read failed for device "); Serial.println(i);
             } else {
-                print_eeprom(i, eeproms[i], sizeof(*eeproms));
+                print_eeprom(i, eeproms[i], bp_eeprom_size(i));
+                print_layout(i);
             }
             delay(100);
         }
@@ -717,30 +3612,77 @@ void loop() {
             Serial.println();
             Serial.print("=== Testing device "); Serial.println(i);
             uint8_t addr = i;
+            // Commands with an 8-bit address only reach the first 256
+            // bytes, test_wide covers the rest
+            uint16_t size = bp_eeprom_size(addr);
+            if (size > 0x100)
+                size = 0x100;
 
             // Only write the eeprom once, to prevent wearing it out
             if (!eeprom_written) {
                 // Fill everything past the unique id with random data
-                test_write_eeprom(addr, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, EEPROM_SIZE - UNIQUE_ID_OFFSET - UNIQUE_ID_LENGTH);
+                test_write_eeprom(addr, UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size - UNIQUE_ID_OFFSET - UNIQUE_ID_LENGTH);
                 // And verify the write worked
-                test_read_eeprom(addr, 0, EEPROM_SIZE);
+                test_read_eeprom(addr, 0, size);
             }
 
-            uint8_t start = random(0, EEPROM_SIZE);
-            test_read_eeprom(addr, start, random(1, EEPROM_SIZE - start));
+            uint8_t start = random(0, size);
+            test_read_eeprom(addr, start, random(1, size - start));
+            test_stats(addr);
+            test_capabilities(addr);
+            test_telemetry(addr);
+            test_capture(addr);
+            test_retry(addr);
+            // These write the eeprom (some rewrite large parts of it),
+            // so only run them on the first pass as well
+            if (!eeprom_written) {
+                start = random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size);
+                test_chained(addr, start, random(1, size - start + 1));
+                test_fec(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size - 4));
+                test_ternary(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size - 8));
+                test_atomic(addr, random(UNIQUE_ID_OFFSET + UNIQUE_ID_LENGTH, size));
+                test_wide(addr);
+                test_layout(addr);
+                test_planned_write(addr);
+                test_kv(addr);
+            }
             test_unknown_command(addr, CMD_RESERVED);
             test_unknown_command(addr, random(CMD_LAST + 1, 256));
-            test_invalid_read_address(addr, random(EEPROM_SIZE, 256));
+            if (size < 0x100)
+                test_invalid_read_address(addr, random(size, 256));
             test_read_overflow(addr);
             test_write_overflow(addr);
             test_write_readonly(addr, UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH));
             test_write_unchanged_readonly(addr, UNIQUE_ID_OFFSET + random(0, UNIQUE_ID_LENGTH));
         }
+        // Slaves without FEATURE_BROADCAST would just ignore these
+        bool broadcast = count && bp_all_support(count, FEATURE_BROADCAST);
+        if (broadcast && !eeprom_written)
+            test_broadcast_write(count);
+        if (broadcast)
+            test_broadcast_read(count);
+        // This writes the eeprom as well. Without extra buses, it only
+        // checks bp_run_jobs() on the default bus.
+        if (count && !eeprom_written) {
+            bp_bus *buses[BP_MAX_JOBS] = {&bp_default_bus};
+            uint8_t bus_count = 1;
+            #if defined(BP_EXTRA_BUS_PINS)
+            for (uint8_t i = 0; i < lengthof(bp_extra_bus_pins) && bus_count < BP_MAX_JOBS; ++i) {
+                bp_bus_init(&bp_extra_buses[i], bp_extra_bus_pins[i], bp_default_bus.timing);
+                buses[bus_count++] = &bp_extra_buses[i];
+            }
+            #endif
+            test_parallel(buses, bus_count);
+        }
         test_unassigned_address(ADDRESS_RESERVED);
         test_unassigned_address(random(count + 1, BC_FIRST));
+        test_eventlog();
         eeprom_written = true;
     }
 
+    bp_log_drain();
+    print_telemetry();
+
     // On every loop, introduce parity errors in different places
     parity_error_byte++;
 }
@@ -1,4 +1,4 @@
-// 8-bit CRC implementation
+// 8-bit and 16-bit CRC implementation
 //
 // Copyright (c) 2013, Matthijs Kooijman <matthijs@stdin.nl>
 //
@@ -46,3 +46,21 @@ uint8_t crc_update(const uint8_t poly, uint8_t crc, uint8_t data)
     return crc;
 }
 
+/* Same as crc_update, but for 16-bit CRCs. */
+uint16_t crc16_update(const uint16_t poly, uint16_t crc, uint8_t data)
+{
+    unsigned int i;
+    bool bit;
+
+    for (i = 0x80; i > 0; i >>= 1) {
+        bit = crc & 0x8000;
+        if (data & i) {
+            bit = !bit;
+        }
+        crc <<= 1;
+        if (bit) {
+            crc ^= poly;
+        }
+    }
+    return crc;
+}
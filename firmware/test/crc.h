@@ -1,4 +1,4 @@
-// 8-bit CRC implementation
+// 8-bit and 16-bit CRC implementation
 //
 // Copyright (c) 2013, Matthijs Kooijman <matthijs@stdin.nl>
 //
@@ -26,4 +26,5 @@
 #include <stdint.h>
 
 uint8_t crc_update(const uint8_t poly, uint8_t crc, uint8_t data);
+uint16_t crc16_update(const uint16_t poly, uint16_t crc, uint8_t data);
 #endif // CRC_H
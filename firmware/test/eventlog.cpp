@@ -0,0 +1,102 @@
+// Deferred event log for the bus master
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "eventlog.h"
+#include "crc.h"
+
+const char *eventlog_str[] = {
+    [EVENT_LOST] = "Events lost",
+    [EVENT_BUS_LOW] = "Bus stays low too long",
+    [EVENT_STALL_TIMEOUT] = "Stall timeout",
+    [EVENT_ID_CHECKSUM] = "Unique ID checksum error",
+    [EVENT_ID_BYTE] = "Unique ID byte",
+};
+
+void eventlog_init(eventlog *log) {
+    log->head = log->tail = 0;
+    log->lost = 0;
+}
+
+void eventlog_put(eventlog *log, uint8_t type, uint8_t arg, uint32_t now) {
+    if ((uint8_t)(log->head - log->tail) == EVENTLOG_SIZE) {
+        if (log->lost != 0xff)
+            log->lost++;
+        return;
+    }
+
+    eventlog_event *e = &log->events[log->head++ % EVENTLOG_SIZE];
+    e->type = type;
+    e->arg = arg;
+    e->time = now;
+}
+
+bool eventlog_get(eventlog *log, eventlog_event *e) {
+    if (log->head != log->tail) {
+        *e = log->events[log->tail++ % EVENTLOG_SIZE];
+        return true;
+    }
+
+    if (!log->lost)
+        return false;
+
+    // Report the dropped events after the last event that did fit, at
+    // the time of that event
+    e->type = EVENT_LOST;
+    e->arg = log->lost;
+    e->time = log->events[(uint8_t)(log->tail - 1) % EVENTLOG_SIZE].time;
+    log->lost = 0;
+    return true;
+}
+
+void eventlog_encode(const eventlog_event *e, uint8_t *buf) {
+    buf[0] = EVENTLOG_SYNC;
+    buf[1] = e->type;
+    buf[2] = e->arg;
+    for (uint8_t i = 0; i < 4; ++i)
+        buf[3 + i] = e->time >> (8 * i);
+
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < EVENTLOG_RECORD_SIZE - 1; ++i)
+        crc = crc_update(EVENTLOG_CRC_POLY, crc, buf[i]);
+    buf[EVENTLOG_RECORD_SIZE - 1] = crc;
+}
+
+bool eventlog_decode(const uint8_t *buf, eventlog_event *e) {
+    if (buf[0] != EVENTLOG_SYNC)
+        return false;
+
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < EVENTLOG_RECORD_SIZE - 1; ++i)
+        crc = crc_update(EVENTLOG_CRC_POLY, crc, buf[i]);
+    if (crc != buf[EVENTLOG_RECORD_SIZE - 1])
+        return false;
+
+    e->type = buf[1];
+    e->arg = buf[2];
+    e->time = 0;
+    for (uint8_t i = 0; i < 4; ++i)
+        e->time |= (uint32_t)buf[3 + i] << (8 * i);
+    return true;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,108 @@
+// Deferred event log for the bus master
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// The bus code cannot print anything while a transaction is running:
+// at 115200 baud a single line can take longer than the time allowed
+// between two bits. Instead, it puts binary events into a fixed-size
+// ring buffer, which takes constant time. The application drains the
+// buffer between transactions and sends the events out as records,
+// which tools/logdecode turns back into text.
+//
+// The log is not protected against interrupts, it should only be used
+// from the main loop.
+
+#ifndef _EVENTLOG_H
+#define _EVENTLOG_H
+
+#include <stdint.h>
+
+// Number of events that fit in the log, must be a power of two no
+// bigger than 128
+#ifndef EVENTLOG_SIZE
+#define EVENTLOG_SIZE 32
+#endif
+
+// Records are sent as the sync byte, the type, the argument, the time
+// (32 bits, little endian) and a CRC over everything before it. The
+// sync byte is not valid ASCII, so records can be mixed with normal
+// text output.
+#define EVENTLOG_SYNC 0xa5
+#define EVENTLOG_RECORD_SIZE 8
+#define EVENTLOG_CRC_POLY 0x2f
+
+enum {
+    // Events were dropped because the log was full. The argument is
+    // the number of events dropped (up to 255).
+    EVENT_LOST,
+    // The bus stayed low too long when the master wanted to send
+    EVENT_BUS_LOW,
+    // A slave sent too many stall bits. The argument is the number of
+    // stall bits.
+    EVENT_STALL_TIMEOUT,
+    // A unique ID received during enumeration had an invalid checksum.
+    // The argument is the address the slave would have gotten, the ID
+    // bytes follow as EVENT_ID_BYTE events.
+    EVENT_ID_CHECKSUM,
+    EVENT_ID_BYTE,
+
+    EVENT_COUNT,
+};
+
+extern const char *eventlog_str[];
+
+struct eventlog_event {
+    uint8_t type;
+    uint8_t arg;
+    // micros() when the event happened
+    uint32_t time;
+};
+
+struct eventlog {
+    eventlog_event events[EVENTLOG_SIZE];
+    // Free-running indices of the next event to put and get
+    uint8_t head;
+    uint8_t tail;
+    // Events dropped since the last EVENT_LOST was returned
+    uint8_t lost;
+};
+
+// Clear the log
+void eventlog_init(eventlog *log);
+
+// Add an event to the log. When the log is full, the event is dropped
+// and counted instead.
+void eventlog_put(eventlog *log, uint8_t type, uint8_t arg, uint32_t now);
+
+// Remove the oldest event from the log. After the last event, an
+// EVENT_LOST event is returned when events were dropped. Returns false
+// when there are no more events.
+bool eventlog_get(eventlog *log, eventlog_event *e);
+
+// Encode an event into EVENTLOG_RECORD_SIZE bytes
+void eventlog_encode(const eventlog_event *e, uint8_t *buf);
+
+// Decode a record of EVENTLOG_RECORD_SIZE bytes. Returns false when
+// it does not start with the sync byte or the CRC does not match.
+bool eventlog_decode(const uint8_t *buf, eventlog_event *e);
+
+#endif // _EVENTLOG_H
@@ -0,0 +1,318 @@
+// Streaming parser for the backpack EEPROM layout
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <string.h>
+#include "layout.h"
+#include "crc.h"
+
+enum {
+    // Reading the fixed part of the header
+    STATE_HEADER,
+    // Reading the backpack name
+    STATE_HEADER_NAME,
+    // Expecting a descriptor type byte (or the checksum)
+    STATE_TYPE,
+    // Reading the fixed fields of a descriptor
+    STATE_FIELDS,
+    // Skipping the data bytes of a data descriptor
+    STATE_DATA,
+    // Reading the name of a descriptor
+    STATE_NAME,
+    // Reading the repeated type bytes of an empty descriptor
+    STATE_EMPTY,
+    // Reading the second checksum byte
+    STATE_CHECKSUM,
+    STATE_DONE,
+    STATE_ERROR,
+};
+
+const char *layout_error_str[] = {
+    [LAYOUT_OK] = "OK",
+    [LAYOUT_ERR_VERSION] = "LAYOUT_ERR_VERSION",
+    [LAYOUT_ERR_SIZE] = "LAYOUT_ERR_SIZE",
+    [LAYOUT_ERR_DESCRIPTOR] = "LAYOUT_ERR_DESCRIPTOR",
+    [LAYOUT_ERR_TRUNCATED] = "LAYOUT_ERR_TRUNCATED",
+    [LAYOUT_ERR_CHECKSUM] = "LAYOUT_ERR_CHECKSUM",
+};
+
+void layout_init(layout_parser *p) {
+    memset(p, 0, sizeof(*p));
+    p->state = STATE_HEADER;
+}
+
+static layout_result layout_fail(layout_parser *p, layout_error error) {
+    p->state = STATE_ERROR;
+    p->error = error;
+    return LAYOUT_ERROR;
+}
+
+// Add a character to the given name. Returns true when this was the
+// last character.
+static bool layout_name_char(layout_parser *p, char *name, uint8_t b) {
+    if (p->name_len < LAYOUT_NAME_LENGTH) {
+        name[p->name_len++] = b & 0x7f;
+        name[p->name_len] = '\0';
+    }
+    return b & 0x80;
+}
+
+static layout_result layout_start_name(layout_parser *p) {
+    p->state = STATE_NAME;
+    p->name_len = 0;
+    return LAYOUT_MORE;
+}
+
+// Finish the current descriptor, including the byte just fed
+static layout_result layout_end(layout_parser *p) {
+    p->cur.length = p->offset - p->cur.offset;
+    p->desc = p->cur;
+    p->state = STATE_TYPE;
+    return LAYOUT_DESCRIPTOR;
+}
+
+static layout_result layout_name_or_end(layout_parser *p, bool has_name) {
+    if (has_name)
+        return layout_start_name(p);
+    return layout_end(p);
+}
+
+// Start a new descriptor with the given type byte
+static layout_result layout_begin(layout_parser *p, uint8_t offset, uint8_t type) {
+    layout_descriptor *d = &p->cur;
+    const char *default_name = "";
+
+    memset(d, 0, sizeof(*d));
+    d->type = type;
+    d->offset = offset;
+    p->state = STATE_FIELDS;
+
+    switch (type) {
+        case DESC_GROUP:
+            return layout_start_name(p);
+        case DESC_EMPTY:
+            p->state = STATE_EMPTY;
+            return LAYOUT_MORE;
+        case DESC_POWER_USAGE:
+        case DESC_IO_PIN:
+            break;
+        case DESC_DATA:
+            default_name = "data";
+            break;
+        case DESC_UART:
+            default_name = "uart";
+            break;
+        case DESC_I2C_SLAVE:
+            default_name = "i2c";
+            break;
+        case DESC_SPI_SLAVE:
+            default_name = "spi";
+            break;
+        default:
+            return layout_fail(p, LAYOUT_ERR_DESCRIPTOR);
+    }
+    strcpy(d->name, default_name);
+    return LAYOUT_MORE;
+}
+
+// Handle the fixed fields of the current descriptor. pos is the offset
+// within the descriptor (the type byte is at pos 0).
+static layout_result layout_fields(layout_parser *p, uint8_t pos, uint8_t b) {
+    layout_descriptor *d = &p->cur;
+
+    switch (d->type) {
+        case DESC_POWER_USAGE:
+            switch (pos) {
+                case 1: d->power.pin = b & LAYOUT_PIN_MASK; break;
+                case 2: d->power.minimum = b; break;
+                case 3: d->power.typical = b; break;
+                case 4: d->power.maximum = b; return layout_end(p);
+            }
+            return LAYOUT_MORE;
+        case DESC_DATA:
+            d->data.offset = p->offset;
+            d->data.length = b & 0x7f;
+            if (d->data.length) {
+                p->state = STATE_DATA;
+                p->data_left = d->data.length;
+                p->has_name = b & 0x80;
+                return LAYOUT_MORE;
+            }
+            return layout_name_or_end(p, b & 0x80);
+        case DESC_IO_PIN:
+            d->io_pin.pin = b & LAYOUT_PIN_MASK;
+            return layout_start_name(p);
+        case DESC_UART:
+            switch (pos) {
+                case 1: d->uart.tx_pin = b & LAYOUT_PIN_MASK; break;
+                case 2: d->uart.rx_pin = b & LAYOUT_PIN_MASK; break;
+                case 3:
+                    d->uart.speed = b & 0x0f;
+                    return layout_name_or_end(p, b & 0x80);
+            }
+            return LAYOUT_MORE;
+        case DESC_I2C_SLAVE:
+            switch (pos) {
+                case 1:
+                    d->i2c.address = b & 0x7f;
+                    p->has_name = b & 0x80;
+                    break;
+                case 2:
+                    d->i2c.speed = b & 0x03;
+                    return layout_name_or_end(p, p->has_name);
+            }
+            return LAYOUT_MORE;
+        case DESC_SPI_SLAVE:
+            switch (pos) {
+                case 1:
+                    d->spi.ss_pin = b & LAYOUT_PIN_MASK;
+                    p->has_name = b & 0x80;
+                    break;
+                case 2:
+                    d->spi.speed = b;
+                    return layout_name_or_end(p, p->has_name);
+            }
+            return LAYOUT_MORE;
+    }
+    // Not reached, layout_begin rejects other types
+    return layout_fail(p, LAYOUT_ERR_DESCRIPTOR);
+}
+
+layout_result layout_feed(layout_parser *p, uint8_t b) {
+    if (p->state == STATE_DONE)
+        return LAYOUT_DONE;
+    if (p->state == STATE_ERROR)
+        return LAYOUT_ERROR;
+
+    uint8_t offset = p->offset++;
+
+    if (offset > LAYOUT_USED_SIZE_OFFSET &&
+        offset == p->header.used_size - LAYOUT_CHECKSUM_SIZE) {
+        // This is the first checksum byte, so the previous byte must
+        // have ended a descriptor. An empty descriptor has no explicit
+        // end, so it ends here.
+        p->checksum = b << 8;
+        if (p->state == STATE_TYPE) {
+            p->state = STATE_CHECKSUM;
+            return LAYOUT_MORE;
+        } else if (p->state == STATE_EMPTY) {
+            p->cur.length = offset - p->cur.offset;
+            p->desc = p->cur;
+            p->state = STATE_CHECKSUM;
+            return LAYOUT_DESCRIPTOR;
+        }
+        return layout_fail(p, LAYOUT_ERR_TRUNCATED);
+    }
+
+    if (p->state == STATE_CHECKSUM) {
+        p->checksum |= b;
+        if (p->checksum != p->crc)
+            return layout_fail(p, LAYOUT_ERR_CHECKSUM);
+        p->state = STATE_DONE;
+        return LAYOUT_DONE;
+    }
+
+    p->crc = crc16_update(LAYOUT_CRC_POLY, p->crc, b);
+
+    switch (p->state) {
+        case STATE_HEADER: {
+            layout_header *h = &p->header;
+            switch (offset) {
+                case 0:
+                    h->layout_version = b;
+                    if (b != LAYOUT_VERSION)
+                        return layout_fail(p, LAYOUT_ERR_VERSION);
+                    break;
+                case 1: h->eeprom_size = b; break;
+                case 2:
+                    h->used_size = b;
+                    if (b < LAYOUT_MIN_SIZE || b > h->eeprom_size)
+                        return layout_fail(p, LAYOUT_ERR_SIZE);
+                    break;
+                case 3: h->protocol_version = b; break;
+                case 4: h->model = b << 8; break;
+                case 5: h->model |= b; break;
+                case 6: h->hardware_revision = b; break;
+                case 7: h->serial = (uint32_t)b << 16; break;
+                case 8: h->serial |= (uint32_t)b << 8; break;
+                case 9: h->serial |= b; break;
+                // 10 is the unique ID checksum, already checked
+                // during enumeration
+                case 11:
+                    h->firmware_version = b;
+                    p->state = STATE_HEADER_NAME;
+                    break;
+            }
+            return LAYOUT_MORE;
+        }
+        case STATE_HEADER_NAME:
+            if (!layout_name_char(p, p->header.name, b))
+                return LAYOUT_MORE;
+            p->state = STATE_TYPE;
+            return LAYOUT_HEADER;
+        case STATE_TYPE:
+            return layout_begin(p, offset, b);
+        case STATE_FIELDS:
+            return layout_fields(p, offset - p->cur.offset, b);
+        case STATE_DATA:
+            if (--p->data_left)
+                return LAYOUT_MORE;
+            return layout_name_or_end(p, p->has_name);
+        case STATE_NAME:
+            if (!layout_name_char(p, p->cur.name, b))
+                return LAYOUT_MORE;
+            return layout_end(p);
+        case STATE_EMPTY: {
+            if (b == DESC_EMPTY)
+                return LAYOUT_MORE;
+            // This byte starts the next descriptor, which cannot be
+            // complete yet, so report the empty descriptor now.
+            layout_descriptor empty = p->cur;
+            empty.length = offset - empty.offset;
+            if (layout_begin(p, offset, b) == LAYOUT_ERROR)
+                return LAYOUT_ERROR;
+            p->desc = empty;
+            return LAYOUT_DESCRIPTOR;
+        }
+    }
+    return LAYOUT_MORE;
+}
+
+uint32_t layout_minifloat(uint8_t v, int8_t ebias, uint32_t unit) {
+    uint8_t e = v >> 4;
+    uint32_t s = v & 0x0f;
+
+    // Normal numbers have an implicit leading 1, denormal numbers (e ==
+    // 0) use the same exponent as e == 1
+    if (e)
+        s |= 0x10;
+    else
+        e = 1;
+
+    // s has 4 fractional bits
+    int8_t shift = e - ebias - 4;
+    s *= unit;
+    if (shift >= 0)
+        return s << shift;
+    return s >> -shift;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
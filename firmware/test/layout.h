@@ -0,0 +1,191 @@
+// Streaming parser for the backpack EEPROM layout
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// This parses the EEPROM contents as described in EEPROMLayout.rst. The
+// parser is fed one byte at a time, in order, so it can run while the
+// bytes are still coming in from the bus. It keeps only the header and
+// the most recent descriptor, the caller should copy whatever it needs
+// as soon as a descriptor is reported.
+
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+#include <stdint.h>
+
+// The only layout version this parser understands
+#define LAYOUT_VERSION 1
+
+// Offsets of header fields
+#define LAYOUT_EEPROM_SIZE_OFFSET 1
+#define LAYOUT_USED_SIZE_OFFSET 2
+#define LAYOUT_NAME_OFFSET 0xc
+
+// The checksum is the last two bytes of the used EEPROM size
+#define LAYOUT_CHECKSUM_SIZE 2
+#define LAYOUT_CRC_POLY 0xa7d3
+
+// The smallest valid layout: A header with a single-character name,
+// no descriptors and a checksum.
+#define LAYOUT_MIN_SIZE (LAYOUT_NAME_OFFSET + 1 + LAYOUT_CHECKSUM_SIZE)
+
+// Names longer than this are truncated
+#define LAYOUT_NAME_LENGTH 16
+
+// Pin numbers are stored in the lower 6 bits of a byte
+#define LAYOUT_PIN_MASK 0x3f
+
+enum {
+    DESC_GROUP = 0x01,
+    DESC_POWER_USAGE = 0x02,
+    DESC_DATA = 0x03,
+    DESC_IO_PIN = 0x04,
+    DESC_UART = 0x05,
+    DESC_I2C_SLAVE = 0x06,
+    DESC_SPI_SLAVE = 0x07,
+    DESC_EMPTY = 0xff,
+};
+
+typedef enum {
+    // More bytes are needed
+    LAYOUT_MORE,
+    // The header is complete and available in parser->header
+    LAYOUT_HEADER,
+    // A descriptor is complete and available in parser->desc
+    LAYOUT_DESCRIPTOR,
+    // The checksum was received and is valid, no more bytes are needed
+    LAYOUT_DONE,
+    // The contents are invalid, see parser->error
+    LAYOUT_ERROR,
+} layout_result;
+
+typedef enum {
+    LAYOUT_OK,
+    // Unsupported layout version
+    LAYOUT_ERR_VERSION,
+    // The used EEPROM size is too small or bigger than the EEPROM
+    LAYOUT_ERR_SIZE,
+    // Unknown descriptor type
+    LAYOUT_ERR_DESCRIPTOR,
+    // The name or a descriptor overlaps the checksum
+    LAYOUT_ERR_TRUNCATED,
+    // The checksum does not match
+    LAYOUT_ERR_CHECKSUM,
+} layout_error;
+
+extern const char *layout_error_str[];
+
+struct layout_header {
+    uint8_t layout_version;
+    uint8_t eeprom_size;
+    uint8_t used_size;
+    uint8_t protocol_version;
+    uint16_t model;
+    uint8_t hardware_revision;
+    uint32_t serial;
+    uint8_t firmware_version;
+    char name[LAYOUT_NAME_LENGTH + 1];
+};
+
+struct layout_descriptor {
+    // DESC_* value
+    uint8_t type;
+    // EEPROM offset of the type byte and the number of bytes in the
+    // descriptor, including the type byte
+    uint8_t offset;
+    uint8_t length;
+    // The name, or the default name when the descriptor has none. Empty
+    // for descriptors that cannot have a name.
+    char name[LAYOUT_NAME_LENGTH + 1];
+    // Type-specific fields. Minifloats are left encoded, use
+    // layout_power_usage() and layout_spi_speed() to decode them.
+    union {
+        struct {
+            uint8_t pin;
+            uint8_t minimum, typical, maximum;
+        } power;
+        struct {
+            // EEPROM offset and length of the data bytes. These are
+            // not stored by the parser, so they can be read later when
+            // needed.
+            uint8_t offset, length;
+        } data;
+        struct {
+            uint8_t pin;
+        } io_pin;
+        struct {
+            uint8_t tx_pin, rx_pin, speed;
+        } uart;
+        struct {
+            uint8_t address, speed;
+        } i2c;
+        struct {
+            uint8_t ss_pin, speed;
+        } spi;
+    };
+};
+
+struct layout_parser {
+    // EEPROM offset of the next byte
+    uint8_t offset;
+    // Parser state, private to layout.cpp
+    uint8_t state;
+    uint8_t name_len;
+    uint8_t data_left;
+    bool has_name;
+    uint16_t crc;
+    uint16_t checksum;
+    layout_error error;
+
+    layout_header header;
+    // The most recently completed descriptor
+    layout_descriptor desc;
+    // The descriptor being parsed
+    layout_descriptor cur;
+};
+
+// Prepare the parser for a new EEPROM, starting at offset 0
+void layout_init(layout_parser *p);
+
+// Pass the next byte of EEPROM contents to the parser. Once this has
+// returned LAYOUT_DONE or LAYOUT_ERROR, no more bytes should be passed.
+//
+// The used EEPROM size from the header determines where the checksum is,
+// so the parser knows when it has seen the last byte. Any bytes after
+// that are never needed.
+layout_result layout_feed(layout_parser *p, uint8_t b);
+
+// Decode a minifloat with a 4-bit exponent and a 4-bit significand, as
+// used in the EEPROM layout, and multiply it by unit. The result is
+// rounded down.
+uint32_t layout_minifloat(uint8_t v, int8_t ebias, uint32_t unit);
+
+// Power usage, in μA
+static inline uint32_t layout_power_usage(uint8_t v) {
+    return layout_minifloat(v, -4, 1);
+}
+
+// Maximum SPI speed, in Hz
+static inline uint32_t layout_spi_speed(uint8_t v) {
+    return layout_minifloat(v, 6, 1000000);
+}
+
+#endif // _LAYOUT_H
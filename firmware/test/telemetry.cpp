@@ -0,0 +1,200 @@
+// Master-side bus telemetry
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <string.h>
+#include "telemetry.h"
+#include "protocol.h"
+
+enum {
+    // No transaction in progress
+    STATE_IDLE,
+    // After a reset, expecting the address
+    STATE_RESET,
+    // Expecting the command
+    STATE_ADDRESSED,
+    // The command was sent
+    STATE_COMMAND,
+};
+
+const char *telemetry_result_str[] = {
+    [TELEMETRY_OK] = "ok",
+    [TELEMETRY_TIMEOUT] = "timeout",
+    [TELEMETRY_NACK] = "nack",
+    [TELEMETRY_NO_REPLY] = "no reply",
+    [TELEMETRY_COLLISION] = "collision",
+    [TELEMETRY_PARITY] = "parity",
+};
+
+void telemetry_init(telemetry *t) {
+    memset(t, 0, sizeof(*t));
+}
+
+static telemetry_entry *find_entry(telemetry *t, uint8_t addr, uint16_t cmd) {
+    for (uint8_t i = 0; i < t->used; ++i) {
+        telemetry_entry *e = &t->entries[i];
+        if (e->addr == addr && e->cmd == cmd)
+            return e;
+    }
+    if (t->used == TELEMETRY_ENTRIES)
+        return NULL;
+
+    telemetry_entry *e = &t->entries[t->used++];
+    memset(e, 0, sizeof(*e));
+    e->addr = addr;
+    e->cmd = cmd;
+    return e;
+}
+
+static void start_transaction(telemetry *t, uint8_t state, uint32_t now) {
+    t->state = state;
+    t->start = t->end = now;
+    t->bytes = 0;
+    t->stall_bits = 0;
+    t->result = TELEMETRY_OK;
+}
+
+void telemetry_end(telemetry *t) {
+    // Nothing was sent after the reset
+    if (t->state == STATE_IDLE || t->state == STATE_RESET) {
+        t->state = STATE_IDLE;
+        return;
+    }
+    t->state = STATE_IDLE;
+
+    bool retry = t->prev_failed && t->prev_addr == t->addr && t->prev_cmd == t->cmd;
+    t->prev_addr = t->addr;
+    t->prev_cmd = t->cmd;
+    t->prev_failed = t->result != TELEMETRY_OK;
+
+    telemetry_entry *e = find_entry(t, t->addr, t->cmd);
+    if (!e) {
+        t->dropped++;
+        return;
+    }
+
+    uint32_t latency = t->end - t->start;
+    e->transactions++;
+    if (retry)
+        e->retries++;
+    e->results[t->result]++;
+    if (t->result == TELEMETRY_NACK)
+        e->last_nack = t->nack;
+    e->bytes += t->bytes;
+    e->stall_bits += t->stall_bits;
+    e->latency_total += latency;
+    if (latency > e->latency_max)
+        e->latency_max = latency;
+
+    uint32_t v = latency / TELEMETRY_BUCKET_US;
+    uint8_t bucket = 0;
+    while (v && bucket < TELEMETRY_BUCKETS - 1) {
+        v >>= 1;
+        bucket++;
+    }
+    e->latency[bucket]++;
+}
+
+void telemetry_begin(telemetry *t, uint32_t now) {
+    telemetry_end(t);
+    start_transaction(t, STATE_RESET, now);
+}
+
+void telemetry_command(telemetry *t, uint32_t now) {
+    if (t->state != STATE_COMMAND)
+        return;
+    telemetry_end(t);
+    start_transaction(t, STATE_ADDRESSED, now);
+}
+
+void telemetry_byte(telemetry *t, bool write, uint8_t value, telemetry_result result, uint8_t slave_code, uint32_t now) {
+    if (t->state == STATE_IDLE)
+        return;
+
+    if (write && t->state == STATE_RESET) {
+        t->addr = value;
+        t->cmd = TELEMETRY_NO_COMMAND;
+        // Broadcasts have no separate command byte
+        t->state = value >= BC_FIRST ? STATE_COMMAND : STATE_ADDRESSED;
+    } else if (write && t->state == STATE_ADDRESSED) {
+        t->cmd = value;
+        t->state = STATE_COMMAND;
+    }
+
+    t->end = now;
+    if (result == TELEMETRY_OK) {
+        t->bytes++;
+    } else if (t->result == TELEMETRY_OK) {
+        t->result = result;
+        t->nack = slave_code;
+    }
+}
+
+void telemetry_stall(telemetry *t) {
+    t->stall_bits++;
+}
+
+const telemetry_entry *telemetry_find(const telemetry *t, uint8_t addr, uint16_t cmd) {
+    for (uint8_t i = 0; i < t->used; ++i) {
+        const telemetry_entry *e = &t->entries[i];
+        if (e->addr == addr && e->cmd == cmd)
+            return e;
+    }
+    return NULL;
+}
+
+bool telemetry_slave(const telemetry *t, uint8_t addr, telemetry_entry *sum) {
+    memset(sum, 0, sizeof(*sum));
+    sum->addr = addr;
+    sum->cmd = TELEMETRY_NO_COMMAND;
+
+    uint16_t most_nacks = 0;
+    for (uint8_t i = 0; i < t->used; ++i) {
+        const telemetry_entry *e = &t->entries[i];
+        if (e->addr != addr)
+            continue;
+        sum->transactions += e->transactions;
+        sum->retries += e->retries;
+        for (uint8_t r = 0; r < TELEMETRY_RESULTS; ++r)
+            sum->results[r] += e->results[r];
+        if (e->results[TELEMETRY_NACK] > most_nacks) {
+            most_nacks = e->results[TELEMETRY_NACK];
+            sum->last_nack = e->last_nack;
+        }
+        sum->bytes += e->bytes;
+        sum->stall_bits += e->stall_bits;
+        sum->latency_total += e->latency_total;
+        if (e->latency_max > sum->latency_max)
+            sum->latency_max = e->latency_max;
+        for (uint8_t b = 0; b < TELEMETRY_BUCKETS; ++b)
+            sum->latency[b] += e->latency[b];
+    }
+    return sum->transactions != 0;
+}
+
+uint8_t telemetry_snapshot(const telemetry *t, telemetry_entry *buf, uint8_t size) {
+    uint8_t count = t->used < size ? t->used : size;
+    memcpy(buf, t->entries, count * sizeof(*buf));
+    return count;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
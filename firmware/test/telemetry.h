@@ -0,0 +1,159 @@
+// Master-side bus telemetry
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// This keeps aggregate numbers about the bus traffic of the master, per
+// slave address and per command: transactions, bytes, stall bits,
+// results, retries and a latency histogram. The bus driver feeds it
+// every reset, byte and stall bit, the telemetry splits these into
+// transactions.
+//
+// A transaction starts at a bus reset, or at the next command in a
+// chained session, and ends at the start of the next one (or at
+// telemetry_end). The first byte written after a reset is the address
+// (or broadcast command), the first byte written after that is the
+// command. Its latency is the time from its start until its last byte
+// was completed.
+//
+// All counters wrap around, so to report them periodically, take
+// snapshots and report the differences.
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdint.h>
+
+// Number of address and command combinations that are tracked.
+// Transactions for combinations that do not fit are only counted in
+// telemetry.dropped.
+#ifndef TELEMETRY_ENTRIES
+#define TELEMETRY_ENTRIES 16
+#endif
+
+// Latency histogram buckets. Bucket n counts latencies below
+// TELEMETRY_BUCKET_US << n, the last bucket counts everything longer.
+#define TELEMETRY_BUCKETS 8
+#define TELEMETRY_BUCKET_US 4096
+
+// telemetry_entry.cmd for transactions that ended before a command was
+// sent (and for broadcasts, which have no separate command byte)
+#define TELEMETRY_NO_COMMAND 0x100
+
+// Result of a transaction, the first error ends it
+typedef enum {
+    TELEMETRY_OK,
+    // The bus stayed low, or the slave kept stalling
+    TELEMETRY_TIMEOUT,
+    // The slave nacked, see telemetry_entry.last_nack
+    TELEMETRY_NACK,
+    // Nobody acked or nacked (this is the normal end of an enumeration)
+    TELEMETRY_NO_REPLY,
+    // Both an ack and a nack were received
+    TELEMETRY_COLLISION,
+    // A byte received by the master had a parity error
+    TELEMETRY_PARITY,
+
+    TELEMETRY_RESULTS,
+} telemetry_result;
+
+extern const char *telemetry_result_str[];
+
+struct telemetry_entry {
+    // Slave address, or BC_CMD_* value for broadcasts
+    uint8_t addr;
+    // CMD_* value or TELEMETRY_NO_COMMAND
+    uint16_t cmd;
+    uint16_t transactions;
+    // Transactions that repeated the command of the previous, failed
+    // transaction to the same address
+    uint16_t retries;
+    uint16_t results[TELEMETRY_RESULTS];
+    // Slave error code (ERR_* value) of the most recent nack
+    uint8_t last_nack;
+    // Bytes acked, in either direction. The error code a slave sends
+    // after a nack is not counted.
+    uint32_t bytes;
+    uint32_t stall_bits;
+    // Latencies, in μs
+    uint32_t latency_total;
+    uint32_t latency_max;
+    uint16_t latency[TELEMETRY_BUCKETS];
+};
+
+struct telemetry {
+    telemetry_entry entries[TELEMETRY_ENTRIES];
+    uint8_t used;
+    // Transactions that did not fit in entries
+    uint16_t dropped;
+
+    // The current transaction, private to telemetry.cpp
+    uint8_t state;
+    uint8_t addr;
+    uint16_t cmd;
+    uint32_t start;
+    uint32_t end;
+    uint32_t bytes;
+    uint32_t stall_bits;
+    telemetry_result result;
+    uint8_t nack;
+
+    // The previous transaction, for counting retries
+    uint8_t prev_addr;
+    uint16_t prev_cmd;
+    bool prev_failed;
+};
+
+// Clear all counters
+void telemetry_init(telemetry *t);
+
+// A bus reset started at now (in μs). Ends the current transaction.
+void telemetry_begin(telemetry *t, uint32_t now);
+
+// The next byte written is a command in the current session. If the
+// current transaction already has a command, it is ended and a new one
+// for the same address starts at now.
+void telemetry_command(telemetry *t, uint32_t now);
+
+// A byte was completed at now. result is the result of the byte, for
+// TELEMETRY_NACK, slave_code is the slave error code.
+void telemetry_byte(telemetry *t, bool write, uint8_t value, telemetry_result result, uint8_t slave_code, uint32_t now);
+
+// A stall bit was received
+void telemetry_stall(telemetry *t);
+
+// End the current transaction, so it is included in the counters
+void telemetry_end(telemetry *t);
+
+// Return the counters for the given address and command, or NULL when
+// there were no transactions for them.
+const telemetry_entry *telemetry_find(const telemetry *t, uint8_t addr, uint16_t cmd);
+
+// Sum the counters of all commands for the given address into *sum,
+// which gets cmd TELEMETRY_NO_COMMAND. last_nack is taken from the
+// entry with the most nacks. Returns false when there were no
+// transactions for the address.
+bool telemetry_slave(const telemetry *t, uint8_t addr, telemetry_entry *sum);
+
+// Copy up to size entries into buf, in the order they were first used.
+// Returns the number of entries copied.
+uint8_t telemetry_snapshot(const telemetry *t, telemetry_entry *buf, uint8_t size);
+
+#endif // _TELEMETRY_H
@@ -0,0 +1,189 @@
+// Backpack bus trace decoder and profiler
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// Decodes a VCD capture of the bus line and prints every transaction
+// and protocol violation, followed by a summary with latencies, stall
+// bits and the time spent on resets, data and handshakes. A sigrok
+// capture can be decoded directly with:
+//
+//   sigrok-cli -i capture.sr -O vcd | busdecode -
+//
+// With -v, every byte is printed as well. With -q, only violations and
+// the summary are printed. The exit status is 1 when there were
+// protocol violations.
+//
+// Usage: busdecode [-v|-q] [-s signal] capture.vcd|-
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "decoder.h"
+#include "vcd.h"
+
+static int verbosity = 1;
+
+static void print_time(decode_time t) {
+    printf("%12.6f", t / 1e9);
+}
+
+class Printer : public DecodeListener {
+public:
+    virtual void byte(const decode_byte &b) {
+        if (verbosity < 2)
+            return;
+        print_time(b.start);
+        printf("     0x%02x %-14s %-8s", b.value, decode_role_str[b.role],
+               decode_handshake_str[b.handshake]);
+        if (b.stall_bits)
+            printf(" stall=%u", b.stall_bits);
+        if (b.parity_error)
+            printf(" parity error");
+        if (b.corrected)
+            printf(" corrected");
+        printf("\n");
+    }
+
+    virtual void transaction(const decode_transaction &t) {
+        if (verbosity < 1)
+            return;
+        print_time(t.start);
+        printf(" %8.3fms %s: %s", (t.end - t.start) / 1e6, t.description,
+               decode_result_str[t.result]);
+        if (t.stall_bits)
+            printf(", %u stall bits", t.stall_bits);
+        printf("\n");
+    }
+
+    virtual void violation(decode_time t, decode_violation v, decode_time duration) {
+        print_time(t);
+        printf(" ---> %s", decode_violation_str[v]);
+        if (duration)
+            printf(" (%.1fus)", duration / 1e3);
+        printf("\n");
+    }
+};
+
+static double percent(decode_time part, decode_time total) {
+    return total ? 100.0 * part / total : 0;
+}
+
+static void print_summary(const decode_stats &s, decode_time end) {
+    printf("\n%lu transactions in %.3fs", s.transactions, end / 1e9);
+    if (s.transactions) {
+        printf(", latency min/avg/max %.3f/%.3f/%.3f ms",
+               s.latency_min / 1e6, s.latency_total / 1e6 / s.transactions,
+               s.latency_max / 1e6);
+    }
+    printf("\n");
+    printf("Results: %lu ok, %lu nack, %lu no slave, %lu error\n",
+           s.results[RESULT_OK], s.results[RESULT_NACK],
+           s.results[RESULT_NO_SLAVE], s.results[RESULT_ERROR]);
+    printf("%lu bytes (%lu data bytes), %lu stall bits (max %u per byte)\n",
+           s.bytes, s.data_bytes, s.stall_bits, s.max_stall_bits);
+    printf("%lu parity errors, %lu corrected\n", s.parity_errors, s.corrected);
+
+    decode_time busy = s.reset_time + s.data_time + s.handshake_time;
+    printf("Bus time: %.1f%% reset, %.1f%% data, %.1f%% handshake\n",
+           percent(s.reset_time, busy), percent(s.data_time, busy),
+           percent(s.handshake_time, busy));
+    if (busy)
+        printf("Goodput: %.0f data bytes/s while busy\n", s.data_bytes * 1e9 / busy);
+
+    bool header = false;
+    for (unsigned c = 0; c < 256; ++c) {
+        if (!s.commands[c])
+            continue;
+        if (!header)
+            printf("Commands:\n");
+        header = true;
+        printf("\t0x%02x: %lu\n", c, s.commands[c]);
+    }
+
+    header = false;
+    for (unsigned v = 0; v < VIOLATION_COUNT; ++v) {
+        if (!s.violations[v])
+            continue;
+        if (!header)
+            printf("Violations:\n");
+        header = true;
+        printf("\t%s: %lu\n", decode_violation_str[v], s.violations[v]);
+    }
+    if (!header)
+        printf("No violations\n");
+}
+
+int main(int argc, char **argv) {
+    const char *signal = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vqs:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbosity = 2;
+            break;
+        case 'q':
+            verbosity = 0;
+            break;
+        case 's':
+            signal = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v|-q] [-s signal] capture.vcd|-\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-v|-q] [-s signal] capture.vcd|-\n", argv[0]);
+        return 2;
+    }
+
+    const char *filename = argv[optind];
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!f) {
+        perror(filename);
+        return 2;
+    }
+
+    Printer printer;
+    BusDecoder decoder(&printer);
+    VcdReader reader(f, signal);
+    bool ok = reader.run(decoder);
+    decoder.finish(reader.end());
+    if (f != stdin)
+        fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", filename, reader.error());
+        return 2;
+    }
+
+    print_summary(decoder.stats(), reader.end());
+
+    for (unsigned v = 0; v < VIOLATION_COUNT; ++v) {
+        if (decoder.stats().violations[v])
+            return 1;
+    }
+    return 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
@@ -0,0 +1,627 @@
+// Backpack bus protocol decoder
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "decoder.h"
+#include "../../firmware/protocol.h"
+
+static inline decode_time us(decode_time x) { return x * 1000; }
+
+// Protocol states: what the next byte means
+enum {
+    STATE_ADDRESS,
+    STATE_COMMAND,
+    STATE_COUNT,
+    // High byte of a 16-bit address, followed by STATE_EEPROM_ADDRESS
+    STATE_EEPROM_ADDRESS_HIGH,
+    STATE_EEPROM_ADDRESS,
+    STATE_DATA,
+    STATE_MODE,
+    STATE_ERROR_CODE,
+    STATE_ENUMERATE,
+    STATE_FAILURES,
+    // The transaction should be over, any byte that is acked or nacked
+    // is unexpected
+    STATE_END,
+};
+
+const char *decode_handshake_str[] = {
+    [HANDSHAKE_ACK] = "ack",
+    [HANDSHAKE_NACK] = "nack",
+    [HANDSHAKE_NONE] = "none",
+    [HANDSHAKE_BOTH] = "ack+nack",
+};
+
+const char *decode_role_str[] = {
+    [ROLE_ADDRESS] = "address",
+    [ROLE_COMMAND] = "command",
+    [ROLE_COUNT] = "count",
+    [ROLE_EEPROM_ADDRESS] = "eeprom address",
+    [ROLE_DATA] = "data",
+    [ROLE_MODE] = "mode",
+    [ROLE_ERROR_CODE] = "error code",
+    [ROLE_UNIQUE_ID] = "unique id",
+    [ROLE_FAILED_SLAVE] = "failed slave",
+    [ROLE_UNEXPECTED] = "unexpected",
+};
+
+const char *decode_violation_str[] = {
+    [VIOLATION_SHORT_RESET] = "Reset too short",
+    [VIOLATION_LONG_RESET] = "Reset too long",
+    [VIOLATION_INVALID_PULSE] = "Low too long for a bit",
+    [VIOLATION_EARLY_BIT] = "Next bit too early",
+    [VIOLATION_LATE_BIT] = "Next bit too late",
+    [VIOLATION_SHORT_IDLE] = "Bus idle time too short",
+    [VIOLATION_INVALID_SYMBOL] = "Invalid symbol pair",
+    [VIOLATION_HANDSHAKE] = "Ack and nack from addressed slave",
+    [VIOLATION_TRUNCATED] = "Transaction ended halfway through a byte",
+    [VIOLATION_UNEXPECTED_BYTE] = "Unexpected byte",
+    [VIOLATION_NO_RESET] = "Bits without a reset",
+};
+
+const char *decode_result_str[] = {
+    [RESULT_OK] = "ok",
+    [RESULT_NACK] = "nack",
+    [RESULT_NO_SLAVE] = "no slave",
+    [RESULT_ERROR] = "error",
+};
+
+static const char *command_name(uint8_t cmd) {
+    switch (cmd) {
+        case CMD_READ_EEPROM: return "READ_EEPROM";
+        case CMD_WRITE_EEPROM: return "WRITE_EEPROM";
+        case CMD_READ_EEPROM_COUNTED: return "READ_EEPROM_COUNTED";
+        case CMD_WRITE_EEPROM_COUNTED: return "WRITE_EEPROM_COUNTED";
+        case CMD_SET_MODE: return "SET_MODE";
+        case CMD_READ_STATS: return "READ_STATS";
+        case CMD_CLEAR_STATS: return "CLEAR_STATS";
+        case CMD_READ_CAPABILITIES: return "READ_CAPABILITIES";
+        case CMD_SET_BITS: return "SET_BITS";
+        case CMD_CLEAR_BITS: return "CLEAR_BITS";
+        case CMD_COMPARE_SWAP: return "COMPARE_SWAP";
+        case CMD_READ_EEPROM_WIDE: return "READ_EEPROM_WIDE";
+        case CMD_WRITE_EEPROM_WIDE: return "WRITE_EEPROM_WIDE";
+        case CMD_READ_EEPROM_SIZE: return "READ_EEPROM_SIZE";
+    }
+    return NULL;
+}
+
+static uint8_t popcount(uint16_t v) {
+    uint8_t n = 0;
+    for (; v; v >>= 1)
+        n += v & 1;
+    return n;
+}
+
+// MODE_FEC check bits, see bp_hamming_check() in the test code
+static const uint8_t fec_positions[] = {3, 5, 6, 7, 9, 10, 11, 12};
+
+static uint8_t fec_check(uint8_t b) {
+    uint8_t result = 0x0c;
+    for (uint8_t n = 0; n < sizeof(fec_positions); ++n) {
+        if (b & (1 << n))
+            result ^= fec_positions[n];
+    }
+    return result;
+}
+
+BusDecoder::BusDecoder(DecodeListener *listener)
+    : listener(listener), level(true), started(false), have_fall(false),
+      fall(0), rise(0), have_prev(false), prev_fall(0), prev_rise(0),
+      last(LAST_NONE), prev_low(0), reported_no_reset(false),
+      in_transaction(false), desc_len(0), phase(PHASE_DATA), bits(0),
+      shift(0), symbols(0), first_symbol(0), first_ack_bit(false),
+      mode(0), requested_mode(0), state(STATE_END), command(0),
+      counted(false), count(0), remaining(0), id_pos(0) {
+    memset(&totals, 0, sizeof(totals));
+    totals.latency_min = ~(decode_time)0;
+    memset(&tx, 0, sizeof(tx));
+    memset(&cur, 0, sizeof(cur));
+}
+
+void BusDecoder::edge(decode_time t, bool high) {
+    if (!started) {
+        // The initial level, not a change
+        started = true;
+        level = high;
+        return;
+    }
+    if (high == level)
+        return;
+    level = high;
+
+    if (!high) {
+        fall = t;
+        have_fall = true;
+    } else if (have_fall) {
+        rise = t;
+        pulse(fall, rise - fall);
+    }
+}
+
+void BusDecoder::finish(decode_time t) {
+    if (!in_transaction || !have_prev)
+        return;
+
+    // The time since the last bit start counts, up to the point where
+    // the next bit should have started
+    decode_time period = t - prev_fall;
+    decode_time cap = last == LAST_RESET ? prev_low + us(DECODE_NEXT_BIT_MAX) : us(DECODE_NEXT_BIT_MAX);
+    if (period > cap)
+        period = cap;
+    account(period);
+    end_transaction(prev_fall + period);
+}
+
+void BusDecoder::report(decode_time t, decode_violation v, decode_time duration) {
+    totals.violations[v]++;
+    if (listener)
+        listener->violation(t, v, duration);
+}
+
+// Add the time since the start of the previous pulse to the part of
+// the transaction it belongs to
+void BusDecoder::account(decode_time duration) {
+    switch (last) {
+        case LAST_RESET: tx.reset_time += duration; break;
+        case LAST_DATA: tx.data_time += duration; break;
+        case LAST_HANDSHAKE: tx.handshake_time += duration; break;
+        case LAST_NONE: break;
+    }
+}
+
+// Handle the time between the previous pulse and a new one starting at
+// start. This ends the transaction when the new pulse is a reset or
+// when the slaves have timed out in between.
+void BusDecoder::previous_pulse(decode_time start, bool is_reset) {
+    if (!have_prev || !in_transaction)
+        return;
+
+    decode_time period = start - prev_fall;
+    decode_time high = start - prev_rise;
+    // After a reset, slaves time out relative to its end
+    decode_time since = last == LAST_RESET ? high : period;
+    if (is_reset || since > us(DECODE_TRANSACTION_TIMEOUT)) {
+        decode_time cap = last == LAST_RESET ? prev_low + us(DECODE_NEXT_BIT_MAX) : us(DECODE_NEXT_BIT_MAX);
+        if (period > cap)
+            period = cap;
+        account(period);
+        end_transaction(prev_fall + period);
+        return;
+    }
+
+    account(period);
+    if (last != LAST_RESET) {
+        if (period + us(DECODE_TOLERANCE) < us(DECODE_NEXT_BIT_MIN))
+            report(start, VIOLATION_EARLY_BIT, period);
+        else if (period > us(DECODE_NEXT_BIT_MAX + DECODE_TOLERANCE))
+            report(start, VIOLATION_LATE_BIT, period);
+    }
+    if (high + us(DECODE_TOLERANCE) < us(DECODE_IDLE_MIN))
+        report(start, VIOLATION_SHORT_IDLE, high);
+}
+
+void BusDecoder::pulse(decode_time start, decode_time low) {
+    bool is_reset = low >= us(DECODE_RESET_DETECT);
+    previous_pulse(start, is_reset);
+
+    if (is_reset) {
+        if (low + us(DECODE_TOLERANCE) < us(DECODE_RESET_MIN))
+            report(start, VIOLATION_SHORT_RESET, low);
+        else if (low > us(DECODE_RESET_MAX + DECODE_TOLERANCE))
+            report(start, VIOLATION_LONG_RESET, low);
+        begin_transaction(start);
+        last = LAST_RESET;
+    } else if (!in_transaction) {
+        // Probably a capture that started halfway through a transaction
+        if (!reported_no_reset)
+            report(start, VIOLATION_NO_RESET);
+        reported_no_reset = true;
+        last = LAST_NONE;
+    } else {
+        if (low > us(DECODE_BIT_LOW_MAX + DECODE_TOLERANCE))
+            report(start, VIOLATION_INVALID_PULSE, low);
+
+        if (phase == PHASE_DATA && !bits && !symbols) {
+            memset(&cur, 0, sizeof(cur));
+            cur.start = start;
+            cur.mode = mode;
+        }
+        last = phase == PHASE_DATA ? LAST_DATA : LAST_HANDSHAKE;
+
+        if (phase == PHASE_DATA && (mode & MODE_TERNARY)) {
+            uint8_t s = low < us(DECODE_SYMBOL_SAMPLE1) ? 0 :
+                        low < us(DECODE_SYMBOL_SAMPLE2) ? 1 : 2;
+            symbol(start, s);
+        } else {
+            bit(start, low < us(DECODE_BIT_ONE_MAX));
+        }
+    }
+
+    have_prev = true;
+    prev_fall = start;
+    prev_rise = start + low;
+    prev_low = low;
+}
+
+void BusDecoder::bit(decode_time start, bool value) {
+    (void)start;
+    switch (phase) {
+        case PHASE_DATA:
+            shift = shift << 1 | value;
+            if (++bits == ((mode & MODE_FEC) ? 13 : 9))
+                data_done();
+            break;
+        case PHASE_READY:
+            // A stall bit is a 0, the ready bit a 1
+            if (value)
+                phase = PHASE_ACK1;
+            else
+                cur.stall_bits++;
+            break;
+        case PHASE_ACK1:
+            first_ack_bit = value;
+            phase = PHASE_ACK2;
+            break;
+        case PHASE_ACK2:
+            if (!first_ack_bit)
+                cur.handshake = value ? HANDSHAKE_ACK : HANDSHAKE_BOTH;
+            else
+                cur.handshake = value ? HANDSHAKE_NONE : HANDSHAKE_NACK;
+            byte_done();
+            break;
+    }
+}
+
+// Every pair of MODE_TERNARY symbols carries three bits
+void BusDecoder::symbol(decode_time start, uint8_t value) {
+    if (!(symbols++ & 1)) {
+        first_symbol = value;
+        return;
+    }
+
+    uint8_t v = 0;
+    if (first_symbol == 2 && value == 2) {
+        report(start, VIOLATION_INVALID_SYMBOL);
+        cur.parity_error = true;
+    } else {
+        v = 7 - (first_symbol * 3 + value);
+    }
+    shift = shift << 3 | v;
+    bits += 3;
+    if (bits == 9)
+        data_done();
+}
+
+// All data, check and parity bits were received
+void BusDecoder::data_done() {
+    if (mode & MODE_FEC) {
+        uint8_t data = shift >> 5;
+        uint8_t check = (shift >> 1) & 0x0f;
+        bool parity_ok = popcount(shift & 0x1fff) & 1;
+        uint8_t syndrome = check ^ fec_check(data);
+        if (parity_ok) {
+            if (syndrome)
+                cur.parity_error = true;
+        } else if (syndrome & (syndrome - 1)) {
+            // A flipped data bit, or more than one flipped bit
+            cur.parity_error = true;
+            for (uint8_t n = 0; n < sizeof(fec_positions); ++n) {
+                if (fec_positions[n] == syndrome) {
+                    data ^= 1 << n;
+                    cur.parity_error = false;
+                    cur.corrected = true;
+                }
+            }
+        } else {
+            // The parity bit or a check bit was flipped
+            cur.corrected = true;
+        }
+        cur.value = data;
+    } else {
+        cur.value = shift >> 1;
+        if (!(popcount(shift & 0x1ff) & 1))
+            cur.parity_error = true;
+    }
+    phase = PHASE_READY;
+}
+
+void BusDecoder::byte_done() {
+    cur.end = rise;
+    protocol(cur);
+
+    tx.bytes++;
+    tx.stall_bits += cur.stall_bits;
+    if (cur.stall_bits > totals.max_stall_bits)
+        totals.max_stall_bits = cur.stall_bits;
+    if (cur.parity_error)
+        totals.parity_errors++;
+    if (cur.corrected)
+        totals.corrected++;
+    if (listener)
+        listener->byte(cur);
+
+    phase = PHASE_DATA;
+    bits = 0;
+    symbols = 0;
+    shift = 0;
+}
+
+void BusDecoder::describe(const char *fmt, ...) {
+    // Already truncated
+    if (desc_len > DECODE_DESCRIPTION_LENGTH)
+        return;
+
+    char buf[32];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    if (desc_len + n > DECODE_DESCRIPTION_LENGTH - 3) {
+        strcpy(&tx.description[desc_len < DECODE_DESCRIPTION_LENGTH - 3 ? desc_len : DECODE_DESCRIPTION_LENGTH - 3], "...");
+        desc_len = DECODE_DESCRIPTION_LENGTH + 1;
+        return;
+    }
+    memcpy(&tx.description[desc_len], buf, n + 1);
+    desc_len += n;
+}
+
+// Called when all data bytes of a command were transferred
+void BusDecoder::data_end() {
+    if (command == BC_CMD_WRITE_EEPROM) {
+        state = STATE_FAILURES;
+    } else if (command == BC_CMD_READ_EEPROM) {
+        // The next slave takes its turn
+        describe(" |");
+        remaining = count;
+        state = count ? STATE_DATA : STATE_END;
+    } else {
+        describe(",");
+        state = STATE_COMMAND;
+    }
+}
+
+// Find out what the byte means and what the next byte will be
+void BusDecoder::protocol(decode_byte &b) {
+    uint8_t v = b.value;
+
+    switch (state) {
+        case STATE_ADDRESS:
+            b.role = ROLE_ADDRESS;
+            tx.address = v;
+            command = v;
+            counted = true;
+            if (v < BC_FIRST) {
+                describe("0x%02x", v);
+                state = STATE_COMMAND;
+            } else if (v == BC_CMD_ENUMERATE) {
+                describe("ENUMERATE");
+                totals.commands[v]++;
+                id_pos = 0;
+                state = STATE_ENUMERATE;
+            } else if (v == BC_CMD_WRITE_EEPROM || v == BC_CMD_READ_EEPROM) {
+                describe(v == BC_CMD_WRITE_EEPROM ? "BC_WRITE_EEPROM" : "BC_READ_EEPROM");
+                totals.commands[v]++;
+                state = STATE_COUNT;
+            } else {
+                describe("0x%02x (reserved)", v);
+                state = STATE_END;
+            }
+            break;
+        case STATE_COMMAND:
+            b.role = ROLE_COMMAND;
+            command = v;
+            totals.commands[v]++;
+            if (command_name(v))
+                describe(" %s", command_name(v));
+            else
+                describe(" 0x%02x", v);
+            counted = v == CMD_READ_EEPROM_COUNTED || v == CMD_WRITE_EEPROM_COUNTED
+                   || v == CMD_READ_EEPROM_WIDE || v == CMD_WRITE_EEPROM_WIDE;
+            if (v == CMD_READ_EEPROM || v == CMD_WRITE_EEPROM)
+                state = STATE_EEPROM_ADDRESS;
+            else if (v == CMD_SET_BITS || v == CMD_CLEAR_BITS || v == CMD_COMPARE_SWAP)
+                state = STATE_EEPROM_ADDRESS;
+            else if (counted)
+                state = STATE_COUNT;
+            else if (v == CMD_SET_MODE)
+                state = STATE_MODE;
+            else if (v == CMD_CLEAR_STATS)
+                describe(",");
+            else if (v == CMD_READ_STATS || v == CMD_READ_CAPABILITIES || v == CMD_READ_EEPROM_SIZE)
+                state = STATE_DATA;
+            else
+                state = STATE_END;
+            if (v == CMD_READ_STATS || v == CMD_READ_CAPABILITIES || v == CMD_READ_EEPROM_SIZE) {
+                // Like a counted read, without count and address
+                counted = true;
+                count = v == CMD_READ_STATS ? STAT_COUNT : 2;
+                remaining = count;
+            }
+            if (v == CMD_SET_BITS || v == CMD_CLEAR_BITS || v == CMD_COMPARE_SWAP) {
+                // Like a counted command, with the operands and the
+                // old value sent back as data
+                counted = true;
+                count = v == CMD_COMPARE_SWAP ? 3 : 2;
+            }
+            break;
+        case STATE_COUNT:
+            b.role = ROLE_COUNT;
+            count = v;
+            describe(" n=%u", v);
+            if (command == CMD_READ_EEPROM_WIDE || command == CMD_WRITE_EEPROM_WIDE)
+                state = STATE_EEPROM_ADDRESS_HIGH;
+            else
+                state = STATE_EEPROM_ADDRESS;
+            break;
+        case STATE_EEPROM_ADDRESS_HIGH:
+            b.role = ROLE_EEPROM_ADDRESS;
+            // The low byte completes the address
+            describe(" @0x%02x", v);
+            state = STATE_EEPROM_ADDRESS;
+            break;
+        case STATE_EEPROM_ADDRESS:
+            b.role = ROLE_EEPROM_ADDRESS;
+            if (command == CMD_READ_EEPROM_WIDE || command == CMD_WRITE_EEPROM_WIDE)
+                describe("%02x:", v);
+            else
+                describe(" @0x%02x:", v);
+            remaining = count;
+            state = STATE_DATA;
+            if (counted && !count)
+                data_end();
+            break;
+        case STATE_DATA:
+            b.role = ROLE_DATA;
+            tx.data_bytes++;
+            describe(" %02x", v);
+            if (counted && !--remaining)
+                data_end();
+            break;
+        case STATE_MODE:
+            b.role = ROLE_MODE;
+            describe(" 0x%02x", v);
+            requested_mode = v;
+            state = STATE_COMMAND;
+            break;
+        case STATE_ERROR_CODE:
+            b.role = ROLE_ERROR_CODE;
+            tx.error_code = v;
+            tx.has_error_code = true;
+            describe(" error 0x%02x", v);
+            state = STATE_END;
+            return;
+        case STATE_ENUMERATE:
+            b.role = ROLE_UNIQUE_ID;
+            if (!id_pos && b.handshake == HANDSHAKE_NONE) {
+                // Every slave has an address now
+                state = STATE_END;
+                return;
+            }
+            describe(id_pos ? "%02x" : " %02x", v);
+            id_pos = (id_pos + 1) % UNIQUE_ID_LENGTH;
+            break;
+        case STATE_FAILURES:
+            b.role = ROLE_FAILED_SLAVE;
+            if (b.handshake == HANDSHAKE_NONE) {
+                state = STATE_END;
+                return;
+            }
+            describe(" failed=%u", v);
+            if (tx.result == RESULT_OK)
+                tx.result = RESULT_NACK;
+            break;
+        case STATE_END:
+            b.role = ROLE_UNEXPECTED;
+            // Reading a byte nobody responds to is harmless (the test
+            // code does this to check the bus is empty)
+            if (b.handshake != HANDSHAKE_NONE)
+                report(b.start, VIOLATION_UNEXPECTED_BYTE);
+            return;
+    }
+
+    if (b.parity_error && tx.result == RESULT_OK)
+        tx.result = RESULT_ERROR;
+
+    switch (b.handshake) {
+        case HANDSHAKE_ACK:
+            // A new mode takes effect after the ack
+            if (b.role == ROLE_MODE)
+                mode = requested_mode;
+            break;
+        case HANDSHAKE_NACK:
+            describe(" NACK");
+            if (tx.result == RESULT_OK || tx.result == RESULT_ERROR)
+                tx.result = RESULT_NACK;
+            state = STATE_ERROR_CODE;
+            break;
+        case HANDSHAKE_NONE:
+            // A missing slave in a broadcast read just leaves a gap
+            if (command == BC_CMD_READ_EEPROM && b.role == ROLE_DATA)
+                break;
+            if (tx.result == RESULT_OK)
+                tx.result = RESULT_NO_SLAVE;
+            describe(" (no reply)");
+            state = STATE_END;
+            break;
+        case HANDSHAKE_BOTH:
+            if (tx.address < BC_FIRST)
+                report(b.start, VIOLATION_HANDSHAKE);
+            break;
+    }
+}
+
+void BusDecoder::begin_transaction(decode_time t) {
+    memset(&tx, 0, sizeof(tx));
+    tx.start = t;
+    tx.result = RESULT_OK;
+    desc_len = 0;
+    in_transaction = true;
+    reported_no_reset = false;
+
+    phase = PHASE_DATA;
+    bits = 0;
+    symbols = 0;
+    shift = 0;
+    mode = 0;
+    requested_mode = 0;
+    state = STATE_ADDRESS;
+    command = 0;
+    counted = false;
+    count = 0;
+}
+
+void BusDecoder::end_transaction(decode_time t) {
+    in_transaction = false;
+    tx.end = t;
+
+    if (phase != PHASE_DATA || bits || symbols) {
+        report(t, VIOLATION_TRUNCATED);
+        if (tx.result == RESULT_OK)
+            tx.result = RESULT_ERROR;
+    }
+
+    decode_time latency = tx.end - tx.start;
+    totals.transactions++;
+    totals.results[tx.result]++;
+    totals.bytes += tx.bytes;
+    totals.data_bytes += tx.data_bytes;
+    totals.stall_bits += tx.stall_bits;
+    totals.reset_time += tx.reset_time;
+    totals.data_time += tx.data_time;
+    totals.handshake_time += tx.handshake_time;
+    totals.latency_total += latency;
+    if (latency < totals.latency_min)
+        totals.latency_min = latency;
+    if (latency > totals.latency_max)
+        totals.latency_max = latency;
+
+    if (listener)
+        listener->transaction(tx);
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
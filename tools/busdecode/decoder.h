@@ -0,0 +1,283 @@
+// Backpack bus protocol decoder
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// This reconstructs the protocol described in BackpackbusProtocol.rst
+// from the level changes of the bus line, as captured by a logic
+// analyzer or recorded by the simulator. The decoder is fed one edge at
+// a time and keeps only the state of the current byte and transaction,
+// so it can process captures of any length in a single pass.
+//
+// Since every bit starts with the master pulling the line low, a bit
+// is fully described by how long the line stays low. The decoder does
+// not know who is driving the line, it follows the protocol to find out
+// what every byte means.
+
+#ifndef _BUSDECODE_DECODER_H
+#define _BUSDECODE_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Time in nanoseconds since the start of the capture
+typedef uint64_t decode_time;
+
+// Limits from the timing table in BackpackbusProtocol.rst, in μs
+#define DECODE_RESET_MIN 2200
+#define DECODE_RESET_MAX 3000
+// Shortest low pulse a slave detects as a reset
+#define DECODE_RESET_DETECT 1500
+// Longest low pulse for a bit (slave send 0)
+#define DECODE_BIT_LOW_MAX 800
+// Bits that are low for less than this are a 1
+#define DECODE_BIT_ONE_MAX 300
+// MODE_TERNARY symbol sample points
+#define DECODE_SYMBOL_SAMPLE1 200
+#define DECODE_SYMBOL_SAMPLE2 450
+#define DECODE_NEXT_BIT_MIN 700
+#define DECODE_NEXT_BIT_MAX 1500
+#define DECODE_IDLE_MIN 50
+// After this long without a bit start, every slave has gone idle
+#define DECODE_TRANSACTION_TIMEOUT 2200
+// Slack allowed on the limits above before reporting a violation, to
+// account for the sample rate of the capture and for small master
+// overhead
+#define DECODE_TOLERANCE 10
+
+typedef enum {
+    HANDSHAKE_ACK,
+    HANDSHAKE_NACK,
+    // Neither an ack nor a nack: no slave is participating
+    HANDSHAKE_NONE,
+    // Both an ack and a nack, from different slaves
+    HANDSHAKE_BOTH,
+} decode_handshake;
+
+extern const char *decode_handshake_str[];
+
+// What a byte means, according to the protocol
+typedef enum {
+    ROLE_ADDRESS,
+    ROLE_COMMAND,
+    ROLE_COUNT,
+    ROLE_EEPROM_ADDRESS,
+    ROLE_DATA,
+    ROLE_MODE,
+    ROLE_ERROR_CODE,
+    ROLE_UNIQUE_ID,
+    // Address reported by a slave after a failed broadcast write
+    ROLE_FAILED_SLAVE,
+    // A byte where the protocol does not allow one
+    ROLE_UNEXPECTED,
+} decode_role;
+
+extern const char *decode_role_str[];
+
+typedef enum {
+    // A reset between DECODE_RESET_DETECT and DECODE_RESET_MIN, which
+    // slaves might not detect
+    VIOLATION_SHORT_RESET,
+    VIOLATION_LONG_RESET,
+    // Low for too long for a bit, but not long enough for a reset
+    VIOLATION_INVALID_PULSE,
+    VIOLATION_EARLY_BIT,
+    // Later than DECODE_NEXT_BIT_MAX, but before slaves time out
+    VIOLATION_LATE_BIT,
+    VIOLATION_SHORT_IDLE,
+    // Two long MODE_TERNARY symbols
+    VIOLATION_INVALID_SYMBOL,
+    // An ack and a nack from a single addressed slave
+    VIOLATION_HANDSHAKE,
+    // The transaction ended halfway through a byte
+    VIOLATION_TRUNCATED,
+    VIOLATION_UNEXPECTED_BYTE,
+    // Bits without a preceding reset
+    VIOLATION_NO_RESET,
+
+    VIOLATION_COUNT,
+} decode_violation;
+
+extern const char *decode_violation_str[];
+
+struct decode_byte {
+    // From the start of the first bit to the end of the last handshake
+    // bit
+    decode_time start, end;
+    uint8_t value;
+    decode_role role;
+    // The parity (and in MODE_FEC the check bits) did not match
+    bool parity_error;
+    // MODE_FEC corrected a single flipped bit
+    bool corrected;
+    // The transfer mode (MODE_* bits) the byte was sent in
+    uint8_t mode;
+    unsigned stall_bits;
+    decode_handshake handshake;
+};
+
+enum {
+    // The transaction ended without errors
+    RESULT_OK,
+    // A slave sent a nack, error_code has the error code (if it was
+    // received)
+    RESULT_NACK,
+    // Nobody responded
+    RESULT_NO_SLAVE,
+    // A parity error, or the transaction ended halfway through a byte
+    RESULT_ERROR,
+};
+
+extern const char *decode_result_str[];
+
+// Length of the human-readable transaction description
+#define DECODE_DESCRIPTION_LENGTH 120
+
+struct decode_transaction {
+    // From the start of the reset to the end of the last bit
+    decode_time start, end;
+    // The first byte, a slave address or broadcast command
+    uint8_t address;
+    uint8_t result;
+    uint8_t error_code;
+    bool has_error_code;
+    unsigned bytes;
+    unsigned data_bytes;
+    unsigned stall_bits;
+    // Time spent on the reset, on data bits (including parity and
+    // check bits) and on handshake bits (stall, ready, ack and nack)
+    decode_time reset_time, data_time, handshake_time;
+    // Like "0x01 READ_EEPROM_COUNTED n=2 @0x10: 01 02", truncated
+    // with "..." when it gets too long
+    char description[DECODE_DESCRIPTION_LENGTH + 1];
+};
+
+// Totals over all transactions
+struct decode_stats {
+    unsigned long transactions;
+    unsigned long results[RESULT_ERROR + 1];
+    unsigned long bytes, data_bytes;
+    unsigned long stall_bits;
+    unsigned max_stall_bits;
+    unsigned long parity_errors, corrected;
+    decode_time latency_min, latency_max, latency_total;
+    decode_time reset_time, data_time, handshake_time;
+    // Per targeted command byte, or per broadcast command (address)
+    unsigned long commands[256];
+    unsigned long violations[VIOLATION_COUNT];
+};
+
+// Receives the decoded protocol elements
+class DecodeListener {
+public:
+    virtual void byte(const decode_byte &b) { (void)b; }
+    virtual void transaction(const decode_transaction &t) { (void)t; }
+    virtual void violation(decode_time t, decode_violation v, decode_time duration) {
+        (void)t; (void)v; (void)duration;
+    }
+protected:
+    ~DecodeListener() {}
+};
+
+class BusDecoder {
+public:
+    BusDecoder(DecodeListener *listener = 0);
+
+    // Pass the next change of the line level, at time t. Times must not
+    // go backwards. Repeated levels are ignored.
+    void edge(decode_time t, bool high);
+
+    // End of the capture at time t, completing the current transaction
+    void finish(decode_time t);
+
+    const decode_stats &stats() const { return totals; }
+
+private:
+    enum {
+        PHASE_DATA,
+        PHASE_READY,
+        PHASE_ACK1,
+        PHASE_ACK2,
+    };
+
+    void pulse(decode_time start, decode_time low);
+    void previous_pulse(decode_time start, bool is_reset);
+    void bit(decode_time start, bool value);
+    void symbol(decode_time start, uint8_t value);
+    void data_done();
+    void byte_done();
+    void protocol(decode_byte &b);
+    void data_end();
+    void begin_transaction(decode_time t);
+    void end_transaction(decode_time t);
+    void account(decode_time duration);
+    void report(decode_time t, decode_violation v, decode_time duration = 0);
+    void describe(const char *fmt, ...);
+
+    DecodeListener *listener;
+    decode_stats totals;
+
+    bool level;
+    bool started;
+    // Start and end of the current (or last) low pulse. have_fall is
+    // false until the first falling edge.
+    bool have_fall;
+    decode_time fall, rise;
+    // Start and end of the previous pulse
+    bool have_prev;
+    decode_time prev_fall, prev_rise;
+
+    // Whether the previous pulse was a reset or part of a byte (and
+    // which part), to attribute the time until the next bit start
+    enum { LAST_NONE, LAST_RESET, LAST_DATA, LAST_HANDSHAKE } last;
+    decode_time prev_low;
+    // A bit without a preceding reset was already reported
+    bool reported_no_reset;
+
+    bool in_transaction;
+    decode_transaction tx;
+    size_t desc_len;
+
+    // The byte being received
+    uint8_t phase;
+    uint8_t bits;
+    uint16_t shift;
+    uint8_t symbols;
+    uint8_t first_symbol;
+    bool first_ack_bit;
+    decode_byte cur;
+
+    // Transfer mode for the next byte, and the mode requested by a
+    // SET_MODE command that still needs its ack
+    uint8_t mode;
+    uint8_t requested_mode;
+
+    // Protocol state, private to decoder.cpp
+    uint8_t state;
+    uint8_t command;
+    bool counted;
+    uint8_t count;
+    unsigned remaining;
+    uint8_t id_pos;
+};
+
+#endif // _BUSDECODE_DECODER_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
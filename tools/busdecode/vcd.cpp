@@ -0,0 +1,217 @@
+// Value Change Dump (VCD) reading and writing
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vcd.h"
+
+VcdReader::VcdReader(FILE *f, const char *name)
+    : f(f), name(name), err(NULL), have_var(false), in_header(true),
+      num(1), den(1), now(0) {
+    tok[0] = id[0] = var_name[0] = '\0';
+}
+
+// Read the next whitespace-separated token into tok. Returns false at
+// the end of the file.
+bool VcdReader::token() {
+    int c;
+    do {
+        c = getc(f);
+    } while (c != EOF && isspace(c));
+    if (c == EOF)
+        return false;
+
+    size_t len = 0;
+    do {
+        if (len < sizeof(tok) - 1)
+            tok[len++] = c;
+        c = getc(f);
+    } while (c != EOF && !isspace(c));
+    tok[len] = '\0';
+    return true;
+}
+
+// Skip everything up to and including the next $end
+bool VcdReader::skip_section() {
+    while (token()) {
+        if (!strcmp(tok, "$end"))
+            return true;
+    }
+    err = "Unterminated section";
+    return false;
+}
+
+bool VcdReader::header(const char *keyword) {
+    if (!strcmp(keyword, "$timescale")) {
+        // Either "1 us" or "1us"
+        if (!token())
+            return false;
+        char *unit;
+        unsigned long n = strtoul(tok, &unit, 10);
+        if (!*unit) {
+            if (!token())
+                return false;
+            unit = tok;
+        }
+
+        num = n;
+        den = 1;
+        if (!strcmp(unit, "s")) num *= 1000000000;
+        else if (!strcmp(unit, "ms")) num *= 1000000;
+        else if (!strcmp(unit, "us")) num *= 1000;
+        else if (!strcmp(unit, "ns")) ;
+        else if (!strcmp(unit, "ps")) den = 1000;
+        else if (!strcmp(unit, "fs")) den = 1000000;
+        else {
+            err = "Unsupported timescale";
+            return false;
+        }
+        return skip_section();
+    }
+
+    if (!strcmp(keyword, "$var")) {
+        // $var type width id reference [index] $end
+        char width[sizeof(tok)], var_id[sizeof(tok)];
+        if (!token() || !token())
+            return false;
+        strcpy(width, tok);
+        if (!token())
+            return false;
+        strcpy(var_id, tok);
+        if (!token())
+            return false;
+
+        bool match = name ? !strcmp(tok, name) : !strcmp(width, "1");
+        if (match && !have_var) {
+            strcpy(id, var_id);
+            strcpy(var_name, tok);
+            have_var = true;
+        }
+        return skip_section();
+    }
+
+    if (!strcmp(keyword, "$enddefinitions")) {
+        in_header = false;
+        if (!have_var) {
+            err = name ? "Signal not found" : "No single-bit signal found";
+            return false;
+        }
+        return skip_section();
+    }
+
+    // $scope, $upscope, $date, $version, $comment
+    return skip_section();
+}
+
+bool VcdReader::timestamp(const char *t) {
+    char *end;
+    decode_time v = strtoull(t, &end, 10);
+    if (*end) {
+        err = "Invalid timestamp";
+        return false;
+    }
+    v = v * num / den;
+    if (v < now) {
+        err = "Timestamps going backwards";
+        return false;
+    }
+    now = v;
+    return true;
+}
+
+bool VcdReader::change(char value, const char *var_id, BusDecoder &decoder) {
+    if (strcmp(var_id, id))
+        return true;
+
+    // An undriven line is pulled up
+    bool high = value == '1' || value == 'z' || value == 'Z';
+    if (value == 'x' || value == 'X')
+        return true;
+    decoder.edge(now, high);
+    return true;
+}
+
+bool VcdReader::run(BusDecoder &decoder) {
+    while (token()) {
+        if (in_header) {
+            if (tok[0] != '$') {
+                err = "Invalid header";
+                return false;
+            }
+            if (!header(tok)) {
+                if (!err)
+                    err = "Unexpected end of file";
+                return false;
+            }
+            continue;
+        }
+
+        switch (tok[0]) {
+            case '#':
+                if (!timestamp(tok + 1))
+                    return false;
+                break;
+            case '$':
+                // $dumpvars and friends just wrap value changes, their
+                // $end can be ignored
+                if (!strcmp(tok, "$comment") && !skip_section())
+                    return false;
+                break;
+            case '0': case '1': case 'x': case 'X': case 'z': case 'Z':
+                if (!change(tok[0], tok + 1, decoder))
+                    return false;
+                break;
+            case 'b': case 'B': case 'r': case 'R':
+                // Vector or real value of another signal
+                if (!token()) {
+                    err = "Unexpected end of file";
+                    return false;
+                }
+                break;
+            default:
+                err = "Invalid value change";
+                return false;
+        }
+    }
+
+    if (in_header) {
+        err = "Unexpected end of file";
+        return false;
+    }
+    return true;
+}
+
+void vcd_write_header(FILE *f, const char *name, bool level) {
+    fprintf(f, "$timescale 1 ns $end\n"
+               "$scope module backpack $end\n"
+               "$var wire 1 ! %s $end\n"
+               "$upscope $end\n"
+               "$enddefinitions $end\n"
+               "#0\n%c!\n", name, level ? '1' : '0');
+}
+
+void vcd_write_change(FILE *f, decode_time t, bool high) {
+    fprintf(f, "#%llu\n%c!\n", (unsigned long long)t, high ? '1' : '0');
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
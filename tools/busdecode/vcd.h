@@ -0,0 +1,85 @@
+// Value Change Dump (VCD) reading and writing
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// VCD is what sigrok (and most other logic analyzer software) exports,
+// e.g.:
+//
+//   sigrok-cli -i capture.sr -O vcd > capture.vcd
+//
+// The reader reads one token at a time and passes every change of the
+// selected signal to the decoder right away, so memory use does not
+// depend on the length of the capture.
+
+#ifndef _BUSDECODE_VCD_H
+#define _BUSDECODE_VCD_H
+
+#include <stdio.h>
+#include "decoder.h"
+
+class VcdReader {
+public:
+    // Read the signal with the given name, or the first single-bit
+    // signal when name is NULL
+    VcdReader(FILE *f, const char *name = NULL);
+
+    // Read the entire file, passing changes to the decoder. Returns
+    // false on errors, see error().
+    bool run(BusDecoder &decoder);
+
+    // Time of the last timestamp read
+    decode_time end() const { return now; }
+
+    const char *error() const { return err; }
+    // Name of the selected signal
+    const char *signal() const { return var_name; }
+
+private:
+    bool token();
+    bool skip_section();
+    bool header(const char *keyword);
+    bool timestamp(const char *t);
+    bool change(char value, const char *id, BusDecoder &decoder);
+
+    FILE *f;
+    const char *name;
+    const char *err;
+
+    // Current token, longer tokens are truncated
+    char tok[128];
+    char id[sizeof(tok)];
+    char var_name[sizeof(tok)];
+    bool have_var;
+    bool in_header;
+
+    // Timestamps are multiplied by num / den to get nanoseconds
+    decode_time num, den;
+    decode_time now;
+};
+
+// Write the header for a single signal, using a 1 ns timescale
+void vcd_write_header(FILE *f, const char *name, bool level);
+
+void vcd_write_change(FILE *f, decode_time t, bool high);
+
+#endif // _BUSDECODE_VCD_H
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */
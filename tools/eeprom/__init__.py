@@ -26,12 +26,21 @@ class Encoded:
     def __init__(self):
         self.roundings = []
         self.offsets = {}
+        self.descriptors = []
         self.data = BitArray()
         self.errors = []
+        self.checksum_offset = None
 
     def append(self, *args, **kwargs):
         self.data.append(*args, **kwargs)
 
+    def start_descriptor(self, descriptor, group):
+        """
+        Record that the given descriptor starts at the current offset.
+        group is the group it is in, or None for group descriptors.
+        """
+        self.descriptors.append((self.data.len // 8, descriptor, group))
+
     def append_string(self, s):
         """
         Append a string of characters to the given BitArray. Characters
@@ -121,7 +130,8 @@ class EEPROM:
         res.data[16:24] = len(res.data) // 8 + 2
 
         # append the checksum descriptor
-        res.offsets[res.data.len // 8] = "Checksum"
+        res.checksum_offset = res.data.len // 8
+        res.offsets[res.checksum_offset] = "Checksum"
         res.append(pack('uintbe:16', eeprom_crc(res.data.bytes)))
 
         if (len(res.data) // 8  > self.d['eeprom_size']):
@@ -57,11 +57,13 @@ class GroupDescriptor(Descriptor):
 
     def encode(self, eeprom, res):
         res.offsets[res.data.len // 8] = self.__class__.__name__ + " " + self.d['name']
+        res.start_descriptor(self, None)
         res.append(pack('uint:8', self.descriptor_type))
         res.append_string(self.d['name'])
 
         for d in self.descriptors:
             res.offsets[res.data.len // 8] = d.__class__.__name__ + " " + (d.effective_name() or "")
+            res.start_descriptor(d, self)
             d.encode(eeprom, res)
 
     def add_descriptor(self, descriptor):
@@ -0,0 +1,154 @@
+# vim: set sw=4 sts=4 et fileencoding=utf-8
+
+"""
+Generate a C++ header from encoded EEPROM contents. This allows code
+written for a specific backpack model to use the EEPROM image, the
+offsets of groups and descriptors and the expected checksums as
+compile-time constants, instead of parsing the EEPROM at runtime.
+"""
+
+import re
+
+import eeprom
+
+# Offset of the unique id checksum byte in the header
+UNIQUE_ID_CRC_OFFSET = 0x0a
+
+def identifier(name):
+    """
+    Turn a group or descriptor name into a valid C++ identifier.
+    """
+    ident = re.sub('[^A-Za-z0-9_]', '_', name)
+    if not re.match('[A-Za-z_]', ident):
+        ident = '_' + ident
+    return ident
+
+def descriptor_identifier(offset, d):
+    """
+    Return the identifier to use for the given descriptor. Descriptors
+    without a name are named after their type and pin (there can be only
+    one power usage descriptor per pin in a group), or their offset.
+    """
+    name = d.effective_name()
+    if name is None:
+        suffix = 'pin{}'.format(d.d['pin']) if 'pin' in d.d else '{:02x}'.format(offset)
+        name = '{}_{}'.format(d.descriptor_name, suffix)
+    return identifier(name)
+
+def unique_identifier(offset, ident, used):
+    """
+    Return ident, or ident with the offset appended when it is already
+    in used (a set of identifiers in the same namespace), and add the
+    result to used. Offsets are unique, so this never collides twice.
+    """
+    if ident in used:
+        ident = '{}_{:02x}'.format(ident, offset)
+    used.add(ident)
+    return ident
+
+def format_bytes(bs, indent, per_line = 12):
+    lines = []
+    for i in range(0, len(bs), per_line):
+        chunk = bs[i:i + per_line]
+        lines.append(indent + ' '.join('0x{:02x},'.format(b) for b in chunk))
+    return '\n'.join(lines)
+
+def generate(eep, res, namespace = None, source = None):
+    """
+    Generate the header for the given EEPROM and the result of encoding
+    it (as returned by EEPROM.encode()). Returns the header contents as
+    a string.
+    """
+    h = eep.d
+    image = bytearray(res.data.tobytes())
+    checksum_offset = res.checksum_offset
+    if res.descriptors:
+        descriptors_offset = res.descriptors[0][0]
+    else:
+        descriptors_offset = checksum_offset
+    descriptors_crc = eeprom.eeprom_crc(bytes(image[descriptors_offset:checksum_offset]))
+    checksum = image[checksum_offset] << 8 | image[checksum_offset + 1]
+
+    if namespace is None:
+        namespace = 'backpack_' + identifier(h['name'])
+    guard = namespace.upper() + '_EEPROM_H'
+
+    out = []
+    w = out.append
+    w('// Generated by pinoccio-eeprom-tool{}, do not edit.'.format(
+        ' from ' + source if source else ''))
+    w('//')
+    w('// EEPROM contents for the "{}" backpack (model 0x{:04x}, hardware'.format(h['name'], h['model']))
+    w('// revision 0x{:02x}, EEPROM layout version {}).'.format(h['hardware_revision'], h['layout_version']))
+    w('')
+    w('#ifndef {}'.format(guard))
+    w('#define {}'.format(guard))
+    w('')
+    w('#include <stdint.h>')
+    w('')
+    w('namespace {} {{'.format(namespace))
+    w('    // The complete EEPROM contents, including the unique id (serial')
+    w('    // number 0x{:06x}) and the checksum'.format(h['serial']))
+    w('    constexpr uint8_t image[] = {')
+    w(format_bytes(image, ' ' * 8))
+    w('    };')
+    w('')
+    w('    constexpr uint16_t model = 0x{:04x};'.format(h['model']))
+    w('    constexpr uint8_t hardware_revision = 0x{:02x};'.format(h['hardware_revision']))
+    w('    constexpr uint8_t eeprom_size = {};'.format(h['eeprom_size']))
+    w('    constexpr uint8_t used_size = {};'.format(len(image)))
+    w('')
+    w('    // CRC-8 over the unique id, stored at unique_id_crc_offset. This')
+    w('    // covers the serial number, so it only matches the backpack this')
+    w('    // image was generated for.')
+    w('    constexpr uint8_t unique_id_crc_offset = 0x{:02x};'.format(UNIQUE_ID_CRC_OFFSET))
+    w('    constexpr uint8_t unique_id_crc = 0x{:02x};'.format(image[UNIQUE_ID_CRC_OFFSET]))
+    w('')
+    w('    // CRC-16 over everything before checksum_offset, stored at')
+    w('    // checksum_offset. Like unique_id_crc, this only matches the')
+    w('    // backpack with the serial number above.')
+    w('    constexpr uint8_t checksum_offset = 0x{:02x};'.format(checksum_offset))
+    w('    constexpr uint16_t checksum = 0x{:04x};'.format(checksum))
+    w('')
+    w('    // CRC-16 (same algorithm as the checksum) over just the')
+    w('    // descriptors, from descriptors_offset up to checksum_offset.')
+    w('    // These are the same for every backpack of this model.')
+    w('    constexpr uint8_t descriptors_offset = 0x{:02x};'.format(descriptors_offset))
+    w('    constexpr uint16_t descriptors_crc = 0x{:04x};'.format(descriptors_crc))
+
+    # The end of every descriptor is the start of the next one
+    ends = [o for (o, _, _) in res.descriptors[1:]] + [checksum_offset]
+    ind = ' ' * 4
+    # Identifiers already used in the outer namespace and in the current
+    # group namespace, so two groups with the same name or two unnamed
+    # descriptors of the same type do not end up in the same namespace
+    group_names = set(['image', 'model', 'hardware_revision', 'eeprom_size',
+                       'used_size', 'unique_id_crc_offset', 'unique_id_crc',
+                       'checksum_offset', 'checksum', 'descriptors_offset',
+                       'descriptors_crc'])
+    descriptor_names = group_names
+    for ((offset, d, group), end) in zip(res.descriptors, ends):
+        if group is None:
+            if offset != descriptors_offset:
+                w('    }')
+            w('')
+            w('    // Group descriptor')
+            w('    namespace {} {{'.format(unique_identifier(offset, identifier(d.d['name']), group_names)))
+            ind = ' ' * 8
+            descriptor_names = set(['offset', 'length'])
+        else:
+            w('')
+            w('{}// {} descriptor'.format(ind, d.__class__.__name__.replace('Descriptor', '')))
+            w('{}namespace {} {{'.format(ind, unique_identifier(offset, descriptor_identifier(offset, d), descriptor_names)))
+            ind = ' ' * 12
+        w('{}constexpr uint8_t offset = 0x{:02x};'.format(ind, offset))
+        w('{}constexpr uint8_t length = {};'.format(ind, end - offset))
+        ind = ' ' * 8
+        if group is not None:
+            w('{}}}'.format(ind))
+    if res.descriptors:
+        w('    }')
+    w('}')
+    w('')
+    w('#endif // {}'.format(guard))
+    return '\n'.join(out) + '\n'
@@ -0,0 +1,138 @@
+// Decoder for the event log of the bus master
+//
+// Copyright (c) 2014, Pinoccio
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+//
+// Reads the serial output of the test sketch and turns the binary event
+// records (see firmware/test/eventlog.h) back into text. Everything
+// else is passed through unchanged, so the serial port can be read
+// directly:
+//
+//   logdecode /dev/ttyACM0
+//
+// Usage: logdecode [file|-]
+
+#include <stdio.h>
+#include <string.h>
+#include "../../firmware/test/eventlog.h"
+
+// Set after an EVENT_ID_CHECKSUM, while its ID bytes are being printed
+static bool in_id = false;
+
+static void end_id() {
+    if (in_id)
+        printf("\n");
+    in_id = false;
+}
+
+static void print_event(const eventlog_event &e) {
+    if (e.type == EVENT_ID_BYTE && in_id) {
+        printf("%02x", e.arg);
+        return;
+    }
+    end_id();
+
+    printf("[%12.6f] ", e.time / 1e6);
+    if (e.type >= EVENT_COUNT) {
+        printf("Unknown event 0x%02x (0x%02x)\n", e.type, e.arg);
+        return;
+    }
+
+    printf("%s", eventlog_str[e.type]);
+    switch (e.type) {
+        case EVENT_LOST:
+            printf(": %u events\n", e.arg);
+            break;
+        case EVENT_STALL_TIMEOUT:
+            printf(" after %u stall bits\n", e.arg);
+            break;
+        case EVENT_ID_CHECKSUM:
+            printf(" for address %u: ", e.arg);
+            in_id = true;
+            break;
+        case EVENT_ID_BYTE:
+            printf(": %02x\n", e.arg);
+            break;
+        default:
+            printf("\n");
+    }
+}
+
+static void print_text(uint8_t c) {
+    end_id();
+    putchar(c);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [file|-]\n", argv[0]);
+        return 2;
+    }
+
+    const char *filename = argc > 1 ? argv[1] : "-";
+    FILE *f = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+    if (!f) {
+        perror(filename);
+        return 2;
+    }
+
+    // Bytes that might be the start of a record
+    uint8_t buf[EVENTLOG_RECORD_SIZE];
+    size_t len = 0;
+    unsigned long events = 0, invalid = 0;
+    int c;
+    while ((c = getc(f)) != EOF) {
+        buf[len++] = c;
+        while (len) {
+            if (buf[0] != EVENTLOG_SYNC) {
+                print_text(buf[0]);
+            } else if (len < EVENTLOG_RECORD_SIZE) {
+                break;
+            } else {
+                eventlog_event e;
+                if (eventlog_decode(buf, &e)) {
+                    print_event(e);
+                    events++;
+                    len = 0;
+                    break;
+                }
+                // Not a record after all, look for the next sync byte
+                invalid++;
+            }
+            memmove(buf, buf + 1, --len);
+        }
+        if (len == 0)
+            fflush(stdout);
+    }
+
+    // A partial record at the end is dropped
+    end_id();
+    if (f != stdin)
+        fclose(f);
+
+    fprintf(stderr, "%lu events decoded", events);
+    if (invalid)
+        fprintf(stderr, ", %lu invalid records skipped", invalid);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+/* vim: set filetype=cpp sw=4 sts=4 expandtab: */